@@ -96,6 +96,15 @@ public:
             MCSR_LOG(INFO) << "Average FPS: " << fps;
             MCSR_LOG(INFO) << "Average bitrate: " << mbps << " Mbps";
         }
+
+        RecorderStats stats = recorder_.getStats();
+        MCSR_LOG(INFO) << "Write latency: p50=" << stats.write_latency.percentile(0.5) / 1000
+                       << "us p99=" << stats.write_latency.percentile(0.99) / 1000
+                       << "us max=" << stats.write_latency.max_ns / 1000 << "us";
+        MCSR_LOG(INFO) << "Flushes: " << stats.flush_count << " (p99 " << stats.flush_latency.percentile(0.99) / 1000
+                       << "us), fsyncs: " << stats.fsync_count << " (p99 " << stats.fsync_latency.percentile(0.99) / 1000 << "us)";
+        MCSR_LOG(INFO) << "Bytes written: mp4=" << stats.mp4_bytes_written << ", idx=" << stats.idx_bytes_written;
+        MCSR_LOG(INFO) << "Finalize: " << stats.finalize_us << "us (moov " << stats.moov_build_us << "us)";
     }
     
     bool checkRecovery(const std::string& filename) {
@@ -0,0 +1,270 @@
+/*
+ * MP4 Crash-Safe Recorder - Multi-Stream Engine Benchmark
+ *
+ * Records many paced streams at once and reports what the host pays for them:
+ *
+ *   direct   one thread per stream, each Mp4Recorder doing its own blocking I/O
+ *   engine   --feeders threads writing all streams round-robin through a RecorderEngine
+ *
+ * For every run one JSON object is printed with the CPU time, the voluntary and involuntary
+ * context switches of the process (getrusage), the number of frames that were written after
+ * their deadline, the write latency over all recorders, and the sync system calls issued.
+ *
+ * --sync-coordinator shares one SyncCoordinator (syncfs or fdatasync) between all recorders
+ * instead of each recorder syncing its own files.
+ *
+ * Usage: engine_benchmark [--streams 16,64,256] [--seconds 10] [--fps 30] [--video-kbps 2000]
+ *                         [--mode direct,engine] [--feeders 1] [--io-threads 2] [--dir .]
+ *                         [--sync-coordinator none|syncfs|fdatasync]
+ *
+ * License: GPL v2+
+ */
+
+#include "mp4_recorder.h"
+#include "recorder_engine.h"
+#include "sync_coordinator.h"
+#include "common.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+    #include <sys/resource.h>
+#endif
+
+using namespace mp4_recorder;
+
+namespace {
+
+struct BenchmarkOptions {
+    std::vector<size_t> streams = {16, 64, 256};
+    std::vector<std::string> modes = {"direct", "engine"};
+    uint32_t seconds = 10;
+    uint32_t fps = 30;
+    uint32_t video_kbps = 2000;
+    size_t feeders = 1;
+    size_t io_threads = 2;
+    std::string dir = ".";
+    std::string sync_coordinator = "none";
+};
+
+struct Usage {
+    double cpu_ms = 0;
+    long voluntary_switches = 0;
+    long involuntary_switches = 0;
+};
+
+Usage processUsage() {
+    Usage usage;
+#ifndef _WIN32
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        usage.cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0 +
+                       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+        usage.voluntary_switches = ru.ru_nvcsw;
+        usage.involuntary_switches = ru.ru_nivcsw;
+    }
+#endif
+    return usage;
+}
+
+void addHistogram(LatencyHistogramSnapshot& total, const LatencyHistogramSnapshot& histogram) {
+    total.counts.resize(std::max(total.counts.size(), histogram.counts.size()));
+    for (size_t i = 0; i < histogram.counts.size(); i++) {
+        total.counts[i] += histogram.counts[i];
+    }
+    total.count += histogram.count;
+    total.sum_ns += histogram.sum_ns;
+    total.max_ns = std::max(total.max_ns, histogram.max_ns);
+}
+
+// Writes its streams round-robin, one frame each per tick, and counts frames written late
+void feed(std::vector<Mp4Recorder*> recorders, const BenchmarkOptions& options, uint64_t& late_frames) {
+    std::vector<uint8_t> frame(options.video_kbps * 1000 / 8 / options.fps, 0);
+    if (frame.size() > 4) {
+        frame[4] = 0x65;
+    }
+    auto tick = std::chrono::microseconds(1000000 / options.fps);
+    auto next = std::chrono::steady_clock::now();
+    uint64_t frames = static_cast<uint64_t>(options.seconds) * options.fps;
+    for (uint64_t i = 0; i < frames; i++) {
+        for (Mp4Recorder* recorder : recorders) {
+            recorder->writeVideoFrame(frame.data(), static_cast<uint32_t>(frame.size()),
+                                      static_cast<int64_t>(i * 1000), i % options.fps == 0);
+        }
+        next += tick;
+        if (std::chrono::steady_clock::now() > next) {
+            late_frames += recorders.size();
+        } else {
+            std::this_thread::sleep_until(next);
+        }
+    }
+}
+
+bool runScenario(const BenchmarkOptions& options, const std::string& mode, size_t streams) {
+    bool use_engine = mode == "engine";
+    std::unique_ptr<RecorderEngine> engine;
+    if (use_engine) {
+        EngineConfig engine_config;
+        engine_config.io_threads_per_disk = options.io_threads;
+        engine.reset(new RecorderEngine(engine_config));
+    }
+
+    RecorderConfig config;
+    config.video_timescale = options.fps * 1000;
+    if (options.sync_coordinator != "none") {
+        SyncCoordinatorConfig sync_config;
+        sync_config.method = options.sync_coordinator == "syncfs" ? SyncMethod::SyncFs : SyncMethod::DataSync;
+        config.sync_coordinator = std::make_shared<SyncCoordinator>(sync_config);
+    }
+    std::vector<std::unique_ptr<Mp4Recorder>> recorders;
+    for (size_t i = 0; i < streams; i++) {
+        recorders.emplace_back(use_engine ? engine->createRecorder() : std::unique_ptr<Mp4Recorder>(new Mp4Recorder()));
+        std::string filename = options.dir + "/engine_benchmark_" + std::to_string(i) + ".mp4";
+        if (!recorders.back()->start(filename, config)) {
+            std::cerr << "Failed to start " << filename << std::endl;
+            return false;
+        }
+    }
+
+    // Direct recorders need a thread each; engine recorders share the feeders
+    size_t threads = use_engine ? std::min(std::max<size_t>(options.feeders, 1), streams) : streams;
+    std::vector<std::vector<Mp4Recorder*>> groups(threads);
+    for (size_t i = 0; i < streams; i++) {
+        groups[i % threads].push_back(recorders[i].get());
+    }
+    std::vector<uint64_t> late_frames(threads, 0);
+
+    Usage begin = processUsage();
+    auto wall_begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> feeders;
+    for (size_t i = 0; i < threads; i++) {
+        feeders.emplace_back(feed, groups[i], std::cref(options), std::ref(late_frames[i]));
+    }
+    for (auto& feeder : feeders) {
+        feeder.join();
+    }
+    for (auto& recorder : recorders) {
+        recorder->stop();
+    }
+    double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wall_begin).count();
+    Usage end = processUsage();
+    LatencyHistogramSnapshot write_latency;
+    uint64_t recorder_syncs = 0;
+    for (auto& recorder : recorders) {
+        RecorderStats stats = recorder->getStats();
+        addHistogram(write_latency, stats.write_latency);
+        recorder_syncs += stats.fsync_count;
+    }
+    EngineStats engine_stats = engine ? engine->getStats() : EngineStats();
+    // Each recorder sync pass is an fsync of mp4 and idx, unless the coordinator batched it
+    uint64_t sync_calls = config.sync_coordinator ? config.sync_coordinator->getStats().sync_calls : recorder_syncs * 2;
+
+    uint64_t late = 0;
+    for (uint64_t count : late_frames) {
+        late += count;
+    }
+    std::printf("{\"mode\":\"%s\",\"streams\":%zu,\"feeder_threads\":%zu,\"io_threads\":%zu,"
+                "\"frames\":%llu,\"late_frames\":%llu,\"wall_ms\":%.0f,\"cpu_ms\":%.0f,"
+                "\"voluntary_switches\":%ld,\"involuntary_switches\":%ld,"
+                "\"write_p99_us\":%.1f,\"write_max_us\":%.1f,\"backpressure_waits\":%llu,"
+                "\"sync_coordinator\":\"%s\",\"sync_calls\":%llu}\n",
+                mode.c_str(), streams, threads, engine_stats.io_threads, static_cast<unsigned long long>(write_latency.count),
+                static_cast<unsigned long long>(late), wall_ms, end.cpu_ms - begin.cpu_ms,
+                end.voluntary_switches - begin.voluntary_switches,
+                end.involuntary_switches - begin.involuntary_switches,
+                write_latency.percentile(0.99) / 1000.0, write_latency.max_ns / 1000.0,
+                static_cast<unsigned long long>(engine_stats.backpressure_waits), options.sync_coordinator.c_str(),
+                static_cast<unsigned long long>(sync_calls));
+
+    for (size_t i = 0; i < streams; i++) {
+        std::remove((options.dir + "/engine_benchmark_" + std::to_string(i) + ".mp4").c_str());
+    }
+    return true;
+}
+
+template <typename T>
+bool parseList(const std::string& text, std::vector<T>& values, T (*parse)(const std::string&)) {
+    values.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(parse(item));
+    }
+    return !values.empty();
+}
+
+size_t parseCount(const std::string& text) {
+    return static_cast<size_t>(std::strtoul(text.c_str(), nullptr, 10));
+}
+
+std::string parseMode(const std::string& text) {
+    return text;
+}
+
+void printUsage() {
+    std::cerr << "Usage: engine_benchmark [--streams 16,64,256] [--seconds 10] [--fps 30] [--video-kbps 2000]\n"
+              << "                        [--mode direct,engine] [--feeders 1] [--io-threads 2] [--dir .]\n"
+              << "                        [--sync-coordinator none|syncfs|fdatasync]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    SetLogSeverity(LogSeverity::LS_ERROR);
+
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--streams" && has_value) {
+            parseList(argv[++i], options.streams, parseCount);
+        } else if (arg == "--mode" && has_value) {
+            parseList(argv[++i], options.modes, parseMode);
+        } else if (arg == "--seconds" && has_value) {
+            options.seconds = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--fps" && has_value) {
+            options.fps = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--video-kbps" && has_value) {
+            options.video_kbps = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--feeders" && has_value) {
+            options.feeders = parseCount(argv[++i]);
+        } else if (arg == "--io-threads" && has_value) {
+            options.io_threads = parseCount(argv[++i]);
+        } else if (arg == "--dir" && has_value) {
+            options.dir = argv[++i];
+        } else if (arg == "--sync-coordinator" && has_value) {
+            options.sync_coordinator = argv[++i];
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+    if (options.fps == 0 || options.video_kbps == 0 || options.seconds == 0 ||
+        (options.sync_coordinator != "none" && options.sync_coordinator != "syncfs" &&
+         options.sync_coordinator != "fdatasync")) {
+        printUsage();
+        return 1;
+    }
+
+    bool ok = true;
+    for (size_t streams : options.streams) {
+        for (const std::string& mode : options.modes) {
+            if (streams > 0 && (mode == "direct" || mode == "engine")) {
+                ok = runScenario(options, mode, streams) && ok;
+            } else {
+                printUsage();
+                return 1;
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+/*
+ * MP4 Crash-Safe Recorder - Logging Overhead Benchmark
+ *
+ * Measures what disabled log statements cost on the per-frame paths:
+ *
+ *   disabled_log_ns      one MCSR_LOG(VERBOSE) statement with frame arguments while the
+ *                        runtime severity is WARNING
+ *   write_frame_ns       Mp4Recorder::writeVideoFrame() into a discarding file
+ *   build_moov_sample_ns MoovBuilder::buildMoov() per sample
+ *
+ * Build with -DMCSR_MIN_LOG_SEVERITY=2 (CMake: -DMCSR_MIN_LOG_SEVERITY=WARNING) to compare
+ * against statements that are compiled out. Results are printed as one JSON object.
+ *
+ * Usage: logging_benchmark [frames]
+ *
+ * License: GPL v2+
+ */
+
+#include "mp4_recorder.h"
+#include "moov_builder.h"
+#include "sample_table.h"
+#include "common.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace mp4_recorder;
+
+namespace {
+
+// Accepts every write and keeps nothing, so the benchmark measures the recorder alone
+class NullFile : public IFile {
+public:
+    size_t read(void* data, size_t size) override { (void)data; (void)size; return 0; }
+    size_t write(const void* data, size_t size) override {
+        (void)data;
+        position_ += size;
+        end_ = std::max(end_, position_);
+        return size;
+    }
+    bool seek(int64_t offset, int origin) override {
+        int64_t base = origin == SEEK_SET ? 0 :
+                       origin == SEEK_CUR ? static_cast<int64_t>(position_) : static_cast<int64_t>(end_);
+        position_ = static_cast<uint64_t>(base + offset);
+        return true;
+    }
+    int64_t tell() override { return static_cast<int64_t>(position_); }
+    bool flush() override { return true; }
+    bool sync() override { return true; }
+    void close() override { open_ = false; }
+    bool isOpen() const override { return open_; }
+
+private:
+    uint64_t position_ = 0;
+    uint64_t end_ = 0;
+    bool open_ = true;
+};
+
+class NullFileOps : public IFileOps {
+public:
+    std::unique_ptr<IFile> open(const std::string& path, const char* mode) override {
+        (void)path;
+        (void)mode;
+        return std::unique_ptr<IFile>(new NullFile());
+    }
+    bool exists(const std::string& path) override { (void)path; return false; }
+    bool remove(const std::string& path) override { (void)path; return true; }
+    bool getFileSize(const std::string& path, uint64_t& size) override { (void)path; size = 0; return true; }
+};
+
+double nsPerItem(std::chrono::steady_clock::time_point begin, uint64_t items) {
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) /
+           static_cast<double>(items);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint64_t frames = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    if (frames == 0) {
+        std::cerr << "Usage: logging_benchmark [frames]" << std::endl;
+        return 1;
+    }
+    SetLogSeverity(LogSeverity::LS_WARNING);
+
+    // A disabled statement shaped like the per-frame ones in the recorder
+    FrameInfo frame = {};
+    auto begin = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < frames; i++) {
+        frame.pts = static_cast<int64_t>(i);
+        frame.offset += 1000;
+        MCSR_LOG(VERBOSE) << "Indexed video frame: pts=" << frame.pts << ", size=" << frame.size << ", offset=" << frame.offset;
+    }
+    double disabled_log_ns = nsPerItem(begin, frames);
+
+    std::vector<uint8_t> payload(1000, 0);
+    payload[4] = 0x65;
+    Mp4Recorder recorder(std::make_shared<NullFileOps>());
+    RecorderConfig config;
+    config.video_timescale = 90000;
+    if (!recorder.start("logging_benchmark.mp4", config)) {
+        std::cerr << "Failed to start recorder" << std::endl;
+        return 1;
+    }
+    begin = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < frames; i++) {
+        recorder.writeVideoFrame(payload.data(), static_cast<uint32_t>(payload.size()),
+                                 static_cast<int64_t>(i * 3000), i % 60 == 0);
+    }
+    double write_frame_ns = nsPerItem(begin, frames);
+    recorder.stop();
+
+    SampleTable video_table;
+    SampleTable audio_table;
+    for (uint64_t i = 0; i < frames; i++) {
+        FrameInfo sample = {};
+        sample.offset = i * 1000;
+        sample.size = 1000;
+        sample.pts = sample.dts = static_cast<int64_t>(i * 3000);
+        sample.is_keyframe = i % 60 == 0;
+        video_table.append(sample);
+    }
+    MoovConfig moov_config;
+    moov_config.video_timescale = 90000;
+    moov_config.mdat_start = 40;
+    std::vector<uint8_t> moov_data;
+    MoovBuilder builder;
+    begin = std::chrono::steady_clock::now();
+    builder.buildMoov(video_table, audio_table, moov_config, moov_data);
+    double build_moov_sample_ns = nsPerItem(begin, frames);
+
+    std::printf("{\"frames\":%llu,\"min_log_severity\":%d,\"disabled_log_ns\":%.2f,"
+                "\"write_frame_ns\":%.1f,\"build_moov_sample_ns\":%.2f}\n",
+                static_cast<unsigned long long>(frames), MCSR_MIN_LOG_SEVERITY, disabled_log_ns,
+                write_frame_ns, build_moov_sample_ns);
+    return 0;
+}
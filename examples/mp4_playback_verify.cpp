@@ -2,7 +2,7 @@
  * MP4 Crash-Safe Recorder - Playback Verification Demo
  * 
  * This demo generates MP4 files with synthetic video/audio data,
- * validates them with ffprobe, and plays them with ffplay.
+ * validates them with Mp4Verifier, and plays them with ffplay if available.
  * 
  * No camera hardware required - uses synthetic data for testing.
  * 
@@ -10,6 +10,7 @@
  */
 
 #include "mp4_recorder.h"
+#include "mp4_verifier.h"
 #include "common.h"
 #include <iostream>
 #include <cstring>
@@ -57,19 +58,17 @@ uint64_t getFileSize(const std::string& filename) {
     return f.tellg();
 }
 
-// Helper function to validate MP4 with ffprobe
-bool validateMP4WithFFprobe(const std::string& filename) {
-    MCSR_LOG(INFO) << "Validating MP4 with ffprobe: " << filename;
+// Helper function to validate MP4 structure (box nesting, sample tables, sample offsets)
+bool validateMP4(const std::string& filename) {
+    MCSR_LOG(INFO) << "Validating MP4 structure: " << filename;
     
-    std::string output;
-    int result = executeCommand("ffprobe -v error -show_format -show_streams \"" + filename + "\" 2>&1", output);
-    
-    if (result == 0 && !output.empty()) {
-        MCSR_LOG(INFO) << "✅ ffprobe validation PASSED";
+    Mp4VerifyResult result = Mp4Verifier::verifyFile(filename);
+    if (result.valid) {
+        MCSR_LOG(INFO) << "✅ MP4 validation PASSED (" << result.track_count << " tracks, " << result.sample_count << " samples)";
         return true;
     } else {
-        MCSR_LOG(WARNING) << "⚠️  ffprobe validation skipped (tool not available)";
-        return true;  // Don't fail if ffprobe not available
+        MCSR_LOG(ERROR) << "❌ MP4 validation failed: " << result.error;
+        return false;
     }
 }
 
@@ -104,8 +103,8 @@ bool playMP4WithFFplay(const std::string& filename, uint32_t duration_seconds =
         return true;
     } else {
         MCSR_LOG(WARNING) << "⚠️  ffplay playback skipped or failed (tool not available)";
-        // Try ffprobe as fallback validation
-        return validateMP4WithFFprobe(filename);
+        // Structure was validated before playback; ffplay is optional
+        return true;
     }
 }
 
@@ -172,7 +171,7 @@ bool generateAndPlayMP4(const std::string& filename, uint32_t num_frames,
     
     // Validate and play
     MCSR_LOG(INFO) << "\n--- Validating and Playing MP4 ---";
-    if (!validateMP4WithFFprobe(filename)) {
+    if (!validateMP4(filename)) {
         MCSR_LOG(ERROR) << "❌ MP4 validation failed";
         return false;
     }
@@ -280,7 +279,7 @@ bool test5_crashRecoveryPlayback() {
     
     // Validate and play recovered file
     MCSR_LOG(INFO) << "\n--- Validating and Playing Recovered MP4 ---";
-    if (!validateMP4WithFFprobe("test_recovery.mp4")) {
+    if (!validateMP4("test_recovery.mp4")) {
         MCSR_LOG(ERROR) << "❌ Recovered MP4 validation failed";
         return false;
     }
@@ -5,12 +5,13 @@
  * - Generating H.264 raw stream once using ffmpeg
  * - Reading H.264 stream frame-by-frame to simulate real-time capture
  * - Writing video and audio frames to MP4 file using the recorder
- * - Validating and playing the generated MP4 with ffmpeg
+ * - Validating the generated MP4 with Mp4Verifier and playing it with ffplay
  * 
  * License: GPL v2+
  */
 
 #include "mp4_recorder.h"
+#include "mp4_verifier.h"
 #include "common.h"
 #include <iostream>
 #include <cstring>
@@ -63,19 +64,16 @@ uint64_t getFileSize(const std::string& filename) {
     return f.tellg();
 }
 
-// Helper function to validate MP4 with ffprobe
-bool validateMP4WithFFprobe(const std::string& filename) {
-    MCSR_LOG(INFO) << "Validating MP4 with ffprobe: " << filename;
+// Helper function to validate MP4 structure (box nesting, sample tables, sample offsets)
+bool validateMP4(const std::string& filename) {
+    MCSR_LOG(INFO) << "Validating MP4 structure: " << filename;
     
-    std::string output;
-    int result = executeCommand("ffprobe -v error -show_format -show_streams \"" + filename + "\" 2>&1", output);
-    
-    if (result == 0 && !output.empty()) {
-        MCSR_LOG(INFO) << "ffprobe validation PASSED";
-        MCSR_LOG(INFO) << "Output: " << output;
+    Mp4VerifyResult result = Mp4Verifier::verifyFile(filename);
+    if (result.valid) {
+        MCSR_LOG(INFO) << "MP4 validation PASSED (" << result.track_count << " tracks, " << result.sample_count << " samples)";
         return true;
     } else {
-        MCSR_LOG(WARNING) << "ffprobe validation failed or tool not available";
+        MCSR_LOG(ERROR) << "MP4 validation failed: " << result.error;
         return false;
     }
 }
@@ -796,7 +794,7 @@ int main(int argc, char* argv[]) {
             
             // Validate recovered file
             MCSR_LOG(INFO) << "\n--- Validating Recovered MP4 ---";
-            if (validateMP4WithFFprobe(output_mp4)) {
+            if (validateMP4(output_mp4)) {
                 MCSR_LOG(INFO) << "Recovered MP4 validation PASSED";
             } else {
                 MCSR_LOG(WARNING) << "Recovered MP4 validation failed";
@@ -842,9 +840,9 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Step 4: Validate MP4 with ffprobe
-    MCSR_LOG(INFO) << "\n--- Step 4: Validate MP4 with ffprobe ---";
-    if (!validateMP4WithFFprobe(output_mp4)) {
+    // Step 4: Validate MP4 structure
+    MCSR_LOG(INFO) << "\n--- Step 4: Validate MP4 structure ---";
+    if (!validateMP4(output_mp4)) {
         MCSR_LOG(ERROR) << "MP4 validation failed";
         return 1;
     }
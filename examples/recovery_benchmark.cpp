@@ -0,0 +1,522 @@
+/*
+ * MP4 Crash-Safe Recorder - Recovery Benchmark
+ *
+ * Measures recovery cost against recording length. For each duration an idx/mp4 pair is
+ * synthesized in memory: the index is written through IndexFile exactly as the recorder
+ * would (config, frame entries, periodic table snapshots), while the mp4 is sparse - only
+ * the headers and the parameter sets of the first keyframe hold data, the frame payload is
+ * a hole that reads as zeros. Recovery phases are then timed separately:
+ *
+ *   index_open_us        IndexFile::open + readConfig
+ *   read_all_frames_us   IndexFile::readAllFrames (full replay, no snapshot)
+ *   table_build_us       SampleTable::append for every frame
+ *   build_moov_us        MoovBuilder::buildMoov into memory
+ *   write_moov_us        MoovBuilder::writeMoovToFile
+ *   recover_*_us         Mp4Recorder::recover() and its RecoveryStats phases
+ *                        (recover_codec_config_us is the SPS/PPS extraction from mdat)
+ *
+ * Results are printed to stdout as one JSON object per duration.
+ *
+ * Usage: recovery_benchmark [--hours 1,24,72] [--video-kbps 4000] [--fps 30] [--gop 60]
+ *                           [--audio-kbps 128] [--snapshot-interval 60] [--no-inband-sps]
+ *
+ * --audio-kbps 0 benchmarks a video-only recording, --snapshot-interval 0 an index without
+ * snapshots. Everything is kept in memory, and every snapshot holds the full tables, so runs of
+ * 24h and more need a longer snapshot interval (e.g. --hours 24,72 --snapshot-interval 3600).
+ *
+ * License: GPL v2+
+ */
+
+#include "mp4_recorder.h"
+#include "index_file.h"
+#include "moov_builder.h"
+#include "sample_table.h"
+#include "common.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace mp4_recorder;
+
+namespace {
+
+// Sparse in-memory file: written extents are kept, everything else reads as zeros
+struct MemoryData {
+    std::map<uint64_t, std::vector<uint8_t>> extents;
+    uint64_t size = 0;
+
+    void write(uint64_t pos, const uint8_t* data, size_t length) {
+        uint64_t end = pos + length;
+        // Extend the extent that contains or ends at pos, otherwise start a new one
+        auto it = extents.upper_bound(pos);
+        if (it != extents.begin()) {
+            auto prev = std::prev(it);
+            if (prev->first + prev->second.size() >= pos) {
+                it = prev;
+            }
+        }
+        if (it == extents.end() || it->first > pos) {
+            it = extents.emplace(pos, std::vector<uint8_t>()).first;
+        }
+        std::vector<uint8_t>& extent = it->second;
+        size_t begin = static_cast<size_t>(pos - it->first);
+        if (extent.size() < begin + length) {
+            extent.resize(begin + length);
+        }
+        std::memcpy(extent.data() + begin, data, length);
+
+        // Absorb later extents that the write reached
+        for (auto next = std::next(it); next != extents.end() && next->first <= it->first + extent.size();) {
+            uint64_t next_end = next->first + next->second.size();
+            uint64_t extent_end = it->first + extent.size();
+            if (next_end > extent_end) {
+                extent.insert(extent.end(), next->second.end() - static_cast<ptrdiff_t>(next_end - extent_end),
+                              next->second.end());
+            }
+            next = extents.erase(next);
+        }
+        size = std::max(size, end);
+    }
+
+    size_t read(uint64_t pos, uint8_t* data, size_t length) const {
+        if (pos >= size) {
+            return 0;
+        }
+        length = static_cast<size_t>(std::min<uint64_t>(length, size - pos));
+        std::memset(data, 0, length);
+        uint64_t end = pos + length;
+        auto it = extents.upper_bound(pos);
+        if (it != extents.begin()) {
+            --it;
+        }
+        for (; it != extents.end() && it->first < end; ++it) {
+            uint64_t extent_end = it->first + it->second.size();
+            uint64_t from = std::max(pos, it->first);
+            uint64_t to = std::min(end, extent_end);
+            if (from < to) {
+                std::memcpy(data + (from - pos), it->second.data() + (from - it->first),
+                            static_cast<size_t>(to - from));
+            }
+        }
+        return length;
+    }
+
+    void truncate(uint64_t new_size) {
+        while (!extents.empty()) {
+            auto last = std::prev(extents.end());
+            if (last->first >= new_size) {
+                extents.erase(last);
+            } else {
+                if (last->first + last->second.size() > new_size) {
+                    last->second.resize(static_cast<size_t>(new_size - last->first));
+                }
+                break;
+            }
+        }
+        size = new_size;
+    }
+};
+
+class MemoryFile : public IFile {
+public:
+    MemoryFile(std::shared_ptr<MemoryData> data, bool append)
+        : data_(std::move(data)), append_(append) {
+    }
+
+    size_t read(void* data, size_t size) override {
+        size_t read_bytes = data_->read(position_, static_cast<uint8_t*>(data), size);
+        position_ += read_bytes;
+        return read_bytes;
+    }
+
+    size_t write(const void* data, size_t size) override {
+        if (append_) {
+            position_ = data_->size;
+        }
+        data_->write(position_, static_cast<const uint8_t*>(data), size);
+        position_ += size;
+        return size;
+    }
+
+    bool seek(int64_t offset, int origin) override {
+        int64_t base = origin == SEEK_SET ? 0 :
+                       origin == SEEK_CUR ? static_cast<int64_t>(position_) : static_cast<int64_t>(data_->size);
+        if (base + offset < 0) {
+            return false;
+        }
+        position_ = static_cast<uint64_t>(base + offset);
+        return true;
+    }
+
+    int64_t tell() override { return static_cast<int64_t>(position_); }
+    bool flush() override { return true; }
+    bool sync() override { return true; }
+    void close() override { open_ = false; }
+    bool isOpen() const override { return open_; }
+
+private:
+    std::shared_ptr<MemoryData> data_;
+    uint64_t position_ = 0;
+    bool append_;
+    bool open_ = true;
+};
+
+class MemoryFileOps : public IFileOps {
+public:
+    std::unique_ptr<IFile> open(const std::string& path, const char* mode) override {
+        auto it = files_.find(path);
+        if (mode[0] == 'r' && it == files_.end()) {
+            return std::unique_ptr<IFile>();
+        }
+        if (mode[0] == 'w' || it == files_.end()) {
+            it = files_.insert_or_assign(path, std::make_shared<MemoryData>()).first;
+        }
+        return std::unique_ptr<IFile>(new MemoryFile(it->second, mode[0] == 'a'));
+    }
+
+    bool exists(const std::string& path) override { return files_.count(path) > 0; }
+    bool remove(const std::string& path) override { return files_.erase(path) > 0; }
+
+    bool getFileSize(const std::string& path, uint64_t& size) override {
+        auto it = files_.find(path);
+        if (it == files_.end()) {
+            return false;
+        }
+        size = it->second->size;
+        return true;
+    }
+
+    bool truncate(const std::string& path, uint64_t size) override {
+        auto it = files_.find(path);
+        if (it == files_.end()) {
+            return false;
+        }
+        it->second->truncate(size);
+        return true;
+    }
+
+private:
+    std::map<std::string, std::shared_ptr<MemoryData>> files_;
+};
+
+struct BenchmarkOptions {
+    std::vector<double> hours = {1};
+    uint32_t video_kbps = 4000;
+    uint32_t fps = 30;
+    uint32_t gop = 60;
+    uint32_t audio_kbps = 128;
+    uint32_t snapshot_interval_s = 60;
+    bool inband_sps = true;
+};
+
+const uint8_t kSps[] = {0x67, 0x42, 0xC0, 0x1E, 0xDA, 0x02, 0x80, 0xBF, 0xE5, 0x84, 0x00, 0x00,
+                        0x03, 0x00, 0x04, 0x00, 0x00, 0x03, 0x00, 0xF0, 0x3C, 0x58, 0xBA, 0x80};
+const uint8_t kPps[] = {0x68, 0xCE, 0x3C, 0x80};
+const uint32_t kAudioSampleRate = 48000;
+const uint32_t kAudioFrameSamples = 1024;
+
+struct Timer {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    uint64_t lapUs() {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t elapsed = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - begin).count());
+        begin = now;
+        return elapsed;
+    }
+};
+
+// Deterministic size jitter, so the size table is not trivially constant
+uint32_t jitter(uint64_t& state, uint32_t size) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t spread = std::max<uint32_t>(size / 10, 1);
+    return size - spread + static_cast<uint32_t>((state >> 33) % (2 * spread));
+}
+
+void appendBE32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<uint8_t>(value >> shift));
+    }
+}
+
+struct SynthesizedPair {
+    uint64_t video_frames = 0;
+    uint64_t audio_frames = 0;
+    uint64_t snapshots = 0;
+    uint64_t mdat_size = 0;
+    uint64_t idx_size = 0;
+    uint64_t mp4_size = 0;
+};
+
+// Lay out an interleaved A/V recording of the given length and write its idx/mp4 pair
+bool synthesize(MemoryFileOps& file_ops, const std::string& filename, const BenchmarkOptions& options,
+                double hours, RecorderConfig& config, SynthesizedPair& pair) {
+    config = RecorderConfig();
+    config.video_timescale = 90000;
+    config.audio_timescale = kAudioSampleRate;
+    config.audio_sample_rate = kAudioSampleRate;
+    config.video_width = 1920;
+    config.video_height = 1080;
+    config.snapshot_interval_ms = options.snapshot_interval_s * 1000;
+
+    std::unique_ptr<IFile> mp4 = file_ops.open(filename, "wb");
+    file_ops.open(filename + ".lock", "wb");
+
+    // Same header as the recorder, but with a 64-bit mdat size so long recordings fit
+    std::vector<uint8_t> header = {0x00, 0x00, 0x00, 0x20, 'f', 't', 'y', 'p', 'i', 's', 'o', 'm',
+                                   0x00, 0x00, 0x02, 0x00, 'i', 's', 'o', 'm', 'i', 's', 'o', '2',
+                                   'a', 'v', 'c', '1', 'm', 'p', '4', '1',
+                                   0x00, 0x00, 0x00, 0x01, 'm', 'd', 'a', 't'};
+    header.resize(header.size() + 8, 0);
+    const uint64_t mdat_start = header.size();
+    mp4->write(header.data(), header.size());
+
+    IndexFile idx(std::shared_ptr<IFileOps>(&file_ops, [](IFileOps*) {}));
+    if (!idx.create(filename + ".idx") || !idx.writeConfig(config)) {
+        return false;
+    }
+
+    const uint64_t video_count = static_cast<uint64_t>(hours * 3600 * options.fps);
+    const uint64_t audio_count = options.audio_kbps == 0 ? 0 :
+        static_cast<uint64_t>(hours * 3600 * kAudioSampleRate / kAudioFrameSamples);
+    const uint32_t video_frame_bytes = options.video_kbps * 125 / options.fps;
+    const uint32_t p_frame_bytes = video_frame_bytes * options.gop / (options.gop + 4);
+    const uint32_t audio_frame_bytes = options.audio_kbps * 125 * kAudioFrameSamples / kAudioSampleRate;
+    const uint32_t video_delta = config.video_timescale / options.fps;
+
+    SampleTable video_table;
+    SampleTable audio_table;
+    uint64_t offset = 0;
+    uint64_t jitter_state = 1;
+    uint64_t next_snapshot_ms = config.snapshot_interval_ms;
+    uint64_t v = 0;
+    uint64_t a = 0;
+    while (v < video_count || a < audio_count) {
+        // Interleave by presentation time
+        bool take_video = a >= audio_count ||
+            (v < video_count && v * kAudioSampleRate < a * kAudioFrameSamples * options.fps);
+        FrameInfo frame = {};
+        frame.offset = offset;
+        if (take_video) {
+            bool keyframe = v % options.gop == 0;
+            frame.size = jitter(jitter_state, keyframe ? p_frame_bytes * 5 : p_frame_bytes);
+            frame.pts = frame.dts = static_cast<int64_t>(v * video_delta);
+            frame.is_keyframe = keyframe ? 1 : 0;
+            frame.track_id = 0;
+            if (v == 0 && options.inband_sps) {
+                // AVCC SPS + PPS + IDR slice header; the rest of the payload stays a hole
+                std::vector<uint8_t> prefix;
+                appendBE32(prefix, sizeof(kSps));
+                prefix.insert(prefix.end(), kSps, kSps + sizeof(kSps));
+                appendBE32(prefix, sizeof(kPps));
+                prefix.insert(prefix.end(), kPps, kPps + sizeof(kPps));
+                appendBE32(prefix, frame.size - static_cast<uint32_t>(prefix.size()) - 4);
+                prefix.push_back(0x65);
+                prefix.push_back(0x88);
+                mp4->seek(static_cast<int64_t>(mdat_start + offset), SEEK_SET);
+                mp4->write(prefix.data(), prefix.size());
+            }
+            video_table.append(frame);
+            v++;
+        } else {
+            frame.size = jitter(jitter_state, audio_frame_bytes);
+            frame.pts = frame.dts = static_cast<int64_t>(a * kAudioFrameSamples);
+            frame.track_id = 1;
+            frame.is_keyframe = 1;
+            audio_table.append(frame);
+            a++;
+        }
+        offset += frame.size;
+        if (!idx.writeFrame(frame)) {
+            return false;
+        }
+
+        uint64_t media_ms = v * 1000 / options.fps;
+        if (config.snapshot_interval_ms > 0 && media_ms >= next_snapshot_ms) {
+            std::vector<uint8_t> payload;
+            encodeTableSnapshot(video_table, audio_table, payload);
+            if (!idx.writeRecord(IndexRecordType::TableSnapshot, payload)) {
+                return false;
+            }
+            next_snapshot_ms += config.snapshot_interval_ms;
+            pair.snapshots++;
+        }
+    }
+    idx.close();
+    file_ops.truncate(filename, mdat_start + offset);
+
+    pair.video_frames = v;
+    pair.audio_frames = a;
+    pair.mdat_size = offset;
+    file_ops.getFileSize(filename + ".idx", pair.idx_size);
+    file_ops.getFileSize(filename, pair.mp4_size);
+    return true;
+}
+
+bool runScenario(const BenchmarkOptions& options, double hours) {
+    MemoryFileOps file_ops;
+    const std::string filename = "bench.mp4";
+    RecorderConfig config;
+    SynthesizedPair pair;
+    std::ostringstream json;
+    json << "{\"hours\":" << hours << ",\"video_kbps\":" << options.video_kbps
+         << ",\"audio_kbps\":" << options.audio_kbps << ",\"fps\":" << options.fps
+         << ",\"gop\":" << options.gop << ",\"snapshot_interval_s\":" << options.snapshot_interval_s
+         << ",\"inband_sps\":" << (options.inband_sps ? "true" : "false");
+
+    Timer timer;
+    if (!synthesize(file_ops, filename, options, hours, config, pair)) {
+        std::cerr << "Failed to synthesize " << hours << "h recording" << std::endl;
+        return false;
+    }
+    json << ",\"synthesize_us\":" << timer.lapUs() << ",\"video_frames\":" << pair.video_frames
+         << ",\"audio_frames\":" << pair.audio_frames << ",\"snapshots\":" << pair.snapshots
+         << ",\"mdat_bytes\":" << pair.mdat_size << ",\"idx_bytes\":" << pair.idx_size;
+
+    std::shared_ptr<IFileOps> shared_ops(&file_ops, [](IFileOps*) {});
+    {
+        // Full index replay, as done for indexes without a snapshot
+        IndexFile idx(shared_ops);
+        RecorderConfig read_config;
+        timer.lapUs();
+        if (!idx.open(filename + ".idx") || !idx.readConfig(read_config)) {
+            std::cerr << "Failed to open synthesized index" << std::endl;
+            return false;
+        }
+        json << ",\"index_open_us\":" << timer.lapUs();
+
+        std::vector<FrameInfo> video_frames, audio_frames;
+        if (!idx.readAllFrames(video_frames, audio_frames)) {
+            std::cerr << "Failed to read synthesized index" << std::endl;
+            return false;
+        }
+        json << ",\"read_all_frames_us\":" << timer.lapUs();
+        idx.close();
+
+        SampleTable video_table;
+        SampleTable audio_table;
+        for (const FrameInfo& frame : video_frames) {
+            video_table.append(frame);
+        }
+        for (const FrameInfo& frame : audio_frames) {
+            audio_table.append(frame);
+        }
+        json << ",\"table_build_us\":" << timer.lapUs();
+
+        MoovConfig moov_config;
+        moov_config.video_timescale = config.video_timescale;
+        moov_config.audio_timescale = config.audio_timescale;
+        moov_config.audio_sample_rate = config.audio_sample_rate;
+        moov_config.audio_channels = config.audio_channels;
+        moov_config.video_width = config.video_width;
+        moov_config.video_height = config.video_height;
+        moov_config.sps = kSps;
+        moov_config.sps_size = sizeof(kSps);
+        moov_config.pps = kPps;
+        moov_config.pps_size = sizeof(kPps);
+        moov_config.mdat_start = 48;
+        MoovBuilder builder;
+        std::vector<uint8_t> moov_data;
+        bool built = builder.buildMoov(video_table, audio_table, moov_config, moov_data);
+        json << ",\"build_moov_us\":" << timer.lapUs() << ",\"moov_bytes\":" << moov_data.size();
+        if (!built) {
+            std::cerr << "Failed to build moov" << std::endl;
+            return false;
+        }
+
+        bool written = builder.writeMoovToFile("bench.moov", moov_data, &file_ops);
+        json << ",\"write_moov_us\":" << timer.lapUs();
+        file_ops.remove("bench.moov");
+        if (!written) {
+            std::cerr << "Failed to write moov" << std::endl;
+            return false;
+        }
+    }
+
+    Mp4Recorder recorder(shared_ops);
+    timer.lapUs();
+    bool recovered = recorder.recover(filename);
+    uint64_t recover_us = timer.lapUs();
+    const RecoveryStats& stats = recorder.getRecoveryStats();
+    json << ",\"recover_ok\":" << (recovered ? "true" : "false") << ",\"recover_us\":" << recover_us
+         << ",\"recover_index_read_us\":" << stats.index_read_us
+         << ",\"recover_mdat_scan_us\":" << stats.mdat_scan_us
+         << ",\"recover_codec_config_us\":" << stats.codec_config_us
+         << ",\"recover_moov_write_us\":" << stats.moov_write_us << "}";
+
+    std::cout << json.str() << std::endl;
+    return recovered;
+}
+
+bool parseHours(const std::string& list, std::vector<double>& hours) {
+    hours.clear();
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        double value = std::atof(item.c_str());
+        if (value <= 0) {
+            return false;
+        }
+        hours.push_back(value);
+    }
+    return !hours.empty();
+}
+
+void printUsage() {
+    std::cerr << "Usage: recovery_benchmark [--hours 1,24,72] [--video-kbps 4000] [--fps 30] [--gop 60]\n"
+              << "                          [--audio-kbps 128] [--snapshot-interval 60] [--no-inband-sps]"
+              << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    SetLogSeverity(LogSeverity::LS_WARNING);
+
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--hours" && has_value) {
+            if (!parseHours(argv[++i], options.hours)) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--video-kbps" && has_value) {
+            options.video_kbps = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--fps" && has_value) {
+            options.fps = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--gop" && has_value) {
+            options.gop = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--audio-kbps" && has_value) {
+            options.audio_kbps = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--snapshot-interval" && has_value) {
+            options.snapshot_interval_s = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--no-inband-sps") {
+            options.inband_sps = false;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+    if (options.video_kbps == 0 || options.fps == 0 || options.gop == 0) {
+        printUsage();
+        return 1;
+    }
+
+    bool ok = true;
+    for (double hours : options.hours) {
+        ok = runScenario(options, hours) && ok;
+    }
+    return ok ? 0 : 1;
+}
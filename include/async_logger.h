@@ -0,0 +1,104 @@
+/*
+ * MP4 Crash-Safe Recorder - Asynchronous Logger
+ *
+ * Moves log formatting and output off the logging threads
+ *
+ * License: GPL v2+
+ */
+
+#ifndef ASYNC_LOGGER_H
+#define ASYNC_LOGGER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+namespace mp4_recorder {
+
+// Every logging thread owns a single-producer ring of fixed-size records; push() copies the
+// message into it without locks or allocation (only a thread's first message registers its
+// ring). A drain thread collects the rings, restores the global order and writes through
+// LogSettings, flushing once per batch. A full ring drops the message and counts it; the
+// drain thread reports drops as a warning.
+//
+// Queued messages are lost if the process dies before they are drained, so the recorder
+// keeps synchronous logging unless LogSettings::EnableAsyncLogging() is called.
+class AsyncLogger {
+public:
+    // Longer messages are truncated
+    static constexpr size_t kMaxMessageSize = 464;
+
+    static AsyncLogger& instance();
+
+    ~AsyncLogger();
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    // ring_capacity is rounded up to a power of two
+    bool start(size_t ring_capacity);
+
+    // Writes everything queued so far and joins the drain thread. Messages pushed
+    // concurrently with stop() may be lost.
+    void stop();
+
+    bool running() const { return running_.load(std::memory_order_acquire); }
+
+    // Queue a message; false if the logger is not running (log synchronously instead).
+    // file must outlive the logger, as __FILE__ does.
+    bool push(LogSeverity severity, const char* file, int line, const std::string& msg);
+
+    // Messages dropped because a ring was full, since the process started
+    uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct Record {
+        uint64_t sequence;
+        std::chrono::system_clock::time_point time;
+        const char* file;
+        int32_t line;
+        LogSeverity severity;
+        uint16_t size;
+        char text[kMaxMessageSize];
+    };
+
+    class Ring;
+
+    AsyncLogger() = default;
+
+    void drainLoop();
+    bool drain(std::vector<Record>& batch);
+    std::shared_ptr<Ring> registerRing();
+
+    // The calling thread's ring. rings_ holds a second reference, so queued records outlive
+    // their thread until they are written.
+    static thread_local std::shared_ptr<Ring> t_ring_;
+
+    std::atomic<bool> running_{false};
+    std::atomic<uint32_t> generation_{0};
+    std::atomic<uint64_t> sequence_{0};
+    std::atomic<uint64_t> dropped_{0};
+    uint64_t reported_dropped_ = 0;
+    size_t ring_capacity_ = 0;
+
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool stop_requested_ = false;
+    std::thread drain_thread_;
+};
+
+} // namespace mp4_recorder
+
+#endif // ASYNC_LOGGER_H
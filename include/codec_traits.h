@@ -0,0 +1,84 @@
+/*
+ * MP4 Crash-Safe Recorder - Codec Traits
+ *
+ * Compile-time codec descriptions used to specialise track building
+ *
+ * License: GPL v2+
+ */
+
+#ifndef CODEC_TRAITS_H
+#define CODEC_TRAITS_H
+
+#include <cstdint>
+
+namespace mp4_recorder {
+
+// Video codec stored in the video track
+enum class VideoCodec : uint8_t {
+    H264 = 0,
+    H265 = 1
+};
+
+// Audio codec stored in the audio track
+enum class AudioCodec : uint8_t {
+    AAC = 0,
+    OPUS = 1
+};
+
+// Properties shared by all video codecs
+struct VideoTrackTraits {
+    static constexpr bool kIsVideo = true;
+    static constexpr const char* kHandlerType = "vide";
+    static constexpr uint16_t kVolume = 0;
+    // Video tracks carry an stss box listing the sync samples
+    static constexpr bool kHasSyncSampleTable = true;
+
+    // Approximate 30fps when the last sample has no successor
+    static uint32_t defaultSampleDuration(uint32_t timescale) {
+        return timescale >= 30 ? timescale / 30 : 1;
+    }
+};
+
+// Properties shared by all audio codecs
+struct AudioTrackTraits {
+    static constexpr bool kIsVideo = false;
+    static constexpr const char* kHandlerType = "soun";
+    static constexpr uint16_t kVolume = 0x0100;  // 1.0
+    // Every audio sample is a sync sample, so stss is omitted
+    static constexpr bool kHasSyncSampleTable = false;
+};
+
+// H.264 / AVC ("avc1" + avcC)
+struct AvcCodec : VideoTrackTraits {
+    static constexpr const char* kSampleEntryType = "avc1";
+};
+
+// H.265 / HEVC ("hvc1" + hvcC)
+struct HevcCodec : VideoTrackTraits {
+    static constexpr const char* kSampleEntryType = "hvc1";
+};
+
+// AAC-LC ("mp4a" + esds)
+struct AacCodec : AudioTrackTraits {
+    static constexpr const char* kSampleEntryType = "mp4a";
+
+    // AAC-LC uses 1024 samples per frame at the audio timescale
+    static uint32_t defaultSampleDuration(uint32_t /*timescale*/) {
+        return 1024;
+    }
+};
+
+// Opus ("Opus" + dOps)
+struct OpusCodec : AudioTrackTraits {
+    static constexpr const char* kSampleEntryType = "Opus";
+    static constexpr uint16_t kPreSkip = 312;  // Encoder delay recommended by RFC 7845
+
+    // Opus encoders default to 20ms frames
+    static uint32_t defaultSampleDuration(uint32_t timescale) {
+        return timescale >= 50 ? timescale / 50 : 1;
+    }
+};
+
+} // namespace mp4_recorder
+
+#endif // CODEC_TRAITS_H
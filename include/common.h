@@ -9,6 +9,8 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include <iostream>
@@ -42,12 +44,29 @@ public:
     static LogSeverity GetMinSeverity();
     static void EnableFileLogging(const std::string& filename = "mp4_recorder.log");
     static void DisableFileLogging();
-    static bool ShouldLog(LogSeverity severity);
+    // Hand messages to a background thread instead of writing them on the logging thread.
+    // queue_capacity is per logging thread; messages beyond it are dropped and counted.
+    static void EnableAsyncLogging(size_t queue_capacity = 512);
+    // Writes all queued messages before returning
+    static void DisableAsyncLogging();
+    static uint64_t GetDroppedLogCount();
+    static bool ShouldLog(LogSeverity severity) {
+        LogSeverity min_severity = min_severity_.load(std::memory_order_relaxed);
+        return severity >= min_severity && min_severity != LogSeverity::LS_NONE;
+    }
     static void Log(LogSeverity severity, const std::string& msg,
                     const char* file, int line);
 
 private:
-    static std::string getCurrentTime();
+    friend class AsyncLogger;
+
+    static inline std::atomic<LogSeverity> min_severity_{LogSeverity::LS_INFO};
+
+    static std::string formatTime(time_t time);
+    static std::string formatLine(LogSeverity severity, const char* msg, size_t size,
+                                  const char* file, int line);
+    static void write(LogSeverity severity, const std::string& line, time_t time, bool flush);
+    static void flushOutputs();
     static void writeToFile(const std::string& msg);
     static const char* severityToString(LogSeverity severity);
 };
@@ -73,6 +92,12 @@ private:
     std::ostringstream stream_;
 };
 
+// Turns the streamed LogMessage into void, so MCSR_LOG can be the false branch of a conditional
+class LogMessageVoidify {
+public:
+    void operator&(const LogMessage&) {}
+};
+
 inline void SetLogSeverity(LogSeverity severity) {
     LogSettings::SetMinSeverity(severity);
 }
@@ -105,7 +130,30 @@ inline void DisableFileLogging() {
     LogSettings::DisableFileLogging();
 }
 
-#define MCSR_LOG(severity) ::mp4_recorder::LogMessage(__FILE__, __LINE__, ::mp4_recorder::LogSeverity::LS_##severity)
+inline void EnableAsyncLogging(size_t queue_capacity = 512) {
+    LogSettings::EnableAsyncLogging(queue_capacity);
+}
+
+inline void DisableAsyncLogging() {
+    LogSettings::DisableAsyncLogging();
+}
+
+// Log statements below this severity are compiled out (0 = VERBOSE, 1 = INFO, 2 = WARNING,
+// 3 = ERROR, 4 = NONE); set it with the MCSR_MIN_LOG_SEVERITY CMake option
+#ifndef MCSR_MIN_LOG_SEVERITY
+#define MCSR_MIN_LOG_SEVERITY 0
+#endif
+
+#define MCSR_LOG_IS_ON(severity) \
+    (static_cast<int>(::mp4_recorder::LogSeverity::LS_##severity) >= MCSR_MIN_LOG_SEVERITY && \
+     ::mp4_recorder::LogSettings::ShouldLog(::mp4_recorder::LogSeverity::LS_##severity))
+
+// The streamed arguments are only evaluated, and the LogMessage only constructed, when the
+// statement is enabled; a disabled statement costs one branch
+#define MCSR_LOG(severity) \
+    !MCSR_LOG_IS_ON(severity) ? (void)0 : \
+        ::mp4_recorder::LogMessageVoidify() & \
+        ::mp4_recorder::LogMessage(__FILE__, __LINE__, ::mp4_recorder::LogSeverity::LS_##severity)
 
 // Utility functions
 inline uint32_t readBE32(const uint8_t* p) {
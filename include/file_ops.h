@@ -28,6 +28,9 @@ public:
     virtual bool sync() = 0;
     virtual void close() = 0;
     virtual bool isOpen() const = 0;
+
+    // Hint that [offset, offset + size) will be read soon. Implementations without support return false.
+    virtual bool prefetch(uint64_t offset, uint64_t size) { (void)offset; (void)size; return false; }
 };
 
 class IFileOps {
@@ -38,6 +41,13 @@ public:
     virtual bool exists(const std::string& path) = 0;
     virtual bool remove(const std::string& path) = 0;
     virtual bool getFileSize(const std::string& path, uint64_t& size) = 0;
+
+    // Shrink a closed file to size bytes. Implementations without support return false.
+    virtual bool truncate(const std::string& path, uint64_t size) { (void)path; (void)size; return false; }
+
+    // True while writes through these ops would wait for queued data to reach the disk.
+    // Recorders with a drop policy shed frames instead of waiting. May be called from any thread.
+    virtual bool congested() { return false; }
 };
 
 class StdioFile : public IFile {
@@ -53,6 +63,7 @@ public:
     bool sync() override;
     void close() override;
     bool isOpen() const override;
+    bool prefetch(uint64_t offset, uint64_t size) override;
 
 private:
     FILE* file_;
@@ -64,6 +75,7 @@ public:
     bool exists(const std::string& path) override;
     bool remove(const std::string& path) override;
     bool getFileSize(const std::string& path, uint64_t& size) override;
+    bool truncate(const std::string& path, uint64_t size) override;
 };
 
 } // namespace mp4_recorder
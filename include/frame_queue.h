@@ -0,0 +1,60 @@
+/*
+ * MP4 Crash-Safe Recorder - Frame Queue
+ *
+ * Single-producer single-consumer queue of frames for concurrent track writers
+ *
+ * License: GPL v2+
+ */
+
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mp4_recorder {
+
+// A frame copied into a FrameQueue
+struct QueuedFrame {
+    std::vector<uint8_t> data;
+    int64_t pts = 0;
+    int64_t dts = 0;
+    bool is_keyframe = false;
+};
+
+// Ring of frames with one producer and one consumer thread. push(), front() and pop() take
+// no locks and never wait. Slot buffers are kept across frames, so once they have grown to
+// the frame size pushing does not allocate either.
+class FrameQueue {
+public:
+    // capacity is rounded up to a power of two
+    explicit FrameQueue(size_t capacity);
+
+    FrameQueue(const FrameQueue&) = delete;
+    FrameQueue& operator=(const FrameQueue&) = delete;
+
+    size_t capacity() const { return slots_.size(); }
+
+    // Producer: copy a frame in; false if the queue is full
+    bool push(const uint8_t* data, uint32_t size, int64_t pts, int64_t dts, bool is_keyframe);
+
+    // Consumer: oldest frame, or nullptr if empty; valid until pop()
+    QueuedFrame* front();
+    void pop();
+
+    // Approximate when called concurrently with push() or pop()
+    size_t size() const;
+    bool empty() const { return size() == 0; }
+
+private:
+    std::vector<QueuedFrame> slots_;
+    size_t mask_;
+    alignas(64) std::atomic<uint64_t> head_{0};  // Next frame to consume
+    alignas(64) std::atomic<uint64_t> tail_{0};  // Next slot to fill
+};
+
+} // namespace mp4_recorder
+
+#endif // FRAME_QUEUE_H
@@ -21,6 +21,33 @@ namespace mp4_recorder {
 struct FrameInfo;
 struct RecorderConfig;
 
+// track_id value that marks a non-frame record (frames use 0 for video, 1 for audio)
+constexpr uint8_t kIndexRecordTrackId = 0xFF;
+constexpr uint32_t kIndexRecordMagic = 0x4D503458;  // "MP4X"
+
+// Non-frame records stored between frame entries
+enum class IndexRecordType : uint32_t {
+    TableSnapshot = 1,  // Serialized sample tables of both tracks
+    CodecConfig = 2,    // Video parameter sets (VPS/SPS/PPS), versioned
+    FileLayout = 3,     // MP4 header layout, always the first entry after the config
+    Finalize = 4        // moov write journal, appended around writing the moov
+};
+
+// Header of a non-frame record. It has the size of FrameInfo and keeps track_id at the
+// same offset, so frame readers can tell records apart. The payload follows the header,
+// zero-padded to a multiple of sizeof(FrameInfo) to keep later entries aligned.
+struct IndexRecordHeader {
+    uint32_t magic;          // kIndexRecordMagic
+    uint32_t type;           // IndexRecordType
+    uint32_t payload_size;   // Payload bytes, excluding padding
+    uint32_t checksum;       // CRC-32 of the payload
+    uint64_t frame_count;    // Frames logged before this record
+    uint64_t reserved0;
+    uint8_t  reserved1;
+    uint8_t  track_id;       // Always kIndexRecordTrackId
+    uint8_t  reserved2[6];
+};
+
 // Index file handler
 class IndexFile {
 public:
@@ -46,6 +73,33 @@ public:
     // Read all frames from index
     bool readAllFrames(std::vector<FrameInfo>& video_frames, std::vector<FrameInfo>& audio_frames);
 
+    // Read frames starting at a file position (e.g. right after a snapshot record)
+    bool readFramesFrom(uint64_t position, std::vector<FrameInfo>& video_frames,
+                        std::vector<FrameInfo>& audio_frames);
+
+    // Append a non-frame record
+    bool writeRecord(IndexRecordType type, const std::vector<uint8_t>& payload);
+
+    // Find the newest intact record of the given type by scanning backward from the end,
+    // looking at no more than max_entries entries.
+    // next_position is the file position of the first entry after the record.
+    bool findLastRecord(IndexRecordType type, std::vector<uint8_t>& payload,
+                        uint64_t& next_position, uint64_t max_entries = UINT64_MAX);
+
+    // Read and verify the record of the given type at a file position
+    bool readRecordAt(uint64_t position, IndexRecordType type, std::vector<uint8_t>& payload,
+                      uint64_t& next_position);
+    
+    // File position of the first frame entry (after magic + config)
+    static uint64_t frameDataStart();
+
+    // Append a non-frame record to an index opened elsewhere
+    static bool appendRecord(IFile& file, IndexRecordType type, uint64_t frame_count,
+                             const std::vector<uint8_t>& payload);
+
+    // CRC-32 (IEEE) used for record checksums
+    static uint32_t checksum(const uint8_t* data, size_t size);
+
     // Flush to disk
     bool flush();
 
@@ -0,0 +1,80 @@
+/*
+ * MP4 Crash-Safe Recorder - Interleaver
+ *
+ * Reorders video and audio frames by decode time and groups them into per-track runs
+ *
+ * License: GPL v2+
+ */
+
+#ifndef INTERLEAVER_H
+#define INTERLEAVER_H
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "frame_queue.h"
+
+namespace mp4_recorder {
+
+// Buffers frames of both tracks and releases them in decode time order, one run of up to
+// chunk_ms of media time per track at a time. Written back to back, a run becomes one
+// multi-sample chunk, and a player reading the file front to back finds video and audio of
+// the same moment next to each other whatever order the producers delivered them in.
+//
+// A run is released once its track has buffered past the end of the run and the other track
+// cannot still deliver an earlier frame. A track that falls silent holds the other one back
+// for at most chunk_ms + window_ms of media time, which also bounds the buffered duration.
+//
+// Not thread safe; frames of each track must be pushed in decode order.
+class Interleaver {
+public:
+    Interleaver(uint32_t video_timescale, uint32_t audio_timescale, uint32_t chunk_ms, uint32_t window_ms);
+
+    Interleaver(const Interleaver&) = delete;
+    Interleaver& operator=(const Interleaver&) = delete;
+
+    // Copy a frame in; track_id is 0 for video and 1 for audio
+    void push(uint8_t track_id, const uint8_t* data, uint32_t size, int64_t pts, int64_t dts, bool is_keyframe);
+    // Take over a frame, leaving frame.data with a buffer that can be reused
+    void push(uint8_t track_id, QueuedFrame& frame);
+
+    // Next frame that may be written, or nullptr if the runs still wait for input. The
+    // frame stays valid until pop(); track_id receives its track.
+    const QueuedFrame* next(uint8_t& track_id);
+    void pop();
+
+    // No more input: release everything that is buffered
+    void finish() { finishing_ = true; }
+    // Release the next run without waiting for it to be complete (memory pressure)
+    void releaseNextRun() { force_run_ = true; }
+
+    size_t bufferedFrames() const { return tracks_[0].frames.size() + tracks_[1].frames.size(); }
+
+private:
+    struct Track {
+        std::deque<QueuedFrame> frames;
+        uint32_t timescale = 0;
+        bool has_input = false;
+        int64_t last_input_us = 0;  // Decode time of the newest frame pushed
+    };
+
+    QueuedFrame& append(uint8_t track_id, int64_t dts);
+    int64_t headUs(const Track& track) const;
+    bool startRun();
+
+    Track tracks_[2];
+    int64_t chunk_us_;
+    int64_t window_us_;
+    bool has_input_ = false;
+    int64_t newest_input_us_ = 0;     // Over both tracks
+    int run_track_ = -1;              // Track of the run being released, -1 between runs
+    int64_t run_end_us_ = 0;
+    bool finishing_ = false;
+    bool force_run_ = false;
+    std::vector<std::vector<uint8_t>> spare_buffers_;
+};
+
+} // namespace mp4_recorder
+
+#endif // INTERLEAVER_H
@@ -0,0 +1,88 @@
+/*
+ * MP4 Crash-Safe Recorder - Mdat Scanner
+ *
+ * Re-derives sample boundaries from mdat payload when the index is missing or incomplete
+ *
+ * License: GPL v2+
+ */
+
+#ifndef MDAT_SCANNER_H
+#define MDAT_SCANNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "codec_traits.h"
+#include "file_ops.h"
+
+namespace mp4_recorder {
+
+// Sample found in mdat (offset is relative to the start of mdat data)
+struct ScannedSample {
+    uint64_t offset;
+    uint32_t size;
+    bool is_keyframe;
+    uint8_t track_id;       // 0 for video, 1 for audio
+};
+
+struct MdatScanStats {
+    uint64_t video_samples = 0;
+    uint64_t audio_samples = 0;
+    uint64_t skipped_bytes = 0;     // Bytes that could not be attributed to a sample
+};
+
+// Walks mdat data and splits it into samples.
+// Video access units are recognized from AVCC length prefixes or Annex-B start codes,
+// audio from ADTS headers. Raw (unframed) audio cannot be delimited without the index
+// and is skipped. NAL boundary and sync word searches use SSE2/NEON when available.
+class MdatScanner {
+public:
+    explicit MdatScanner(VideoCodec video_codec, size_t buffer_size = 4 * 1024 * 1024);
+
+    // Scan mdat data in [begin, end) (relative to mdat_start) and append the samples found
+    bool scan(IFile& file, uint64_t mdat_start, uint64_t begin, uint64_t end,
+              std::vector<ScannedSample>& samples);
+
+    const MdatScanStats& stats() const { return stats_; }
+
+    // Largest video sample known from before the scanned range (e.g. from the index).
+    // Tightens the access unit size bound from the first sample on.
+    void setKnownMaxVideoSampleSize(uint32_t size) { max_video_sample_ = size; }
+
+    // Index of the first 00 00 00, 00 00 01 or 00 00 02, none of which can occur inside
+    // a NAL unit, or size when there is none
+    static size_t findNalBoundary(const uint8_t* data, size_t size);
+
+    // Index of the first ADTS sync word (0xFFF, layer 0), or size when there is none
+    static size_t findAdtsSync(const uint8_t* data, size_t size);
+
+private:
+    class Window;
+
+    bool parseVideo(Window& window, uint64_t pos, uint32_t& length, bool& is_keyframe);
+    bool parseAdts(Window& window, uint64_t pos, uint32_t& length);
+    bool parseAvcc(Window& window, uint64_t pos, uint32_t& length, bool& is_keyframe);
+    bool parseAnnexB(Window& window, uint64_t pos, uint32_t& length, bool& is_keyframe);
+    bool startsSample(Window& window, uint64_t pos);
+    uint64_t findSample(Window& window, uint64_t begin, uint64_t end);
+    uint64_t maxVideoSampleSize() const;
+
+    // NAL unit header checks, per codec
+    size_t nalHeaderSize() const;
+    bool isValidNalHeader(const uint8_t* header) const;
+    bool isVcl(const uint8_t* header) const;
+    bool isKeyframeNal(const uint8_t* header) const;
+    bool startsAccessUnit(const uint8_t* header, size_t available, bool has_vcl) const;
+
+    VideoCodec video_codec_;
+    size_t buffer_size_;
+    MdatScanStats stats_;
+    uint32_t max_video_sample_ = 0;
+    uint64_t avcc_samples_ = 0;
+    uint64_t annexb_samples_ = 0;
+};
+
+} // namespace mp4_recorder
+
+#endif // MDAT_SCANNER_H
@@ -0,0 +1,97 @@
+/*
+ * MP4 Crash-Safe Recorder - Metrics Registry
+ *
+ * Aggregates the statistics of all recorders in the process and exports them
+ * periodically as Prometheus text or through a callback
+ *
+ * License: GPL v2+
+ */
+
+#ifndef METRICS_REGISTRY_H
+#define METRICS_REGISTRY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "recorder_stats.h"
+
+namespace mp4_recorder {
+
+// Process-wide totals of all recorders
+struct MetricsSnapshot {
+    std::chrono::system_clock::time_point time;
+    size_t recorders = 0;        // Live Mp4Recorder instances
+    size_t recording = 0;        // Of which between start() and stop()
+    // Summed over live recorders and over the recordings of recorders since restarted or
+    // destroyed, so counters and histograms never go backwards. unflushed_frames covers live
+    // recorders only; moov_build_us and finalize_us add up the time of all finalizations.
+    RecorderStats totals;
+};
+
+struct MetricsExporterConfig {
+    uint32_t interval_ms = 10000;
+    // Prometheus textfile collector file, replaced atomically on each export (empty = none)
+    std::string textfile_path;
+    // Called on the exporter thread with each snapshot (empty = none)
+    std::function<void(const MetricsSnapshot&)> callback;
+};
+
+// Every Mp4Recorder registers its counters here for its lifetime. A snapshot reads each
+// recorder's relaxed atomics once, so it costs O(recorders) regardless of the frame rate and
+// never blocks a recording thread; only constructing or destroying a recorder, and start(),
+// wait for a snapshot in progress.
+class MetricsRegistry {
+public:
+    static MetricsRegistry& instance();
+
+    ~MetricsRegistry();
+
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+    void add(const RecorderCounters* counters);
+    // Keeps the counters in the totals
+    void remove(const RecorderCounters* counters);
+    // Zero counters for a new recording, keeping their values in the totals
+    void reset(RecorderCounters& counters);
+
+    MetricsSnapshot snapshot();
+
+    // Export a snapshot every interval_ms on a background thread; replaces a running exporter
+    bool startExporter(const MetricsExporterConfig& config);
+    // Exports one last snapshot and joins the thread
+    void stopExporter();
+
+    // Prometheus text exposition format, metric names prefixed with mcsr_
+    static void writePrometheus(std::ostream& out, const MetricsSnapshot& snapshot);
+    // Write to a temporary file next to path, then rename over path
+    static bool writePrometheusFile(const std::string& path, const MetricsSnapshot& snapshot);
+
+private:
+    MetricsRegistry() = default;
+
+    void exportLoop();
+    void exportSnapshot();
+
+    std::mutex mutex_;
+    std::vector<const RecorderCounters*> recorders_;
+    RecorderStats retired_;  // Totals of recordings no longer in recorders_
+
+    std::mutex exporter_mutex_;
+    std::condition_variable exporter_wake_;
+    bool exporter_stop_ = false;
+    MetricsExporterConfig exporter_config_;
+    std::thread exporter_thread_;
+};
+
+} // namespace mp4_recorder
+
+#endif // METRICS_REGISTRY_H
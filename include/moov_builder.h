@@ -12,14 +12,72 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include "codec_traits.h"
 #include "common.h"
 #include "file_ops.h"
+#include "sample_table.h"
 
 namespace mp4_recorder {
 
 // Forward declaration
 struct FrameInfo;
 
+// Track and codec parameters used to build the moov box
+struct MoovConfig {
+    VideoCodec video_codec = VideoCodec::H264;
+    AudioCodec audio_codec = AudioCodec::AAC;
+    uint32_t video_timescale = 30000;
+    uint32_t audio_timescale = 48000;
+    uint32_t audio_sample_rate = 48000;
+    uint16_t audio_channels = 2;
+    uint32_t video_width = 0;
+    uint32_t video_height = 0;
+    // Video parameter sets (NAL start codes are stripped). VPS is only used by H.265.
+    const uint8_t* vps = nullptr;
+    uint32_t vps_size = 0;
+    const uint8_t* sps = nullptr;
+    uint32_t sps_size = 0;
+    const uint8_t* pps = nullptr;
+    uint32_t pps_size = 0;
+    uint64_t mdat_start = 0;
+    // Samples of a track that follow each other in mdat share a chunk up to this size
+    uint64_t max_chunk_bytes = 1024 * 1024;
+};
+
+// Destination for serialized boxes: either an in-memory vector or a file written
+// through a bounded buffer, so large sample tables never need a full copy in memory
+class BoxSink {
+public:
+    explicit BoxSink(std::vector<uint8_t>& out);
+    explicit BoxSink(IFile& file, size_t buffer_size = 64 * 1024);
+    ~BoxSink();
+
+    BoxSink(const BoxSink&) = delete;
+    BoxSink& operator=(const BoxSink&) = delete;
+
+    void write(const uint8_t* data, size_t size);
+    void writeUint32BE(uint32_t value);
+    void writeUint16BE(uint16_t value);
+    void writeUint8(uint8_t value);
+    void writeAtomHeader(const char* type, uint32_t size);
+
+    // Drain buffered bytes to the file; returns false if any write failed
+    bool finish();
+
+    bool ok() const { return ok_; }
+    uint64_t bytesWritten() const { return bytes_written_; }
+
+private:
+    void drain();
+
+    std::vector<uint8_t>* out_ = nullptr;
+    IFile* file_ = nullptr;
+    std::vector<uint8_t> buffer_;
+    size_t buffer_size_ = 0;
+    uint64_t bytes_written_ = 0;
+    bool ok_ = true;
+};
+
 // Moov box builder
 class MoovBuilder {
 public:
@@ -44,41 +102,96 @@ public:
         std::vector<uint8_t>& moov_data
     );
 
+    // Build moov box for the codecs selected in config
+    bool buildMoov(
+        const std::vector<FrameInfo>& video_frames,
+        const std::vector<FrameInfo>& audio_frames,
+        const MoovConfig& config,
+        std::vector<uint8_t>& moov_data
+    );
+
+    // Build moov box from sample tables maintained during recording
+    bool buildMoov(
+        const SampleTable& video_table,
+        const SampleTable& audio_table,
+        const MoovConfig& config,
+        std::vector<uint8_t>& moov_data
+    );
+
+    // Serialize moov box at the current position of an open file.
+    // Sample tables are streamed in buffer_size pieces instead of being copied into a moov vector.
+    bool writeMoov(
+        const SampleTable& video_table,
+        const SampleTable& audio_table,
+        const MoovConfig& config,
+        IFile& file,
+        size_t buffer_size = 64 * 1024
+    );
+
+    // Serialize moov box into an arbitrary sink
+    bool writeMoov(
+        const SampleTable& video_table,
+        const SampleTable& audio_table,
+        const MoovConfig& config,
+        BoxSink& sink
+    );
+
     // Write moov box to file
     bool writeMoovToFile(const std::string& filename, const std::vector<uint8_t>& moov_data,
                          IFileOps* file_ops = nullptr);
 
 private:
+    // Small per-track boxes built up front, plus the sizes of the streamed sample table boxes
+    struct TrakLayout {
+        std::vector<uint8_t> tkhd;
+        std::vector<uint8_t> mdhd;
+        std::vector<uint8_t> hdlr;
+        std::vector<uint8_t> media_header;
+        std::vector<uint8_t> dinf;
+        std::vector<uint8_t> stsd;
+        uint32_t stts_default_duration = 0;
+        uint32_t stts_size = 0;
+        uint32_t ctts_size = 0;  // 0 when ctts is omitted
+        uint32_t stss_size = 0;  // 0 when stss is omitted
+        uint32_t stsz_size = 0;
+        std::vector<uint64_t> chunk_offsets;
+        std::vector<SampleToChunkEntry> sample_to_chunk;
+        uint32_t stco_size = 0;  // stco, or co64 when chunk offsets pass 4GB
+        bool co64 = false;
+        uint32_t stsc_size = 0;
+        uint32_t stbl_size = 0;
+        uint32_t minf_size = 0;
+        uint32_t mdia_size = 0;
+        uint32_t trak_size = 0;
+    };
+
     // Helper methods for building atoms
     bool buildFtyp(std::vector<uint8_t>& data);
     bool buildMvhd(uint32_t duration, std::vector<uint8_t>& data);
-    bool buildTrak(
-        const std::vector<FrameInfo>& frames,
-        uint32_t track_id,
-        uint32_t timescale,
-        const std::string& codec,
-        uint32_t video_width,
-        uint32_t video_height,
-        uint32_t audio_sample_rate,
-        uint16_t audio_channels,
-        const uint8_t* h264_sps,
-        uint32_t h264_sps_size,
-        const uint8_t* h264_pps,
-        uint32_t h264_pps_size,
-        uint64_t mdat_start,
-        std::vector<uint8_t>& data
-    );
-    bool buildStts(const std::vector<FrameInfo>& frames, std::vector<uint8_t>& data,
-                   uint32_t default_duration);
-    bool buildStss(const std::vector<FrameInfo>& frames, std::vector<uint8_t>& data);
-    bool buildStsz(const std::vector<FrameInfo>& frames, std::vector<uint8_t>& data);
-    bool buildStco(const std::vector<FrameInfo>& frames, uint64_t mdat_start, std::vector<uint8_t>& data);
-    bool buildStsc(const std::vector<FrameInfo>& frames, std::vector<uint8_t>& data);
-    bool buildStsd(const std::string& codec, uint32_t width, uint32_t height,
-                   uint32_t audio_sample_rate, uint16_t audio_channels,
-                   const uint8_t* h264_sps, uint32_t h264_sps_size,
-                   const uint8_t* h264_pps, uint32_t h264_pps_size,
-                   std::vector<uint8_t>& data);
+    template <typename Codec>
+    bool prepareTrak(const SampleTable& table, uint32_t track_id,
+                     const MoovConfig& config, TrakLayout& layout);
+    void writeTrak(const SampleTable& table, const TrakLayout& layout,
+                   uint64_t mdat_start, BoxSink& sink);
+    uint32_t sttsSize(const SampleTable& table) const;
+    void writeStts(const SampleTable& table, uint32_t default_duration, BoxSink& sink);
+    void writeCtts(const SampleTable& table, BoxSink& sink);
+    void writeStss(const SampleTable& table, BoxSink& sink);
+    void writeStsz(const SampleTable& table, BoxSink& sink);
+    void writeStco(const TrakLayout& layout, uint64_t mdat_start, BoxSink& sink);
+    void writeStsc(const TrakLayout& layout, BoxSink& sink);
+    template <typename Codec>
+    bool buildStsd(const MoovConfig& config, std::vector<uint8_t>& data);
+
+    // Sample entries, selected by codec tag
+    bool buildSampleEntry(AvcCodec, const MoovConfig& config, std::vector<uint8_t>& data);
+    bool buildSampleEntry(HevcCodec, const MoovConfig& config, std::vector<uint8_t>& data);
+    bool buildSampleEntry(AacCodec, const MoovConfig& config, std::vector<uint8_t>& data);
+    bool buildSampleEntry(OpusCodec, const MoovConfig& config, std::vector<uint8_t>& data);
+    void writeVisualSampleEntry(const char* type, uint32_t width, uint32_t height,
+                                const std::vector<uint8_t>& config_box, std::vector<uint8_t>& data);
+    void writeAudioSampleEntry(const char* type, uint16_t channels, uint32_t sample_rate,
+                               const std::vector<uint8_t>& config_box, std::vector<uint8_t>& data);
 
     // Utility methods
     void writeAtomHeader(std::vector<uint8_t>& data, const char* type, uint32_t size);
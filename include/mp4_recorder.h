@@ -9,16 +9,29 @@
 #ifndef MP4_RECORDER_H
 #define MP4_RECORDER_H
 
+#include <atomic>
 #include <string>
 #include <cstdint>
 #include <vector>
 #include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <thread>
 
+#include "codec_traits.h"
 #include "file_ops.h"
+#include "frame_queue.h"
+#include "interleaver.h"
+#include "recorder_stats.h"
+#include "sample_table.h"
+#include "shm_journal.h"
 
 namespace mp4_recorder {
 
+class SyncCoordinator;
+class SyncParticipant;
+
 // Frame information structure
 struct FrameInfo {
     uint64_t offset;        // Offset in mdat
@@ -29,6 +42,15 @@ struct FrameInfo {
     uint8_t  track_id;      // 0 for video, 1 for audio
 };
 
+// What a frame write does when the recorder holds memory_budget_bytes of unwritten frames, a
+// concurrent_writes queue is full or the storage is congested (IFileOps::congested())
+enum class OverflowPolicy {
+    Block,              // Wait until the frame fits; without a queue, cut interleaving runs short
+    DropNonReference,   // Drop H.264/H.265 frames no other frame refers to; wait for the rest
+    DropUntilKeyframe,  // Drop the frame; video stays dropped until a keyframe fits again
+    DropAudioLast       // As DropUntilKeyframe, but video may only use 3/4 of the budget
+};
+
 // Recording configuration
 struct RecorderConfig {
     uint32_t video_timescale = 30000;
@@ -39,6 +61,30 @@ struct RecorderConfig {
     uint32_t flush_frame_count = 1000; // Or every 1000 frames
     uint32_t video_width = 640;        // Video width
     uint32_t video_height = 480;       // Video height
+    VideoCodec video_codec = VideoCodec::H264;
+    AudioCodec audio_codec = AudioCodec::AAC;
+    uint32_t snapshot_interval_ms = 60000;  // Persist sample tables to idx every minute (0 = off)
+    bool shm_journal = false;          // Mirror the idx into shared memory (survives process crashes)
+    uint32_t sync_interval_ms = 10000; // fsync cadence with shm_journal; flushes stay at flush_interval_ms
+    bool concurrent_writes = false;    // Video and audio may be written from one thread each (see API.md)
+    uint32_t track_queue_frames = 256; // Per-track queue with concurrent_writes; a full queue applies overflow_policy
+    uint32_t interleave_window_ms = 100; // How long a queued frame waits for the other track
+    uint32_t interleave_chunk_ms = 0;  // Reorder frames into per-track runs of this duration (0 = off)
+    std::shared_ptr<SyncCoordinator> sync_coordinator;  // Batch fsyncs with other recorders (null = sync inline)
+    size_t memory_budget_bytes = 0;    // Queued frame bytes before overflow_policy applies (0 = no limit)
+    OverflowPolicy overflow_policy = OverflowPolicy::Block;
+};
+
+// Where the last recover() call spent its time (microseconds) and what it recovered
+struct RecoveryStats {
+    uint64_t index_read_us = 0;     // Index config, snapshot and replay
+    uint64_t mdat_scan_us = 0;      // Layout check and tail salvage
+    uint64_t codec_config_us = 0;   // SPS/PPS extraction from mdat when the index has none
+    uint64_t moov_write_us = 0;     // Truncation, mdat size update, moov write and cleanup
+    uint64_t total_us = 0;
+    uint64_t video_frames = 0;
+    uint64_t audio_frames = 0;
+    uint64_t salvaged_frames = 0;   // Found by the mdat scan past the index
 };
 
 // Main recorder class
@@ -51,12 +97,21 @@ public:
     // Start recording
     bool start(const std::string& filename, const RecorderConfig& config = RecorderConfig());
 
-    // Write video frame
+    // Write video frame (decode order equals presentation order, dts = pts)
     bool writeVideoFrame(const uint8_t* data, uint32_t size, int64_t pts, bool is_keyframe);
 
+    // Write video frame with an explicit decode timestamp (B-frame encoders).
+    // Frames must be passed in decode order; pts - dts is stored in the ctts box.
+    bool writeVideoFrame(const uint8_t* data, uint32_t size, int64_t pts, int64_t dts,
+                         bool is_keyframe);
+
     // Set H.264 SPS/PPS (for proper avcC box construction)
     bool setH264Config(const uint8_t* sps, uint32_t sps_size, const uint8_t* pps, uint32_t pps_size);
 
+    // Set H.265 VPS/SPS/PPS (for proper hvcC box construction)
+    bool setH265Config(const uint8_t* vps, uint32_t vps_size, const uint8_t* sps, uint32_t sps_size,
+                       const uint8_t* pps, uint32_t pps_size);
+
     // Write audio frame
     bool writeAudioFrame(const uint8_t* data, uint32_t size, int64_t pts);
 
@@ -69,18 +124,49 @@ public:
     // Recover from incomplete recording
     bool recover(const std::string& filename);
 
+    // Recover using fallback_config when the index is missing or its header is unreadable.
+    // Frame boundaries are then re-derived by scanning mdat.
+    bool recover(const std::string& filename, const RecorderConfig& fallback_config);
+
     // Get current recording status
-    bool isRecording() const { return recording_; }
+    bool isRecording() const { return recording_.load(std::memory_order_acquire); }
 
     // Get number of frames recorded
     uint64_t getFrameCount() const { return frame_count_; }
 
+    // Latency histograms and counters of the current or last recording. Safe to call from
+    // any thread while recording; the recording thread is never blocked by it.
+    RecorderStats getStats() const { return stats_.snapshot(); }
+
+    // Phase timings of the last recover() call
+    const RecoveryStats& getRecoveryStats() const { return recovery_stats_; }
+
 private:
     // Internal methods
     bool createFiles(const std::string& filename);
+    bool writeVideoSample(const uint8_t* data, uint32_t size, int64_t pts, int64_t dts, bool is_keyframe);
+    bool writeAudioSample(const uint8_t* data, uint32_t size, int64_t pts);
+    // concurrent_writes: producers queue frames, one consumer thread writes them by timestamp
+    bool queueFrame(FrameQueue& queue, const uint8_t* data, uint32_t size, int64_t pts, int64_t dts,
+                    bool is_keyframe);
+    bool startConsumer();
+    void stopConsumer();
+    void consumeFrames();
+    void waitForFrames(std::chrono::steady_clock::time_point deadline);
+    // interleave_chunk_ms: write the frames the interleaver releases
+    bool writeInterleaved();
+    // overflow_policy: false if the frame is dropped (and counted); may wait for room
+    bool admitFrame(uint8_t track_id, const uint8_t* data, uint32_t size, bool is_keyframe);
+    bool overBudget(const FrameQueue* queue, uint32_t size, uint64_t budget) const;
+    void waitForRoom(const FrameQueue& queue, uint32_t size);
+    void notifyRoom();
     bool writeFrameToMdat(const uint8_t* data, uint32_t size);
     bool logFrameToIndex(const FrameInfo& frame);
-    bool flushIfNeeded();
+    // now: start of the current write call, which is recent enough for the interval checks
+    bool flushIfNeeded(std::chrono::steady_clock::time_point now);
+    bool writeTableSnapshot();
+    bool hasVideoConfig() const;
+    bool writeCodecConfig();
     bool buildAndWriteMoov();
     bool cleanupFiles();
 
@@ -93,21 +179,58 @@ private:
     std::unique_ptr<IFile> mp4_file_;
     std::unique_ptr<IFile> idx_file_;
     std::unique_ptr<IFile> lock_file_;
+    ShmJournal journal_;
 
     RecorderConfig config_;
-    bool recording_ = false;
-    uint64_t frame_count_ = 0;
+    std::atomic<bool> recording_{false};
+    std::atomic<uint64_t> frame_count_{0};
+    uint64_t mdat_header_offset_ = 0;
     uint64_t mdat_start_ = 0;
     uint64_t mdat_size_ = 0;
+    bool has_video_dts_ = false;
+    int64_t last_video_dts_ = 0;
 
-    std::vector<FrameInfo> video_frames_;
-    std::vector<FrameInfo> audio_frames_;
+    SampleTable video_table_;
+    SampleTable audio_table_;
 
-    std::vector<uint8_t> h264_sps_;
-    std::vector<uint8_t> h264_pps_;
+    std::vector<uint8_t> video_vps_;
+    std::vector<uint8_t> video_sps_;
+    std::vector<uint8_t> video_pps_;
 
     std::chrono::steady_clock::time_point last_flush_time_;
+    std::chrono::steady_clock::time_point last_sync_time_;
+    RecoveryStats recovery_stats_;
+    RecorderCounters stats_;
     uint32_t frames_since_flush_ = 0;
+    std::chrono::steady_clock::time_point last_snapshot_time_;
+
+    // Held while writing a sample or changing the codec config
+    std::mutex writer_mutex_;
+
+    // concurrent_writes state
+    std::unique_ptr<FrameQueue> video_queue_;
+    std::unique_ptr<FrameQueue> audio_queue_;
+    bool has_queued_video_dts_ = false;    // Video producer only; set whenever frames are validated up front
+    int64_t last_queued_video_dts_ = 0;
+    std::thread consumer_;
+    std::mutex consumer_mutex_;
+    std::condition_variable consumer_wake_;
+    std::atomic<bool> consumer_waiting_{false};
+    std::atomic<bool> consumer_stop_{false};
+    std::atomic<bool> consumer_failed_{false};
+
+    // Back-pressure state
+    std::atomic<uint64_t> queued_bytes_{0};    // In video_queue_ and audio_queue_
+    uint64_t interleaved_bytes_ = 0;           // Held by interleaver_; used by whoever writes it
+    std::atomic<int> producers_waiting_{0};
+    std::condition_variable room_available_;   // Waits on consumer_mutex_
+    bool dropping_video_ = false;              // Video producer only
+
+    // interleave_chunk_ms state; used by the consumer thread with concurrent_writes
+    std::unique_ptr<Interleaver> interleaver_;
+
+    // Set while recording with a sync_coordinator
+    std::unique_ptr<SyncParticipant> sync_participant_;
 };
 
 } // namespace mp4_recorder
@@ -0,0 +1,42 @@
+/*
+ * MP4 Crash-Safe Recorder - MP4 Verifier
+ *
+ * Structural check of finished MP4 files without external tools
+ *
+ * License: GPL v2+
+ */
+
+#ifndef MP4_VERIFIER_H
+#define MP4_VERIFIER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace mp4_recorder {
+
+struct Mp4VerifyResult {
+    bool valid = false;
+    std::string error;              // First problem found, empty when valid
+    uint32_t track_count = 0;
+    uint64_t sample_count = 0;      // Over all tracks
+    uint64_t mdat_size = 0;         // Payload bytes over all mdat boxes
+};
+
+// Checks that
+// - boxes nest properly: every box fits its parent and children fill containers exactly
+// - ftyp comes first and there is exactly one moov and at least one mdat
+// - each track has the mandatory boxes, and stts/ctts/stss/stsc/stsz/stz2/stco/co64 agree
+//   on sample and chunk counts
+// - every sample lies inside the payload of an mdat box
+// Files are memory mapped (read into memory where mapping is unavailable), and the tables are
+// walked in place without allocating per sample.
+class Mp4Verifier {
+public:
+    static Mp4VerifyResult verifyFile(const std::string& path);
+    static Mp4VerifyResult verify(const uint8_t* data, size_t size);
+};
+
+} // namespace mp4_recorder
+
+#endif // MP4_VERIFIER_H
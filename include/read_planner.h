@@ -0,0 +1,73 @@
+/*
+ * MP4 Crash-Safe Recorder - Read Planner
+ *
+ * Turns many small reads of one file into a few large sequential ones
+ *
+ * License: GPL v2+
+ */
+
+#ifndef READ_PLANNER_H
+#define READ_PLANNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "file_ops.h"
+
+namespace mp4_recorder {
+
+// Collects byte ranges, then reads them in file order. Ranges closer than max_gap are
+// coalesced into one request of up to max_request_size bytes (a larger range gets a request
+// of its own), and the next requests are announced to the OS with IFile::prefetch() while
+// the current one is processed.
+class ReadPlanner {
+public:
+    // Called once per range with its id (position in add() order) and contents.
+    // Returning true stops the run.
+    using Visitor = std::function<bool(size_t id, const uint8_t* data, size_t size)>;
+
+    explicit ReadPlanner(size_t max_request_size = 1024 * 1024, size_t max_gap = 64 * 1024,
+                         size_t prefetch_depth = 4);
+
+    void add(uint64_t offset, uint32_t size);
+    size_t rangeCount() const { return ranges_.size(); }
+    void clear();
+
+    // Read all ranges. Ranges that cannot be read (e.g. past the end of the file) are skipped.
+    // Returns true if the visitor stopped the run.
+    bool run(IFile& file, const Visitor& visitor);
+
+    // Statistics of the last run
+    size_t requestCount() const { return request_count_; }
+    size_t skippedRanges() const { return skipped_ranges_; }
+
+private:
+    struct Range {
+        uint64_t offset;
+        uint32_t size;
+        size_t id;
+    };
+
+    struct Request {
+        uint64_t offset;
+        uint64_t size;
+        size_t first_range;
+        size_t range_count;
+    };
+
+    void buildRequests();
+
+    size_t max_request_size_;
+    size_t max_gap_;
+    size_t prefetch_depth_;
+    std::vector<Range> ranges_;
+    std::vector<Request> requests_;
+    size_t request_count_ = 0;
+    size_t skipped_ranges_ = 0;
+};
+
+} // namespace mp4_recorder
+
+#endif // READ_PLANNER_H
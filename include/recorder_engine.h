@@ -0,0 +1,97 @@
+/*
+ * MP4 Crash-Safe Recorder - Recording Engine
+ *
+ * Hosts many recording sessions on a fixed pool of I/O threads
+ *
+ * License: GPL v2+
+ */
+
+#ifndef RECORDER_ENGINE_H
+#define RECORDER_ENGINE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "file_ops.h"
+#include "mp4_recorder.h"
+
+namespace mp4_recorder {
+
+struct EngineConfig {
+    size_t io_threads_per_disk = 2;
+    size_t chunk_size = 256 * 1024;            // Bytes a file buffers before they are queued
+    size_t max_queued_bytes = 8 * 1024 * 1024; // Per session; writers wait beyond this
+    size_t max_total_queued_bytes = 0;         // All sessions; writers wait beyond this (0 = no limit)
+    std::shared_ptr<IFileOps> file_ops;        // Files written by the I/O threads (default: stdio)
+};
+
+struct EngineStats {
+    size_t io_threads = 0;
+    size_t sessions = 0;
+    uint64_t queued_bytes = 0;        // Written by recorders, not yet by the I/O threads
+    uint64_t write_ops = 0;
+    uint64_t sync_ops = 0;
+    uint64_t backpressure_waits = 0;  // Writes that waited for a full session queue
+};
+
+// Every recorder created by the engine is a session. Its files buffer writes in memory and
+// hand full chunks, flushes and syncs to a queue that one I/O thread executes in order, so
+// the order in which mp4 data and index records reach the disk is the same as with direct
+// I/O. Sessions are assigned to the least busy I/O thread of the disk (device) holding
+// their output, and an I/O thread serves its sessions round-robin, one operation each.
+//
+// flush() waits until the session's queue has been written to the kernel, as the recorder
+// expects before it publishes index entries. sync() only queues the fsync, so recording
+// threads never block on the disk unless their session exceeds max_queued_bytes, or all
+// sessions together exceed max_total_queued_bytes. A session with nothing queued never waits,
+// so every session keeps making progress. Recorders with a drop policy check
+// IFileOps::congested() and shed frames rather than wait. A failed queued operation makes the
+// session's following file calls fail.
+//
+// Files opened for reading or updating (recovery) bypass the queue. Destroy all recorders
+// and sessions before the engine.
+class RecorderEngine {
+public:
+    explicit RecorderEngine(const EngineConfig& config = EngineConfig());
+    ~RecorderEngine();
+
+    RecorderEngine(const RecorderEngine&) = delete;
+    RecorderEngine& operator=(const RecorderEngine&) = delete;
+
+    std::unique_ptr<Mp4Recorder> createRecorder();
+
+    // File operations of a new session, for recorders constructed elsewhere
+    std::shared_ptr<IFileOps> createSession();
+
+    EngineStats getStats() const;
+
+private:
+    class Session;
+    class SessionFile;
+    class SessionFileOps;
+    class Worker;
+
+    Worker* assignWorker(const std::string& path);
+    void releaseWorker(Worker* worker);
+
+    EngineConfig config_;
+
+    mutable std::mutex workers_mutex_;
+    std::map<uint64_t, std::vector<std::unique_ptr<Worker>>> workers_;  // Per device
+
+    std::atomic<size_t> sessions_{0};
+    std::atomic<uint64_t> queued_bytes_{0};
+    std::atomic<uint64_t> write_ops_{0};
+    std::atomic<uint64_t> sync_ops_{0};
+    std::atomic<uint64_t> backpressure_waits_{0};
+};
+
+} // namespace mp4_recorder
+
+#endif // RECORDER_ENGINE_H
@@ -0,0 +1,146 @@
+/*
+ * MP4 Crash-Safe Recorder - Recorder Statistics
+ *
+ * Latency histograms and counters of a recording, readable from any thread
+ *
+ * License: GPL v2+
+ */
+
+#ifndef RECORDER_STATS_H
+#define RECORDER_STATS_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "file_ops.h"
+
+namespace mp4_recorder {
+
+// Bucket counts copied out of a LatencyHistogram
+struct LatencyHistogramSnapshot {
+    std::vector<uint64_t> counts;  // Per bucket, see LatencyHistogram::bucketUpperBound()
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;           // Exact, not bucketed
+
+    // Upper bound of the bucket holding the given quantile (0..1), capped at max_ns
+    uint64_t percentile(double quantile) const;
+    uint64_t mean() const { return count ? sum_ns / count : 0; }
+};
+
+// Log-linear histogram of nanosecond latencies, in the style of HdrHistogram: values below 8
+// have a bucket each, above that every power of two is split into 8 buckets (at most 12.5%
+// error). Values beyond 2^41 ns (~37 minutes) land in the last bucket.
+// record() only does relaxed atomic increments, so snapshots taken on another thread never
+// block the recording thread; a snapshot may be a few samples out of step with count/sum.
+class LatencyHistogram {
+public:
+    static constexpr uint32_t kSubBucketBits = 3;
+    static constexpr uint32_t kSubBuckets = 1u << kSubBucketBits;
+    static constexpr uint32_t kMaxExponent = 40;
+    static constexpr size_t kBucketCount = (kMaxExponent - kSubBucketBits + 2) * kSubBuckets;
+
+    LatencyHistogram() { reset(); }
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(uint64_t value_ns);
+    void reset();
+    LatencyHistogramSnapshot snapshot() const;
+    // Add the buckets to total (counts sized on first use), e.g. to merge recorders
+    void addTo(LatencyHistogramSnapshot& total) const;
+
+    static size_t bucketIndex(uint64_t value_ns);
+    // Largest value counted in the bucket
+    static uint64_t bucketUpperBound(size_t index);
+
+private:
+    std::array<std::atomic<uint64_t>, kBucketCount> counts_;
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+// Statistics of the current (or last) recording, see Mp4Recorder::getStats()
+struct RecorderStats {
+    LatencyHistogramSnapshot write_latency;  // writeVideoFrame/writeAudioFrame calls; max is the longest stall
+    LatencyHistogramSnapshot flush_latency;  // Flushing mp4 and idx to the kernel
+    LatencyHistogramSnapshot fsync_latency;  // Syncing mp4 and idx to disk
+    uint64_t mp4_bytes_written = 0;
+    uint64_t idx_bytes_written = 0;
+    uint64_t video_frames = 0;
+    uint64_t audio_frames = 0;
+    uint64_t index_records = 0;              // Non-frame index records (snapshots, codec config, ...)
+    uint64_t unflushed_frames = 0;           // Frames written since the last flush
+    uint64_t durable_frames = 0;             // Frames known to be synced to disk
+    uint64_t dropped_video_frames = 0;       // Shed by RecorderConfig::overflow_policy
+    uint64_t dropped_audio_frames = 0;
+    uint64_t overflow_waits = 0;             // Frame writes that waited for buffer room
+    uint64_t flush_count = 0;
+    uint64_t fsync_count = 0;
+    uint64_t moov_build_us = 0;              // Building and writing moov in stop()
+    uint64_t finalize_us = 0;                // All of stop()
+};
+
+// Live counters behind RecorderStats. Written by the recording thread with relaxed atomics;
+// the drop and wait counters may be written by both producers and use fetch_add.
+class RecorderCounters {
+public:
+    LatencyHistogram write_latency;
+    LatencyHistogram flush_latency;
+    LatencyHistogram fsync_latency;
+    std::atomic<uint64_t> mp4_bytes_written{0};
+    std::atomic<uint64_t> idx_bytes_written{0};
+    std::atomic<uint64_t> video_frames{0};
+    std::atomic<uint64_t> audio_frames{0};
+    std::atomic<uint64_t> index_records{0};
+    std::atomic<uint64_t> unflushed_frames{0};
+    std::atomic<uint64_t> durable_frames{0};
+    std::atomic<uint64_t> dropped_video_frames{0};
+    std::atomic<uint64_t> dropped_audio_frames{0};
+    std::atomic<uint64_t> overflow_waits{0};
+    std::atomic<uint64_t> flush_count{0};
+    std::atomic<uint64_t> fsync_count{0};
+    std::atomic<uint64_t> moov_build_us{0};
+    std::atomic<uint64_t> finalize_us{0};
+    std::atomic<bool> recording{false};
+
+    void reset();
+    RecorderStats snapshot() const;
+    // Add every field to total
+    void addTo(RecorderStats& total) const;
+};
+
+// Single-writer increment: a relaxed load and store, no locked instruction
+inline void addRelaxed(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Counts the bytes written through a file
+class CountingFile : public IFile {
+public:
+    CountingFile(std::unique_ptr<IFile> file, std::atomic<uint64_t>& bytes_written);
+
+    size_t read(void* data, size_t size) override;
+    size_t write(const void* data, size_t size) override;
+    bool seek(int64_t offset, int origin) override;
+    int64_t tell() override;
+    bool flush() override;
+    bool sync() override;
+    void close() override;
+    bool isOpen() const override;
+    bool prefetch(uint64_t offset, uint64_t size) override;
+
+private:
+    std::unique_ptr<IFile> file_;
+    std::atomic<uint64_t>& bytes_written_;
+};
+
+} // namespace mp4_recorder
+
+#endif // RECORDER_STATS_H
@@ -0,0 +1,76 @@
+/*
+ * MP4 Crash-Safe Recorder - Recovery Manager
+ *
+ * Finds incomplete recordings in a directory tree and recovers them in parallel
+ *
+ * License: GPL v2+
+ */
+
+#ifndef RECOVERY_MANAGER_H
+#define RECOVERY_MANAGER_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_ops.h"
+
+namespace mp4_recorder {
+
+// Order in which queued recordings are handed to workers
+enum class RecoveryOrder {
+    SmallestFirst,   // Most recordings usable as early as possible
+    LargestFirst,    // Longest jobs start first, shortest total wall time
+    OldestFirst,     // By lock file modification time
+    NewestFirst
+};
+
+struct RecoveryOptions {
+    uint32_t max_workers = 4;        // 0 = one worker per hardware thread
+    bool recursive = true;           // Descend into subdirectories
+    RecoveryOrder order = RecoveryOrder::SmallestFirst;
+    bool verify = false;             // Check each recovered file with Mp4Verifier
+};
+
+// Outcome of recovering a single recording
+struct RecoveryResult {
+    std::string filename;            // MP4 path
+    bool success = false;
+    uint64_t file_size = 0;          // MP4 size before recovery
+    uint64_t duration_us = 0;        // Time spent in recover()
+    std::string verify_error;        // Mp4Verifier finding (with RecoveryOptions::verify)
+};
+
+// Called from worker threads (serialized) after each recording finishes
+using RecoveryProgressCallback =
+    std::function<void(const RecoveryResult& result, size_t completed, size_t total)>;
+
+class RecoveryManager {
+public:
+    RecoveryManager();
+    explicit RecoveryManager(std::shared_ptr<IFileOps> file_ops);
+
+    // List MP4 files that have both a .lock and an .idx file
+    std::vector<std::string> findIncompleteRecordings(const std::string& directory,
+                                                      bool recursive = true) const;
+
+    // Find and recover all incomplete recordings below directory
+    std::vector<RecoveryResult> recoverDirectory(const std::string& directory,
+                                                 const RecoveryOptions& options = RecoveryOptions(),
+                                                 RecoveryProgressCallback progress = nullptr);
+
+    // Recover the given recordings on a bounded worker pool.
+    // Results are returned in the order the recordings were scheduled.
+    std::vector<RecoveryResult> recoverFiles(const std::vector<std::string>& filenames,
+                                             const RecoveryOptions& options = RecoveryOptions(),
+                                             RecoveryProgressCallback progress = nullptr);
+
+private:
+    std::shared_ptr<IFileOps> file_ops_;
+};
+
+} // namespace mp4_recorder
+
+#endif // RECOVERY_MANAGER_H
@@ -0,0 +1,148 @@
+/*
+ * MP4 Crash-Safe Recorder - Sample Tables
+ *
+ * Per-track sample tables maintained incrementally while recording
+ *
+ * License: GPL v2+
+ */
+
+#ifndef SAMPLE_TABLE_H
+#define SAMPLE_TABLE_H
+
+#include <cstdint>
+#include <vector>
+
+namespace mp4_recorder {
+
+struct FrameInfo;
+
+// Sample sizes, stored in the narrowest encoding that fits every sample seen so far.
+// Constant-size tracks (e.g. CBR audio) keep no per-sample data at all.
+class SampleSizeTable {
+public:
+    void reset();
+
+    // Append the size of the next sample
+    void append(uint32_t size);
+
+    uint32_t sampleCount() const { return count_; }
+    bool isConstant() const { return constant_; }
+    uint32_t constantSize() const { return constant_ ? first_size_ : 0; }
+    uint32_t maxSize() const { return max_size_; }
+
+    // Bits per entry in the emitted table: 0 (stsz without table), 8/16 (stz2) or 32 (stsz)
+    uint8_t fieldSize() const { return constant_ ? 0 : static_cast<uint8_t>(field_bytes_ * 8); }
+
+    // Box type ("stsz" or "stz2") and full box size including header
+    const char* boxType() const;
+    uint32_t boxSize() const;
+
+    // Big-endian table entries, ready to be copied into the box payload
+    const std::vector<uint8_t>& packedEntries() const { return packed_; }
+
+    uint32_t sizeAt(uint32_t index) const;
+
+    // Compact encoding of the table state (see SampleTable::serialize)
+    void serialize(std::vector<uint8_t>& out) const;
+    bool deserialize(const uint8_t*& data, const uint8_t* end);
+
+private:
+    void pushEntry(uint32_t size);
+    void widen(uint8_t field_bytes);
+
+    uint32_t count_ = 0;
+    uint32_t first_size_ = 0;
+    uint32_t max_size_ = 0;
+    bool constant_ = true;
+    uint8_t field_bytes_ = 0;
+    std::vector<uint8_t> packed_;
+};
+
+// Run-length entry for stts
+struct TimeToSampleEntry {
+    uint32_t count;
+    uint32_t delta;
+};
+
+// Run-length entry for ctts (signed offsets need a version 1 box)
+struct CompositionOffsetEntry {
+    uint32_t count;
+    int32_t offset;
+};
+
+// Run-length entry for stsc
+struct SampleToChunkEntry {
+    uint32_t first_chunk;  // 1-based
+    uint32_t samples_per_chunk;
+};
+
+// All sample tables of a single track, updated one sample at a time in decode order
+class SampleTable {
+public:
+    void reset();
+
+    // Append the next sample of this track
+    void append(const FrameInfo& frame);
+
+    bool empty() const { return sample_count_ == 0; }
+    uint32_t sampleCount() const { return sample_count_; }
+    int64_t lastDts() const { return last_dts_; }
+    // Largest presentation timestamp, used as the track duration
+    int64_t maxPts() const { return max_pts_; }
+
+    // stts runs covering the DTS deltas between consecutive samples (the last sample is not included)
+    const std::vector<TimeToSampleEntry>& timeDeltas() const { return time_deltas_; }
+
+    // stts entries including the last sample; default_duration is used when it has no predecessor
+    std::vector<TimeToSampleEntry> timeToSample(uint32_t default_duration) const;
+
+    // ctts runs of (pts - dts); only needed when some sample has a non-zero offset
+    const std::vector<CompositionOffsetEntry>& compositionOffsets() const { return composition_offsets_; }
+    bool hasCompositionOffsets() const { return has_composition_offsets_; }
+    bool hasNegativeCompositionOffsets() const { return has_negative_offsets_; }
+
+    // 1-based indices of sync samples
+    const std::vector<uint32_t>& syncSamples() const { return sync_samples_; }
+
+    const SampleSizeTable& sizes() const { return sizes_; }
+
+    // Sample offsets relative to the start of mdat data
+    const std::vector<uint64_t>& sampleOffsets() const { return sample_offsets_; }
+
+    // Group samples that directly follow each other in mdat into chunks of at most
+    // max_chunk_bytes (a larger sample gets a chunk of its own). Only offsets and sizes
+    // are used, so recovered tables get the same chunks as the recording would have.
+    void buildChunks(uint64_t max_chunk_bytes, std::vector<uint64_t>& chunk_offsets,
+                     std::vector<SampleToChunkEntry>& sample_to_chunk) const;
+
+    // End of the last sample relative to the start of mdat data
+    uint64_t dataEnd() const;
+
+    // Compact encoding of the whole table state, used for idx snapshots.
+    // Integers are varints and sample offsets are stored as gaps after the previous sample.
+    void serialize(std::vector<uint8_t>& out) const;
+    // Restore a serialized state; appending continues where the snapshot left off
+    bool deserialize(const uint8_t* data, size_t size);
+
+private:
+    uint32_t sample_count_ = 0;
+    int64_t last_dts_ = 0;
+    int64_t max_pts_ = 0;
+    std::vector<TimeToSampleEntry> time_deltas_;
+    std::vector<CompositionOffsetEntry> composition_offsets_;
+    bool has_composition_offsets_ = false;
+    bool has_negative_offsets_ = false;
+    std::vector<uint32_t> sync_samples_;
+    SampleSizeTable sizes_;
+    std::vector<uint64_t> sample_offsets_;
+};
+
+// TableSnapshot index record payload: video table length (4 bytes), video table, audio table
+void encodeTableSnapshot(const SampleTable& video_table, const SampleTable& audio_table,
+                         std::vector<uint8_t>& payload);
+bool decodeTableSnapshot(const std::vector<uint8_t>& payload, SampleTable& video_table,
+                         SampleTable& audio_table);
+
+} // namespace mp4_recorder
+
+#endif // SAMPLE_TABLE_H
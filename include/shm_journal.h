@@ -0,0 +1,96 @@
+/*
+ * MP4 Crash-Safe Recorder - Shared Memory Journal
+ *
+ * Mirrors the index file into a POSIX shared memory segment, so recovery after a
+ * process crash does not depend on the index having been fsync'd
+ *
+ * License: GPL v2+
+ */
+
+#ifndef SHM_JOURNAL_H
+#define SHM_JOURNAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "file_ops.h"
+
+namespace mp4_recorder {
+
+struct ShmJournalHeader;
+
+// Append-mostly copy of the index bytes in shared memory. The segment outlives the
+// recording process (not the machine). Recovery only sees bytes covered by publish().
+class ShmJournal {
+public:
+    ShmJournal();
+    ~ShmJournal();
+
+    ShmJournal(const ShmJournal&) = delete;
+    ShmJournal& operator=(const ShmJournal&) = delete;
+
+    // Create (or reset) the segment belonging to mp4_filename
+    bool create(const std::string& mp4_filename, size_t initial_capacity = 4 * 1024 * 1024);
+
+    // Copy data to position, growing the segment as needed. After a failed write the
+    // journal has a hole and stops publishing.
+    bool write(uint64_t position, const void* data, size_t size);
+
+    // Make everything written so far visible to recovery
+    void publish();
+
+    // Mapped and consistent with the index file
+    bool ok() const { return header_ != nullptr && !failed_; }
+
+    // Unmap the segment; it stays available for recovery until remove()
+    void close();
+
+    // Overwrite idx_filename with the published journal of mp4_filename when the journal
+    // holds more than the file. Returns true if the index was restored.
+    static bool restore(const std::string& mp4_filename, IFileOps& file_ops,
+                        const std::string& idx_filename);
+
+    // Delete the segment belonging to mp4_filename
+    static void remove(const std::string& mp4_filename);
+
+    // Segment name derived from the absolute mp4 path
+    static std::string segmentName(const std::string& mp4_filename);
+
+private:
+    bool map(size_t capacity);
+
+    std::string name_;
+    int fd_ = -1;
+    ShmJournalHeader* header_ = nullptr;
+    uint8_t* data_ = nullptr;
+    size_t capacity_ = 0;
+    uint64_t written_end_ = 0;
+    bool failed_ = false;
+};
+
+// IFile decorator that mirrors every write into a ShmJournal
+class JournaledFile : public IFile {
+public:
+    JournaledFile(std::unique_ptr<IFile> file, ShmJournal& journal);
+
+    size_t read(void* data, size_t size) override;
+    size_t write(const void* data, size_t size) override;
+    bool seek(int64_t offset, int origin) override;
+    int64_t tell() override;
+    bool flush() override;
+    bool sync() override;
+    void close() override;
+    bool isOpen() const override;
+    bool prefetch(uint64_t offset, uint64_t size) override;
+
+private:
+    std::unique_ptr<IFile> file_;
+    ShmJournal& journal_;
+    uint64_t position_ = 0;
+};
+
+} // namespace mp4_recorder
+
+#endif // SHM_JOURNAL_H
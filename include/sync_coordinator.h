@@ -0,0 +1,112 @@
+/*
+ * MP4 Crash-Safe Recorder - Sync Coordinator
+ *
+ * Batches the disk syncs of many recorders into one sync per filesystem
+ *
+ * License: GPL v2+
+ */
+
+#ifndef SYNC_COORDINATOR_H
+#define SYNC_COORDINATOR_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "recorder_stats.h"
+
+namespace mp4_recorder {
+
+enum class SyncMethod {
+    SyncFs,    // One syncfs() per filesystem and batch (Linux; DataSync elsewhere)
+    DataSync   // fdatasync() of every file in the batch, parallel_syncs at a time
+};
+
+struct SyncCoordinatorConfig {
+    uint32_t window_ms = 20;        // Requests within this time of the first one share a batch
+    SyncMethod method = SyncMethod::SyncFs;
+    size_t parallel_syncs = 4;      // Concurrent fdatasync() calls per filesystem with DataSync
+};
+
+struct SyncCoordinatorStats {
+    size_t filesystems = 0;
+    size_t participants = 0;
+    uint64_t requests = 0;
+    uint64_t batches = 0;           // Summed over filesystems
+    uint64_t sync_calls = 0;        // syncfs() or fdatasync() calls issued
+    uint64_t failed_syncs = 0;
+};
+
+class SyncParticipant;
+
+// Recorders that share a coordinator (RecorderConfig::sync_coordinator) no longer fsync their
+// files themselves at every flush. They request a sync and carry on; one thread per
+// filesystem waits window_ms for further requests, syncs the whole batch and then advances
+// each participant's durable watermark (RecorderStats::durable_frames). With 100 recorders on
+// one disk that is one syncfs() per window instead of 200 fsync() calls, each of which can
+// force a journal commit.
+//
+// The files are synced through descriptors of their own, so data must reach the kernel
+// (IFile::flush()) before it is requested. syncfs() also writes back unrelated files of the
+// same filesystem.
+class SyncCoordinator {
+public:
+    explicit SyncCoordinator(const SyncCoordinatorConfig& config = SyncCoordinatorConfig());
+    ~SyncCoordinator();
+
+    SyncCoordinator(const SyncCoordinator&) = delete;
+    SyncCoordinator& operator=(const SyncCoordinator&) = delete;
+
+    // Register existing files that live on one filesystem. counters (optional) receive the
+    // durable watermark and the request-to-durable latency as fsync_latency/fsync_count.
+    // nullptr if the files cannot be opened or the platform has no support.
+    std::unique_ptr<SyncParticipant> join(const std::vector<std::string>& paths, RecorderCounters* counters);
+
+    SyncCoordinatorStats getStats() const;
+
+private:
+    friend class SyncParticipant;
+    class Filesystem;
+
+    SyncCoordinatorConfig config_;
+    mutable std::mutex mutex_;
+    std::map<uint64_t, std::unique_ptr<Filesystem>> filesystems_;  // By device
+};
+
+// Membership of one recorder's files in a SyncCoordinator
+class SyncParticipant {
+public:
+    // Leaves the coordinator; waits for a batch that is syncing these files
+    ~SyncParticipant();
+
+    SyncParticipant(const SyncParticipant&) = delete;
+    SyncParticipant& operator=(const SyncParticipant&) = delete;
+
+    // Make everything flushed so far durable; watermark is reported once it is
+    void requestSync(uint64_t watermark);
+
+    // A sync of these files failed; sticky
+    bool failed() const;
+
+private:
+    friend class SyncCoordinator;
+    SyncParticipant(SyncCoordinator::Filesystem& filesystem, std::vector<int> fds, RecorderCounters* counters);
+
+    SyncCoordinator::Filesystem& filesystem_;
+    std::vector<int> fds_;
+    RecorderCounters* counters_;
+    // Guarded by the filesystem's mutex
+    bool pending_ = false;
+    uint64_t pending_watermark_ = 0;
+    std::chrono::steady_clock::time_point request_time_;
+    bool failed_ = false;
+};
+
+} // namespace mp4_recorder
+
+#endif // SYNC_COORDINATOR_H
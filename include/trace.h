@@ -0,0 +1,115 @@
+/*
+ * MP4 Crash-Safe Recorder - Tracing
+ *
+ * Scoped trace events on the write, finalize and recovery paths, exported as
+ * Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+ *
+ * License: GPL v2+
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace mp4_recorder {
+
+// Collects complete ("X") events into one fixed-size buffer per thread. A thread appends
+// without locks and publishes each event with a release store, so events can be dumped while
+// recording goes on. A full buffer drops further events and counts them. While tracing is
+// off, a trace scope costs one relaxed load and a branch.
+class Tracer {
+public:
+    static Tracer& instance();
+
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    // Start collecting into fresh buffers of events_per_thread events each
+    void start(size_t events_per_thread = 64 * 1024);
+    // Stop collecting; collected events stay available for writeJson()
+    void stop();
+
+    // Name the calling thread in this and later traces
+    void setThreadName(const std::string& name);
+
+    // Append an event; name and category must be string literals (or outlive the tracer)
+    void record(const char* category, const char* name, std::chrono::steady_clock::time_point begin,
+                std::chrono::steady_clock::time_point end);
+
+    bool writeJson(std::ostream& out);
+    bool writeJson(const std::string& filename);
+
+    uint64_t eventCount();
+    uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct Event {
+        const char* category;
+        const char* name;
+        int64_t begin_ns;
+        int64_t duration_ns;
+    };
+
+    class Buffer;
+
+    Tracer() = default;
+
+    Buffer* threadBuffer();
+
+    static std::atomic<bool> enabled_;
+    // The calling thread's buffer; buffers_ keeps it alive after the thread exits
+    static thread_local std::shared_ptr<Buffer> t_buffer_;
+    static thread_local std::string t_thread_name_;
+
+    std::atomic<uint32_t> generation_{0};
+    std::atomic<uint64_t> dropped_{0};
+    size_t events_per_thread_ = 0;
+    std::atomic<int64_t> epoch_ns_{0};  // steady_clock time of start()
+
+    std::mutex buffers_mutex_;
+    std::vector<std::shared_ptr<Buffer>> buffers_;
+    uint32_t next_thread_id_ = 1;
+};
+
+// Records the enclosing scope as one event when tracing is enabled
+class TraceScope {
+public:
+    TraceScope(const char* category, const char* name)
+        : category_(category), name_(name), active_(Tracer::enabled()) {
+        if (active_) {
+            begin_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~TraceScope() {
+        if (active_) {
+            Tracer::instance().record(category_, name_, begin_, std::chrono::steady_clock::now());
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* category_;
+    const char* name_;
+    bool active_;
+    std::chrono::steady_clock::time_point begin_;
+};
+
+#define MCSR_TRACE_CONCAT_INNER(a, b) a##b
+#define MCSR_TRACE_CONCAT(a, b) MCSR_TRACE_CONCAT_INNER(a, b)
+#define MCSR_TRACE_SCOPE(category, name) \
+    ::mp4_recorder::TraceScope MCSR_TRACE_CONCAT(mcsr_trace_scope_, __LINE__)(category, name)
+
+} // namespace mp4_recorder
+
+#endif // TRACE_H
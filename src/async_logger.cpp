@@ -0,0 +1,223 @@
+/*
+ * MP4 Crash-Safe Recorder - Asynchronous Logger Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "async_logger.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mp4_recorder {
+
+namespace {
+
+// How long the drain thread sleeps when no producer wakes it
+const auto kDrainInterval = std::chrono::milliseconds(20);
+
+size_t roundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+} // namespace
+
+// Single-producer single-consumer ring. head is only written by the owning thread,
+// tail only by the drain thread.
+class AsyncLogger::Ring {
+public:
+    Ring(size_t capacity, uint32_t generation)
+        : records_(capacity), mask_(capacity - 1), generation_(generation) {
+    }
+
+    uint32_t generation() const { return generation_; }
+
+    // Producer side: the slot to fill, or nullptr when the ring is full
+    Record* reserve() {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) > mask_) {
+            return nullptr;
+        }
+        return &records_[head & mask_];
+    }
+
+    void publish() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool halfFull() const {
+        return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed) > mask_ / 2;
+    }
+
+    // Consumer side: copy out everything published so far
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed);
+    }
+
+    void drainTo(std::vector<Record>& batch) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        uint64_t head = head_.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            batch.push_back(records_[tail & mask_]);
+        }
+        tail_.store(tail, std::memory_order_release);
+    }
+
+private:
+    std::vector<Record> records_;
+    size_t mask_;
+    uint32_t generation_;
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+};
+
+thread_local std::shared_ptr<AsyncLogger::Ring> AsyncLogger::t_ring_;
+
+AsyncLogger& AsyncLogger::instance() {
+    static AsyncLogger logger;
+    return logger;
+}
+
+AsyncLogger::~AsyncLogger() {
+    stop();
+}
+
+bool AsyncLogger::start(size_t ring_capacity) {
+    if (running()) {
+        return true;
+    }
+    ring_capacity_ = roundUpToPowerOfTwo(std::max<size_t>(ring_capacity, 2));
+    stop_requested_ = false;
+    // Rings of an earlier run are left behind by their threads on their next message
+    generation_.fetch_add(1, std::memory_order_relaxed);
+    try {
+        drain_thread_ = std::thread(&AsyncLogger::drainLoop, this);
+    } catch (...) {
+        return false;
+    }
+    running_.store(true, std::memory_order_release);
+    return true;
+}
+
+void AsyncLogger::stop() {
+    if (!running_.exchange(false, std::memory_order_acq_rel)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stop_requested_ = true;
+    }
+    wake_.notify_one();
+    drain_thread_.join();
+
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    rings_.clear();
+}
+
+bool AsyncLogger::push(LogSeverity severity, const char* file, int line, const std::string& msg) {
+    if (!running()) {
+        return false;
+    }
+
+    Ring* ring = t_ring_.get();
+    if (!ring || ring->generation() != generation_.load(std::memory_order_relaxed)) {
+        t_ring_ = registerRing();
+        ring = t_ring_.get();
+    }
+
+    Record* record = ring->reserve();
+    if (!record) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    record->sequence = sequence_.fetch_add(1, std::memory_order_relaxed);
+    record->time = std::chrono::system_clock::now();
+    record->file = file;
+    record->line = line;
+    record->severity = severity;
+    size_t size = std::min(msg.size(), kMaxMessageSize);
+    std::memcpy(record->text, msg.data(), size);
+    if (size < msg.size()) {
+        std::memcpy(record->text + size - 3, "...", 3);
+    }
+    record->size = static_cast<uint16_t>(size);
+    ring->publish();
+
+    // Everything else waits for the next drain interval
+    if (severity >= LogSeverity::LS_WARNING || ring->halfFull()) {
+        wake_.notify_one();
+    }
+    return true;
+}
+
+std::shared_ptr<AsyncLogger::Ring> AsyncLogger::registerRing() {
+    auto ring = std::make_shared<Ring>(ring_capacity_, generation_.load(std::memory_order_relaxed));
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    rings_.push_back(ring);
+    return ring;
+}
+
+void AsyncLogger::drainLoop() {
+    std::vector<Record> batch;
+    bool stopping = false;
+    while (!stopping) {
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_.wait_for(lock, kDrainInterval, [this] { return stop_requested_; });
+            stopping = stop_requested_;
+        }
+        // Keep going while producers refill the rings faster than one pass empties them
+        while (drain(batch)) {
+        }
+    }
+}
+
+bool AsyncLogger::drain(std::vector<Record>& batch) {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        // Forget rings whose thread has exited once they are empty
+        rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                    [](const std::shared_ptr<Ring>& ring) {
+                                        return ring.use_count() == 1 && ring->empty();
+                                    }),
+                     rings_.end());
+        rings = rings_;
+    }
+
+    batch.clear();
+    for (const auto& ring : rings) {
+        ring->drainTo(batch);
+    }
+
+    uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+    if (batch.empty() && dropped == reported_dropped_) {
+        return false;
+    }
+
+    // Rings are drained one after another; restore the order the messages were logged in
+    std::sort(batch.begin(), batch.end(),
+              [](const Record& a, const Record& b) { return a.sequence < b.sequence; });
+    for (const Record& record : batch) {
+        LogSettings::write(record.severity,
+                           LogSettings::formatLine(record.severity, record.text, record.size,
+                                                   record.file, record.line),
+                           std::chrono::system_clock::to_time_t(record.time), false);
+    }
+    if (dropped != reported_dropped_) {
+        std::string msg = std::to_string(dropped - reported_dropped_) + " log messages dropped (queue full)";
+        LogSettings::write(LogSeverity::LS_WARNING,
+                           LogSettings::formatLine(LogSeverity::LS_WARNING, msg.data(), msg.size(),
+                                                   __FILE__, __LINE__),
+                           time(nullptr), false);
+        reported_dropped_ = dropped;
+    }
+    LogSettings::flushOutputs();
+    return !batch.empty();
+}
+
+} // namespace mp4_recorder
@@ -7,36 +7,65 @@
  */
 
 #include "common.h"
+#include "async_logger.h"
+
+#include <mutex>
 
 namespace mp4_recorder {
 
 namespace {
-LogSeverity g_min_severity = LogSeverity::LS_INFO;
 std::string g_log_file;
 bool g_enable_file_logging = false;
+
+// Serializes console and file output; the log file stays open while file logging is enabled
+std::mutex g_output_mutex;
+std::ofstream g_log_stream;
 }
 
 void LogSettings::SetMinSeverity(LogSeverity severity) {
-    g_min_severity = severity;
+    min_severity_.store(severity, std::memory_order_relaxed);
 }
 
 LogSeverity LogSettings::GetMinSeverity() {
-    return g_min_severity;
+    return min_severity_.load(std::memory_order_relaxed);
 }
 
 void LogSettings::EnableFileLogging(const std::string& filename) {
-    g_log_file = filename;
-    g_enable_file_logging = true;
+    {
+        std::lock_guard<std::mutex> lock(g_output_mutex);
+        if (g_log_stream.is_open()) {
+            g_log_stream.close();
+        }
+        g_log_file = filename;
+        g_enable_file_logging = true;
+        try {
+            g_log_stream.open(g_log_file, std::ios::app);
+        } catch (...) {
+            // Silently ignore file open errors
+        }
+    }
     writeToFile("=== MP4 Crash-Safe Recorder Log ===");
-    writeToFile("Started at: " + getCurrentTime());
+    writeToFile("Started at: " + formatTime(time(nullptr)));
 }
 
 void LogSettings::DisableFileLogging() {
+    std::lock_guard<std::mutex> lock(g_output_mutex);
     g_enable_file_logging = false;
+    if (g_log_stream.is_open()) {
+        g_log_stream.close();
+    }
+}
+
+void LogSettings::EnableAsyncLogging(size_t queue_capacity) {
+    AsyncLogger::instance().start(queue_capacity);
 }
 
-bool LogSettings::ShouldLog(LogSeverity severity) {
-    return severity >= g_min_severity && g_min_severity != LogSeverity::LS_NONE;
+void LogSettings::DisableAsyncLogging() {
+    AsyncLogger::instance().stop();
+}
+
+uint64_t LogSettings::GetDroppedLogCount() {
+    return AsyncLogger::instance().droppedCount();
 }
 
 void LogSettings::Log(LogSeverity severity, const std::string& msg,
@@ -44,47 +73,68 @@ void LogSettings::Log(LogSeverity severity, const std::string& msg,
     if (!ShouldLog(severity)) {
         return;
     }
-
-    std::string formatted = std::string("[") + severityToString(severity) + "] ";
-    if (file && line > 0) {
-        formatted += std::string(file) + ":" + std::to_string(line) + " ";
-    }
-    formatted += msg;
-
-    if (severity == LogSeverity::LS_ERROR) {
-        std::cerr << formatted << std::endl;
-    } else {
-        std::cout << formatted << std::endl;
+    if (AsyncLogger::instance().push(severity, file, line, msg)) {
+        return;
     }
-    writeToFile(formatted);
+    write(severity, formatLine(severity, msg.data(), msg.size(), file, line), time(nullptr), true);
 }
 
-std::string LogSettings::getCurrentTime() {
-    time_t now = time(nullptr);
+std::string LogSettings::formatTime(time_t time) {
     struct tm timeinfo;
-    localtime_s(&timeinfo, &now);
+#ifdef _WIN32
+    localtime_s(&timeinfo, &time);
+#else
+    localtime_r(&time, &timeinfo);
+#endif
 
     std::ostringstream oss;
     oss << std::put_time(&timeinfo, "%Y-%m-%d %H:%M:%S");
     return oss.str();
 }
 
-void LogSettings::writeToFile(const std::string& msg) {
-    if (!g_enable_file_logging || g_log_file.empty()) {
-        return;
+std::string LogSettings::formatLine(LogSeverity severity, const char* msg, size_t size,
+                                    const char* file, int line) {
+    std::string formatted = std::string("[") + severityToString(severity) + "] ";
+    if (file && line > 0) {
+        formatted += std::string(file) + ":" + std::to_string(line) + " ";
+    }
+    formatted.append(msg, size);
+    return formatted;
+}
+
+void LogSettings::write(LogSeverity severity, const std::string& line, time_t time, bool flush) {
+    std::lock_guard<std::mutex> lock(g_output_mutex);
+    std::ostream& console = severity == LogSeverity::LS_ERROR ? std::cerr : std::cout;
+    console << line << '\n';
+    if (flush) {
+        console.flush();
     }
 
-    try {
-        std::ofstream file(g_log_file, std::ios::app);
-        if (file.is_open()) {
-            file << getCurrentTime() << " " << msg << std::endl;
-            file.close();
+    if (g_enable_file_logging && g_log_stream.is_open()) {
+        g_log_stream << formatTime(time) << " " << line << '\n';
+        if (flush) {
+            g_log_stream.flush();
         }
-    } catch (...) {
-        // Silently ignore file write errors
     }
 }
 
+void LogSettings::flushOutputs() {
+    std::lock_guard<std::mutex> lock(g_output_mutex);
+    std::cout.flush();
+    std::cerr.flush();
+    if (g_log_stream.is_open()) {
+        g_log_stream.flush();
+    }
+}
+
+void LogSettings::writeToFile(const std::string& msg) {
+    std::lock_guard<std::mutex> lock(g_output_mutex);
+    if (!g_enable_file_logging || !g_log_stream.is_open()) {
+        return;
+    }
+    g_log_stream << formatTime(time(nullptr)) << " " << msg << std::endl;
+}
+
 const char* LogSettings::severityToString(LogSeverity severity) {
     switch (severity) {
         case LogSeverity::LS_ERROR:
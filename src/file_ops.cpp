@@ -10,9 +10,12 @@
 #include <cstring>
 
 #ifdef _WIN32
+    #include <fcntl.h>
     #include <io.h>
+    #include <share.h>
     #include <sys/stat.h>
 #else
+    #include <fcntl.h>
     #include <unistd.h>
     #include <sys/stat.h>
 #endif
@@ -92,6 +95,21 @@ bool StdioFile::isOpen() const {
     return file_ != nullptr;
 }
 
+bool StdioFile::prefetch(uint64_t offset, uint64_t size) {
+    if (!file_) {
+        return false;
+    }
+#if defined(POSIX_FADV_WILLNEED)
+    // Starts asynchronous readahead into the page cache; stdio buffering is not involved
+    return posix_fadvise(fileno(file_), static_cast<off_t>(offset), static_cast<off_t>(size),
+                         POSIX_FADV_WILLNEED) == 0;
+#else
+    (void)offset;
+    (void)size;
+    return false;
+#endif
+}
+
 std::unique_ptr<IFile> StdioFileOps::open(const std::string& path, const char* mode) {
     FILE* file = fopen(path.c_str(), mode);
     if (!file) {
@@ -127,4 +145,18 @@ bool StdioFileOps::getFileSize(const std::string& path, uint64_t& size) {
 #endif
 }
 
+bool StdioFileOps::truncate(const std::string& path, uint64_t size) {
+#ifdef _WIN32
+    int fd = -1;
+    if (_sopen_s(&fd, path.c_str(), _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE) != 0) {
+        return false;
+    }
+    bool ok = _chsize_s(fd, static_cast<__int64>(size)) == 0;
+    _close(fd);
+    return ok;
+#else
+    return ::truncate(path.c_str(), static_cast<off_t>(size)) == 0;
+#endif
+}
+
 } // namespace mp4_recorder
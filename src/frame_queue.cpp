@@ -0,0 +1,58 @@
+/*
+ * MP4 Crash-Safe Recorder - Frame Queue Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "frame_queue.h"
+
+namespace mp4_recorder {
+
+namespace {
+
+size_t roundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+} // namespace
+
+FrameQueue::FrameQueue(size_t capacity)
+    : slots_(roundUpToPowerOfTwo(capacity < 2 ? 2 : capacity)), mask_(slots_.size() - 1) {
+}
+
+bool FrameQueue::push(const uint8_t* data, uint32_t size, int64_t pts, int64_t dts, bool is_keyframe) {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+        return false;
+    }
+    QueuedFrame& slot = slots_[tail & mask_];
+    slot.data.assign(data, data + size);
+    slot.pts = pts;
+    slot.dts = dts;
+    slot.is_keyframe = is_keyframe;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+QueuedFrame* FrameQueue::front() {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return &slots_[head & mask_];
+}
+
+void FrameQueue::pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+size_t FrameQueue::size() const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    return static_cast<size_t>(tail_.load(std::memory_order_acquire) - head);
+}
+
+} // namespace mp4_recorder
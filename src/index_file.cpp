@@ -7,10 +7,45 @@
 #include "index_file.h"
 #include "mp4_recorder.h"
 #include "common.h"
+#include <algorithm>
+#include <cstddef>
 #include <cstring>
 
 namespace mp4_recorder {
 
+static_assert(sizeof(IndexRecordHeader) == sizeof(FrameInfo),
+              "index records must have the size of a frame entry");
+static_assert(offsetof(IndexRecordHeader, track_id) == offsetof(FrameInfo, track_id),
+              "index records must keep track_id at the frame entry offset");
+
+namespace {
+
+// Entries per read when replaying the index (640KB)
+const size_t kReadBatchEntries = 16384;
+
+// Payload padded to whole frame entries
+uint64_t paddedPayloadSize(uint32_t payload_size) {
+    return (static_cast<uint64_t>(payload_size) + sizeof(FrameInfo) - 1) / sizeof(FrameInfo) *
+           sizeof(FrameInfo);
+}
+
+// Lookup table for the reflected CRC-32 polynomial
+struct Crc32Table {
+    uint32_t entries[256];
+
+    Crc32Table() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+} // namespace
+
 IndexFile::IndexFile()
     : file_ops_(std::make_shared<StdioFileOps>()) {
 }
@@ -75,7 +110,7 @@ bool IndexFile::open(const std::string& filename) {
         return false;
     }
     int64_t file_size = file_->tell();
-    uint64_t header_size = sizeof(uint32_t) + sizeof(RecorderConfig);
+    uint64_t header_size = frameDataStart();
     if (file_size > 0 && static_cast<uint64_t>(file_size) > header_size) {
         frame_count_ = (static_cast<uint64_t>(file_size) - header_size) / sizeof(FrameInfo);
     } else {
@@ -132,6 +167,12 @@ bool IndexFile::writeFrame(const FrameInfo& frame) {
 }
 
 bool IndexFile::readAllFrames(std::vector<FrameInfo>& video_frames, std::vector<FrameInfo>& audio_frames) {
+    // Skip header (magic + config) and start reading frames
+    return readFramesFrom(frameDataStart(), video_frames, audio_frames);
+}
+
+bool IndexFile::readFramesFrom(uint64_t position, std::vector<FrameInfo>& video_frames,
+                               std::vector<FrameInfo>& audio_frames) {
     if (!file_) {
         MCSR_LOG(ERROR) << "Index file not open";
         return false;
@@ -146,22 +187,189 @@ bool IndexFile::readAllFrames(std::vector<FrameInfo>& video_frames, std::vector<
         audio_frames.reserve(reserve_count);
     }
     
-    // Skip header (magic + config) and start reading frames
-    uint64_t header_size = sizeof(uint32_t) + sizeof(RecorderConfig);
-    file_->seek(static_cast<int64_t>(header_size), SEEK_SET);
-    
-    FrameInfo frame;
-    while (file_->read(&frame, sizeof(FrameInfo)) == sizeof(FrameInfo)) {
-        if (frame.track_id == 0) {
-            video_frames.push_back(frame);
-        } else if (frame.track_id == 1) {
-            audio_frames.push_back(frame);
+    if (!file_->seek(static_cast<int64_t>(position), SEEK_SET)) {
+        MCSR_LOG(ERROR) << "Failed to seek index file to " << position;
+        return false;
+    }
+    
+    // Entries are read in large batches, with the next batch prefetched while one is parsed
+    std::vector<FrameInfo> batch(kReadBatchEntries);
+    const size_t batch_bytes = batch.size() * sizeof(FrameInfo);
+    uint64_t skip_entries = 0;
+    for (;;) {
+        file_->prefetch(position + batch_bytes, batch_bytes);
+        size_t count = file_->read(batch.data(), batch_bytes) / sizeof(FrameInfo);
+        position += batch_bytes;
+
+        for (size_t i = 0; i < count; i++) {
+            if (skip_entries > 0) {
+                skip_entries--;
+                continue;
+            }
+            const FrameInfo& frame = batch[i];
+            if (frame.track_id == 0) {
+                video_frames.push_back(frame);
+            } else if (frame.track_id == 1) {
+                audio_frames.push_back(frame);
+            } else if (frame.track_id == kIndexRecordTrackId) {
+                // Skip the record payload; a torn header is skipped as a single entry
+                IndexRecordHeader header;
+                std::memcpy(&header, &frame, sizeof(header));
+                if (header.magic == kIndexRecordMagic) {
+                    skip_entries = paddedPayloadSize(header.payload_size) / sizeof(FrameInfo);
+                }
+            }
+        }
+        if (count < batch.size()) {
+            break;
         }
     }
     
     return true;
 }
 
+bool IndexFile::writeRecord(IndexRecordType type, const std::vector<uint8_t>& payload) {
+    if (!file_) {
+        MCSR_LOG(ERROR) << "Index file not open";
+        return false;
+    }
+    
+    if (!appendRecord(*file_, type, frame_count_, payload)) {
+        return false;
+    }
+    
+    dirty_ = true;
+    return true;
+}
+
+bool IndexFile::findLastRecord(IndexRecordType type, std::vector<uint8_t>& payload,
+                               uint64_t& next_position, uint64_t max_entries) {
+    if (!file_) {
+        MCSR_LOG(ERROR) << "Index file not open";
+        return false;
+    }
+    
+    if (!file_->seek(0, SEEK_END)) {
+        MCSR_LOG(ERROR) << "Failed to seek index file for size";
+        return false;
+    }
+    int64_t file_size = file_->tell();
+    uint64_t data_start = frameDataStart();
+    if (file_size <= 0 || static_cast<uint64_t>(file_size) < data_start + sizeof(FrameInfo)) {
+        return false;
+    }
+    
+    // Records start on entry boundaries; a torn entry at the end is ignored
+    const uint64_t entry_size = sizeof(FrameInfo);
+    const uint64_t block_entries = 1024;
+    uint64_t end_entry = (static_cast<uint64_t>(file_size) - data_start) / entry_size;
+    uint64_t first_entry = end_entry > max_entries ? end_entry - max_entries : 0;
+    std::vector<uint8_t> block;
+    
+    while (end_entry > first_entry) {
+        uint64_t begin_entry = std::max(first_entry, end_entry > block_entries ? end_entry - block_entries : 0);
+        size_t block_size = static_cast<size_t>((end_entry - begin_entry) * entry_size);
+        block.resize(block_size);
+        if (!file_->seek(static_cast<int64_t>(data_start + begin_entry * entry_size), SEEK_SET) ||
+            file_->read(block.data(), block_size) != block_size) {
+            MCSR_LOG(ERROR) << "Failed to read index block while searching for records";
+            return false;
+        }
+        
+        for (uint64_t entry = end_entry; entry-- > begin_entry;) {
+            IndexRecordHeader header;
+            std::memcpy(&header, block.data() + (entry - begin_entry) * entry_size, sizeof(header));
+            if (header.track_id != kIndexRecordTrackId || header.magic != kIndexRecordMagic ||
+                header.type != static_cast<uint32_t>(type)) {
+                continue;
+            }
+            
+            uint64_t position = data_start + entry * entry_size;
+            if (!readRecordAt(position, type, payload, next_position)) {
+                MCSR_LOG(WARNING) << "Skipping damaged index record at " << position;
+                continue;
+            }
+            
+            MCSR_LOG(INFO) << "Found index record type " << header.type << " at " << position << " (" << header.frame_count << " frames before it)";
+            return true;
+        }
+        end_entry = begin_entry;
+    }
+    
+    payload.clear();
+    return false;
+}
+
+bool IndexFile::readRecordAt(uint64_t position, IndexRecordType type, std::vector<uint8_t>& payload,
+                             uint64_t& next_position) {
+    if (!file_) {
+        MCSR_LOG(ERROR) << "Index file not open";
+        return false;
+    }
+    
+    IndexRecordHeader header;
+    if (!file_->seek(static_cast<int64_t>(position), SEEK_SET) ||
+        file_->read(&header, sizeof(header)) != sizeof(header) ||
+        header.track_id != kIndexRecordTrackId || header.magic != kIndexRecordMagic ||
+        header.type != static_cast<uint32_t>(type)) {
+        return false;
+    }
+    
+    // A torn payload fails the short read or the checksum
+    payload.resize(header.payload_size);
+    if (file_->read(payload.data(), payload.size()) != payload.size() ||
+        checksum(payload.data(), payload.size()) != header.checksum) {
+        payload.clear();
+        return false;
+    }
+    
+    next_position = position + sizeof(header) + paddedPayloadSize(header.payload_size);
+    return true;
+}
+
+uint64_t IndexFile::frameDataStart() {
+    return sizeof(uint32_t) + sizeof(RecorderConfig);
+}
+
+bool IndexFile::appendRecord(IFile& file, IndexRecordType type, uint64_t frame_count,
+                             const std::vector<uint8_t>& payload) {
+    if (payload.size() > 0xFFFFFFFFULL) {
+        MCSR_LOG(ERROR) << "Index record payload too large: " << payload.size();
+        return false;
+    }
+    
+    IndexRecordHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kIndexRecordMagic;
+    header.type = static_cast<uint32_t>(type);
+    header.payload_size = static_cast<uint32_t>(payload.size());
+    header.checksum = checksum(payload.data(), payload.size());
+    header.frame_count = frame_count;
+    header.track_id = kIndexRecordTrackId;
+    
+    // Header, payload and padding go out in one write so a crash tears at most this record
+    std::vector<uint8_t> record(sizeof(header) + paddedPayloadSize(header.payload_size), 0);
+    std::memcpy(record.data(), &header, sizeof(header));
+    if (!payload.empty()) {
+        std::memcpy(record.data() + sizeof(header), payload.data(), payload.size());
+    }
+    if (file.write(record.data(), record.size()) != record.size()) {
+        MCSR_LOG(ERROR) << "Failed to write record to index";
+        return false;
+    }
+    return true;
+}
+
+uint32_t IndexFile::checksum(const uint8_t* data, size_t size) {
+    static const Crc32Table table;
+    
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFU;
+}
+
 bool IndexFile::flush() {
     if (!file_ || !dirty_) {
         return true;
@@ -0,0 +1,133 @@
+/*
+ * MP4 Crash-Safe Recorder - Interleaver Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "interleaver.h"
+
+namespace mp4_recorder {
+
+namespace {
+
+// Frame buffers kept for reuse once their frame has been written
+const size_t kMaxSpareBuffers = 64;
+
+int64_t floorDiv(int64_t value, int64_t divisor) {
+    int64_t quotient = value / divisor;
+    return (value % divisor != 0 && value < 0) ? quotient - 1 : quotient;
+}
+
+// Timestamp in microseconds, rounded down; split so large timestamps do not overflow
+int64_t toMicros(int64_t ts, uint32_t timescale) {
+    int64_t quotient = floorDiv(ts, timescale);
+    int64_t remainder = ts - quotient * timescale;
+    return quotient * 1000000 + remainder * 1000000 / timescale;
+}
+
+} // namespace
+
+Interleaver::Interleaver(uint32_t video_timescale, uint32_t audio_timescale, uint32_t chunk_ms,
+                         uint32_t window_ms)
+    : chunk_us_(static_cast<int64_t>(chunk_ms > 0 ? chunk_ms : 1) * 1000),
+      window_us_(static_cast<int64_t>(window_ms) * 1000) {
+    tracks_[0].timescale = video_timescale > 0 ? video_timescale : 1;
+    tracks_[1].timescale = audio_timescale > 0 ? audio_timescale : 1;
+}
+
+void Interleaver::push(uint8_t track_id, const uint8_t* data, uint32_t size, int64_t pts, int64_t dts,
+                       bool is_keyframe) {
+    QueuedFrame& slot = append(track_id, dts);
+    slot.data.assign(data, data + size);
+    slot.pts = pts;
+    slot.dts = dts;
+    slot.is_keyframe = is_keyframe;
+}
+
+void Interleaver::push(uint8_t track_id, QueuedFrame& frame) {
+    QueuedFrame& slot = append(track_id, frame.dts);
+    slot.data.swap(frame.data);
+    slot.pts = frame.pts;
+    slot.dts = frame.dts;
+    slot.is_keyframe = frame.is_keyframe;
+}
+
+QueuedFrame& Interleaver::append(uint8_t track_id, int64_t dts) {
+    Track& track = tracks_[track_id == 0 ? 0 : 1];
+    track.frames.emplace_back();
+    QueuedFrame& slot = track.frames.back();
+    if (!spare_buffers_.empty()) {
+        slot.data.swap(spare_buffers_.back());
+        spare_buffers_.pop_back();
+    }
+    int64_t us = toMicros(dts, track.timescale);
+    track.has_input = true;
+    track.last_input_us = us;
+    if (!has_input_ || us > newest_input_us_) {
+        has_input_ = true;
+        newest_input_us_ = us;
+    }
+    return slot;
+}
+
+const QueuedFrame* Interleaver::next(uint8_t& track_id) {
+    if (run_track_ >= 0) {
+        const Track& track = tracks_[run_track_];
+        if (!track.frames.empty() && headUs(track) < run_end_us_) {
+            track_id = static_cast<uint8_t>(run_track_);
+            return &track.frames.front();
+        }
+        run_track_ = -1;
+    }
+    if (!startRun()) {
+        return nullptr;
+    }
+    track_id = static_cast<uint8_t>(run_track_);
+    return &tracks_[run_track_].frames.front();
+}
+
+void Interleaver::pop() {
+    Track& track = tracks_[run_track_];
+    if (spare_buffers_.size() < kMaxSpareBuffers) {
+        spare_buffers_.emplace_back();
+        spare_buffers_.back().swap(track.frames.front().data);
+    }
+    track.frames.pop_front();
+}
+
+int64_t Interleaver::headUs(const Track& track) const {
+    return toMicros(track.frames.front().dts, track.timescale);
+}
+
+bool Interleaver::startRun() {
+    // The earliest head goes first; video wins ties
+    int chosen = -1;
+    for (int i = 0; i < 2; i++) {
+        if (!tracks_[i].frames.empty() && (chosen < 0 || headUs(tracks_[i]) < headUs(tracks_[chosen]))) {
+            chosen = i;
+        }
+    }
+    if (chosen < 0) {
+        return false;
+    }
+
+    // Runs end on multiples of the chunk duration, so both tracks cut at the same times
+    const Track& track = tracks_[chosen];
+    const Track& other = tracks_[1 - chosen];
+    int64_t head = headUs(track);
+    int64_t end = (floorDiv(head, chunk_us_) + 1) * chunk_us_;
+    // Frames arrive in decode order per track, so the other track's next frame comes no
+    // earlier than the newest one it pushed
+    bool complete = track.last_input_us >= end;
+    bool other_caught_up = !other.frames.empty() || (other.has_input && other.last_input_us >= head);
+    bool overdue = newest_input_us_ - head >= chunk_us_ + window_us_;
+    if (!finishing_ && !force_run_ && !(complete && other_caught_up) && !overdue) {
+        return false;
+    }
+    force_run_ = false;
+    run_track_ = chosen;
+    run_end_us_ = end;
+    return true;
+}
+
+} // namespace mp4_recorder
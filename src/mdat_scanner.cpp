@@ -0,0 +1,585 @@
+/*
+ * MP4 Crash-Safe Recorder - Mdat Scanner Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "mdat_scanner.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MCSR_SCAN_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define MCSR_SCAN_NEON 1
+#endif
+
+namespace mp4_recorder {
+
+namespace {
+
+const size_t kStartCodeSize = 3;     // 00 00 01
+const size_t kAdtsHeaderSize = 7;
+const size_t kLengthPrefixSize = 4;  // AVCC / HVCC NAL length
+
+uint32_t readUint32BE(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+bool isStartCode(const uint8_t* p) {
+    return p[0] == 0x00 && p[1] == 0x00 && p[2] == 0x01;
+}
+
+bool isAdtsSync(const uint8_t* p) {
+    // 12-bit syncword, layer must be 0
+    return p[0] == 0xFF && (p[1] & 0xF6) == 0xF0;
+}
+
+// Exp-Golomb reader for the first fields of a slice header (emulation prevention is
+// ignored, which is fine for the few leading bits that are inspected)
+class BitReader {
+public:
+    BitReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+    bool readUe(uint32_t& value) {
+        int leading_zeros = 0;
+        uint32_t bit = 0;
+        while (readBit(bit) && bit == 0) {
+            if (++leading_zeros > 31) {
+                return false;
+            }
+        }
+        if (bit != 1) {
+            return false;
+        }
+        uint32_t suffix = 0;
+        for (int i = 0; i < leading_zeros; i++) {
+            if (!readBit(bit)) {
+                return false;
+            }
+            suffix = (suffix << 1) | bit;
+        }
+        value = (1u << leading_zeros) - 1 + suffix;
+        return true;
+    }
+
+private:
+    bool readBit(uint32_t& bit) {
+        if (pos_ >= size_ * 8) {
+            return false;
+        }
+        bit = (data_[pos_ / 8] >> (7 - pos_ % 8)) & 1;
+        pos_++;
+        return true;
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    size_t pos_ = 0;
+};
+
+} // namespace
+
+// Sliding read buffer over [begin, end) of mdat data. Positions are relative to mdat_start.
+class MdatScanner::Window {
+public:
+    Window(IFile& file, uint64_t mdat_start, uint64_t end, size_t capacity)
+        : file_(file), mdat_start_(mdat_start), end_(end), capacity_(std::max<size_t>(capacity, 64)) {
+    }
+
+    uint64_t end() const { return end_; }
+    bool failed() const { return failed_; }
+
+    // Pointer to [pos, pos + size), or nullptr when the range extends past end
+    const uint8_t* at(uint64_t pos, size_t size) {
+        if (pos + size > end_ || size > capacity_) {
+            return nullptr;
+        }
+        if (pos < buffer_pos_ || pos + size > buffer_pos_ + buffer_.size()) {
+            if (!fill(pos)) {
+                return nullptr;
+            }
+        }
+        return buffer_.data() + (pos - buffer_pos_);
+    }
+
+    // First position in [pos, limit) where finder matches a pattern of pattern_size bytes
+    // lying entirely before limit, or limit when there is none
+    template <typename Finder>
+    uint64_t find(uint64_t pos, uint64_t limit, size_t pattern_size, Finder finder) {
+        limit = std::min(limit, end_);
+        while (pos + pattern_size <= limit) {
+            if (!at(pos, pattern_size)) {
+                break;
+            }
+            uint64_t buffer_end = std::min<uint64_t>(buffer_pos_ + buffer_.size(), limit);
+            size_t available = static_cast<size_t>(buffer_end - pos);
+            size_t index = finder(buffer_.data() + (pos - buffer_pos_), available);
+            if (index < available) {
+                return pos + index;
+            }
+            if (buffer_end >= limit) {
+                break;
+            }
+            // Keep a pattern-sized overlap so matches across refills are not missed
+            pos += available - (pattern_size - 1);
+            fill(pos);
+        }
+        return limit;
+    }
+
+private:
+    bool fill(uint64_t pos) {
+        size_t size = static_cast<size_t>(std::min<uint64_t>(capacity_, end_ - pos));
+        buffer_.resize(size);
+        buffer_pos_ = pos;
+        if (!file_.seek(static_cast<int64_t>(mdat_start_ + pos), SEEK_SET) ||
+            file_.read(buffer_.data(), size) != size) {
+            MCSR_LOG(ERROR) << "Failed to read mdat at " << (mdat_start_ + pos);
+            buffer_.clear();
+            failed_ = true;
+            return false;
+        }
+        // Scans run forward, so have the OS fetch the next window while this one is parsed
+        uint64_t next = pos + size;
+        if (next < end_) {
+            file_.prefetch(mdat_start_ + next, std::min<uint64_t>(capacity_, end_ - next));
+        }
+        return true;
+    }
+
+    IFile& file_;
+    uint64_t mdat_start_;
+    uint64_t end_;
+    size_t capacity_;
+    std::vector<uint8_t> buffer_;
+    uint64_t buffer_pos_ = 0;
+    bool failed_ = false;
+};
+
+MdatScanner::MdatScanner(VideoCodec video_codec, size_t buffer_size)
+    : video_codec_(video_codec), buffer_size_(buffer_size) {
+}
+
+size_t MdatScanner::findNalBoundary(const uint8_t* data, size_t size) {
+    if (size < 3) {
+        return size;
+    }
+    size_t i = 0;
+#if defined(MCSR_SCAN_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi8(2);
+    for (; i + 16 + 2 <= size; i += 16) {
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+        __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 2));
+        // b2 <= 2 (unsigned)
+        __m128i small = _mm_cmpeq_epi8(_mm_min_epu8(b2, two), b2);
+        __m128i match = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                                      small);
+        int mask = _mm_movemask_epi8(match);
+        if (mask != 0) {
+            for (int bit = 0; bit < 16; bit++) {
+                if (mask & (1 << bit)) {
+                    return i + bit;
+                }
+            }
+        }
+    }
+#elif defined(MCSR_SCAN_NEON)
+    const uint8x16_t two = vdupq_n_u8(2);
+    for (; i + 16 + 2 <= size; i += 16) {
+        uint8x16_t b0 = vld1q_u8(data + i);
+        uint8x16_t b1 = vld1q_u8(data + i + 1);
+        uint8x16_t b2 = vld1q_u8(data + i + 2);
+        uint8x16_t match = vandq_u8(vandq_u8(vceqzq_u8(b0), vceqzq_u8(b1)), vcleq_u8(b2, two));
+        if (vmaxvq_u8(match) != 0) {
+            break;  // Locate the exact byte with the scalar loop below
+        }
+    }
+#endif
+    for (; i + 3 <= size; i++) {
+        if (data[i] == 0x00 && data[i + 1] == 0x00 && data[i + 2] <= 0x02) {
+            return i;
+        }
+    }
+    return size;
+}
+
+size_t MdatScanner::findAdtsSync(const uint8_t* data, size_t size) {
+    if (size < 2) {
+        return size;
+    }
+    size_t i = 0;
+#if defined(MCSR_SCAN_SSE2)
+    const __m128i ff = _mm_set1_epi8(static_cast<char>(0xFF));
+    const __m128i sync_mask = _mm_set1_epi8(static_cast<char>(0xF6));
+    const __m128i sync_bits = _mm_set1_epi8(static_cast<char>(0xF0));
+    for (; i + 16 + 1 <= size; i += 16) {
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+        __m128i match = _mm_and_si128(_mm_cmpeq_epi8(b0, ff),
+                                      _mm_cmpeq_epi8(_mm_and_si128(b1, sync_mask), sync_bits));
+        int mask = _mm_movemask_epi8(match);
+        if (mask != 0) {
+            for (int bit = 0; bit < 16; bit++) {
+                if (mask & (1 << bit)) {
+                    return i + bit;
+                }
+            }
+        }
+    }
+#elif defined(MCSR_SCAN_NEON)
+    const uint8x16_t ff = vdupq_n_u8(0xFF);
+    const uint8x16_t sync_mask = vdupq_n_u8(0xF6);
+    const uint8x16_t sync_bits = vdupq_n_u8(0xF0);
+    for (; i + 16 + 1 <= size; i += 16) {
+        uint8x16_t b0 = vld1q_u8(data + i);
+        uint8x16_t b1 = vld1q_u8(data + i + 1);
+        uint8x16_t match = vandq_u8(vceqq_u8(b0, ff), vceqq_u8(vandq_u8(b1, sync_mask), sync_bits));
+        if (vmaxvq_u8(match) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; i + 2 <= size; i++) {
+        if (isAdtsSync(data + i)) {
+            return i;
+        }
+    }
+    return size;
+}
+
+bool MdatScanner::scan(IFile& file, uint64_t mdat_start, uint64_t begin, uint64_t end,
+                       std::vector<ScannedSample>& samples) {
+    Window window(file, mdat_start, end, buffer_size_);
+    uint64_t pos = begin;
+
+    while (pos < end && !window.failed()) {
+        uint32_t length = 0;
+        bool is_keyframe = false;
+        if (parseVideo(window, pos, length, is_keyframe)) {
+            samples.push_back({pos, length, is_keyframe, 0});
+            stats_.video_samples++;
+            max_video_sample_ = std::max(max_video_sample_, length);
+            pos += length;
+            continue;
+        }
+        if (parseAdts(window, pos, length)) {
+            samples.push_back({pos, length, true, 1});
+            stats_.audio_samples++;
+            pos += length;
+            continue;
+        }
+
+        // Unrecognized bytes (e.g. raw audio or a torn write): resync at the next position
+        // that starts a sample
+        uint64_t next = findSample(window, pos + 1, end);
+        stats_.skipped_bytes += next - pos;
+        pos = next;
+    }
+
+    if (window.failed()) {
+        return false;
+    }
+    MCSR_LOG(INFO) << "Mdat scan: " << stats_.video_samples << " video samples, " << stats_.audio_samples << " audio samples, " << stats_.skipped_bytes << " bytes skipped";
+    return true;
+}
+
+uint64_t MdatScanner::findSample(Window& window, uint64_t begin, uint64_t end) {
+    // Length prefixes start with a zero byte, start codes too, so only zero bytes and
+    // ADTS sync words are candidates
+    uint64_t candidate = begin;
+    uint64_t zero = 0;
+    uint64_t sync = 0;
+    while (candidate < end && !window.failed()) {
+        if (zero < candidate) {
+            zero = window.find(candidate, end, 1, [](const uint8_t* data, size_t size) {
+                const void* hit = std::memchr(data, 0, size);
+                return hit ? static_cast<size_t>(static_cast<const uint8_t*>(hit) - data) : size;
+            });
+        }
+        if (sync < candidate) {
+            sync = window.find(candidate, end, 2, findAdtsSync);
+        }
+        candidate = std::min(zero, sync);
+        if (candidate >= end) {
+            break;
+        }
+
+        uint32_t length = 0;
+        bool is_keyframe = false;
+        if (parseAvcc(window, candidate, length, is_keyframe) ||
+            parseAnnexB(window, candidate, length, is_keyframe) ||
+            parseAdts(window, candidate, length)) {
+            return candidate;
+        }
+        candidate++;
+    }
+    return end;
+}
+
+bool MdatScanner::parseVideo(Window& window, uint64_t pos, uint32_t& length, bool& is_keyframe) {
+    // A length prefix of 256..511 also reads as a start code. AVCC wins outright when the
+    // next sample starts right after it; otherwise (e.g. raw audio follows) the framing
+    // seen so far in this stream decides.
+    uint32_t avcc_length = 0;
+    bool avcc_keyframe = false;
+    bool avcc = parseAvcc(window, pos, avcc_length, avcc_keyframe);
+    bool annexb = false;
+    if (!avcc || !startsSample(window, pos + avcc_length)) {
+        annexb = parseAnnexB(window, pos, length, is_keyframe);
+    }
+    if (annexb && (!avcc || annexb_samples_ > avcc_samples_)) {
+        annexb_samples_++;
+        return true;
+    }
+    if (avcc) {
+        avcc_samples_++;
+        length = avcc_length;
+        is_keyframe = avcc_keyframe;
+        return true;
+    }
+    return false;
+}
+
+uint64_t MdatScanner::maxVideoSampleSize() const {
+    // Random bytes rarely form a small length prefix, so bounding access unit sizes by what
+    // the stream has shown so far keeps false matches in raw audio rare
+    const uint64_t kInitialLimit = 4 * 1024 * 1024;
+    const uint64_t kMinimumLimit = 256 * 1024;
+    if (max_video_sample_ == 0) {
+        return kInitialLimit;
+    }
+    return std::max<uint64_t>(kMinimumLimit, static_cast<uint64_t>(max_video_sample_) * 4);
+}
+
+bool MdatScanner::parseAdts(Window& window, uint64_t pos, uint32_t& length) {
+    const uint8_t* h = window.at(pos, kAdtsHeaderSize);
+    if (!h || !isAdtsSync(h)) {
+        return false;
+    }
+    uint32_t frame_length = (static_cast<uint32_t>(h[3] & 0x03) << 11) |
+                            (static_cast<uint32_t>(h[4]) << 3) | (h[5] >> 5);
+    uint32_t header_size = (h[1] & 0x01) ? 7 : 9;
+    uint8_t sample_rate_index = (h[2] >> 2) & 0x0F;
+    if (frame_length < header_size || sample_rate_index > 12 || pos + frame_length > window.end()) {
+        return false;
+    }
+    // Sync words are common inside video payload, so require a plausible successor
+    if (!startsSample(window, pos + frame_length)) {
+        return false;
+    }
+    length = frame_length;
+    return true;
+}
+
+bool MdatScanner::parseAvcc(Window& window, uint64_t pos, uint32_t& length, bool& is_keyframe) {
+    const size_t header_size = nalHeaderSize();
+    uint64_t p = pos;
+    bool has_vcl = false;
+    is_keyframe = false;
+
+    while (true) {
+        // Length prefix, NAL header and the first slice header bytes
+        size_t peek = kLengthPrefixSize + header_size + 4;
+        const uint8_t* prefix = window.at(p, peek);
+        if (!prefix) {
+            peek = static_cast<size_t>(std::min<uint64_t>(peek, window.end() - p));
+            if (peek < kLengthPrefixSize + header_size || !(prefix = window.at(p, peek))) {
+                break;
+            }
+        }
+        uint32_t nal_size = readUint32BE(prefix);
+        if (nal_size < header_size || p + kLengthPrefixSize + nal_size > window.end() ||
+            p + kLengthPrefixSize + nal_size - pos > maxVideoSampleSize()) {
+            break;
+        }
+        const uint8_t* nal = prefix + kLengthPrefixSize;
+        size_t available = std::min<size_t>(peek - kLengthPrefixSize, nal_size);
+        if (!isValidNalHeader(nal) || startsAccessUnit(nal, available, has_vcl)) {
+            break;
+        }
+        bool vcl = isVcl(nal);
+        bool keyframe = isKeyframeNal(nal);
+        if (vcl) {
+            // A slice carries at least a few header bytes after the NAL header
+            if (nal_size < header_size + 2) {
+                break;
+            }
+            if (video_codec_ == VideoCodec::H264) {
+                // first_mb_in_slice, slice_type (0..9) and pic_parameter_set_id (0..255)
+                BitReader reader(nal + header_size, available - header_size);
+                uint32_t first_mb = 0, slice_type = 0, pps_id = 0;
+                if (available > header_size && reader.readUe(first_mb) && reader.readUe(slice_type) &&
+                    (slice_type > 9 || (reader.readUe(pps_id) && pps_id > 255))) {
+                    break;
+                }
+            }
+        }
+        // Emulation prevention guarantees the payload never contains 00 00 00..02; a match
+        // means the length prefix is bogus or the NAL unit is torn
+        uint64_t nal_pos = p + kLengthPrefixSize;
+        uint64_t nal_end = nal_pos + nal_size;
+        if (window.find(nal_pos, nal_end, 3, findNalBoundary) < nal_end) {
+            break;
+        }
+        has_vcl = has_vcl || vcl;
+        is_keyframe = is_keyframe || keyframe;
+        p = nal_end;
+    }
+
+    // An access unit must carry at least one slice
+    if (!has_vcl) {
+        return false;
+    }
+    length = static_cast<uint32_t>(p - pos);
+    return true;
+}
+
+bool MdatScanner::parseAnnexB(Window& window, uint64_t pos, uint32_t& length, bool& is_keyframe) {
+    const size_t header_size = nalHeaderSize();
+    uint64_t p = pos;
+    bool has_vcl = false;
+    is_keyframe = false;
+
+    while (p < window.end()) {
+        const uint8_t* sc = window.at(p, 4);
+        size_t sc_size = 0;
+        if (sc && sc[0] == 0x00 && isStartCode(sc + 1)) {
+            sc_size = 4;
+        } else if ((sc || (sc = window.at(p, kStartCodeSize))) && isStartCode(sc)) {
+            sc_size = 3;
+        } else {
+            break;
+        }
+
+        uint64_t nal_pos = p + sc_size;
+        size_t available = static_cast<size_t>(std::min<uint64_t>(header_size + 4, window.end() - nal_pos));
+        const uint8_t* nal = available >= header_size ? window.at(nal_pos, available) : nullptr;
+        if (!nal || !isValidNalHeader(nal) || startsAccessUnit(nal, available, has_vcl)) {
+            break;
+        }
+
+        // The NAL unit ends before the next 00 00 01 or 00 00 00 (leading zero of a 4-byte
+        // start code, or zero padding that ends the stream); 00 00 02 marks torn data
+        uint64_t next = window.find(nal_pos + header_size, window.end(), 3, findNalBoundary);
+        nal = window.at(nal_pos, available);
+        if (!nal) {
+            break;
+        }
+        if (isVcl(nal)) {
+            has_vcl = true;
+        }
+        if (isKeyframeNal(nal)) {
+            is_keyframe = true;
+        }
+        p = next;
+    }
+
+    if (!has_vcl || p - pos > maxVideoSampleSize()) {
+        return false;
+    }
+    length = static_cast<uint32_t>(p - pos);
+    return true;
+}
+
+bool MdatScanner::startsSample(Window& window, uint64_t pos) {
+    if (pos >= window.end()) {
+        return true;
+    }
+    const size_t header_size = nalHeaderSize();
+    const uint8_t* p = window.at(pos, kLengthPrefixSize + header_size);
+    if (p) {
+        uint32_t nal_size = readUint32BE(p);
+        if (nal_size >= header_size && pos + kLengthPrefixSize + nal_size <= window.end() &&
+            isValidNalHeader(p + kLengthPrefixSize)) {
+            return true;
+        }
+        if (isStartCode(p) && isValidNalHeader(p + kStartCodeSize)) {
+            return true;
+        }
+        if (p[0] == 0x00 && isStartCode(p + 1) && isValidNalHeader(p + 4)) {
+            return true;
+        }
+    }
+    p = window.at(pos, kAdtsHeaderSize);
+    return p && isAdtsSync(p);
+}
+
+size_t MdatScanner::nalHeaderSize() const {
+    return video_codec_ == VideoCodec::H265 ? 2 : 1;
+}
+
+bool MdatScanner::isValidNalHeader(const uint8_t* header) const {
+    if (header[0] & 0x80) {
+        return false;  // forbidden_zero_bit
+    }
+    if (video_codec_ == VideoCodec::H265) {
+        uint8_t type = (header[0] >> 1) & 0x3F;
+        uint8_t layer_id = static_cast<uint8_t>(((header[0] & 0x01) << 5) | (header[1] >> 3));
+        uint8_t temporal_id_plus1 = header[1] & 0x07;
+        bool reserved = (type >= 10 && type <= 15) || (type >= 22 && type <= 31) || type >= 41;
+        return !reserved && layer_id == 0 && temporal_id_plus1 != 0;
+    }
+
+    uint8_t type = header[0] & 0x1F;
+    uint8_t ref_idc = (header[0] >> 5) & 0x03;
+    if (type == 0 || type >= 22) {
+        return false;
+    }
+    // IDR slices and parameter sets are always reference data; SEI and delimiters never are
+    if ((type == 5 || type == 7 || type == 8) && ref_idc == 0) {
+        return false;
+    }
+    if ((type == 6 || (type >= 9 && type <= 12)) && ref_idc != 0) {
+        return false;
+    }
+    return true;
+}
+
+bool MdatScanner::isVcl(const uint8_t* header) const {
+    if (video_codec_ == VideoCodec::H265) {
+        return ((header[0] >> 1) & 0x3F) < 32;
+    }
+    uint8_t type = header[0] & 0x1F;
+    return type >= 1 && type <= 5;
+}
+
+bool MdatScanner::isKeyframeNal(const uint8_t* header) const {
+    if (video_codec_ == VideoCodec::H265) {
+        uint8_t type = (header[0] >> 1) & 0x3F;
+        return type >= 16 && type <= 21;  // IRAP pictures
+    }
+    return (header[0] & 0x1F) == 5;  // IDR
+}
+
+bool MdatScanner::startsAccessUnit(const uint8_t* header, size_t available, bool has_vcl) const {
+    // Everything up to the first slice belongs to the current access unit
+    if (!has_vcl) {
+        return false;
+    }
+    const size_t header_size = nalHeaderSize();
+    if (video_codec_ == VideoCodec::H265) {
+        uint8_t type = (header[0] >> 1) & 0x3F;
+        if (type < 32) {
+            // first_slice_segment_in_pic_flag
+            return available > header_size && (header[header_size] & 0x80) != 0;
+        }
+        return (type >= 32 && type <= 35) || type == 39;  // VPS/SPS/PPS/AUD/prefix SEI
+    }
+
+    uint8_t type = header[0] & 0x1F;
+    if (type == 1 || type == 5) {
+        // first_mb_in_slice == 0 is coded as a single 1 bit
+        return available > header_size && (header[header_size] & 0x80) != 0;
+    }
+    return type == 6 || type == 7 || type == 8 || type == 9 || (type >= 14 && type <= 18);
+}
+
+} // namespace mp4_recorder
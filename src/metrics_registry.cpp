@@ -0,0 +1,226 @@
+/*
+ * MP4 Crash-Safe Recorder - Metrics Registry Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "metrics_registry.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+namespace mp4_recorder {
+
+namespace {
+
+// Histogram bucket bounds: powers of 4 from ~1us to ~17s. They fall on power-of-two
+// boundaries of LatencyHistogram, so the cumulative counts are exact.
+constexpr uint32_t kFirstBoundExponent = 10;
+constexpr uint32_t kLastBoundExponent = 34;
+constexpr uint32_t kBoundExponentStep = 2;
+
+std::string formatSeconds(uint64_t ns) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.9g", static_cast<double>(ns) / 1e9);
+    return buffer;
+}
+
+void writeHeader(std::ostream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << ' ' << help << '\n' << "# TYPE " << name << ' ' << type << '\n';
+}
+
+void writeValue(std::ostream& out, const char* name, uint64_t value, const char* labels = nullptr) {
+    out << name;
+    if (labels) {
+        out << '{' << labels << '}';
+    }
+    out << ' ' << value << '\n';
+}
+
+void writeHistogram(std::ostream& out, const char* name, const char* help,
+                    const LatencyHistogramSnapshot& histogram) {
+    writeHeader(out, name, "histogram", help);
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (uint32_t exponent = kFirstBoundExponent; exponent <= kLastBoundExponent; exponent += kBoundExponentStep) {
+        uint64_t bound_ns = 1ull << exponent;
+        for (; bucket < histogram.counts.size() && LatencyHistogram::bucketUpperBound(bucket) < bound_ns; bucket++) {
+            cumulative += histogram.counts[bucket];
+        }
+        out << name << "_bucket{le=\"" << formatSeconds(bound_ns) << "\"} " << cumulative << '\n';
+    }
+    out << name << "_bucket{le=\"+Inf\"} " << histogram.count << '\n';
+    out << name << "_sum " << formatSeconds(histogram.sum_ns) << '\n';
+    out << name << "_count " << histogram.count << '\n';
+}
+
+} // namespace
+
+MetricsRegistry& MetricsRegistry::instance() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::~MetricsRegistry() {
+    stopExporter();
+}
+
+void MetricsRegistry::add(const RecorderCounters* counters) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    recorders_.push_back(counters);
+}
+
+void MetricsRegistry::remove(const RecorderCounters* counters) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find(recorders_.begin(), recorders_.end(), counters);
+    if (it == recorders_.end()) {
+        return;
+    }
+    recorders_.erase(it);
+    counters->addTo(retired_);
+    retired_.unflushed_frames = 0;
+}
+
+void MetricsRegistry::reset(RecorderCounters& counters) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    counters.addTo(retired_);
+    retired_.unflushed_frames = 0;
+    counters.reset();
+}
+
+MetricsSnapshot MetricsRegistry::snapshot() {
+    MetricsSnapshot snapshot;
+    snapshot.time = std::chrono::system_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    snapshot.totals = retired_;
+    snapshot.recorders = recorders_.size();
+    for (const RecorderCounters* counters : recorders_) {
+        counters->addTo(snapshot.totals);
+        if (counters->recording.load(std::memory_order_relaxed)) {
+            snapshot.recording++;
+        }
+    }
+    return snapshot;
+}
+
+bool MetricsRegistry::startExporter(const MetricsExporterConfig& config) {
+    stopExporter();
+    if (config.textfile_path.empty() && !config.callback) {
+        MCSR_LOG(ERROR) << "Metrics exporter needs a textfile path or a callback";
+        return false;
+    }
+    exporter_config_ = config;
+    exporter_config_.interval_ms = std::max<uint32_t>(config.interval_ms, 1);
+    exporter_stop_ = false;
+    try {
+        exporter_thread_ = std::thread(&MetricsRegistry::exportLoop, this);
+    } catch (...) {
+        MCSR_LOG(ERROR) << "Failed to start metrics exporter thread";
+        return false;
+    }
+    return true;
+}
+
+void MetricsRegistry::stopExporter() {
+    if (!exporter_thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(exporter_mutex_);
+        exporter_stop_ = true;
+    }
+    exporter_wake_.notify_one();
+    exporter_thread_.join();
+}
+
+void MetricsRegistry::exportLoop() {
+    bool stopping = false;
+    while (!stopping) {
+        {
+            std::unique_lock<std::mutex> lock(exporter_mutex_);
+            exporter_wake_.wait_for(lock, std::chrono::milliseconds(exporter_config_.interval_ms),
+                                    [this] { return exporter_stop_; });
+            stopping = exporter_stop_;
+        }
+        exportSnapshot();
+    }
+}
+
+void MetricsRegistry::exportSnapshot() {
+    MetricsSnapshot current = snapshot();
+    if (!exporter_config_.textfile_path.empty()) {
+        writePrometheusFile(exporter_config_.textfile_path, current);
+    }
+    if (exporter_config_.callback) {
+        exporter_config_.callback(current);
+    }
+}
+
+void MetricsRegistry::writePrometheus(std::ostream& out, const MetricsSnapshot& snapshot) {
+    const RecorderStats& totals = snapshot.totals;
+
+    writeHeader(out, "mcsr_recorders", "gauge", "Mp4Recorder instances");
+    writeValue(out, "mcsr_recorders", snapshot.recorders);
+    writeHeader(out, "mcsr_recording", "gauge", "Recorders between start() and stop()");
+    writeValue(out, "mcsr_recording", snapshot.recording);
+    writeHeader(out, "mcsr_unflushed_frames", "gauge", "Frames written but not yet flushed to the kernel");
+    writeValue(out, "mcsr_unflushed_frames", totals.unflushed_frames);
+
+    writeHeader(out, "mcsr_bytes_written_total", "counter", "Bytes written per file");
+    writeValue(out, "mcsr_bytes_written_total", totals.mp4_bytes_written, "file=\"mp4\"");
+    writeValue(out, "mcsr_bytes_written_total", totals.idx_bytes_written, "file=\"idx\"");
+    writeHeader(out, "mcsr_frames_total", "counter", "Frames written per track");
+    writeValue(out, "mcsr_frames_total", totals.video_frames, "track=\"video\"");
+    writeValue(out, "mcsr_frames_total", totals.audio_frames, "track=\"audio\"");
+    writeHeader(out, "mcsr_durable_frames_total", "counter", "Frames known to be synced to disk");
+    writeValue(out, "mcsr_durable_frames_total", totals.durable_frames);
+    writeHeader(out, "mcsr_dropped_frames_total", "counter", "Frames shed by the overflow policy per track");
+    writeValue(out, "mcsr_dropped_frames_total", totals.dropped_video_frames, "track=\"video\"");
+    writeValue(out, "mcsr_dropped_frames_total", totals.dropped_audio_frames, "track=\"audio\"");
+    writeHeader(out, "mcsr_overflow_waits_total", "counter", "Frame writes that waited for buffer room");
+    writeValue(out, "mcsr_overflow_waits_total", totals.overflow_waits);
+    writeHeader(out, "mcsr_index_records_total", "counter", "Non-frame index records");
+    writeValue(out, "mcsr_index_records_total", totals.index_records);
+    writeHeader(out, "mcsr_flushes_total", "counter", "Flushes of mp4 and idx to the kernel");
+    writeValue(out, "mcsr_flushes_total", totals.flush_count);
+    writeHeader(out, "mcsr_fsyncs_total", "counter", "Syncs of mp4 and idx to disk");
+    writeValue(out, "mcsr_fsyncs_total", totals.fsync_count);
+
+    writeHeader(out, "mcsr_moov_build_seconds_total", "counter", "Time spent building and writing moov");
+    out << "mcsr_moov_build_seconds_total " << formatSeconds(totals.moov_build_us * 1000) << '\n';
+    writeHeader(out, "mcsr_finalize_seconds_total", "counter", "Time spent in stop()");
+    out << "mcsr_finalize_seconds_total " << formatSeconds(totals.finalize_us * 1000) << '\n';
+
+    writeHistogram(out, "mcsr_write_latency_seconds", "Duration of frame write calls", totals.write_latency);
+    writeHistogram(out, "mcsr_flush_latency_seconds", "Duration of flushes", totals.flush_latency);
+    writeHistogram(out, "mcsr_fsync_latency_seconds", "Duration of syncs", totals.fsync_latency);
+}
+
+bool MetricsRegistry::writePrometheusFile(const std::string& path, const MetricsSnapshot& snapshot) {
+    // The textfile collector only reads *.prom files, so it never sees the partial file
+    std::string temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            MCSR_LOG(ERROR) << "Failed to open metrics file: " << temp_path;
+            return false;
+        }
+        writePrometheus(out, snapshot);
+        out.flush();
+        if (!out) {
+            MCSR_LOG(ERROR) << "Failed to write metrics file: " << temp_path;
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        MCSR_LOG(ERROR) << "Failed to replace metrics file: " << path;
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace mp4_recorder
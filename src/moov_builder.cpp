@@ -7,11 +7,120 @@
 #include "moov_builder.h"
 #include "mp4_recorder.h"
 #include "common.h"
+#include "trace.h"
 #include <cstring>
 #include <algorithm>
 
 namespace mp4_recorder {
 
+namespace {
+
+// Copy a parameter set NAL unit, stripping an Annex-B start code if present
+void stripStartCode(const uint8_t* nal, uint32_t size, std::vector<uint8_t>& out) {
+    if (size >= 4 && nal[0] == 0x00 && nal[1] == 0x00 && nal[2] == 0x00 && nal[3] == 0x01) {
+        nal += 4;
+        size -= 4;
+    } else if (size >= 3 && nal[0] == 0x00 && nal[1] == 0x00 && nal[2] == 0x01) {
+        nal += 3;
+        size -= 3;
+    }
+    out.assign(nal, nal + size);
+}
+
+// Convert NAL payload to RBSP by dropping emulation prevention bytes (00 00 03)
+void removeEmulationPrevention(const uint8_t* data, size_t size, std::vector<uint8_t>& rbsp) {
+    rbsp.clear();
+    rbsp.reserve(size);
+    size_t zeros = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (zeros >= 2 && data[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = (data[i] == 0x00) ? zeros + 1 : 0;
+        rbsp.push_back(data[i]);
+    }
+}
+
+} // namespace
+
+BoxSink::BoxSink(std::vector<uint8_t>& out)
+    : out_(&out) {
+}
+
+BoxSink::BoxSink(IFile& file, size_t buffer_size)
+    : file_(&file), buffer_size_(buffer_size > 0 ? buffer_size : 1) {
+    buffer_.reserve(buffer_size_);
+}
+
+BoxSink::~BoxSink() {
+    finish();
+}
+
+void BoxSink::write(const uint8_t* data, size_t size) {
+    bytes_written_ += size;
+    if (out_) {
+        out_->insert(out_->end(), data, data + size);
+        return;
+    }
+    if (!ok_) {
+        return;
+    }
+    if (buffer_.size() + size > buffer_size_) {
+        drain();
+        if (size >= buffer_size_) {
+            // Large payloads (e.g. packed stsz entries) bypass the buffer
+            if (file_->write(data, size) != size) {
+                ok_ = false;
+            }
+            return;
+        }
+    }
+    buffer_.insert(buffer_.end(), data, data + size);
+}
+
+void BoxSink::writeUint32BE(uint32_t value) {
+    uint8_t bytes[4] = {
+        static_cast<uint8_t>((value >> 24) & 0xFF),
+        static_cast<uint8_t>((value >> 16) & 0xFF),
+        static_cast<uint8_t>((value >> 8) & 0xFF),
+        static_cast<uint8_t>(value & 0xFF)
+    };
+    write(bytes, sizeof(bytes));
+}
+
+void BoxSink::writeUint16BE(uint16_t value) {
+    uint8_t bytes[2] = {
+        static_cast<uint8_t>((value >> 8) & 0xFF),
+        static_cast<uint8_t>(value & 0xFF)
+    };
+    write(bytes, sizeof(bytes));
+}
+
+void BoxSink::writeUint8(uint8_t value) {
+    write(&value, 1);
+}
+
+void BoxSink::writeAtomHeader(const char* type, uint32_t size) {
+    writeUint32BE(size);
+    write(reinterpret_cast<const uint8_t*>(type), 4);
+}
+
+bool BoxSink::finish() {
+    drain();
+    return ok_;
+}
+
+void BoxSink::drain() {
+    if (!file_ || buffer_.empty()) {
+        return;
+    }
+    if (ok_ && file_->write(buffer_.data(), buffer_.size()) != buffer_.size()) {
+        ok_ = false;
+    }
+    buffer_.clear();
+}
+
 MoovBuilder::MoovBuilder() {
 }
 
@@ -33,18 +142,83 @@ bool MoovBuilder::buildMoov(
     uint32_t h264_pps_size,
     uint64_t mdat_start,
     std::vector<uint8_t>& moov_data) {
+
+    MoovConfig config;
+    config.video_codec = VideoCodec::H264;
+    config.audio_codec = AudioCodec::AAC;
+    config.video_timescale = video_timescale;
+    config.audio_timescale = audio_timescale;
+    config.audio_sample_rate = audio_sample_rate;
+    config.audio_channels = audio_channels;
+    config.video_width = video_width;
+    config.video_height = video_height;
+    config.sps = h264_sps;
+    config.sps_size = h264_sps_size;
+    config.pps = h264_pps;
+    config.pps_size = h264_pps_size;
+    config.mdat_start = mdat_start;
+    return buildMoov(video_frames, audio_frames, config, moov_data);
+}
+
+bool MoovBuilder::buildMoov(
+    const std::vector<FrameInfo>& video_frames,
+    const std::vector<FrameInfo>& audio_frames,
+    const MoovConfig& config,
+    std::vector<uint8_t>& moov_data) {
+
+    SampleTable video_table;
+    for (const auto& frame : video_frames) {
+        video_table.append(frame);
+    }
+    SampleTable audio_table;
+    for (const auto& frame : audio_frames) {
+        audio_table.append(frame);
+    }
+    return buildMoov(video_table, audio_table, config, moov_data);
+}
+
+bool MoovBuilder::buildMoov(
+    const SampleTable& video_table,
+    const SampleTable& audio_table,
+    const MoovConfig& config,
+    std::vector<uint8_t>& moov_data) {
+    
+    moov_data.clear();
+    BoxSink sink(moov_data);
+    if (!writeMoov(video_table, audio_table, config, sink)) {
+        return false;
+    }
+    MCSR_LOG(INFO) << "moov_data final size: " << moov_data.size();
+    return true;
+}
+
+bool MoovBuilder::writeMoov(
+    const SampleTable& video_table,
+    const SampleTable& audio_table,
+    const MoovConfig& config,
+    IFile& file,
+    size_t buffer_size) {
+    
+    BoxSink sink(file, buffer_size);
+    return writeMoov(video_table, audio_table, config, sink);
+}
+
+bool MoovBuilder::writeMoov(
+    const SampleTable& video_table,
+    const SampleTable& audio_table,
+    const MoovConfig& config,
+    BoxSink& sink) {
+    MCSR_TRACE_SCOPE("moov", "writeMoov");
     
-     moov_data.clear();
-     
       // Calculate total duration
       uint32_t video_duration = 0;
-      if (!video_frames.empty()) {
+      if (!video_table.empty()) {
           // Duration is already in video_timescale units
           // For mvhd, we need to convert to mvhd timescale (1000)
           // mvhd_duration = video_duration * (mvhd_timescale / video_timescale)
           // mvhd_duration = video_duration * (1000 / video_timescale)
-          video_duration = (video_frames.back().pts * 1000) / video_timescale;
-          MCSR_LOG(INFO) << "Video duration calculation: pts=" << video_frames.back().pts << ", timescale=" << video_timescale << ", mvhd_duration=" << video_duration;
+          video_duration = (video_table.maxPts() * 1000) / config.video_timescale;
+          MCSR_LOG(INFO) << "Video duration calculation: pts=" << video_table.maxPts() << ", timescale=" << config.video_timescale << ", mvhd_duration=" << video_duration;
       }
     
     // Build mvhd
@@ -55,45 +229,80 @@ bool MoovBuilder::buildMoov(
     }
     MCSR_LOG(INFO) << "mvhd built, size: " << mvhd_data.size();
     
-    // Build video track
-    std::vector<uint8_t> video_trak;
-    if (!video_frames.empty()) {
-        if (!buildTrak(video_frames, 1, video_timescale, "avc1", video_width, video_height,
-                      0, 0,
-                      h264_sps, h264_sps_size, h264_pps, h264_pps_size, mdat_start, video_trak)) {
+    // Lay out video track (codec is resolved once here, not per sample)
+    TrakLayout video_layout;
+    if (!video_table.empty()) {
+        bool prepared = false;
+        switch (config.video_codec) {
+            case VideoCodec::H265:
+                prepared = prepareTrak<HevcCodec>(video_table, 1, config, video_layout);
+                break;
+            case VideoCodec::H264:
+            default:
+                prepared = prepareTrak<AvcCodec>(video_table, 1, config, video_layout);
+                break;
+        }
+        if (!prepared) {
             MCSR_LOG(ERROR) << "Failed to build video trak";
             return false;
         }
-        MCSR_LOG(INFO) << "video trak built, size: " << video_trak.size();
+        MCSR_LOG(INFO) << "video trak laid out, size: " << video_layout.trak_size;
     }
     
-    // Build audio track
-    std::vector<uint8_t> audio_trak;
-    if (!audio_frames.empty()) {
-        if (!buildTrak(audio_frames, 2, audio_timescale, "mp4a", 0, 0,
-                      audio_sample_rate, audio_channels,
-                      nullptr, 0, nullptr, 0, mdat_start, audio_trak)) {
+    // Lay out audio track
+    TrakLayout audio_layout;
+    if (!audio_table.empty()) {
+        bool prepared = false;
+        switch (config.audio_codec) {
+            case AudioCodec::OPUS:
+                prepared = prepareTrak<OpusCodec>(audio_table, 2, config, audio_layout);
+                break;
+            case AudioCodec::AAC:
+            default:
+                prepared = prepareTrak<AacCodec>(audio_table, 2, config, audio_layout);
+                break;
+        }
+        if (!prepared) {
             MCSR_LOG(ERROR) << "Failed to build audio trak";
             return false;
         }
-        MCSR_LOG(INFO) << "audio trak built, size: " << audio_trak.size();
+        MCSR_LOG(INFO) << "audio trak laid out, size: " << audio_layout.trak_size;
     }
     
-    // Combine into moov
-    uint32_t moov_size = 8 + mvhd_data.size() + video_trak.size() + audio_trak.size();
+    // All sizes are known up front, so boxes are serialized in a single pass
+    uint64_t moov_size_64 = 8 + static_cast<uint64_t>(mvhd_data.size()) +
+                            video_layout.trak_size + audio_layout.trak_size;
+    if (moov_size_64 > 0xFFFFFFFFULL) {
+        MCSR_LOG(ERROR) << "moov size exceeds 32-bit limit: " << moov_size_64;
+        return false;
+    }
+    uint32_t moov_size = static_cast<uint32_t>(moov_size_64);
     MCSR_LOG(INFO) << "moov_size calculated: " << moov_size;
-    moov_data.reserve(moov_size);
-    writeAtomHeader(moov_data, "moov", moov_size);
-    moov_data.insert(moov_data.end(), mvhd_data.begin(), mvhd_data.end());
-    moov_data.insert(moov_data.end(), video_trak.begin(), video_trak.end());
-    moov_data.insert(moov_data.end(), audio_trak.begin(), audio_trak.end());
     
-    MCSR_LOG(INFO) << "moov_data final size: " << moov_data.size();
+    uint64_t start_bytes = sink.bytesWritten();
+    sink.writeAtomHeader("moov", moov_size);
+    sink.write(mvhd_data.data(), mvhd_data.size());
+    if (!video_table.empty()) {
+        writeTrak(video_table, video_layout, config.mdat_start, sink);
+    }
+    if (!audio_table.empty()) {
+        writeTrak(audio_table, audio_layout, config.mdat_start, sink);
+    }
+    
+    if (!sink.finish()) {
+        MCSR_LOG(ERROR) << "Failed to write moov data";
+        return false;
+    }
+    if (sink.bytesWritten() - start_bytes != moov_size) {
+        MCSR_LOG(ERROR) << "moov size mismatch: expected " << moov_size << ", wrote " << (sink.bytesWritten() - start_bytes);
+        return false;
+    }
     return true;
 }
 
 bool MoovBuilder::writeMoovToFile(const std::string& filename, const std::vector<uint8_t>& moov_data,
                                   IFileOps* file_ops) {
+    MCSR_TRACE_SCOPE("moov", "writeMoovToFile");
     MCSR_LOG(INFO) << "Opening file for writing moov: " << filename;
     MCSR_LOG(INFO) << "moov_data first 20 bytes (hex):";
     std::string hex_str;
@@ -197,26 +406,16 @@ bool MoovBuilder::buildMvhd(uint32_t duration, std::vector<uint8_t>& data) {
     return true;
 }
 
-bool MoovBuilder::buildTrak(
-    const std::vector<FrameInfo>& frames,
-    uint32_t track_id,
-    uint32_t timescale,
-    const std::string& codec,
-    uint32_t video_width,
-    uint32_t video_height,
-    uint32_t audio_sample_rate,
-    uint16_t audio_channels,
-    const uint8_t* h264_sps,
-    uint32_t h264_sps_size,
-    const uint8_t* h264_pps,
-    uint32_t h264_pps_size,
-    uint64_t mdat_start,
-    std::vector<uint8_t>& data) {
-    
-    data.clear();
+template <typename Codec>
+bool MoovBuilder::prepareTrak(const SampleTable& table, uint32_t track_id,
+                              const MoovConfig& config, TrakLayout& layout) {
+    MCSR_TRACE_SCOPE("moov", "prepareTrak");
+    const uint32_t timescale = Codec::kIsVideo ? config.video_timescale : config.audio_timescale;
+    const uint32_t video_width = config.video_width;
+    const uint32_t video_height = config.video_height;
     
       // Build tkhd (version 0)
-      std::vector<uint8_t> tkhd_data;
+      std::vector<uint8_t>& tkhd_data = layout.tkhd;
       // tkhd size: 8 (header) + 4 (version/flags) + 4 (creation) + 4 (modification) + 4 (track_id) +
       //            4 (reserved) + 4 (duration) + 8 (reserved) + 2 (layer) + 2 (alternate group) +
       //            2 (volume) + 2 (reserved) + 36 (matrix) + 4 (width) + 4 (height) = 92
@@ -228,7 +427,7 @@ bool MoovBuilder::buildTrak(
      writeUint32BE(tkhd_data, track_id);  // track ID
       writeUint32BE(tkhd_data, 0);  // reserved
       // Duration in tkhd should be in mvhd timescale (1000), not video timescale
-      uint32_t tkhd_duration = (frames.back().pts * 1000) / timescale;
+      uint32_t tkhd_duration = (table.maxPts() * 1000) / timescale;
       writeUint32BE(tkhd_data, tkhd_duration);  // duration
       // Reserved (8 bytes)
       writeUint32BE(tkhd_data, 0);
@@ -239,8 +438,7 @@ bool MoovBuilder::buildTrak(
       writeUint16BE(tkhd_data, 0);
       
       // Volume (audio tracks use 1.0, video uses 0)
-      uint16_t volume = (codec == "avc1") ? 0 : 0x0100;
-      writeUint16BE(tkhd_data, volume);
+      writeUint16BE(tkhd_data, Codec::kVolume);
       
       // Reserved
       writeUint16BE(tkhd_data, 0);
@@ -255,7 +453,7 @@ bool MoovBuilder::buildTrak(
       }
       
       // Width and height in fixed-point 16.16 format
-      if (codec == "avc1" && video_width > 0 && video_height > 0) {
+      if (Codec::kIsVideo && video_width > 0 && video_height > 0) {
           writeUint32BE(tkhd_data, video_width << 16);   // width in fixed-point
           writeUint32BE(tkhd_data, video_height << 16);  // height in fixed-point
       } else {
@@ -263,26 +461,21 @@ bool MoovBuilder::buildTrak(
           writeUint32BE(tkhd_data, 0x00010000);  // height (default 1.0)
       }
     
-    // Build mdia
-    std::vector<uint8_t> mdia_data;
-    
     // Build mdhd
-    std::vector<uint8_t> mdhd_data;
+    std::vector<uint8_t>& mdhd_data = layout.mdhd;
     uint32_t mdhd_size = 32;
     writeAtomHeader(mdhd_data, "mdhd", mdhd_size);
     writeUint32BE(mdhd_data, 0);  // version 0 + flags 0
     writeUint32BE(mdhd_data, 0);  // creation time
     writeUint32BE(mdhd_data, 0);  // modification time
     writeUint32BE(mdhd_data, timescale);  // timescale
-    writeUint32BE(mdhd_data, frames.back().pts);  // duration
+    writeUint32BE(mdhd_data, table.maxPts());  // duration
     writeUint16BE(mdhd_data, 0x55C4);  // language
     writeUint16BE(mdhd_data, 0);  // quality
     
-    mdia_data.insert(mdia_data.end(), mdhd_data.begin(), mdhd_data.end());
-    
     // Build hdlr
-    std::vector<uint8_t> hdlr_data;
-    std::string handler_type = (codec == "avc1") ? "vide" : "soun";
+    std::vector<uint8_t>& hdlr_data = layout.hdlr;
+    const char* handler_type = Codec::kHandlerType;
     // hdlr size: 8 (header) + 4 (version/flags) + 4 (pre_defined) + 4 (handler_type) + 48 (reserved) = 68
     uint32_t hdlr_size = 68;
     writeAtomHeader(hdlr_data, "hdlr", hdlr_size);
@@ -291,14 +484,9 @@ bool MoovBuilder::buildTrak(
     for (int i = 0; i < 4; i++) writeUint8(hdlr_data, handler_type[i]);
     for (int i = 0; i < 12; i++) writeUint32BE(hdlr_data, 0);  // reserved (48 bytes)
     
-    mdia_data.insert(mdia_data.end(), hdlr_data.begin(), hdlr_data.end());
-    
-    // Build minf (Media Information Box)
-    std::vector<uint8_t> minf_data;
-    
     // Build vmhd (Video Media Header) or smhd (Sound Media Header)
-    std::vector<uint8_t> media_header;
-    if (codec == "avc1") {
+    std::vector<uint8_t>& media_header = layout.media_header;
+    if (Codec::kIsVideo) {
         // Video media header
         // vmhd size: 8 (header) + 4 (version/flags) + 2 (graphics mode) + 6 (opcolor) = 20
         uint32_t vmhd_size = 20;
@@ -314,10 +502,8 @@ bool MoovBuilder::buildTrak(
          writeUint16BE(media_header, 0);  // balance
          writeUint16BE(media_header, 0);  // reserved
      }
-    minf_data.insert(minf_data.end(), media_header.begin(), media_header.end());
     
     // Build dinf (Data Information Box)
-    std::vector<uint8_t> dinf_data;
     std::vector<uint8_t> dref_data;
     writeUint32BE(dref_data, 0);  // version 0 + flags 0
     writeUint32BE(dref_data, 1);  // entry count
@@ -335,125 +521,84 @@ bool MoovBuilder::buildTrak(
     dref_box.insert(dref_box.end(), dref_data.begin(), dref_data.end());
     
     uint32_t dinf_size = 8 + dref_box.size();
-    std::vector<uint8_t> dinf_box;
+    std::vector<uint8_t>& dinf_box = layout.dinf;
     writeAtomHeader(dinf_box, "dinf", dinf_size);
     dinf_box.insert(dinf_box.end(), dref_box.begin(), dref_box.end());
-    minf_data.insert(minf_data.end(), dinf_box.begin(), dinf_box.end());
-    
-    // Build stbl (Sample Table Box)
-    std::vector<uint8_t> stbl_data;
     
     // Build stsd (Sample Description)
-    std::vector<uint8_t> stsd_data;
-    if (!buildStsd(codec, video_width, video_height,
-                   audio_sample_rate, audio_channels,
-                   h264_sps, h264_sps_size, h264_pps, h264_pps_size, stsd_data)) {
+    if (!buildStsd<Codec>(config, layout.stsd)) {
         return false;
     }
-    MCSR_LOG(INFO) << "stsd_data size: " << stsd_data.size();
-    stbl_data.insert(stbl_data.end(), stsd_data.begin(), stsd_data.end());
-    MCSR_LOG(INFO) << "After adding stsd, stbl_data.size() = " << stbl_data.size();
-    
-    // Build stts
-    std::vector<uint8_t> stts_data;
-    // Default duration used for the final sample when there is no next PTS.
-    uint32_t stts_default_duration = 1;
-    if (codec == "mp4a") {
-        // AAC-LC uses 1024 samples per frame at the audio timescale.
-        stts_default_duration = 1024;
-    } else if (timescale >= 30) {
-        // Approximate 30fps for video to avoid zero or invalid duration.
-        stts_default_duration = timescale / 30;
-    }
-    if (!buildStts(frames, stts_data, stts_default_duration)) {
+    MCSR_LOG(INFO) << "stsd_data size: " << layout.stsd.size();
+    
+    // Sample table boxes are streamed later; only their sizes are computed here.
+    // Default duration used for the final sample when there is no next DTS.
+    layout.stts_default_duration = Codec::defaultSampleDuration(timescale);
+    layout.stts_size = sttsSize(table);
+    // ctts only when presentation order differs from decode order
+    layout.ctts_size = table.hasCompositionOffsets() ?
+        8 + 8 + static_cast<uint32_t>(table.compositionOffsets().size()) * 8 : 0;
+    // stss only for video with keyframes
+    layout.stss_size = Codec::kHasSyncSampleTable ?
+        8 + 8 + static_cast<uint32_t>(table.syncSamples().size()) * 4 : 0;
+    layout.stsz_size = table.sizes().boxSize();
+    
+    table.buildChunks(config.max_chunk_bytes, layout.chunk_offsets, layout.sample_to_chunk);
+    if (layout.chunk_offsets.empty()) {
+        MCSR_LOG(ERROR) << "Track has no chunk offsets";
         return false;
     }
-    MCSR_LOG(INFO) << "stts_data size: " << stts_data.size();
-    stbl_data.insert(stbl_data.end(), stts_data.begin(), stts_data.end());
-    MCSR_LOG(INFO) << "After adding stts, stbl_data.size() = " << stbl_data.size();
-    
-    // Build stss (only for video with keyframes)
-    if (codec == "avc1") {
-        std::vector<uint8_t> stss_data;
-        if (!buildStss(frames, stss_data)) {
-            return false;
-        }
-        MCSR_LOG(INFO) << "stss_data size: " << stss_data.size();
-        stbl_data.insert(stbl_data.end(), stss_data.begin(), stss_data.end());
-        MCSR_LOG(INFO) << "After adding stss, stbl_data.size() = " << stbl_data.size();
-    }
-    
-    // Build stsz
-    std::vector<uint8_t> stsz_data;
-    if (!buildStsz(frames, stsz_data)) {
+    layout.stsc_size = 8 + 8 + static_cast<uint32_t>(layout.sample_to_chunk.size()) * 12;
+    // Chunk offsets increase within a track, so the last one is the largest.
+    // Files past 4GB need 64-bit offsets (co64) for the samples beyond.
+    layout.co64 = config.mdat_start + layout.chunk_offsets.back() > 0xFFFFFFFFULL;
+    layout.stco_size = 8 + 8 + static_cast<uint32_t>(layout.chunk_offsets.size()) * (layout.co64 ? 8 : 4);
+    MCSR_LOG(INFO) << "Sample table sizes: stts=" << layout.stts_size << ", ctts=" << layout.ctts_size << ", stss=" << layout.stss_size << ", " << table.sizes().boxType() << "=" << layout.stsz_size << ", " << (layout.co64 ? "co64=" : "stco=") << layout.stco_size;
+    
+    uint64_t stbl_size = 8 + static_cast<uint64_t>(layout.stsd.size()) + layout.stts_size +
+                         layout.ctts_size + layout.stss_size + layout.stsz_size +
+                         layout.stco_size + layout.stsc_size;
+    uint64_t minf_size = 8 + static_cast<uint64_t>(layout.media_header.size()) +
+                         layout.dinf.size() + stbl_size;
+    uint64_t mdia_size = 8 + static_cast<uint64_t>(layout.mdhd.size()) + layout.hdlr.size() +
+                         minf_size;
+    uint64_t trak_size = 8 + static_cast<uint64_t>(layout.tkhd.size()) + mdia_size;
+    if (trak_size > 0xFFFFFFFFULL) {
+        MCSR_LOG(ERROR) << "trak size exceeds 32-bit limit: " << trak_size;
         return false;
     }
-    MCSR_LOG(INFO) << "stsz_data size: " << stsz_data.size();
-    stbl_data.insert(stbl_data.end(), stsz_data.begin(), stsz_data.end());
-    MCSR_LOG(INFO) << "After adding stsz, stbl_data.size() = " << stbl_data.size();
+    layout.stbl_size = static_cast<uint32_t>(stbl_size);
+    layout.minf_size = static_cast<uint32_t>(minf_size);
+    layout.mdia_size = static_cast<uint32_t>(mdia_size);
+    layout.trak_size = static_cast<uint32_t>(trak_size);
+    MCSR_LOG(INFO) << "trak layout: stbl=" << layout.stbl_size << ", minf=" << layout.minf_size << ", mdia=" << layout.mdia_size << ", trak=" << layout.trak_size;
     
-    // Build stco
-    std::vector<uint8_t> stco_data;
-    if (!buildStco(frames, mdat_start, stco_data)) {
-        return false;
+    return true;
+}
+
+void MoovBuilder::writeTrak(const SampleTable& table, const TrakLayout& layout,
+                            uint64_t mdat_start, BoxSink& sink) {
+    MCSR_TRACE_SCOPE("moov", "writeTrak");
+    sink.writeAtomHeader("trak", layout.trak_size);
+    sink.write(layout.tkhd.data(), layout.tkhd.size());
+    sink.writeAtomHeader("mdia", layout.mdia_size);
+    sink.write(layout.mdhd.data(), layout.mdhd.size());
+    sink.write(layout.hdlr.data(), layout.hdlr.size());
+    sink.writeAtomHeader("minf", layout.minf_size);
+    sink.write(layout.media_header.data(), layout.media_header.size());
+    sink.write(layout.dinf.data(), layout.dinf.size());
+    sink.writeAtomHeader("stbl", layout.stbl_size);
+    sink.write(layout.stsd.data(), layout.stsd.size());
+    writeStts(table, layout.stts_default_duration, sink);
+    if (layout.ctts_size > 0) {
+        writeCtts(table, sink);
     }
-    MCSR_LOG(INFO) << "stco_data size: " << stco_data.size();
-    stbl_data.insert(stbl_data.end(), stco_data.begin(), stco_data.end());
-    MCSR_LOG(INFO) << "After adding stco, stbl_data.size() = " << stbl_data.size();
-    
-    // Build stsc
-    std::vector<uint8_t> stsc_data;
-    if (!buildStsc(frames, stsc_data)) {
-        return false;
+    if (layout.stss_size > 0) {
+        writeStss(table, sink);
     }
-    MCSR_LOG(INFO) << "stsc_data size: " << stsc_data.size();
-    stbl_data.insert(stbl_data.end(), stsc_data.begin(), stsc_data.end());
-    MCSR_LOG(INFO) << "After adding stsc, stbl_data.size() = " << stbl_data.size();
-    
-    // Combine stbl
-    uint32_t stbl_size = 8 + stbl_data.size();
-    MCSR_LOG(INFO) << "stbl size calculation: 8 + " << stbl_data.size() << " = " << stbl_size;
-    std::vector<uint8_t> stbl_box;
-    writeAtomHeader(stbl_box, "stbl", stbl_size);
-    MCSR_LOG(INFO) << "After writeAtomHeader, stbl_box.size() = " << stbl_box.size();
-    stbl_box.insert(stbl_box.end(), stbl_data.begin(), stbl_data.end());
-    MCSR_LOG(INFO) << "After insert, stbl_box.size() = " << stbl_box.size();
-    minf_data.insert(minf_data.end(), stbl_box.begin(), stbl_box.end());
-    MCSR_LOG(INFO) << "After adding stbl_box to minf_data, minf_data.size() = " << minf_data.size();
-    
-    // Combine minf
-    uint32_t minf_size = 8 + minf_data.size();
-    MCSR_LOG(INFO) << "minf size calculation: 8 + " << minf_data.size() << " = " << minf_size;
-    std::vector<uint8_t> minf_box;
-    writeAtomHeader(minf_box, "minf", minf_size);
-    minf_box.insert(minf_box.end(), minf_data.begin(), minf_data.end());
-    
-    // Combine mdia
-    uint32_t mdia_size = 8 + mdhd_data.size() + hdlr_data.size() + minf_box.size();
-    MCSR_LOG(INFO) << "mdia size calculation: 8 + " << mdhd_data.size() << " + " << hdlr_data.size() << " + " << minf_box.size() << " = " << mdia_size;
-    std::vector<uint8_t> mdia_box;
-    MCSR_LOG(INFO) << "Before writeAtomHeader, mdia_box.size() = " << mdia_box.size();
-    writeAtomHeader(mdia_box, "mdia", mdia_size);
-    MCSR_LOG(INFO) << "After writeAtomHeader, mdia_box.size() = " << mdia_box.size() << ", mdia_size = " << mdia_size;
-    mdia_box.insert(mdia_box.end(), mdhd_data.begin(), mdhd_data.end());
-    MCSR_LOG(INFO) << "After adding mdhd, mdia_box.size() = " << mdia_box.size();
-    mdia_box.insert(mdia_box.end(), hdlr_data.begin(), hdlr_data.end());
-    MCSR_LOG(INFO) << "After adding hdlr, mdia_box.size() = " << mdia_box.size();
-    mdia_box.insert(mdia_box.end(), minf_box.begin(), minf_box.end());
-    MCSR_LOG(INFO) << "After adding minf_box, mdia_box.size() = " << mdia_box.size();
-    
-    // Combine into trak
-    uint32_t trak_size = 8 + tkhd_data.size() + mdia_box.size();
-    MCSR_LOG(INFO) << "trak size calculation: 8 + " << tkhd_data.size() << " + " << mdia_box.size() << " = " << trak_size;
-    MCSR_LOG(INFO) << "Before writeAtomHeader, data.size() = " << data.size();
-    writeAtomHeader(data, "trak", trak_size);
-    MCSR_LOG(INFO) << "After writeAtomHeader, data.size() = " << data.size();
-    data.insert(data.end(), tkhd_data.begin(), tkhd_data.end());
-    MCSR_LOG(INFO) << "After adding tkhd, data.size() = " << data.size();
-    data.insert(data.end(), mdia_box.begin(), mdia_box.end());
-    MCSR_LOG(INFO) << "After adding mdia_box, data.size() = " << data.size();
-    
-    return true;
+    writeStsz(table, sink);
+    writeStco(layout, mdat_start, sink);
+    writeStsc(layout, sink);
 }
 
 void MoovBuilder::writeAtomHeader(std::vector<uint8_t>& data, const char* type, uint32_t size) {
@@ -525,456 +670,501 @@ uint8_t MoovBuilder::getSampleRateIndex(uint32_t sample_rate) const {
     }
 }
 
-bool MoovBuilder::buildStts(const std::vector<FrameInfo>& frames, std::vector<uint8_t>& data,
-                            uint32_t default_duration) {
+uint32_t MoovBuilder::sttsSize(const SampleTable& table) const {
+    // The last sample either extends the final run or gets its own default entry
+    size_t entry_count = table.timeDeltas().size();
+    if (entry_count == 0) {
+        entry_count = 1;
+    }
+    return 8 + 8 + static_cast<uint32_t>(entry_count) * 8;
+}
+
+void MoovBuilder::writeStts(const SampleTable& table, uint32_t default_duration, BoxSink& sink) {
+    MCSR_TRACE_SCOPE("moov", "writeStts");
     // Decoding Time to Sample Box
-    data.clear();
+    // Sample groups with same duration are accumulated while recording
+    const std::vector<TimeToSampleEntry>& deltas = table.timeDeltas();
+    
+    sink.writeAtomHeader("stts", sttsSize(table));
+    sink.writeUint32BE(0);  // version 0 + flags 0
+    if (deltas.empty()) {
+        sink.writeUint32BE(1);  // entry count
+        sink.writeUint32BE(1);  // sample count
+        sink.writeUint32BE(default_duration);  // sample duration
+        return;
+    }
     
-    if (frames.empty()) {
-        return false;
+    sink.writeUint32BE(static_cast<uint32_t>(deltas.size()));  // entry count
+    for (size_t i = 0; i < deltas.size(); i++) {
+        // The last sample repeats the previous sample's duration
+        uint32_t count = deltas[i].count + (i + 1 == deltas.size() ? 1 : 0);
+        sink.writeUint32BE(count);            // sample count
+        sink.writeUint32BE(deltas[i].delta);  // sample duration
+    }
+}
+
+void MoovBuilder::writeCtts(const SampleTable& table, BoxSink& sink) {
+    MCSR_TRACE_SCOPE("moov", "writeCtts");
+    // Composition Time to Sample Box
+    // Version 1 stores signed offsets, needed when pts < dts for some sample
+    const std::vector<CompositionOffsetEntry>& entries = table.compositionOffsets();
+    uint32_t version = table.hasNegativeCompositionOffsets() ? 1 : 0;
+    
+    uint32_t ctts_size = 8 + 8 + static_cast<uint32_t>(entries.size()) * 8;
+    sink.writeAtomHeader("ctts", ctts_size);
+    sink.writeUint32BE(version << 24);  // version + flags 0
+    sink.writeUint32BE(static_cast<uint32_t>(entries.size()));  // entry count
+    
+    for (const auto& entry : entries) {
+        sink.writeUint32BE(entry.count);   // sample count
+        sink.writeUint32BE(static_cast<uint32_t>(entry.offset));  // sample offset
     }
+}
+
+void MoovBuilder::writeStss(const SampleTable& table, BoxSink& sink) {
+    MCSR_TRACE_SCOPE("moov", "writeStss");
+    // Sync Sample Box (Keyframes)
+    // Keyframe indices (1-based) are collected while recording
+    const std::vector<uint32_t>& keyframe_indices = table.syncSamples();
     
-    // Count sample groups with same duration
-    std::vector<std::pair<uint32_t, uint32_t>> stts_entries;  // (count, duration)
-    uint32_t current_duration = 0;
-    uint32_t current_count = 0;
+    uint32_t stss_size = 8 + 8 + static_cast<uint32_t>(keyframe_indices.size()) * 4;
+    sink.writeAtomHeader("stss", stss_size);
+    sink.writeUint32BE(0);  // version 0 + flags 0
+    sink.writeUint32BE(static_cast<uint32_t>(keyframe_indices.size()));  // entry count
     
-    // Calculate default duration for last frame (use previous frame's duration)
-    if (frames.size() >= 2) {
-        default_duration = frames[frames.size() - 1].pts - frames[frames.size() - 2].pts;
+    for (uint32_t idx : keyframe_indices) {
+        sink.writeUint32BE(idx);
     }
+}
+
+void MoovBuilder::writeStsz(const SampleTable& table, BoxSink& sink) {
+    MCSR_TRACE_SCOPE("moov", "writeStsz");
+    // Sample Size Box (stsz) or Compact Sample Size Box (stz2)
+    const SampleSizeTable& sizes = table.sizes();
+    sink.writeAtomHeader(sizes.boxType(), sizes.boxSize());
+    sink.writeUint32BE(0);  // version 0 + flags 0
+    if (sizes.fieldSize() == 8 || sizes.fieldSize() == 16) {
+        // stz2: 24-bit reserved + field size
+        sink.writeUint32BE(sizes.fieldSize());
+    } else {
+        // stsz: constant sample size, or 0 when sizes are listed per sample
+        sink.writeUint32BE(sizes.constantSize());
+    }
+    sink.writeUint32BE(sizes.sampleCount());  // sample count
     
-    for (size_t i = 0; i < frames.size(); i++) {
-        uint32_t duration = (i + 1 < frames.size()) ?
-            (frames[i + 1].pts - frames[i].pts) : default_duration;
-        
-        if (duration == current_duration || current_count == 0) {
-            current_duration = duration;
-            current_count++;
-        } else {
-            stts_entries.push_back({current_count, current_duration});
-            current_duration = duration;
-            current_count = 1;
+    // Entries are already encoded at the selected width
+    const std::vector<uint8_t>& entries = sizes.packedEntries();
+    sink.write(entries.data(), entries.size());
+}
+
+void MoovBuilder::writeStco(const TrakLayout& layout, uint64_t mdat_start, BoxSink& sink) {
+    MCSR_TRACE_SCOPE("moov", "writeStco");
+    // Chunk Offset Box (co64 when offsets do not fit 32 bits)
+    // Offset = mdat_start + chunk offset (relative to mdat data start)
+    MCSR_LOG(INFO) << "buildStco: mdat_start=" << mdat_start << (layout.co64 ? " (co64)" : "");
+    
+    const std::vector<uint64_t>& offsets = layout.chunk_offsets;
+    
+    sink.writeAtomHeader(layout.co64 ? "co64" : "stco", layout.stco_size);
+    sink.writeUint32BE(0);  // version 0 + flags 0
+    sink.writeUint32BE(static_cast<uint32_t>(offsets.size()));  // entry count
+    
+    // Without co64, 32-bit overflow was ruled out when the track was laid out
+    for (uint64_t offset : offsets) {
+        uint64_t chunk_offset = mdat_start + offset;
+        MCSR_LOG(VERBOSE) << "Chunk offset: " << offset << " -> " << chunk_offset;
+        if (layout.co64) {
+            sink.writeUint32BE(static_cast<uint32_t>(chunk_offset >> 32));
         }
+        sink.writeUint32BE(static_cast<uint32_t>(chunk_offset));
     }
-    if (current_count > 0) {
-        stts_entries.push_back({current_count, current_duration});
-    }
-    
-    // Build stts box
-    uint32_t stts_size = 8 + 8 + (stts_entries.size() * 8);
-    writeAtomHeader(data, "stts", stts_size);
-    writeUint32BE(data, 0);  // version 0 + flags 0
-    writeUint32BE(data, stts_entries.size());  // entry count
-    
-    for (const auto& entry : stts_entries) {
-        writeUint32BE(data, entry.first);   // sample count
-        writeUint32BE(data, entry.second);  // sample duration
+}
+
+void MoovBuilder::writeStsc(const TrakLayout& layout, BoxSink& sink) {
+    // Sample to Chunk Box: one entry wherever the number of samples per chunk changes
+    sink.writeAtomHeader("stsc", layout.stsc_size);
+    sink.writeUint32BE(0);  // version 0 + flags 0
+    sink.writeUint32BE(static_cast<uint32_t>(layout.sample_to_chunk.size()));  // entry count
+    
+    for (const SampleToChunkEntry& entry : layout.sample_to_chunk) {
+        sink.writeUint32BE(entry.first_chunk);
+        sink.writeUint32BE(entry.samples_per_chunk);
+        sink.writeUint32BE(1);  // sample description index
     }
-    
-    return true;
 }
 
-bool MoovBuilder::buildStss(const std::vector<FrameInfo>& frames, std::vector<uint8_t>& data) {
-    // Sync Sample Box (Keyframes)
+template <typename Codec>
+bool MoovBuilder::buildStsd(const MoovConfig& config, std::vector<uint8_t>& data) {
+    // Sample Description Box
     data.clear();
     
-    // Find keyframe indices
-    std::vector<uint32_t> keyframe_indices;
-    for (size_t i = 0; i < frames.size(); i++) {
-        if (frames[i].is_keyframe) {
-            keyframe_indices.push_back(i + 1);  // 1-based index
-        }
+    std::vector<uint8_t> stsd_entries;
+    if (!buildSampleEntry(Codec(), config, stsd_entries)) {
+        MCSR_LOG(ERROR) << "Failed to build " << Codec::kSampleEntryType << " sample entry";
+        return false;
     }
     
-    // Build stss box
-    uint32_t stss_size = 8 + 8 + (keyframe_indices.size() * 4);
-    writeAtomHeader(data, "stss", stss_size);
+    // Build stsd box
+    uint32_t stsd_size = 8 + 8 + stsd_entries.size();
+    writeAtomHeader(data, "stsd", stsd_size);
     writeUint32BE(data, 0);  // version 0 + flags 0
-    writeUint32BE(data, keyframe_indices.size());  // entry count
-    
-    for (uint32_t idx : keyframe_indices) {
-        writeUint32BE(data, idx);
-    }
+    writeUint32BE(data, 1);  // entry count
+    data.insert(data.end(), stsd_entries.begin(), stsd_entries.end());
     
     return true;
 }
 
-bool MoovBuilder::buildStsz(const std::vector<FrameInfo>& frames, std::vector<uint8_t>& data) {
-    // Sample Size Box
-    data.clear();
+void MoovBuilder::writeVisualSampleEntry(const char* type, uint32_t width, uint32_t height,
+                                         const std::vector<uint8_t>& config_box,
+                                         std::vector<uint8_t>& data) {
+    // VisualSampleEntry size: 4 (size) + 4 (type) + 6 (reserved) + 2 (ref index) + 2 (version) +
+    //            2 (revision) + 4 (vendor) + 4 (temporal) + 4 (spatial) + 2 (width) + 2 (height) +
+    //            4 (h-res) + 4 (v-res) + 4 (data size) + 2 (frame count) + 32 (compressor) +
+    //            2 (depth) + 2 (color table) + config box
+    uint32_t entry_size = 86 + static_cast<uint32_t>(config_box.size());
+    writeAtomHeader(data, type, entry_size);
+    
+    // Reserved
+    for (int i = 0; i < 6; i++) writeUint8(data, 0);
+    
+    // Data reference index
+    writeUint16BE(data, 1);
+    
+    // Version and revision
+    writeUint16BE(data, 0);
+    writeUint16BE(data, 0);
     
-    if (frames.empty()) {
-        return false;
-    }
+    // Vendor
+    writeUint32BE(data, 0);
     
-    // Build stsz box
-    uint32_t stsz_size = 8 + 8 + 4 + (frames.size() * 4);
-    writeAtomHeader(data, "stsz", stsz_size);
-    writeUint32BE(data, 0);  // version 0 + flags 0
-    writeUint32BE(data, 0);  // sample size (0 = variable)
-    writeUint32BE(data, frames.size());  // sample count
+    // Temporal quality
+    writeUint32BE(data, 0);
     
-    for (const auto& frame : frames) {
-        writeUint32BE(data, frame.size);
-    }
+    // Spatial quality
+    writeUint32BE(data, 0);
     
-    return true;
+    // Width and height
+    writeUint16BE(data, width);
+    writeUint16BE(data, height);
+    
+    // Horizontal resolution
+    writeUint32BE(data, 0x00480000);  // 72 dpi
+    
+    // Vertical resolution
+    writeUint32BE(data, 0x00480000);  // 72 dpi
+    
+    // Data size
+    writeUint32BE(data, 0);
+    
+    // Frame count
+    writeUint16BE(data, 1);
+    
+    // Compressor name (32 bytes)
+    for (int i = 0; i < 32; i++) writeUint8(data, 0);
+    
+    // Depth
+    writeUint16BE(data, 24);
+    
+    // Color table ID
+    writeUint16BE(data, 0xFFFF);
+    
+    data.insert(data.end(), config_box.begin(), config_box.end());
 }
 
-bool MoovBuilder::buildStco(const std::vector<FrameInfo>& frames, uint64_t mdat_start, std::vector<uint8_t>& data) {
-    // Chunk Offset Box
-    data.clear();
+void MoovBuilder::writeAudioSampleEntry(const char* type, uint16_t channels, uint32_t sample_rate,
+                                        const std::vector<uint8_t>& config_box,
+                                        std::vector<uint8_t>& data) {
+    // AudioSampleEntry size: 8 (header) + 6 (reserved) + 2 (ref index) + 2 (version) +
+    //            2 (revision) + 4 (vendor) + 2 (channels) + 2 (sample size) +
+    //            2 (compression id) + 2 (packet size) + 4 (sample rate) + config box
+    uint32_t entry_size = 36 + static_cast<uint32_t>(config_box.size());
+    writeAtomHeader(data, type, entry_size);
+    
+    // Reserved
+    for (int i = 0; i < 6; i++) writeUint8(data, 0);
+    
+    // Data reference index
+    writeUint16BE(data, 1);
+    
+    // Version and revision
+    writeUint16BE(data, 0);
+    writeUint16BE(data, 0);
     
-    if (frames.empty()) {
-        return false;
+    // Vendor
+    writeUint32BE(data, 0);
+    
+    // Channel count
+    writeUint16BE(data, channels);
+    
+    // Sample size
+    writeUint16BE(data, 16);
+    
+    // Compression ID
+    writeUint16BE(data, 0);
+    
+    // Packet size
+    writeUint16BE(data, 0);
+    
+    // Sample rate (16.16 fixed point)
+    writeUint32BE(data, sample_rate << 16);
+    
+    data.insert(data.end(), config_box.begin(), config_box.end());
+}
+
+bool MoovBuilder::buildSampleEntry(AvcCodec, const MoovConfig& config, std::vector<uint8_t>& data) {
+    // AVC1 (H.264) sample description
+    // Use provided SPS/PPS if available, otherwise use defaults
+    std::vector<uint8_t> sps_data;
+    std::vector<uint8_t> pps_data;
+    
+    if (config.sps && config.sps_size > 0) {
+        stripStartCode(config.sps, config.sps_size, sps_data);
+        MCSR_LOG(INFO) << "Using provided SPS, size=" << sps_data.size();
+    } else {
+        // Fallback SPS for 640x480 H.264 Baseline Profile
+        MCSR_LOG(WARNING) << "Using fallback SPS - this may cause playback issues";
+        sps_data.push_back(0x42);  // Profile IDC (Baseline)
+        sps_data.push_back(0x00);  // Constraint flags
+        sps_data.push_back(0x1E);  // Level IDC (3.0)
+        sps_data.push_back(0xE1);  // Encoded parameters
+        sps_data.push_back(0x00);  // Encoded parameters
+        sps_data.push_back(0x00);  // Encoded parameters
+        sps_data.push_back(0x00);  // Encoded parameters
     }
     
-    // Each frame is a separate chunk
-    // Offset = mdat_start + frame offset (relative to mdat data start)
-    MCSR_LOG(INFO) << "buildStco: mdat_start=" << mdat_start;
+    if (config.pps && config.pps_size > 0) {
+        stripStartCode(config.pps, config.pps_size, pps_data);
+        MCSR_LOG(INFO) << "Using provided PPS, size=" << pps_data.size();
+    } else {
+        // Fallback PPS
+        MCSR_LOG(WARNING) << "Using fallback PPS - this may cause playback issues";
+        pps_data.push_back(0xE1);  // Encoded parameters
+        pps_data.push_back(0x00);  // Encoded parameters
+    }
     
-    // Build stco box
-    uint32_t stco_size = 8 + 8 + (frames.size() * 4);
-    writeAtomHeader(data, "stco", stco_size);
-    writeUint32BE(data, 0);  // version 0 + flags 0
-    writeUint32BE(data, frames.size());  // entry count (one chunk per frame)
-    
-    for (const auto& frame : frames) {
-        // Calculate absolute offset: mdat_start + frame offset within mdat
-        uint64_t chunk_offset_64 = mdat_start + frame.offset;
-        
-        // Check for 32-bit overflow (MP4 standard limitation)
-        if (chunk_offset_64 > 0xFFFFFFFFULL) {
-            MCSR_LOG(ERROR) << "Chunk offset overflow: " << chunk_offset_64 << " exceeds 32-bit limit";
-            return false;
-        }
-        
-        uint32_t chunk_offset = (uint32_t)chunk_offset_64;
-        MCSR_LOG(VERBOSE) << "Frame offset: " << frame.offset << " -> chunk_offset: " << chunk_offset;
-        writeUint32BE(data, chunk_offset);
+    // avcC: 8 (header) + 1 (version) + 1 (profile) + 1 (compatibility) + 1 (level) +
+    //       1 (reserved + nal_length_size) + 1 (num_sps) + 2 (sps_length) + sps_size +
+    //       1 (num_pps) + 2 (pps_length) + pps_size
+    uint32_t avcc_size = 8 + 1 + 1 + 1 + 1 + 1 + 1 + 2 + sps_data.size() + 1 + 2 + pps_data.size();
+    MCSR_LOG(INFO) << "avcC size calculation: 8+1+1+1+1+1+1+2+" << sps_data.size() << "+1+2+" << pps_data.size() << " = " << avcc_size;
+    
+    // avcC box - must include SPS and PPS
+    std::vector<uint8_t> avcc;
+    avcc.reserve(avcc_size);
+    writeAtomHeader(avcc, "avcC", avcc_size);
+    writeUint8(avcc, 0x01);  // version
+    
+    // Extract profile, compatibility, and level from SPS if available
+    uint8_t profile = 0x42;  // Default Baseline
+    uint8_t compatibility = 0x00;
+    uint8_t level = 0x1F;  // Default Level 3.1
+    
+    if (sps_data.size() >= 4) {
+        profile = sps_data[1];
+        compatibility = sps_data[2];
+        level = sps_data[3];
     }
     
+    writeUint8(avcc, profile);  // profile
+    writeUint8(avcc, compatibility);  // compatibility
+    writeUint8(avcc, level);  // level
+    writeUint8(avcc, 0xFF);  // reserved (6 bits) + nal_length_size-1 (2 bits)
+    
+    // Number of SPS (5 bits reserved + 3 bits count)
+    writeUint8(avcc, 0xE1);  // 1 SPS
+    
+    // SPS length and data
+    writeUint16BE(avcc, sps_data.size());
+    avcc.insert(avcc.end(), sps_data.begin(), sps_data.end());
+    
+    // Number of PPS
+    writeUint8(avcc, 0x01);  // 1 PPS
+    
+    // PPS length and data
+    writeUint16BE(avcc, pps_data.size());
+    avcc.insert(avcc.end(), pps_data.begin(), pps_data.end());
+    
+    writeVisualSampleEntry(AvcCodec::kSampleEntryType, config.video_width, config.video_height,
+                           avcc, data);
     return true;
 }
 
-bool MoovBuilder::buildStsc(const std::vector<FrameInfo>& frames, std::vector<uint8_t>& data) {
-     // Sample to Chunk Box
-     // Maps samples to chunks. Since each frame is a separate chunk,
-     // we need one entry per chunk.
-     data.clear();
-     
-     if (frames.empty()) {
-         return false;
-     }
-     
-     // Build stsc box with one entry (all chunks have 1 sample each)
-     // Each chunk contains exactly 1 sample
-     uint32_t stsc_size = 8 + 8 + 12;  // 1 entry
-     writeAtomHeader(data, "stsc", stsc_size);
-     writeUint32BE(data, 0);  // version 0 + flags 0
-     writeUint32BE(data, 1);  // entry count (1 entry for all chunks)
-     
-      // All chunks have 1 sample each
-      writeUint32BE(data, 1);  // first chunk (1-based)
-      writeUint32BE(data, 1);  // samples per chunk (1 sample per chunk)
-      writeUint32BE(data, 1);  // sample description index
-      
-      return true;
- }
- 
-bool MoovBuilder::buildStsd(const std::string& codec, uint32_t width, uint32_t height,
-                           uint32_t audio_sample_rate, uint16_t audio_channels,
-                           const uint8_t* h264_sps, uint32_t h264_sps_size,
-                           const uint8_t* h264_pps, uint32_t h264_pps_size,
-                           std::vector<uint8_t>& data) {
-    // Sample Description Box
-    data.clear();
+bool MoovBuilder::buildSampleEntry(HevcCodec, const MoovConfig& config, std::vector<uint8_t>& data) {
+    // HVC1 (H.265) sample description, parameter sets stored out-of-band in hvcC
+    std::vector<uint8_t> vps_data;
+    std::vector<uint8_t> sps_data;
+    std::vector<uint8_t> pps_data;
+    if (config.vps && config.vps_size > 0) {
+        stripStartCode(config.vps, config.vps_size, vps_data);
+    }
+    if (config.sps && config.sps_size > 0) {
+        stripStartCode(config.sps, config.sps_size, sps_data);
+    }
+    if (config.pps && config.pps_size > 0) {
+        stripStartCode(config.pps, config.pps_size, pps_data);
+    }
+    if (vps_data.empty() || sps_data.empty() || pps_data.empty()) {
+        MCSR_LOG(WARNING) << "Missing H.265 VPS/SPS/PPS - this may cause playback issues";
+    }
     
-    std::vector<uint8_t> stsd_entries;
+    // general_profile_tier_level defaults: Main profile, Main tier, level 3.1
+    uint8_t profile_byte = 0x01;
+    uint8_t compatibility[4] = {0x60, 0x00, 0x00, 0x00};
+    uint8_t constraints[6] = {0x90, 0x00, 0x00, 0x00, 0x00, 0x00};
+    uint8_t level = 93;
+    uint8_t temporal_layers = 1;
+    uint8_t temporal_id_nested = 1;
+    
+    // SPS: 2-byte NAL header, then vps_id/max_sub_layers/nesting, then profile_tier_level
+    std::vector<uint8_t> sps_rbsp;
+    if (sps_data.size() > 2) {
+        removeEmulationPrevention(sps_data.data() + 2, sps_data.size() - 2, sps_rbsp);
+    }
+    if (sps_rbsp.size() >= 13) {
+        temporal_layers = static_cast<uint8_t>(((sps_rbsp[0] >> 1) & 0x07) + 1);
+        temporal_id_nested = sps_rbsp[0] & 0x01;
+        profile_byte = sps_rbsp[1];
+        memcpy(compatibility, &sps_rbsp[2], sizeof(compatibility));
+        memcpy(constraints, &sps_rbsp[6], sizeof(constraints));
+        level = sps_rbsp[12];
+    }
     
-      if (codec == "avc1") {
-          // AVC1 (H.264) sample description
-          // Use provided SPS/PPS if available, otherwise use defaults
-          std::vector<uint8_t> sps_data;
-          std::vector<uint8_t> pps_data;
-          
-           if (h264_sps && h264_sps_size > 0) {
-               // Strip NAL start code if present (0x00 0x00 0x00 0x01 or 0x00 0x00 0x01)
-               const uint8_t* sps_start = h264_sps;
-               uint32_t sps_len = h264_sps_size;
-               
-               if (h264_sps_size >= 4 && h264_sps[0] == 0x00 && h264_sps[1] == 0x00 && 
-                   h264_sps[2] == 0x00 && h264_sps[3] == 0x01) {
-                   sps_start = h264_sps + 4;
-                   sps_len = h264_sps_size - 4;
-                   MCSR_LOG(INFO) << "Stripped 4-byte NAL start code from SPS";
-               } else if (h264_sps_size >= 3 && h264_sps[0] == 0x00 && h264_sps[1] == 0x00 && 
-                          h264_sps[2] == 0x01) {
-                   sps_start = h264_sps + 3;
-                   sps_len = h264_sps_size - 3;
-                   MCSR_LOG(INFO) << "Stripped 3-byte NAL start code from SPS";
-               }
-               
-               sps_data.assign(sps_start, sps_start + sps_len);
-               MCSR_LOG(INFO) << "Using provided SPS, size=" << sps_data.size();
-           } else {
-               // Fallback SPS for 640x480 H.264 Baseline Profile
-               MCSR_LOG(WARNING) << "Using fallback SPS - this may cause playback issues";
-               sps_data.push_back(0x42);  // Profile IDC (Baseline)
-               sps_data.push_back(0x00);  // Constraint flags
-               sps_data.push_back(0x1E);  // Level IDC (3.0)
-               sps_data.push_back(0xE1);  // Encoded parameters
-               sps_data.push_back(0x00);  // Encoded parameters
-               sps_data.push_back(0x00);  // Encoded parameters
-               sps_data.push_back(0x00);  // Encoded parameters
-           }
-           
-           if (h264_pps && h264_pps_size > 0) {
-               // Strip NAL start code if present
-               const uint8_t* pps_start = h264_pps;
-               uint32_t pps_len = h264_pps_size;
-               
-               if (h264_pps_size >= 4 && h264_pps[0] == 0x00 && h264_pps[1] == 0x00 && 
-                   h264_pps[2] == 0x00 && h264_pps[3] == 0x01) {
-                   pps_start = h264_pps + 4;
-                   pps_len = h264_pps_size - 4;
-                   MCSR_LOG(INFO) << "Stripped 4-byte NAL start code from PPS";
-               } else if (h264_pps_size >= 3 && h264_pps[0] == 0x00 && h264_pps[1] == 0x00 && 
-                          h264_pps[2] == 0x01) {
-                   pps_start = h264_pps + 3;
-                   pps_len = h264_pps_size - 3;
-                   MCSR_LOG(INFO) << "Stripped 3-byte NAL start code from PPS";
-               }
-               
-               pps_data.assign(pps_start, pps_start + pps_len);
-               MCSR_LOG(INFO) << "Using provided PPS, size=" << pps_data.size();
-           } else {
-               // Fallback PPS
-               MCSR_LOG(WARNING) << "Using fallback PPS - this may cause playback issues";
-               pps_data.push_back(0xE1);  // Encoded parameters
-               pps_data.push_back(0x00);  // Encoded parameters
-           }
-        
-        // Calculate avcC size first
-        // avcC: 8 (header) + 1 (version) + 1 (profile) + 1 (compatibility) + 1 (level) +
-        //       1 (reserved + nal_length_size) + 1 (num_sps) + 2 (sps_length) + sps_size +
-        //       1 (num_pps) + 2 (pps_length) + pps_size
-        uint32_t avcc_size = 8 + 1 + 1 + 1 + 1 + 1 + 1 + 2 + sps_data.size() + 1 + 2 + pps_data.size();
-        MCSR_LOG(INFO) << "avcC size calculation: 8+1+1+1+1+1+1+2+" << sps_data.size() << "+1+2+" << pps_data.size() << " = " << avcc_size;
-        
-        // avc1 size: 4 (size) + 4 (type) + 6 (reserved) + 2 (ref index) + 2 (version) + 2 (revision) +
-        //            4 (vendor) + 4 (temporal) + 4 (spatial) + 2 (width) + 2 (height) +
-        //            4 (h-res) + 4 (v-res) + 4 (data size) + 2 (frame count) + 32 (compressor) +
-        //            2 (depth) + 2 (color table) + avcc_size
-        uint32_t avc1_size = 4 + 4 + 6 + 2 + 2 + 2 + 4 + 4 + 4 + 2 + 2 + 4 + 4 + 4 + 2 + 32 + 2 + 2 + avcc_size;
-        
-        writeUint32BE(stsd_entries, avc1_size);
-        writeUint8(stsd_entries, 'a');
-        writeUint8(stsd_entries, 'v');
-        writeUint8(stsd_entries, 'c');
-        writeUint8(stsd_entries, '1');
-        
-        // Reserved
-        for (int i = 0; i < 6; i++) writeUint8(stsd_entries, 0);
-        
-        // Data reference index
-        writeUint16BE(stsd_entries, 1);
-        
-        // Version and revision
-        writeUint16BE(stsd_entries, 0);
-        writeUint16BE(stsd_entries, 0);
-        
-        // Vendor
-        writeUint32BE(stsd_entries, 0);
-        
-        // Temporal quality
-        writeUint32BE(stsd_entries, 0);
-        
-        // Spatial quality
-        writeUint32BE(stsd_entries, 0);
-        
-        // Width - USE ACTUAL WIDTH
-        writeUint16BE(stsd_entries, width);
-        
-        // Height - USE ACTUAL HEIGHT
-        writeUint16BE(stsd_entries, height);
-        
-        // Horizontal resolution
-        writeUint32BE(stsd_entries, 0x00480000);  // 72 dpi
-        
-        // Vertical resolution
-        writeUint32BE(stsd_entries, 0x00480000);  // 72 dpi
-        
-        // Data size
-        writeUint32BE(stsd_entries, 0);
-        
-        // Frame count
-        writeUint16BE(stsd_entries, 1);
-        
-        // Compressor name (32 bytes)
-        for (int i = 0; i < 32; i++) writeUint8(stsd_entries, 0);
-        
-        // Depth
-        writeUint16BE(stsd_entries, 24);
-        
-        // Color table ID
-        writeUint16BE(stsd_entries, 0xFFFF);
-        
-         // avcC box - must include SPS and PPS
-         writeUint32BE(stsd_entries, avcc_size);
-         writeUint8(stsd_entries, 'a');
-         writeUint8(stsd_entries, 'v');
-         writeUint8(stsd_entries, 'c');
-         writeUint8(stsd_entries, 'C');
-         writeUint8(stsd_entries, 0x01);  // version
-         
-         // Extract profile, compatibility, and level from SPS if available
-         uint8_t profile = 0x42;  // Default Baseline
-         uint8_t compatibility = 0x00;
-         uint8_t level = 0x1F;  // Default Level 3.1
-         
-          if (sps_data.size() >= 4) {
-              profile = sps_data[1];
-              compatibility = sps_data[2];
-              level = sps_data[3];
-          }
-         
-         writeUint8(stsd_entries, profile);  // profile
-         writeUint8(stsd_entries, compatibility);  // compatibility
-         writeUint8(stsd_entries, level);  // level
-         writeUint8(stsd_entries, 0xFF);  // reserved (6 bits) + nal_length_size-1 (2 bits)
-        
-        // Number of SPS (5 bits reserved + 3 bits count)
-        writeUint8(stsd_entries, 0xE1);  // 1 SPS
-        
-        // SPS length and data
-        writeUint16BE(stsd_entries, sps_data.size());
-        for (uint8_t b : sps_data) {
-            writeUint8(stsd_entries, b);
+    std::vector<uint8_t> hvcc_payload;
+    writeUint8(hvcc_payload, 0x01);  // configurationVersion
+    writeUint8(hvcc_payload, profile_byte);  // profile_space + tier + profile_idc
+    for (uint8_t b : compatibility) writeUint8(hvcc_payload, b);
+    for (uint8_t b : constraints) writeUint8(hvcc_payload, b);
+    writeUint8(hvcc_payload, level);
+    writeUint16BE(hvcc_payload, 0xF000);  // reserved + min_spatial_segmentation_idc
+    writeUint8(hvcc_payload, 0xFC);  // reserved + parallelismType
+    writeUint8(hvcc_payload, 0xFD);  // reserved + chroma_format_idc (4:2:0)
+    writeUint8(hvcc_payload, 0xF8);  // reserved + bit_depth_luma_minus8
+    writeUint8(hvcc_payload, 0xF8);  // reserved + bit_depth_chroma_minus8
+    writeUint16BE(hvcc_payload, 0);  // avgFrameRate
+    // constantFrameRate (2) + numTemporalLayers (3) + temporalIdNested (1) + lengthSizeMinusOne (2)
+    writeUint8(hvcc_payload, static_cast<uint8_t>(((temporal_layers & 0x07) << 3) |
+                                                  ((temporal_id_nested & 0x01) << 2) | 0x03));
+    
+    const std::vector<uint8_t>* arrays[3] = {&vps_data, &sps_data, &pps_data};
+    const uint8_t nal_types[3] = {32, 33, 34};
+    uint8_t array_count = 0;
+    for (const auto* nal : arrays) {
+        if (!nal->empty()) {
+            array_count++;
         }
-        
-        // Number of PPS
-        writeUint8(stsd_entries, 0x01);  // 1 PPS
-        
-        // PPS length and data
-        writeUint16BE(stsd_entries, pps_data.size());
-        for (uint8_t b : pps_data) {
-            writeUint8(stsd_entries, b);
+    }
+    writeUint8(hvcc_payload, array_count);
+    for (int i = 0; i < 3; i++) {
+        if (arrays[i]->empty()) {
+            continue;
         }
-        
-    } else {
-        // MP4A (AAC) sample description
-        // mp4a box
-        uint16_t channel_count = audio_channels > 0 ? audio_channels : 2;
-        uint32_t sample_rate = audio_sample_rate > 0 ? audio_sample_rate : 48000;
-        uint8_t sample_rate_index = getSampleRateIndex(sample_rate);
-
-        // AudioSpecificConfig (AAC-LC)
-        uint8_t audio_object_type = 2;
-        uint16_t asc_bits = static_cast<uint16_t>((audio_object_type & 0x1F) << 11) |
-                            static_cast<uint16_t>((sample_rate_index & 0x0F) << 7) |
-                            static_cast<uint16_t>((channel_count & 0x0F) << 3);
-        uint8_t asc_bytes[2] = {
-            static_cast<uint8_t>((asc_bits >> 8) & 0xFF),
-            static_cast<uint8_t>(asc_bits & 0xFF)
-        };
-
-        std::vector<uint8_t> esds_payload;
-        writeUint32BE(esds_payload, 0);  // version and flags
-
-        // ES_Descriptor
-        esds_payload.push_back(0x03);
-        std::vector<uint8_t> es_descriptor;
-        writeUint16BE(es_descriptor, 2);  // ES_ID (audio track id)
-        writeUint8(es_descriptor, 0x00);  // flags
-
-        // DecoderConfigDescriptor
-        std::vector<uint8_t> decoder_config;
-        writeUint8(decoder_config, 0x40);  // objectTypeIndication (AAC)
-        writeUint8(decoder_config, 0x15);  // streamType (audio) << 2 | 1
-        writeUint8(decoder_config, 0x00);  // bufferSizeDB (24-bit)
-        writeUint8(decoder_config, 0x00);
-        writeUint8(decoder_config, 0x00);
-        writeUint32BE(decoder_config, 0x00000000);  // maxBitrate
-        writeUint32BE(decoder_config, 0x00000000);  // avgBitrate
-
-        // DecoderSpecificInfo (AudioSpecificConfig)
-        decoder_config.push_back(0x05);
-        writeDescriptorLength(decoder_config, sizeof(asc_bytes));
-        decoder_config.push_back(asc_bytes[0]);
-        decoder_config.push_back(asc_bytes[1]);
-
-        // SLConfigDescriptor
-        std::vector<uint8_t> sl_config;
-        sl_config.push_back(0x06);
-        writeDescriptorLength(sl_config, 1);
-        sl_config.push_back(0x02);
-
-        std::vector<uint8_t> decoder_config_descriptor;
-        decoder_config_descriptor.push_back(0x04);
-        writeDescriptorLength(decoder_config_descriptor,
-                              static_cast<uint32_t>(decoder_config.size()));
-        decoder_config_descriptor.insert(decoder_config_descriptor.end(),
-                                         decoder_config.begin(), decoder_config.end());
-
-        es_descriptor.insert(es_descriptor.end(),
-                             decoder_config_descriptor.begin(), decoder_config_descriptor.end());
-        es_descriptor.insert(es_descriptor.end(), sl_config.begin(), sl_config.end());
-
-        writeDescriptorLength(esds_payload, static_cast<uint32_t>(es_descriptor.size()));
-        esds_payload.insert(esds_payload.end(), es_descriptor.begin(), es_descriptor.end());
-
-        std::vector<uint8_t> esds_box;
-        uint32_t esds_size = 8 + static_cast<uint32_t>(esds_payload.size());
-        writeAtomHeader(esds_box, "esds", esds_size);
-        esds_box.insert(esds_box.end(), esds_payload.begin(), esds_payload.end());
-
-        uint32_t mp4a_size = 36 + static_cast<uint32_t>(esds_box.size());
-        writeUint32BE(stsd_entries, mp4a_size);
-        writeUint8(stsd_entries, 'm');
-        writeUint8(stsd_entries, 'p');
-        writeUint8(stsd_entries, '4');
-        writeUint8(stsd_entries, 'a');
-        
-        // Reserved
-        for (int i = 0; i < 6; i++) writeUint8(stsd_entries, 0);
-        
-        // Data reference index
-        writeUint16BE(stsd_entries, 1);
-        
-        // Version and revision
-        writeUint16BE(stsd_entries, 0);
-        writeUint16BE(stsd_entries, 0);
-        
-        // Vendor
-        writeUint32BE(stsd_entries, 0);
-        
-        // Channel count
-        writeUint16BE(stsd_entries, channel_count);
-        
-        // Sample size
-        writeUint16BE(stsd_entries, 16);
-        
-        // Compression ID
-        writeUint16BE(stsd_entries, 0);
-        
-        // Packet size
-        writeUint16BE(stsd_entries, 0);
-        
-        // Sample rate (16.16 fixed point)
-        writeUint32BE(stsd_entries, sample_rate << 16);
-
-        stsd_entries.insert(stsd_entries.end(), esds_box.begin(), esds_box.end());
+        writeUint8(hvcc_payload, 0x80 | nal_types[i]);  // array_completeness + NAL unit type
+        writeUint16BE(hvcc_payload, 1);  // numNalus
+        writeUint16BE(hvcc_payload, static_cast<uint16_t>(arrays[i]->size()));
+        hvcc_payload.insert(hvcc_payload.end(), arrays[i]->begin(), arrays[i]->end());
     }
     
-    // Build stsd box
-    uint32_t stsd_size = 8 + 8 + stsd_entries.size();
-    writeAtomHeader(data, "stsd", stsd_size);
-    writeUint32BE(data, 0);  // version 0 + flags 0
-    writeUint32BE(data, 1);  // entry count
-    data.insert(data.end(), stsd_entries.begin(), stsd_entries.end());
+    std::vector<uint8_t> hvcc;
+    writeAtomHeader(hvcc, "hvcC", 8 + static_cast<uint32_t>(hvcc_payload.size()));
+    hvcc.insert(hvcc.end(), hvcc_payload.begin(), hvcc_payload.end());
     
+    writeVisualSampleEntry(HevcCodec::kSampleEntryType, config.video_width, config.video_height,
+                           hvcc, data);
+    return true;
+}
+
+bool MoovBuilder::buildSampleEntry(AacCodec, const MoovConfig& config, std::vector<uint8_t>& data) {
+    // MP4A (AAC) sample description
+    uint16_t channel_count = config.audio_channels > 0 ? config.audio_channels : 2;
+    uint32_t sample_rate = config.audio_sample_rate > 0 ? config.audio_sample_rate : 48000;
+    uint8_t sample_rate_index = getSampleRateIndex(sample_rate);
+
+    // AudioSpecificConfig (AAC-LC)
+    uint8_t audio_object_type = 2;
+    uint16_t asc_bits = static_cast<uint16_t>((audio_object_type & 0x1F) << 11) |
+                        static_cast<uint16_t>((sample_rate_index & 0x0F) << 7) |
+                        static_cast<uint16_t>((channel_count & 0x0F) << 3);
+    uint8_t asc_bytes[2] = {
+        static_cast<uint8_t>((asc_bits >> 8) & 0xFF),
+        static_cast<uint8_t>(asc_bits & 0xFF)
+    };
+
+    std::vector<uint8_t> esds_payload;
+    writeUint32BE(esds_payload, 0);  // version and flags
+
+    // ES_Descriptor
+    esds_payload.push_back(0x03);
+    std::vector<uint8_t> es_descriptor;
+    writeUint16BE(es_descriptor, 2);  // ES_ID (audio track id)
+    writeUint8(es_descriptor, 0x00);  // flags
+
+    // DecoderConfigDescriptor
+    std::vector<uint8_t> decoder_config;
+    writeUint8(decoder_config, 0x40);  // objectTypeIndication (AAC)
+    writeUint8(decoder_config, 0x15);  // streamType (audio) << 2 | 1
+    writeUint8(decoder_config, 0x00);  // bufferSizeDB (24-bit)
+    writeUint8(decoder_config, 0x00);
+    writeUint8(decoder_config, 0x00);
+    writeUint32BE(decoder_config, 0x00000000);  // maxBitrate
+    writeUint32BE(decoder_config, 0x00000000);  // avgBitrate
+
+    // DecoderSpecificInfo (AudioSpecificConfig)
+    decoder_config.push_back(0x05);
+    writeDescriptorLength(decoder_config, sizeof(asc_bytes));
+    decoder_config.push_back(asc_bytes[0]);
+    decoder_config.push_back(asc_bytes[1]);
+
+    // SLConfigDescriptor
+    std::vector<uint8_t> sl_config;
+    sl_config.push_back(0x06);
+    writeDescriptorLength(sl_config, 1);
+    sl_config.push_back(0x02);
+
+    std::vector<uint8_t> decoder_config_descriptor;
+    decoder_config_descriptor.push_back(0x04);
+    writeDescriptorLength(decoder_config_descriptor,
+                          static_cast<uint32_t>(decoder_config.size()));
+    decoder_config_descriptor.insert(decoder_config_descriptor.end(),
+                                     decoder_config.begin(), decoder_config.end());
+
+    es_descriptor.insert(es_descriptor.end(),
+                         decoder_config_descriptor.begin(), decoder_config_descriptor.end());
+    es_descriptor.insert(es_descriptor.end(), sl_config.begin(), sl_config.end());
+
+    writeDescriptorLength(esds_payload, static_cast<uint32_t>(es_descriptor.size()));
+    esds_payload.insert(esds_payload.end(), es_descriptor.begin(), es_descriptor.end());
+
+    std::vector<uint8_t> esds_box;
+    uint32_t esds_size = 8 + static_cast<uint32_t>(esds_payload.size());
+    writeAtomHeader(esds_box, "esds", esds_size);
+    esds_box.insert(esds_box.end(), esds_payload.begin(), esds_payload.end());
+
+    writeAudioSampleEntry(AacCodec::kSampleEntryType, channel_count, sample_rate, esds_box, data);
+    return true;
+}
+
+bool MoovBuilder::buildSampleEntry(OpusCodec, const MoovConfig& config, std::vector<uint8_t>& data) {
+    // Opus sample description (ISO/IEC 14496-12 encapsulation of Opus)
+    uint16_t channel_count = config.audio_channels > 0 ? config.audio_channels : 2;
+    if (channel_count > 2) {
+        MCSR_LOG(ERROR) << "Opus track supports mono or stereo only (channels=" << channel_count << ")";
+        return false;
+    }
+    uint32_t input_sample_rate = config.audio_sample_rate > 0 ? config.audio_sample_rate : 48000;
+
+    // dOps: 8 (header) + 1 (version) + 1 (channels) + 2 (pre-skip) + 4 (input rate) +
+    //       2 (output gain) + 1 (channel mapping family) = 19
+    std::vector<uint8_t> dops_box;
+    writeAtomHeader(dops_box, "dOps", 19);
+    writeUint8(dops_box, 0);  // version
+    writeUint8(dops_box, static_cast<uint8_t>(channel_count));
+    writeUint16BE(dops_box, OpusCodec::kPreSkip);
+    writeUint32BE(dops_box, input_sample_rate);
+    writeUint16BE(dops_box, 0);  // output gain
+    writeUint8(dops_box, 0);  // channel mapping family 0 (mono/stereo)
+
+    // Opus is always decoded at 48kHz
+    writeAudioSampleEntry(OpusCodec::kSampleEntryType, channel_count, 48000, dops_box, data);
     return true;
 }
 
@@ -9,8 +9,15 @@
 #include "mp4_recorder.h"
 #include "moov_builder.h"
 #include "index_file.h"
+#include "mdat_scanner.h"
+#include "read_planner.h"
+#include "metrics_registry.h"
+#include "sync_coordinator.h"
+#include "trace.h"
 #include "common.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <chrono>
 
@@ -18,12 +25,19 @@ namespace mp4_recorder {
 
 namespace {
 
-bool extractH264ConfigFromSample(const std::vector<uint8_t>& sample, std::vector<uint8_t>& sps, std::vector<uint8_t>& pps)
+bool extractVideoConfigFromSample(const uint8_t* sample, size_t sample_size, VideoCodec codec,
+                                  std::vector<uint8_t>& vps, std::vector<uint8_t>& sps,
+                                  std::vector<uint8_t>& pps)
 {
-    if (sample.size() < 4) {
+    if (sample_size < 4) {
         return false;
     }
 
+    // H.264 needs SPS+PPS; H.265 additionally needs the VPS
+    auto complete = [&]() {
+        return !sps.empty() && !pps.empty() && (codec != VideoCodec::H265 || !vps.empty());
+    };
+
     auto handleNal = [&](const uint8_t* nal_data, size_t nal_size) {
         const size_t max_param_size = 256;
         if (nal_size == 0) {
@@ -32,6 +46,17 @@ bool extractH264ConfigFromSample(const std::vector<uint8_t>& sample, std::vector
         if (nal_size > max_param_size) {
             return;
         }
+        if (codec == VideoCodec::H265) {
+            uint8_t nal_type = (nal_data[0] >> 1) & 0x3F;
+            if (nal_type == 32 && vps.empty()) {
+                vps.assign(nal_data, nal_data + nal_size);
+            } else if (nal_type == 33 && sps.empty()) {
+                sps.assign(nal_data, nal_data + nal_size);
+            } else if (nal_type == 34 && pps.empty()) {
+                pps.assign(nal_data, nal_data + nal_size);
+            }
+            return;
+        }
         uint8_t nal_type = nal_data[0] & 0x1F;
         if (nal_type == 7 && sps.empty()) {
             sps.assign(nal_data, nal_data + nal_size);
@@ -41,22 +66,22 @@ bool extractH264ConfigFromSample(const std::vector<uint8_t>& sample, std::vector
     };
 
     bool has_start_code = false;
-    if (sample.size() >= 4 && sample[0] == 0x00 && sample[1] == 0x00 && sample[2] == 0x00 && sample[3] == 0x01) {
+    if (sample_size >= 4 && sample[0] == 0x00 && sample[1] == 0x00 && sample[2] == 0x00 && sample[3] == 0x01) {
         has_start_code = true;
-    } else if (sample.size() >= 3 && sample[0] == 0x00 && sample[1] == 0x00 && sample[2] == 0x01) {
+    } else if (sample_size >= 3 && sample[0] == 0x00 && sample[1] == 0x00 && sample[2] == 0x01) {
         has_start_code = true;
     }
 
     if (has_start_code) {
         size_t pos = 0;
         size_t start = 0;
-        while (pos + 3 < sample.size()) {
+        while (pos + 3 < sample_size) {
             bool is_start = false;
             size_t start_len = 0;
-            if (pos + 3 < sample.size() && sample[pos] == 0x00 && sample[pos + 1] == 0x00 && sample[pos + 2] == 0x01) {
+            if (pos + 3 < sample_size && sample[pos] == 0x00 && sample[pos + 1] == 0x00 && sample[pos + 2] == 0x01) {
                 is_start = true;
                 start_len = 3;
-            } else if (pos + 4 < sample.size() && sample[pos] == 0x00 && sample[pos + 1] == 0x00 &&
+            } else if (pos + 4 < sample_size && sample[pos] == 0x00 && sample[pos + 1] == 0x00 &&
                        sample[pos + 2] == 0x00 && sample[pos + 3] == 0x01) {
                 is_start = true;
                 start_len = 4;
@@ -64,8 +89,8 @@ bool extractH264ConfigFromSample(const std::vector<uint8_t>& sample, std::vector
 
             if (is_start) {
                 if (start < pos) {
-                    handleNal(sample.data() + start, pos - start);
-                    if (!sps.empty() && !pps.empty()) {
+                    handleNal(sample + start, pos - start);
+                    if (complete()) {
                         return true;
                     }
                 }
@@ -76,76 +101,472 @@ bool extractH264ConfigFromSample(const std::vector<uint8_t>& sample, std::vector
             }
         }
 
-        if (start < sample.size()) {
-            handleNal(sample.data() + start, sample.size() - start);
+        if (start < sample_size) {
+            handleNal(sample + start, sample_size - start);
         }
-        return !sps.empty() && !pps.empty();
+        return complete();
     }
 
     size_t pos = 0;
-    while (pos + 4 <= sample.size()) {
-        uint32_t nal_size = readBE32(sample.data() + pos);
+    while (pos + 4 <= sample_size) {
+        uint32_t nal_size = readBE32(sample + pos);
         pos += 4;
-        if (nal_size == 0 || pos + nal_size > sample.size()) {
+        if (nal_size == 0 || pos + nal_size > sample_size) {
             break;
         }
-        handleNal(sample.data() + pos, nal_size);
-        if (!sps.empty() && !pps.empty()) {
+        handleNal(sample + pos, nal_size);
+        if (complete()) {
             return true;
         }
         pos += nal_size;
     }
 
-    return !sps.empty() && !pps.empty();
+    return complete();
 }
 
-bool extractH264ConfigFromMdat(IFileOps& file_ops, const std::string& filename, uint64_t mdat_start,
-                               const std::vector<FrameInfo>& video_frames,
-                               std::vector<uint8_t>& sps, std::vector<uint8_t>& pps)
-{
-    std::unique_ptr<IFile> file = file_ops.open(filename, "rb");
-    if (!file || !file->isOpen()) {
-        MCSR_LOG(WARNING) << "Failed to open MP4 for H.264 config extraction";
+// Whether the first slice of a frame marks it as unused for reference, so dropping it leaves
+// the other frames decodable. H.265 sub-layer non-reference pictures qualify; in streams with
+// temporal sub-layers they may still be referenced by higher sub-layers. Frames whose layout
+// is not recognised count as reference frames.
+bool isNonReferenceFrame(const uint8_t* sample, size_t sample_size, VideoCodec codec) {
+    // True once a VCL NAL unit has been classified
+    auto classify = [codec](const uint8_t* nal, size_t nal_size, bool& non_reference) {
+        if (codec == VideoCodec::H265) {
+            uint8_t nal_type = nal_size >= 2 ? (nal[0] >> 1) & 0x3F : 0xFF;
+            if (nal_type > 31) {
+                return false;
+            }
+            // TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and the reserved *_N types are even
+            non_reference = nal_type <= 14 && nal_type % 2 == 0;
+            return true;
+        }
+        uint8_t nal_type = nal_size >= 1 ? nal[0] & 0x1F : 0;
+        if (nal_type < 1 || nal_type > 5) {
+            return false;
+        }
+        non_reference = (nal[0] & 0x60) == 0;  // nal_ref_idc
+        return true;
+    };
+
+    bool non_reference = false;
+    size_t pos = 0;
+    bool has_start_code = sample_size >= 3 && sample[0] == 0x00 && sample[1] == 0x00 &&
+                          (sample[2] == 0x01 || (sample_size >= 4 && sample[2] == 0x00 && sample[3] == 0x01));
+    if (has_start_code) {
+        while (pos + 3 < sample_size) {
+            if (sample[pos] == 0x00 && sample[pos + 1] == 0x00 && sample[pos + 2] == 0x01) {
+                pos += 3;
+                if (classify(sample + pos, sample_size - pos, non_reference)) {
+                    return non_reference;
+                }
+            } else {
+                pos++;
+            }
+        }
         return false;
     }
 
-    for (const auto& frame : video_frames) {
-        if (frame.size == 0) {
-            continue;
+    while (pos + 4 <= sample_size) {
+        uint32_t nal_size = readBE32(sample + pos);
+        pos += 4;
+        if (nal_size == 0 || nal_size > sample_size - pos) {
+            break;
+        }
+        if (classify(sample + pos, nal_size, non_reference)) {
+            return non_reference;
         }
+        pos += nal_size;
+    }
+    return false;
+}
 
-        uint64_t offset = mdat_start + frame.offset;
-        if (!file->seek(static_cast<int64_t>(offset), SEEK_SET)) {
-            continue;
+bool extractVideoConfigFromMdat(IFile& file, uint64_t mdat_start, const SampleTable& video_table,
+                                VideoCodec codec, std::vector<uint8_t>& vps,
+                                std::vector<uint8_t>& sps, std::vector<uint8_t>& pps)
+{
+    // Parameter sets travel with keyframes, so those are read first; the other samples are
+    // only needed for streams that send them elsewhere
+    const std::vector<uint64_t>& offsets = video_table.sampleOffsets();
+    std::vector<bool> is_sync(video_table.sampleCount(), false);
+    for (uint32_t sample : video_table.syncSamples()) {
+        is_sync[sample - 1] = true;
+    }
+
+    auto visitor = [&](size_t, const uint8_t* data, size_t size) {
+        return extractVideoConfigFromSample(data, size, codec, vps, sps, pps);
+    };
+    for (bool keyframes : {true, false}) {
+        ReadPlanner planner;
+        for (uint32_t i = 0; i < video_table.sampleCount(); i++) {
+            uint32_t size = video_table.sizes().sizeAt(i);
+            if (size > 0 && is_sync[i] == keyframes) {
+                planner.add(mdat_start + offsets[i], size);
+            }
         }
+        if (planner.rangeCount() > 0 && planner.run(file, visitor)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        std::vector<uint8_t> sample(frame.size);
-        size_t read_bytes = file->read(sample.data(), frame.size);
-        if (read_bytes != frame.size) {
-            continue;
+// Codec config payload: version (1 byte), video codec (1 byte), then VPS, SPS and PPS, each
+// as a 4-byte length followed by the NAL unit. Later versions may only append fields.
+const uint8_t kCodecConfigVersion = 1;
+
+void encodeCodecConfig(VideoCodec codec, const std::vector<uint8_t>& vps,
+                       const std::vector<uint8_t>& sps, const std::vector<uint8_t>& pps,
+                       std::vector<uint8_t>& payload)
+{
+    payload.clear();
+    payload.push_back(kCodecConfigVersion);
+    payload.push_back(static_cast<uint8_t>(codec));
+    for (const std::vector<uint8_t>* nal : {&vps, &sps, &pps}) {
+        uint32_t size = static_cast<uint32_t>(nal->size());
+        const uint8_t* size_bytes = reinterpret_cast<const uint8_t*>(&size);
+        payload.insert(payload.end(), size_bytes, size_bytes + sizeof(size));
+        payload.insert(payload.end(), nal->begin(), nal->end());
+    }
+}
+
+bool decodeCodecConfig(const std::vector<uint8_t>& payload, VideoCodec codec,
+                       std::vector<uint8_t>& vps, std::vector<uint8_t>& sps,
+                       std::vector<uint8_t>& pps)
+{
+    if (payload.size() < 2 || payload[0] < kCodecConfigVersion ||
+        payload[1] != static_cast<uint8_t>(codec)) {
+        return false;
+    }
+    size_t pos = 2;
+    for (std::vector<uint8_t>* nal : {&vps, &sps, &pps}) {
+        uint32_t size = 0;
+        if (payload.size() - pos < sizeof(size)) {
+            return false;
         }
+        std::memcpy(&size, payload.data() + pos, sizeof(size));
+        pos += sizeof(size);
+        if (payload.size() - pos < size) {
+            return false;
+        }
+        nal->assign(payload.begin() + pos, payload.begin() + pos + size);
+        pos += size;
+    }
+    return !sps.empty() && !pps.empty() && (codec != VideoCodec::H265 || !vps.empty());
+}
+
+// Where the mdat box sits in the mp4, as recorded by createFiles()
+struct FileLayout {
+    uint64_t mdat_header_offset = 0;
+    uint32_t mdat_header_size = 0;      // 8, or 16 with a 64-bit largesize field
+    uint64_t mdat_start = 0;            // First byte of mdat data
+    std::vector<uint8_t> ftyp;          // ftyp box as written (brand set)
+};
+
+// File layout payload: version (1 byte), mdat header size (1 byte), mdat header offset
+// (8 bytes), then the ftyp box. Later versions may only append fields.
+const uint8_t kFileLayoutVersion = 1;
+
+void encodeFileLayout(const FileLayout& layout, std::vector<uint8_t>& payload)
+{
+    payload.clear();
+    payload.push_back(kFileLayoutVersion);
+    payload.push_back(static_cast<uint8_t>(layout.mdat_header_size));
+    const uint8_t* offset_bytes = reinterpret_cast<const uint8_t*>(&layout.mdat_header_offset);
+    payload.insert(payload.end(), offset_bytes, offset_bytes + sizeof(layout.mdat_header_offset));
+    payload.insert(payload.end(), layout.ftyp.begin(), layout.ftyp.end());
+}
+
+bool decodeFileLayout(const std::vector<uint8_t>& payload, FileLayout& layout)
+{
+    const size_t fixed_size = 2 + sizeof(layout.mdat_header_offset);
+    if (payload.size() < fixed_size + 8 || payload[0] < kFileLayoutVersion) {
+        return false;
+    }
+    layout.mdat_header_size = payload[1];
+    std::memcpy(&layout.mdat_header_offset, payload.data() + 2, sizeof(layout.mdat_header_offset));
+    uint32_t ftyp_size = readBE32(payload.data() + fixed_size);
+    if ((layout.mdat_header_size != 8 && layout.mdat_header_size != 16) || ftyp_size < 8 ||
+        ftyp_size > payload.size() - fixed_size) {
+        return false;
+    }
+    layout.ftyp.assign(payload.begin() + fixed_size, payload.begin() + fixed_size + ftyp_size);
+    layout.mdat_start = layout.mdat_header_offset + layout.mdat_header_size;
+    return true;
+}
+
+// Header bytes up to mdat data, read once to validate or derive the layout
+bool readFileHeader(IFile& file, size_t size, std::vector<uint8_t>& header)
+{
+    header.resize(size);
+    return file.seek(0, SEEK_SET) && file.read(header.data(), size) == size;
+}
+
+// Check that the mp4 still starts with the recorded ftyp and an mdat header
+bool verifyFileLayout(IFile& file, const FileLayout& layout)
+{
+    std::vector<uint8_t> header;
+    if (layout.mdat_start > 64 * 1024 || !readFileHeader(file, static_cast<size_t>(layout.mdat_start), header)) {
+        return false;
+    }
+    const uint8_t* mdat = header.data() + layout.mdat_header_offset;
+    return layout.ftyp.size() <= layout.mdat_header_offset &&
+           std::equal(layout.ftyp.begin(), layout.ftyp.end(), header.begin()) &&
+           std::memcmp(mdat + 4, "mdat", 4) == 0 &&
+           (layout.mdat_header_size == 8 || readBE32(mdat) == 1);
+}
 
-        if (extractH264ConfigFromSample(sample, sps, pps)) {
+// Derive the layout from the top-level boxes when the index does not record it: ftyp
+// (and possibly free/skip boxes) followed by mdat
+bool probeFileLayout(IFile& file, uint64_t file_size, FileLayout& layout)
+{
+    std::vector<uint8_t> header;
+    size_t probe_size = static_cast<size_t>(std::min<uint64_t>(file_size, 4096));
+    if (!readFileHeader(file, probe_size, header)) {
+        return false;
+    }
+    uint64_t pos = 0;
+    while (pos + 8 <= header.size()) {
+        uint32_t box_size = readBE32(header.data() + pos);
+        const uint8_t* type = header.data() + pos + 4;
+        if (std::memcmp(type, "mdat", 4) == 0) {
+            layout.mdat_header_offset = pos;
+            layout.mdat_header_size = box_size == 1 ? 16 : 8;
+            layout.mdat_start = pos + layout.mdat_header_size;
             return true;
         }
+        if (box_size < 8 || (pos == 0 && std::memcmp(type, "ftyp", 4) != 0)) {
+            return false;
+        }
+        if (pos == 0) {
+            layout.ftyp.assign(header.begin(), header.begin() + std::min<size_t>(box_size, header.size()));
+        }
+        pos += box_size;
     }
     return false;
 }
 
+// Patch the size of the mdat box whose header is at header_offset
+bool writeMdatBoxSize(IFile& file, uint64_t header_offset, uint32_t header_size, uint64_t data_size)
+{
+    uint64_t total_size = header_size + data_size;
+    uint8_t size_bytes[8];
+    size_t field_size = 4;
+    if (header_size == 16) {
+        // size = 1 is followed by 'mdat' and the 64-bit largesize
+        header_offset += 8;
+        field_size = 8;
+        for (int i = 0; i < 8; i++) {
+            size_bytes[i] = static_cast<uint8_t>(total_size >> (56 - 8 * i));
+        }
+    } else {
+        if (total_size > 0xFFFFFFFFULL) {
+            MCSR_LOG(ERROR) << "mdat size exceeds 32-bit limit";
+            return false;
+        }
+        for (int i = 0; i < 4; i++) {
+            size_bytes[i] = static_cast<uint8_t>(total_size >> (24 - 8 * i));
+        }
+    }
+    if (!file.seek(static_cast<int64_t>(header_offset), SEEK_SET) ||
+        file.write(size_bytes, field_size) != field_size) {
+        MCSR_LOG(ERROR) << "Failed to write mdat size";
+        return false;
+    }
+    return true;
+}
+
+// Finalize payload: journal of the moov write. Begin is made durable before the moov is
+// written and Done after it is synced, so recovery can tell a finished file from one with a
+// partial moov.
+enum class FinalizeState : uint32_t {
+    Begin = 1,
+    Done = 2
+};
+
+struct FinalizeMarker {
+    uint32_t state;
+    uint32_t reserved;
+    uint64_t moov_offset;   // End of mdat, where the moov starts
+    uint64_t file_end;      // File size with the moov written (Done only)
+};
+
+// Finalize records are the last entries of the index; don't search further back than this
+const uint64_t kFinalizeSearchEntries = 8;
+
+bool appendFinalizeMarker(IFile& idx_file, FinalizeState state, uint64_t moov_offset,
+                          uint64_t file_end, uint64_t frame_count)
+{
+    FinalizeMarker marker = {static_cast<uint32_t>(state), 0, moov_offset, file_end};
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&marker);
+    std::vector<uint8_t> payload(bytes, bytes + sizeof(marker));
+    return IndexFile::appendRecord(idx_file, IndexRecordType::Finalize, frame_count, payload) &&
+           idx_file.flush();
+}
+
+bool readFinalizeMarker(IndexFile& idx, FinalizeMarker& marker)
+{
+    std::vector<uint8_t> payload;
+    uint64_t next_position = 0;
+    if (!idx.findLastRecord(IndexRecordType::Finalize, payload, next_position, kFinalizeSearchEntries) ||
+        payload.size() != sizeof(marker)) {
+        return false;
+    }
+    std::memcpy(&marker, payload.data(), sizeof(marker));
+    return true;
+}
+
+// Journal a moov write of recover() into an index that was opened read-only
+bool journalFinalize(IFileOps& file_ops, const std::string& idx_filename, FinalizeState state,
+                     uint64_t moov_offset, uint64_t file_end, uint64_t frame_count)
+{
+    // Drop a torn entry first so the record starts on an entry boundary
+    uint64_t size = 0;
+    if (!file_ops.getFileSize(idx_filename, size) || size < IndexFile::frameDataStart()) {
+        return false;
+    }
+    uint64_t aligned = IndexFile::frameDataStart() +
+        (size - IndexFile::frameDataStart()) / sizeof(FrameInfo) * sizeof(FrameInfo);
+    if (aligned != size && !file_ops.truncate(idx_filename, aligned)) {
+        return false;
+    }
+    std::unique_ptr<IFile> file = file_ops.open(idx_filename, "ab");
+    return file && file->isOpen() &&
+           appendFinalizeMarker(*file, state, moov_offset, file_end, frame_count) && file->sync();
+}
+
+// A finished file ends with exactly the moov recorded in the Done marker
+bool isFinalized(IFileOps& file_ops, const std::string& filename, const FinalizeMarker& marker)
+{
+    uint64_t file_size = 0;
+    if (marker.state != static_cast<uint32_t>(FinalizeState::Done) ||
+        !file_ops.getFileSize(filename, file_size) || file_size != marker.file_end ||
+        marker.moov_offset + 8 > marker.file_end) {
+        return false;
+    }
+    std::unique_ptr<IFile> file = file_ops.open(filename, "rb");
+    uint8_t header[8];
+    return file && file->isOpen() && file->seek(static_cast<int64_t>(marker.moov_offset), SEEK_SET) &&
+           file->read(header, sizeof(header)) == sizeof(header) &&
+           readBE32(header) == marker.file_end - marker.moov_offset && std::memcmp(header + 4, "moov", 4) == 0;
+}
+
+// Microseconds since begin, traced as trace_name; begin moves to now for the next phase
+uint64_t lapUs(std::chrono::steady_clock::time_point& begin, const char* trace_name) {
+    auto now = std::chrono::steady_clock::now();
+    if (Tracer::enabled()) {
+        Tracer::instance().record("recover", trace_name, begin, now);
+    }
+    uint64_t elapsed = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(now - begin).count());
+    begin = now;
+    return elapsed;
+}
+
+uint64_t elapsedNs(std::chrono::steady_clock::time_point begin) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count());
+}
+
+// Records how long the enclosing scope took
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram& histogram)
+        : histogram_(histogram), begin_(std::chrono::steady_clock::now()) {
+    }
+    ~ScopedLatency() { histogram_.record(elapsedNs(begin_)); }
+
+    std::chrono::steady_clock::time_point begin() const { return begin_; }
+
+private:
+    LatencyHistogram& histogram_;
+    std::chrono::steady_clock::time_point begin_;
+};
+
+void removeRecordingFiles(IFileOps& file_ops, const std::string& idx_filename,
+                          const std::string& lock_filename)
+{
+    if (!file_ops.remove(idx_filename)) {
+        MCSR_LOG(WARNING) << "Failed to delete index file: " << idx_filename;
+    } else {
+        MCSR_LOG(INFO) << "Deleted index file: " << idx_filename;
+    }
+    
+    if (!file_ops.remove(lock_filename)) {
+        MCSR_LOG(WARNING) << "Failed to delete lock file: " << lock_filename;
+    } else {
+        MCSR_LOG(INFO) << "Deleted lock file: " << lock_filename;
+    }
+}
+
+// Frames re-derived from mdat carry no timestamps; use the codec's nominal frame duration
+void appendScannedSamples(const std::vector<ScannedSample>& samples, const RecorderConfig& config,
+                          SampleTable& video_table, SampleTable& audio_table)
+{
+    uint32_t video_duration = VideoTrackTraits::defaultSampleDuration(config.video_timescale);
+    uint32_t audio_duration = config.audio_codec == AudioCodec::OPUS ?
+        OpusCodec::defaultSampleDuration(config.audio_timescale) :
+        AacCodec::defaultSampleDuration(config.audio_timescale);
+    int64_t video_pts = video_table.empty() ? 0 : video_table.lastDts() + video_duration;
+    int64_t audio_pts = audio_table.empty() ? 0 : audio_table.lastDts() + audio_duration;
+
+    for (const auto& sample : samples) {
+        FrameInfo frame;
+        frame.offset = sample.offset;
+        frame.size = sample.size;
+        frame.is_keyframe = sample.is_keyframe ? 1 : 0;
+        frame.track_id = sample.track_id;
+        if (sample.track_id == 0) {
+            frame.pts = frame.dts = video_pts;
+            video_pts += video_duration;
+            video_table.append(frame);
+        } else {
+            frame.pts = frame.dts = audio_pts;
+            audio_pts += audio_duration;
+            audio_table.append(frame);
+        }
+    }
+}
+
+MoovConfig makeMoovConfig(const RecorderConfig& config, const std::vector<uint8_t>& vps,
+                          const std::vector<uint8_t>& sps, const std::vector<uint8_t>& pps,
+                          uint64_t mdat_start)
+{
+    MoovConfig moov_config;
+    moov_config.video_codec = config.video_codec;
+    moov_config.audio_codec = config.audio_codec;
+    moov_config.video_timescale = config.video_timescale;
+    moov_config.audio_timescale = config.audio_timescale;
+    moov_config.audio_sample_rate = config.audio_sample_rate;
+    moov_config.audio_channels = config.audio_channels;
+    moov_config.video_width = config.video_width;
+    moov_config.video_height = config.video_height;
+    moov_config.vps = vps.empty() ? nullptr : vps.data();
+    moov_config.vps_size = static_cast<uint32_t>(vps.size());
+    moov_config.sps = sps.empty() ? nullptr : sps.data();
+    moov_config.sps_size = static_cast<uint32_t>(sps.size());
+    moov_config.pps = pps.empty() ? nullptr : pps.data();
+    moov_config.pps_size = static_cast<uint32_t>(pps.size());
+    moov_config.mdat_start = mdat_start;
+    return moov_config;
+}
+
 } // namespace
 
 Mp4Recorder::Mp4Recorder()
     : file_ops_(std::make_shared<StdioFileOps>()) {
+    MetricsRegistry::instance().add(&stats_);
 }
 
 Mp4Recorder::Mp4Recorder(std::shared_ptr<IFileOps> file_ops)
     : file_ops_(file_ops ? file_ops : std::make_shared<StdioFileOps>()) {
+    MetricsRegistry::instance().add(&stats_);
 }
 
 Mp4Recorder::~Mp4Recorder() {
     if (recording_) {
         stop();
     }
+    MetricsRegistry::instance().remove(&stats_);
 }
 
 bool Mp4Recorder::start(const std::string& filename, const RecorderConfig& config) {
@@ -158,6 +579,7 @@ bool Mp4Recorder::start(const std::string& filename, const RecorderConfig& confi
     idx_filename_ = filename + ".idx";
     lock_filename_ = filename + ".lock";
     config_ = config;
+    MetricsRegistry::instance().reset(stats_);
 
     if (!createFiles(filename)) {
         MCSR_LOG(ERROR) << "Failed to create files";
@@ -165,13 +587,41 @@ bool Mp4Recorder::start(const std::string& filename, const RecorderConfig& confi
     }
 
     recording_ = true;
+    stats_.recording.store(true, std::memory_order_relaxed);
     frame_count_ = 0;
     last_flush_time_ = std::chrono::steady_clock::now();
     frames_since_flush_ = 0;
+    last_snapshot_time_ = last_flush_time_;
+    last_sync_time_ = last_flush_time_;
+
+    video_table_.reset();
+    audio_table_.reset();
+    has_video_dts_ = false;
+    last_video_dts_ = 0;
+    has_queued_video_dts_ = false;
+    queued_bytes_.store(0, std::memory_order_relaxed);
+    interleaved_bytes_ = 0;
+    producers_waiting_.store(0, std::memory_order_relaxed);
+    dropping_video_ = false;
+    if (config_.sync_coordinator) {
+        sync_participant_ = config_.sync_coordinator->join({mp4_filename_, idx_filename_}, &stats_);
+        if (!sync_participant_) {
+            MCSR_LOG(WARNING) << "Sync coordinator unavailable, syncing at every flush";
+        }
+    }
+    if (config_.interleave_chunk_ms > 0) {
+        interleaver_.reset(new Interleaver(config_.video_timescale, config_.audio_timescale,
+                                           config_.interleave_chunk_ms, config_.interleave_window_ms));
+    }
 
-    if (config_.flush_frame_count > 0) {
-        video_frames_.reserve(config_.flush_frame_count);
-        audio_frames_.reserve(config_.flush_frame_count);
+    // Parameter sets given before start() apply to this recording
+    if (hasVideoConfig() && !writeCodecConfig()) {
+        return false;
+    }
+
+    if (config_.concurrent_writes && !startConsumer()) {
+        stop();
+        return false;
     }
 
     MCSR_LOG(INFO) << "Recording started: " << filename;
@@ -184,25 +634,92 @@ bool Mp4Recorder::setH264Config(const uint8_t* sps, uint32_t sps_size, const uin
         return false;
     }
     
-    h264_sps_.assign(sps, sps + sps_size);
-    h264_pps_.assign(pps, pps + pps_size);
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    video_vps_.clear();
+    video_sps_.assign(sps, sps + sps_size);
+    video_pps_.assign(pps, pps + pps_size);
     
     MCSR_LOG(INFO) << "H.264 config set: SPS size=" << sps_size << ", PPS size=" << pps_size;
-    return true;
+    return !recording_ || writeCodecConfig();
+}
+
+bool Mp4Recorder::setH265Config(const uint8_t* vps, uint32_t vps_size, const uint8_t* sps,
+                                uint32_t sps_size, const uint8_t* pps, uint32_t pps_size) {
+    if (!vps || vps_size == 0 || !sps || sps_size == 0 || !pps || pps_size == 0) {
+        MCSR_LOG(ERROR) << "Invalid VPS/SPS/PPS data";
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    video_vps_.assign(vps, vps + vps_size);
+    video_sps_.assign(sps, sps + sps_size);
+    video_pps_.assign(pps, pps + pps_size);
+    
+    MCSR_LOG(INFO) << "H.265 config set: VPS size=" << vps_size << ", SPS size=" << sps_size << ", PPS size=" << pps_size;
+    return !recording_ || writeCodecConfig();
 }
 
 bool Mp4Recorder::writeVideoFrame(const uint8_t* data, uint32_t size, int64_t pts, bool is_keyframe) {
+    return writeVideoFrame(data, size, pts, pts, is_keyframe);
+}
+
+bool Mp4Recorder::writeVideoFrame(const uint8_t* data, uint32_t size, int64_t pts, int64_t dts,
+                                  bool is_keyframe) {
     if (!recording_) {
         MCSR_LOG(ERROR) << "Not recording";
         return false;
     }
+    if (video_queue_ || interleaver_ || config_.overflow_policy != OverflowPolicy::Block) {
+        // The frame is written later or maybe not at all; reject what writeVideoSample()
+        // would, so the caller still gets the result
+        if (has_queued_video_dts_ && dts < last_queued_video_dts_) {
+            MCSR_LOG(ERROR) << "Video DTS not monotonic: dts=" << dts << ", previous=" << last_queued_video_dts_;
+            return false;
+        }
+        if (pts - dts > INT32_MAX || pts - dts < INT32_MIN) {
+            MCSR_LOG(ERROR) << "Composition offset out of range: pts=" << pts << ", dts=" << dts;
+            return false;
+        }
+        if (!admitFrame(0, data, size, is_keyframe)) {
+            return true;  // Dropped by the overflow policy
+        }
+        if (video_queue_ && !queueFrame(*video_queue_, data, size, pts, dts, is_keyframe)) {
+            return false;
+        }
+        has_queued_video_dts_ = true;
+        last_queued_video_dts_ = dts;
+        if (video_queue_) {
+            return true;
+        }
+        if (interleaver_) {
+            interleaved_bytes_ += size;
+            interleaver_->push(0, data, size, pts, dts, is_keyframe);
+            return writeInterleaved();
+        }
+    }
+    return writeVideoSample(data, size, pts, dts, is_keyframe);
+}
+
+bool Mp4Recorder::writeVideoSample(const uint8_t* data, uint32_t size, int64_t pts, int64_t dts,
+                                   bool is_keyframe) {
+    ScopedLatency latency(stats_.write_latency);
+
+    // stts is derived from DTS deltas, so frames must arrive in decode order
+    if (has_video_dts_ && dts < last_video_dts_) {
+        MCSR_LOG(ERROR) << "Video DTS not monotonic: dts=" << dts << ", previous=" << last_video_dts_;
+        return false;
+    }
+    if (pts - dts > INT32_MAX || pts - dts < INT32_MIN) {
+        MCSR_LOG(ERROR) << "Composition offset out of range: pts=" << pts << ", dts=" << dts;
+        return false;
+    }
 
     // Log frame info BEFORE writing (offset is current mdat_size_)
     FrameInfo frame;
     frame.offset = mdat_size_;
     frame.size = size;
     frame.pts = pts;
-    frame.dts = pts;
+    frame.dts = dts;
     frame.is_keyframe = is_keyframe ? 1 : 0;
     frame.track_id = 0;  // Video track
 
@@ -217,12 +734,31 @@ bool Mp4Recorder::writeVideoFrame(const uint8_t* data, uint32_t size, int64_t pt
         return false;
     }
 
+    // Pick up in-band parameter sets so neither stop() nor recover() has to search mdat
+    if (is_keyframe && !hasVideoConfig()) {
+        std::vector<uint8_t> vps, sps, pps;
+        if (extractVideoConfigFromSample(data, size, config_.video_codec, vps, sps, pps)) {
+            video_vps_.swap(vps);
+            video_sps_.swap(sps);
+            video_pps_.swap(pps);
+            MCSR_LOG(INFO) << "Parameter sets detected in-band: SPS size=" << video_sps_.size() << ", PPS size=" << video_pps_.size();
+            if (!writeCodecConfig()) {
+                return false;
+            }
+        }
+    }
+
+    has_video_dts_ = true;
+    last_video_dts_ = dts;
+
     mdat_size_ += size;
-    frame_count_++;
+    addRelaxed(frame_count_, 1);
     frames_since_flush_++;
+    stats_.unflushed_frames.store(frames_since_flush_, std::memory_order_relaxed);
+    addRelaxed(stats_.video_frames, 1);
 
     // Flush if needed
-    if (!flushIfNeeded()) {
+    if (!flushIfNeeded(latency.begin())) {
         MCSR_LOG(ERROR) << "Failed to flush";
         return false;
     }
@@ -235,6 +771,22 @@ bool Mp4Recorder::writeAudioFrame(const uint8_t* data, uint32_t size, int64_t pt
         MCSR_LOG(ERROR) << "Not recording";
         return false;
     }
+    if (!admitFrame(1, data, size, true)) {
+        return true;  // Dropped by the overflow policy
+    }
+    if (audio_queue_) {
+        return queueFrame(*audio_queue_, data, size, pts, pts, true);
+    }
+    if (interleaver_) {
+        interleaved_bytes_ += size;
+        interleaver_->push(1, data, size, pts, pts, true);
+        return writeInterleaved();
+    }
+    return writeAudioSample(data, size, pts);
+}
+
+bool Mp4Recorder::writeAudioSample(const uint8_t* data, uint32_t size, int64_t pts) {
+    ScopedLatency latency(stats_.write_latency);
 
     // Write frame to mdat
     if (!writeFrameToMdat(data, size)) {
@@ -257,11 +809,13 @@ bool Mp4Recorder::writeAudioFrame(const uint8_t* data, uint32_t size, int64_t pt
     }
 
     mdat_size_ += size;
-    frame_count_++;
+    addRelaxed(frame_count_, 1);
     frames_since_flush_++;
+    stats_.unflushed_frames.store(frames_since_flush_, std::memory_order_relaxed);
+    addRelaxed(stats_.audio_frames, 1);
 
     // Flush if needed
-    if (!flushIfNeeded()) {
+    if (!flushIfNeeded(latency.begin())) {
         MCSR_LOG(ERROR) << "Failed to flush";
         return false;
     }
@@ -269,42 +823,332 @@ bool Mp4Recorder::writeAudioFrame(const uint8_t* data, uint32_t size, int64_t pt
     return true;
 }
 
+bool Mp4Recorder::queueFrame(FrameQueue& queue, const uint8_t* data, uint32_t size, int64_t pts, int64_t dts,
+                             bool is_keyframe) {
+    if (consumer_failed_.load(std::memory_order_acquire)) {
+        MCSR_LOG(ERROR) << "Recording failed; not accepting frames";
+        return false;
+    }
+    // Counted first, so the consumer never subtracts a frame that is not counted yet
+    queued_bytes_.fetch_add(size, std::memory_order_relaxed);
+    if (!queue.push(data, size, pts, dts, is_keyframe)) {
+        queued_bytes_.fetch_sub(size, std::memory_order_relaxed);
+        MCSR_LOG(ERROR) << (&queue == video_queue_.get() ? "Video" : "Audio") << " queue full, frame dropped: pts=" << pts;
+        return false;
+    }
+    // Pairs with the fence in waitForFrames(): either the consumer sees this frame, or we see it waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (consumer_waiting_.load(std::memory_order_relaxed)) {
+        {
+            std::lock_guard<std::mutex> lock(consumer_mutex_);
+        }
+        consumer_wake_.notify_one();
+    }
+    return true;
+}
+
+bool Mp4Recorder::startConsumer() {
+    video_queue_.reset(new FrameQueue(config_.track_queue_frames));
+    audio_queue_.reset(new FrameQueue(config_.track_queue_frames));
+    consumer_stop_.store(false, std::memory_order_relaxed);
+    consumer_failed_.store(false, std::memory_order_relaxed);
+    try {
+        consumer_ = std::thread(&Mp4Recorder::consumeFrames, this);
+    } catch (...) {
+        MCSR_LOG(ERROR) << "Failed to start frame consumer thread";
+        video_queue_.reset();
+        audio_queue_.reset();
+        return false;
+    }
+    return true;
+}
+
+void Mp4Recorder::stopConsumer() {
+    if (!consumer_.joinable()) {
+        return;
+    }
+    consumer_stop_.store(true, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(consumer_mutex_);
+    }
+    consumer_wake_.notify_one();
+    consumer_.join();
+    video_queue_.reset();
+    audio_queue_.reset();
+}
+
+void Mp4Recorder::consumeFrames() {
+    const auto window = std::chrono::milliseconds(config_.interleave_window_ms);
+    bool waiting_for_other_track = false;
+    std::chrono::steady_clock::time_point wait_begin;
+    while (true) {
+        bool stopping = consumer_stop_.load(std::memory_order_acquire);
+        QueuedFrame* video = video_queue_->front();
+        QueuedFrame* audio = audio_queue_->front();
+        if (!video && !audio) {
+            if (stopping) {
+                break;
+            }
+            waitForFrames(std::chrono::steady_clock::time_point::max());
+            continue;
+        }
+
+        // Write the earlier of the two heads. A head without a counterpart waits up to the
+        // interleave window for the other track, in case it brings an earlier frame.
+        bool take_video = video != nullptr;
+        if (video && audio) {
+            take_video = static_cast<long double>(video->dts) * config_.audio_timescale <=
+                         static_cast<long double>(audio->pts) * config_.video_timescale;
+        } else if (!stopping) {
+            auto now = std::chrono::steady_clock::now();
+            if (!waiting_for_other_track) {
+                waiting_for_other_track = true;
+                wait_begin = now;
+            }
+            if (now - wait_begin < window) {
+                waitForFrames(wait_begin + window);
+                continue;
+            }
+        }
+        waiting_for_other_track = false;
+
+        bool written;
+        if (interleaver_) {
+            QueuedFrame& frame = take_video ? *video : *audio;
+            uint32_t size = static_cast<uint32_t>(frame.data.size());
+            interleaver_->push(take_video ? 0 : 1, frame);
+            interleaved_bytes_ += size;
+            (take_video ? video_queue_ : audio_queue_)->pop();
+            queued_bytes_.fetch_sub(size, std::memory_order_relaxed);
+            notifyRoom();
+            std::lock_guard<std::mutex> lock(writer_mutex_);
+            written = writeInterleaved();
+        } else {
+            QueuedFrame& frame = take_video ? *video : *audio;
+            uint32_t size = static_cast<uint32_t>(frame.data.size());
+            {
+                std::lock_guard<std::mutex> lock(writer_mutex_);
+                written = take_video ? writeVideoSample(frame.data.data(), size, frame.pts, frame.dts, frame.is_keyframe)
+                                     : writeAudioSample(frame.data.data(), size, frame.pts);
+            }
+            (take_video ? video_queue_ : audio_queue_)->pop();
+            queued_bytes_.fetch_sub(size, std::memory_order_relaxed);
+            notifyRoom();
+        }
+        if (!written && !consumer_failed_.exchange(true, std::memory_order_acq_rel)) {
+            MCSR_LOG(ERROR) << "Failed to write queued frame; rejecting further frames";
+        }
+    }
+}
+
+bool Mp4Recorder::writeInterleaved() {
+    const uint64_t budget = config_.memory_budget_bytes;
+    bool written = true;
+    uint8_t track_id = 0;
+    while (true) {
+        const QueuedFrame* frame = interleaver_->next(track_id);
+        if (!frame) {
+            // Runs go out before they are complete rather than hold more than the budget
+            bool pressure = budget > 0 && queued_bytes_.load(std::memory_order_relaxed) + interleaved_bytes_ > budget;
+            if (!pressure || interleaver_->bufferedFrames() == 0) {
+                break;
+            }
+            interleaver_->releaseNextRun();
+            continue;
+        }
+        uint32_t size = static_cast<uint32_t>(frame->data.size());
+        written = (track_id == 0 ? writeVideoSample(frame->data.data(), size, frame->pts, frame->dts, frame->is_keyframe)
+                                 : writeAudioSample(frame->data.data(), size, frame->pts)) && written;
+        interleaver_->pop();
+        interleaved_bytes_ -= size;
+    }
+    return written;
+}
+
+bool Mp4Recorder::admitFrame(uint8_t track_id, const uint8_t* data, uint32_t size, bool is_keyframe) {
+    const OverflowPolicy policy = config_.overflow_policy;
+    FrameQueue* queue = track_id == 0 ? video_queue_.get() : audio_queue_.get();
+    if (policy == OverflowPolicy::Block) {
+        // Direct writes block on the storage anyway; writeInterleaved() keeps the budget
+        if (queue) {
+            waitForRoom(*queue, size);
+        }
+        return true;
+    }
+
+    const uint64_t budget = config_.memory_budget_bytes;
+    if (track_id == 0) {
+        // Audio keeps the last quarter of the budget to itself
+        uint64_t video_budget = policy == OverflowPolicy::DropAudioLast ? budget - budget / 4 : budget;
+        bool over = overBudget(queue, size, video_budget);
+        if (dropping_video_) {
+            // Frames after a dropped one may refer to it; only a keyframe starts clean
+            if (!is_keyframe || over) {
+                stats_.dropped_video_frames.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            dropping_video_ = false;
+            MCSR_LOG(INFO) << "Video resumed at a keyframe after dropping frames";
+        } else if (over) {
+            if (policy != OverflowPolicy::DropNonReference) {
+                dropping_video_ = true;
+                MCSR_LOG(WARNING) << "Recorder over its buffer limit; dropping video until the next keyframe";
+                stats_.dropped_video_frames.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (isNonReferenceFrame(data, size, config_.video_codec)) {
+                stats_.dropped_video_frames.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+    } else if (policy != OverflowPolicy::DropNonReference && overBudget(queue, size, budget)) {
+        stats_.dropped_audio_frames.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Admitted while over the limit, e.g. a reference frame with DropNonReference
+    if (queue) {
+        waitForRoom(*queue, size);
+    }
+    return true;
+}
+
+bool Mp4Recorder::overBudget(const FrameQueue* queue, uint32_t size, uint64_t budget) const {
+    if (queue && queue->size() >= queue->capacity()) {
+        return true;
+    }
+    if (queue && budget > 0 && queued_bytes_.load(std::memory_order_relaxed) + size > budget) {
+        return true;
+    }
+    return file_ops_->congested();
+}
+
+void Mp4Recorder::waitForRoom(const FrameQueue& queue, uint32_t size) {
+    const uint64_t budget = config_.memory_budget_bytes;
+    // Queued frames always get written, so a frame larger than the budget waits for empty
+    // queues rather than forever
+    auto has_room = [&] {
+        if (consumer_failed_.load(std::memory_order_acquire)) {
+            return true;  // queueFrame() rejects the frame
+        }
+        if (queue.size() >= queue.capacity()) {
+            return false;
+        }
+        uint64_t queued = queued_bytes_.load(std::memory_order_relaxed);
+        return budget == 0 || queued == 0 || queued + size <= budget;
+    };
+    if (has_room()) {
+        return;
+    }
+    MCSR_TRACE_SCOPE("write", "waitForRoom");
+    stats_.overflow_waits.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(consumer_mutex_);
+    producers_waiting_.fetch_add(1, std::memory_order_relaxed);
+    // Pairs with the fence in notifyRoom(): either the consumer sees us waiting, or we see the room it made
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    room_available_.wait(lock, has_room);
+    producers_waiting_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Mp4Recorder::notifyRoom() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (producers_waiting_.load(std::memory_order_relaxed) > 0) {
+        {
+            std::lock_guard<std::mutex> lock(consumer_mutex_);
+        }
+        room_available_.notify_all();
+    }
+}
+
+void Mp4Recorder::waitForFrames(std::chrono::steady_clock::time_point deadline) {
+    size_t video_frames = video_queue_->size();
+    size_t audio_frames = audio_queue_->size();
+    std::unique_lock<std::mutex> lock(consumer_mutex_);
+    consumer_waiting_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto changed = [&] {
+        return consumer_stop_.load(std::memory_order_acquire) || video_queue_->size() != video_frames ||
+               audio_queue_->size() != audio_frames;
+    };
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+        consumer_wake_.wait(lock, changed);
+    } else {
+        consumer_wake_.wait_until(lock, deadline, changed);
+    }
+    consumer_waiting_.store(false, std::memory_order_relaxed);
+}
+
 bool Mp4Recorder::stop() {
     if (!recording_) {
         MCSR_LOG(ERROR) << "Not recording";
         return false;
     }
+    auto stop_begin = std::chrono::steady_clock::now();
+    MCSR_TRACE_SCOPE("finalize", "stop");
 
      recording_ = false;
+     stopConsumer();
+     // Frames still held back for interleaving go out before mdat is closed
+     if (interleaver_) {
+         interleaver_->finish();
+         if (!writeInterleaved()) {
+             MCSR_LOG(ERROR) << "Failed to write interleaved frames";
+         }
+         interleaver_.reset();
+     }
+     // Finalizing syncs on its own; wait for a batch that may be syncing our files
+     sync_participant_.reset();
+     stats_.recording.store(false, std::memory_order_relaxed);
      
      // Flush mp4 file before writing moov
      if (mp4_file_) {
          mp4_file_->flush();
      }
+     stats_.unflushed_frames.store(0, std::memory_order_relaxed);
      
-      // Update mdat box size (mdat_start_ - 8 is the position of mdat size field)
-      // mdat size = 8 (header) + mdat_size_ (data)
-      uint32_t mdat_total_size = 8 + mdat_size_;
-      MCSR_LOG(INFO) << "Updating mdat size: mdat_size_=" << mdat_size_ << ", mdat_total_size=" << mdat_total_size << ", mdat_start_=" << mdat_start_;
+      // Update mdat box size, then put moov right after the last mdat byte through the same handle
+      MCSR_LOG(INFO) << "Updating mdat size: mdat_size_=" << mdat_size_ << ", mdat_start_=" << mdat_start_;
       if (mp4_file_) {
-          mp4_file_->seek(static_cast<int64_t>(mdat_start_ - 8), SEEK_SET);
-          uint8_t size_bytes[4] = {
-              (uint8_t)((mdat_total_size >> 24) & 0xFF),
-              (uint8_t)((mdat_total_size >> 16) & 0xFF),
-              (uint8_t)((mdat_total_size >> 8) & 0xFF),
-              (uint8_t)(mdat_total_size & 0xFF)
-          };
-          mp4_file_->write(size_bytes, 4);
-          mp4_file_->flush();
-          mp4_file_->close();  // Close mp4_file_ before buildAndWriteMoov
-          mp4_file_.reset();
+          if (!writeMdatBoxSize(*mp4_file_, mdat_header_offset_,
+                                static_cast<uint32_t>(mdat_start_ - mdat_header_offset_), mdat_size_)) {
+              return false;
+          }
+          mp4_file_->seek(static_cast<int64_t>(mdat_start_ + mdat_size_), SEEK_SET);
       }
 
+     // Journal the moov write in the index, so recovery after a crash from here on
+     // drops a partial moov or just cleans up after a complete one
+     bool journaled = mp4_file_ && idx_file_ && mp4_file_->sync() &&
+                      appendFinalizeMarker(*idx_file_, FinalizeState::Begin, mdat_start_ + mdat_size_, 0,
+                                           frame_count_) &&
+                      idx_file_->sync();
+     if (journaled) {
+         addRelaxed(stats_.index_records, 1);
+     }
+     journal_.publish();
+
      // Build and write moov
+     auto moov_begin = std::chrono::steady_clock::now();
      if (!buildAndWriteMoov()) {
          MCSR_LOG(ERROR) << "Failed to build and write moov";
          return false;
      }
+     stats_.moov_build_us.store(elapsedNs(moov_begin) / 1000, std::memory_order_relaxed);
+
+     if (mp4_file_) {
+         mp4_file_->flush();
+         int64_t file_end = mp4_file_->tell();
+         if (mp4_file_->sync()) {
+             stats_.durable_frames.store(frame_count_, std::memory_order_relaxed);
+         }
+         mp4_file_->close();
+         mp4_file_.reset();
+         if (journaled && file_end >= 0 &&
+             appendFinalizeMarker(*idx_file_, FinalizeState::Done, mdat_start_ + mdat_size_,
+                                  static_cast<uint64_t>(file_end), frame_count_)) {
+             addRelaxed(stats_.index_records, 1);
+         }
+     }
 
      // Close remaining files
       if (idx_file_) {
@@ -322,6 +1166,7 @@ bool Mp4Recorder::stop() {
         return false;
     }
 
+    stats_.finalize_us.store(elapsedNs(stop_begin) / 1000, std::memory_order_relaxed);
     MCSR_LOG(INFO) << "Recording stopped: " << mp4_filename_;
     return true;
 }
@@ -335,153 +1180,239 @@ bool Mp4Recorder::hasIncompleteRecording(const std::string& filename) {
 }
 
 bool Mp4Recorder::recover(const std::string& filename) {
+    return recover(filename, config_);
+}
+
+bool Mp4Recorder::recover(const std::string& filename, const RecorderConfig& fallback_config) {
     MCSR_LOG(INFO) << "Recovering from incomplete recording: " << filename;
+    recovery_stats_ = RecoveryStats();
+    auto recovery_begin = std::chrono::steady_clock::now();
+    auto phase_begin = recovery_begin;
 
     std::string idx_filename = filename + ".idx";
     std::string lock_filename = filename + ".lock";
 
-    // Read index file
-    IndexFile idx(file_ops_);
-    if (!idx.open(idx_filename)) {
-        MCSR_LOG(ERROR) << "Failed to open index file";
-        return false;
+    // After a process crash the shared memory journal can hold index entries that never
+    // reached the disk
+    if (ShmJournal::restore(filename, *file_ops_, idx_filename)) {
+        MCSR_LOG(INFO) << "Recovery: using index restored from shared memory journal";
     }
 
-    // Read config from index file
+    // Read index file; without a usable one the samples are re-derived from mdat
+    IndexFile idx(file_ops_);
     RecorderConfig recovery_config;
-    if (!idx.readConfig(recovery_config)) {
-        MCSR_LOG(ERROR) << "Failed to read config from index file";
-        return false;
+    bool has_index = file_ops_->exists(idx_filename) && idx.open(idx_filename) &&
+                     idx.readConfig(recovery_config);
+    if (has_index) {
+        MCSR_LOG(INFO) << "Recovery: config read from index (timescale=" << recovery_config.video_timescale << ", resolution=" << recovery_config.video_width << "x" << recovery_config.video_height << ")";
+    } else {
+        recovery_config = fallback_config;
+        MCSR_LOG(WARNING) << "Recovery: index file missing or unreadable, scanning mdat instead";
     }
-    
-    MCSR_LOG(INFO) << "Recovery: config read from index (timescale=" << recovery_config.video_timescale << ", resolution=" << recovery_config.video_width << "x" << recovery_config.video_height << ")";
 
-    std::vector<FrameInfo> video_frames, audio_frames;
-    if (!idx.readAllFrames(video_frames, audio_frames)) {
-        MCSR_LOG(ERROR) << "Failed to read frames from index";
-        return false;
+    // A stop() or recover() that got as far as writing the moov journaled it in the index
+    FinalizeMarker marker;
+    bool has_marker = has_index && readFinalizeMarker(idx, marker);
+    if (has_marker && isFinalized(*file_ops_, filename, marker)) {
+        MCSR_LOG(INFO) << "Recovery: moov already written at " << marker.moov_offset << "; removing leftover files";
+        idx.close();
+        removeRecordingFiles(*file_ops_, idx_filename, lock_filename);
+        ShmJournal::remove(filename);
+        recovery_stats_.index_read_us = lapUs(phase_begin, "readIndex");
+        recovery_stats_.total_us = lapUs(recovery_begin, "recover");
+        return true;
     }
+    if (has_marker) {
+        MCSR_LOG(WARNING) << "Recovery: moov write at " << marker.moov_offset << " was interrupted; rebuilding it";
+    }
+    uint64_t frame_count = has_index ? idx.getFrameCount() : 0;
 
-    MCSR_LOG(INFO) << "Recovery: read " << video_frames.size() << " video frames, " << audio_frames.size() << " audio frames";
-    
-    // Close index file before attempting to delete it
-    idx.close();
+    SampleTable video_table;
+    SampleTable audio_table;
+    std::vector<uint8_t> recovered_vps;
+    std::vector<uint8_t> recovered_sps;
+    std::vector<uint8_t> recovered_pps;
+    bool has_codec_config = false;
+    FileLayout layout;
+    bool has_layout = false;
+    if (has_index) {
+        std::vector<uint8_t> layout_payload;
+        uint64_t layout_end = 0;
+        has_layout = idx.readRecordAt(IndexFile::frameDataStart(), IndexRecordType::FileLayout,
+                                      layout_payload, layout_end) &&
+                     decodeFileLayout(layout_payload, layout);
+
+
+        // Start from the newest intact snapshot, then replay only the entries logged after it
+        std::vector<uint8_t> snapshot;
+        uint64_t replay_position = IndexFile::frameDataStart();
+        uint64_t snapshot_end = 0;
+        if (idx.findLastRecord(IndexRecordType::TableSnapshot, snapshot, snapshot_end)) {
+            if (decodeTableSnapshot(snapshot, video_table, audio_table)) {
+                replay_position = snapshot_end;
+                MCSR_LOG(INFO) << "Recovery: loaded snapshot with " << video_table.sampleCount() << " video frames, " << audio_table.sampleCount() << " audio frames";
+            } else {
+                MCSR_LOG(WARNING) << "Recovery: snapshot could not be decoded; replaying full index";
+                video_table.reset();
+                audio_table.reset();
+            }
+        }
 
-    // Calculate mdat_start from file structure
-    // ftyp box is 32 bytes, mdat header is 8 bytes, so mdat data starts at offset 40
-    uint64_t mdat_start = 40;
-    MCSR_LOG(INFO) << "Recovery: mdat_start=" << mdat_start;
-    
-    // Calculate actual mdat size from frame data
-    uint64_t mdat_size = 0;
-    for (const auto& frame : video_frames) {
-        uint64_t frame_end = frame.offset + frame.size;
-        if (frame_end > mdat_size) {
-            mdat_size = frame_end;
+        std::vector<FrameInfo> video_frames, audio_frames;
+        if (!idx.readFramesFrom(replay_position, video_frames, audio_frames)) {
+            MCSR_LOG(ERROR) << "Failed to read frames from index";
+            return false;
         }
-    }
-    for (const auto& frame : audio_frames) {
-        uint64_t frame_end = frame.offset + frame.size;
-        if (frame_end > mdat_size) {
-            mdat_size = frame_end;
+        for (const auto& frame : video_frames) {
+            video_table.append(frame);
+        }
+        for (const auto& frame : audio_frames) {
+            audio_table.append(frame);
+        }
+
+        MCSR_LOG(INFO) << "Recovery: replayed " << video_frames.size() << " video frames, " << audio_frames.size() << " audio frames";
+
+        std::vector<uint8_t> codec_config;
+        uint64_t codec_config_end = 0;
+        has_codec_config = idx.findLastRecord(IndexRecordType::CodecConfig, codec_config, codec_config_end) &&
+                           decodeCodecConfig(codec_config, recovery_config.video_codec, recovered_vps,
+                                             recovered_sps, recovered_pps);
+        if (!has_codec_config) {
+            recovered_vps.clear();
+            recovered_sps.clear();
+            recovered_pps.clear();
         }
     }
     
-    MCSR_LOG(INFO) << "Recovery: calculated mdat_size=" << mdat_size;
-    
-    // Update mdat box size in the MP4 file
-    // mdat box header is at offset 32 (after ftyp), size field is first 4 bytes
-    std::unique_ptr<IFile> mp4_file = file_ops_->open(filename, "r+b");
-    if (!mp4_file || !mp4_file->isOpen()) {
-        MCSR_LOG(ERROR) << "Failed to open MP4 file for updating mdat size";
-        return false;
-    }
+    // Close index file before attempting to delete it
+    idx.close();
+    recovery_stats_.index_read_us = lapUs(phase_begin, "readIndex");
 
     uint64_t file_size = 0;
     if (!file_ops_->getFileSize(filename, file_size)) {
         MCSR_LOG(ERROR) << "Failed to read MP4 file size";
         return false;
     }
-    if (file_size < 40) {
-        MCSR_LOG(ERROR) << "MP4 file too small to contain ftyp+mdat header";
+
+    // Validate the recorded layout with one small read; without one (older or missing index)
+    // derive it from the top-level boxes
+    std::unique_ptr<IFile> read_file = file_ops_->open(filename, "rb");
+    if (!read_file || !read_file->isOpen()) {
+        MCSR_LOG(ERROR) << "Failed to open MP4 file for reading";
         return false;
     }
-    
-    // Seek to mdat size field (offset 32)
-    if (!mp4_file->seek(32, SEEK_SET)) {
-        MCSR_LOG(ERROR) << "Failed to seek MP4 file to mdat size field";
+    if (has_layout ? !verifyFileLayout(*read_file, layout) : !probeFileLayout(*read_file, file_size, layout)) {
+        MCSR_LOG(ERROR) << "MP4 header does not match the expected ftyp+mdat layout";
         return false;
     }
-    
-    // Write mdat total size based on actual file size before moov is appended
-    uint64_t mdat_total_size_64 = file_size - 32;
-    if (mdat_total_size_64 > 0xFFFFFFFFULL) {
-        MCSR_LOG(ERROR) << "mdat size exceeds 32-bit limit";
+    uint64_t mdat_start = layout.mdat_start;
+    MCSR_LOG(INFO) << "Recovery: mdat header at " << layout.mdat_header_offset << ", mdat_start=" << mdat_start << (has_layout ? " (from index)" : " (probed)");
+
+    // mdat and idx are synced separately, so frames often reach the mp4 before their index
+    // entries do. Parse forward from the end of the last indexed frame to salvage them.
+    uint64_t indexed_end = std::max(video_table.dataEnd(), audio_table.dataEnd());
+    uint64_t written_end = file_size - mdat_start;
+    if (has_marker && marker.moov_offset >= mdat_start && marker.moov_offset < file_size) {
+        // Everything from the interrupted moov on is dropped by the truncation below
+        written_end = marker.moov_offset - mdat_start;
+    }
+    if (indexed_end < written_end) {
+        MdatScanner scanner(recovery_config.video_codec);
+        scanner.setKnownMaxVideoSampleSize(video_table.sizes().maxSize());
+        std::vector<ScannedSample> samples;
+        if (!scanner.scan(*read_file, mdat_start, indexed_end, written_end, samples)) {
+            MCSR_LOG(ERROR) << "Failed to scan mdat";
+            return false;
+        }
+        appendScannedSamples(samples, recovery_config, video_table, audio_table);
+        recovery_stats_.salvaged_frames = samples.size();
+        MCSR_LOG(INFO) << "Recovery: salvaged " << scanner.stats().video_samples << " video frames, " << scanner.stats().audio_samples << " audio frames past offset " << indexed_end << " (" << scanner.stats().skipped_bytes << " bytes skipped)";
+    }
+    if (!has_index && video_table.empty() && audio_table.empty()) {
+        MCSR_LOG(ERROR) << "Recovery: no frames found in mdat";
         return false;
     }
+    recovery_stats_.mdat_scan_us = lapUs(phase_begin, "scanMdat");
+
+    // Parameter sets persisted in the index avoid reading mdat; otherwise extract them
+    // from the recorded frames to build a valid avcC/hvcC box
+    if (has_codec_config) {
+        MCSR_LOG(INFO) << "Recovery: using SPS/PPS from index (SPS=" << recovered_sps.size() << " bytes, PPS=" << recovered_pps.size() << " bytes)";
+    } else if (extractVideoConfigFromMdat(*read_file, mdat_start, video_table, recovery_config.video_codec,
+                                          recovered_vps, recovered_sps, recovered_pps)) {
+        MCSR_LOG(INFO) << "Recovery: extracted SPS/PPS from mdat (SPS=" << recovered_sps.size() << " bytes, PPS=" << recovered_pps.size() << " bytes)";
+    } else {
+        MCSR_LOG(WARNING) << "Recovery: failed to extract SPS/PPS from mdat; using fallback decoder config";
+    }
+    read_file->close();
+    recovery_stats_.codec_config_us = lapUs(phase_begin, "extractCodecConfig");
 
-    uint32_t mdat_total_size = static_cast<uint32_t>(mdat_total_size_64);
-    uint8_t size_bytes[4] = {
-        (uint8_t)((mdat_total_size >> 24) & 0xFF),
-        (uint8_t)((mdat_total_size >> 16) & 0xFF),
-        (uint8_t)((mdat_total_size >> 8) & 0xFF),
-        (uint8_t)(mdat_total_size & 0xFF)
-    };
-    
-    if (mp4_file->write(size_bytes, 4) != 4) {
-        MCSR_LOG(ERROR) << "Failed to write mdat size";
+    // Calculate actual mdat size from frame data (offsets increase within a track)
+    uint64_t mdat_size = std::max(video_table.dataEnd(), audio_table.dataEnd());
+    MCSR_LOG(INFO) << "Recovery: calculated mdat_size=" << mdat_size;
+
+    // Drop the torn frame and any junk after the last sample, so moov follows mdat directly.
+    // If the file cannot be truncated, mdat keeps covering the whole tail instead.
+    if (mdat_start + mdat_size < file_size) {
+        if (file_ops_->truncate(filename, mdat_start + mdat_size)) {
+            MCSR_LOG(INFO) << "Recovery: truncated " << (file_size - mdat_start - mdat_size) << " trailing bytes";
+            file_size = mdat_start + mdat_size;
+        } else {
+            MCSR_LOG(WARNING) << "Recovery: failed to truncate trailing bytes; keeping them inside mdat";
+        }
+    }
+
+    // Update mdat box size in the MP4 file
+    std::unique_ptr<IFile> mp4_file = file_ops_->open(filename, "r+b");
+    if (!mp4_file || !mp4_file->isOpen()) {
+        MCSR_LOG(ERROR) << "Failed to open MP4 file for updating mdat size";
+        return false;
+    }
+    if (!writeMdatBoxSize(*mp4_file, layout.mdat_header_offset, layout.mdat_header_size,
+                          file_size - mdat_start)) {
         return false;
     }
-    
     mp4_file->flush();
     
-    MCSR_LOG(INFO) << "Recovery: updated mdat size to " << mdat_total_size << " (file_size=" << file_size << ")";
-
-    // Attempt to extract SPS/PPS from mdat to build a valid avcC box
-    std::vector<uint8_t> recovered_sps;
-    std::vector<uint8_t> recovered_pps;
-    if (extractH264ConfigFromMdat(*file_ops_, filename, mdat_start, video_frames, recovered_sps, recovered_pps)) {
-        MCSR_LOG(INFO) << "Recovery: extracted SPS/PPS from mdat (SPS=" << recovered_sps.size() << " bytes, PPS=" << recovered_pps.size() << " bytes)";
-    } else {
-        MCSR_LOG(WARNING) << "Recovery: failed to extract SPS/PPS from mdat; using fallback avcC";
-    }
+    MCSR_LOG(INFO) << "Recovery: updated mdat size to " << (layout.mdat_header_size + file_size - mdat_start) << " (file_size=" << file_size << ")";
 
-    // Build moov using config from index file
+    // Write moov to the end of the mp4 through the handle used for the mdat patch
     MoovBuilder builder;
-    std::vector<uint8_t> moov_data;
-    if (!builder.buildMoov(video_frames, audio_frames, 
-                          recovery_config.video_timescale, recovery_config.audio_timescale,
-                          recovery_config.audio_sample_rate, recovery_config.audio_channels,
-                          recovery_config.video_width, recovery_config.video_height,
-                          recovered_sps.empty() ? nullptr : recovered_sps.data(),
-                          recovered_sps.size(),
-                          recovered_pps.empty() ? nullptr : recovered_pps.data(),
-                          recovered_pps.size(),
-                          mdat_start,
-                          moov_data)) {
-        MCSR_LOG(ERROR) << "Failed to build moov";
-        return false;
-    }
-
-    // Write moov to mp4
-    if (!builder.writeMoovToFile(filename, moov_data, file_ops_.get())) {
+    MoovConfig moov_config = makeMoovConfig(recovery_config, recovered_vps, recovered_sps,
+                                            recovered_pps, mdat_start);
+    if (!mp4_file->seek(0, SEEK_END)) {
+        MCSR_LOG(ERROR) << "Failed to seek MP4 file to end";
+        return false;
+    }
+    // Journal the moov write, so a crash from here on is detected and undone by the next run
+    bool journaled = has_index && mp4_file->sync() &&
+                     journalFinalize(*file_ops_, idx_filename, FinalizeState::Begin, file_size, 0, frame_count);
+    if (has_index && !journaled) {
+        MCSR_LOG(WARNING) << "Recovery: failed to journal moov write in index";
+    }
+    if (!builder.writeMoov(video_table, audio_table, moov_config, *mp4_file)) {
         MCSR_LOG(ERROR) << "Failed to write moov to mp4";
         return false;
     }
+    mp4_file->flush();
+    int64_t file_end = mp4_file->tell();
+    mp4_file->sync();
+    mp4_file->close();
+
+    if (journaled && (file_end < 0 ||
+                      !journalFinalize(*file_ops_, idx_filename, FinalizeState::Done, file_size,
+                                       static_cast<uint64_t>(file_end), frame_count))) {
+        MCSR_LOG(WARNING) << "Recovery: failed to record moov completion in index";
+    }
 
     // Cleanup index and lock files
-    if (!file_ops_->remove(idx_filename)) {
-        MCSR_LOG(WARNING) << "Failed to delete index file: " << idx_filename;
-    } else {
-        MCSR_LOG(INFO) << "Deleted index file: " << idx_filename;
-    }
-    
-    if (!file_ops_->remove(lock_filename)) {
-        MCSR_LOG(WARNING) << "Failed to delete lock file: " << lock_filename;
-    } else {
-        MCSR_LOG(INFO) << "Deleted lock file: " << lock_filename;
-    }
+    removeRecordingFiles(*file_ops_, idx_filename, lock_filename);
+    ShmJournal::remove(filename);
 
+    recovery_stats_.moov_write_us = lapUs(phase_begin, "writeMoov");
+    recovery_stats_.total_us = lapUs(recovery_begin, "recover");
+    recovery_stats_.video_frames = video_table.sampleCount();
+    recovery_stats_.audio_frames = audio_table.sampleCount();
     MCSR_LOG(INFO) << "Recovery completed successfully";
     return true;
 }
@@ -493,6 +1424,7 @@ bool Mp4Recorder::createFiles(const std::string& filename) {
         MCSR_LOG(ERROR) << "Failed to create mp4 file";
         return false;
     }
+    mp4_file_.reset(new CountingFile(std::move(mp4_file_), stats_.mp4_bytes_written));
 
     // Write ftyp box (32 bytes for better compatibility)
     // ftyp structure: size(4) + type(4) + major_brand(4) + minor_version(4) + compatible_brands(16)
@@ -511,6 +1443,8 @@ bool Mp4Recorder::createFiles(const std::string& filename) {
         return false;
     }
 
+    mdat_header_offset_ = sizeof(ftyp);
+
     // Write mdat placeholder (size = 0 means until EOF)
     // This will be updated later when we know the actual size
     uint8_t mdat_header[8] = {
@@ -537,6 +1471,16 @@ bool Mp4Recorder::createFiles(const std::string& filename) {
         return false;
     }
 
+    // Mirror every index byte into shared memory; without it, fsync stays at flush cadence
+    if (config_.shm_journal) {
+        if (journal_.create(filename)) {
+            idx_file_.reset(new JournaledFile(std::move(idx_file_), journal_));
+        } else {
+            MCSR_LOG(WARNING) << "Shared memory journal unavailable; syncing at flush interval";
+        }
+    }
+    idx_file_.reset(new CountingFile(std::move(idx_file_), stats_.idx_bytes_written));
+
     // Write config header to index file
     // Magic number for validation
     uint32_t magic = 0x4D503452;  // "MP4R" in hex
@@ -551,6 +1495,20 @@ bool Mp4Recorder::createFiles(const std::string& filename) {
         return false;
     }
     
+    // Record the layout so recovery does not have to assume where mdat is
+    FileLayout layout;
+    layout.mdat_header_offset = mdat_header_offset_;
+    layout.mdat_header_size = static_cast<uint32_t>(mdat_start_ - mdat_header_offset_);
+    layout.mdat_start = mdat_start_;
+    layout.ftyp.assign(ftyp, ftyp + sizeof(ftyp));
+    std::vector<uint8_t> layout_payload;
+    encodeFileLayout(layout, layout_payload);
+    if (!IndexFile::appendRecord(*idx_file_, IndexRecordType::FileLayout, 0, layout_payload)) {
+        MCSR_LOG(ERROR) << "Failed to write file layout to index";
+        return false;
+    }
+    addRelaxed(stats_.index_records, 1);
+    
     idx_file_->flush();
     MCSR_LOG(INFO) << "Config written to index file";
 
@@ -567,6 +1525,7 @@ bool Mp4Recorder::createFiles(const std::string& filename) {
 }
 
 bool Mp4Recorder::writeFrameToMdat(const uint8_t* data, uint32_t size) {
+    MCSR_TRACE_SCOPE("write", "writeFrameToMdat");
     if (mp4_file_->write(data, size) != size) {
         MCSR_LOG(ERROR) << "Failed to write frame to mdat";
         return false;
@@ -575,6 +1534,7 @@ bool Mp4Recorder::writeFrameToMdat(const uint8_t* data, uint32_t size) {
 }
 
 bool Mp4Recorder::logFrameToIndex(const FrameInfo& frame) {
+    MCSR_TRACE_SCOPE("write", "logFrameToIndex");
     if (!idx_file_) {
         MCSR_LOG(ERROR) << "Index file not open";
         return false;
@@ -585,26 +1545,41 @@ bool Mp4Recorder::logFrameToIndex(const FrameInfo& frame) {
         return false;
     }
     
-    // Also add to in-memory frame list for moov building
+    // Also update the in-memory sample tables for moov building
      if (frame.track_id == 0) {
-         video_frames_.push_back(frame);
+         video_table_.append(frame);
          MCSR_LOG(VERBOSE) << "Indexed video frame: pts=" << frame.pts << ", size=" << frame.size << ", offset=" << frame.offset;
      } else if (frame.track_id == 1) {
-         audio_frames_.push_back(frame);
+         audio_table_.append(frame);
      }
     
     return true;
 }
 
-bool Mp4Recorder::flushIfNeeded() {
-    auto now = std::chrono::steady_clock::now();
+bool Mp4Recorder::flushIfNeeded(std::chrono::steady_clock::time_point now) {
     uint64_t elapsed_ms = static_cast<uint64_t>(
         std::chrono::duration_cast<std::chrono::milliseconds>(now - last_flush_time_).count());
 
-    if (elapsed_ms >= config_.flush_interval_ms || 
+    // Snapshots bound recovery time: only index entries after the last one are replayed
+    bool snapshot_written = false;
+    if (config_.snapshot_interval_ms > 0) {
+        uint64_t snapshot_elapsed_ms = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(now - last_snapshot_time_).count());
+        if (snapshot_elapsed_ms >= config_.snapshot_interval_ms) {
+            if (!writeTableSnapshot()) {
+                return false;
+            }
+            last_snapshot_time_ = now;
+            snapshot_written = true;
+        }
+    }
+
+    if (snapshot_written || elapsed_ms >= config_.flush_interval_ms || 
         frames_since_flush_ >= config_.flush_frame_count) {
         
         // Flush C library buffers for both files
+        auto flush_begin = std::chrono::steady_clock::now();
+        MCSR_TRACE_SCOPE("flush", "flushIfNeeded");
         if (!mp4_file_->flush()) {
             MCSR_LOG(ERROR) << "Failed to flush mp4 file";
             return false;
@@ -613,57 +1588,103 @@ bool Mp4Recorder::flushIfNeeded() {
             MCSR_LOG(ERROR) << "Failed to flush idx file";
             return false;
         }
+        stats_.flush_latency.record(elapsedNs(flush_begin));
+        addRelaxed(stats_.flush_count, 1);
         
+        // Frame data is in the kernel now and survives a process crash, so the matching
+        // index entries can be exposed to recovery through the journal
+        journal_.publish();
+
         // Sync to disk (CRITICAL for crash safety)
-        // This ensures data is written to physical disk
-        if (!mp4_file_->sync()) {
-            MCSR_LOG(ERROR) << "Failed to sync mp4 file to disk";
-            return false;
-        }
-        if (!idx_file_->sync()) {
-            MCSR_LOG(ERROR) << "Failed to sync idx file to disk";
-            return false;
+        // This ensures data is written to physical disk. With the shared memory journal
+        // only power loss needs it, which is covered at the lower sync_interval_ms cadence.
+        uint64_t sync_elapsed_ms = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(now - last_sync_time_).count());
+        if (!journal_.ok() || snapshot_written || sync_elapsed_ms >= config_.sync_interval_ms) {
+            if (sync_participant_) {
+                // The coordinator syncs this recording with the others on its filesystem
+                if (sync_participant_->failed()) {
+                    MCSR_LOG(ERROR) << "Failed to sync recording files to disk";
+                    return false;
+                }
+                sync_participant_->requestSync(frame_count_.load(std::memory_order_relaxed));
+            } else {
+                auto sync_begin = std::chrono::steady_clock::now();
+                MCSR_TRACE_SCOPE("flush", "fsync");
+                if (!mp4_file_->sync()) {
+                    MCSR_LOG(ERROR) << "Failed to sync mp4 file to disk";
+                    return false;
+                }
+                if (!idx_file_->sync()) {
+                    MCSR_LOG(ERROR) << "Failed to sync idx file to disk";
+                    return false;
+                }
+                stats_.fsync_latency.record(elapsedNs(sync_begin));
+                addRelaxed(stats_.fsync_count, 1);
+                stats_.durable_frames.store(frame_count_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            last_sync_time_ = now;
         }
 
         last_flush_time_ = now;
         frames_since_flush_ = 0;
+        stats_.unflushed_frames.store(0, std::memory_order_relaxed);
+    }
+
+    return true;
+}
+
+bool Mp4Recorder::writeTableSnapshot() {
+    MCSR_TRACE_SCOPE("flush", "writeTableSnapshot");
+    // Repeat the codec config next to each snapshot, so recovery finds both in the tail
+    if (hasVideoConfig() && !writeCodecConfig()) {
+        return false;
+    }
+
+    std::vector<uint8_t> payload;
+    encodeTableSnapshot(video_table_, audio_table_, payload);
+    if (!IndexFile::appendRecord(*idx_file_, IndexRecordType::TableSnapshot, frame_count_, payload)) {
+        MCSR_LOG(ERROR) << "Failed to write sample table snapshot";
+        return false;
     }
+    addRelaxed(stats_.index_records, 1);
+    MCSR_LOG(INFO) << "Sample table snapshot written: " << payload.size() << " bytes, " << frame_count_ << " frames";
+    return true;
+}
+
+bool Mp4Recorder::hasVideoConfig() const {
+    return !video_sps_.empty() && !video_pps_.empty() &&
+           (config_.video_codec != VideoCodec::H265 || !video_vps_.empty());
+}
 
+bool Mp4Recorder::writeCodecConfig() {
+    std::vector<uint8_t> payload;
+    encodeCodecConfig(config_.video_codec, video_vps_, video_sps_, video_pps_, payload);
+    if (!IndexFile::appendRecord(*idx_file_, IndexRecordType::CodecConfig, frame_count_, payload)) {
+        MCSR_LOG(ERROR) << "Failed to write codec config to index";
+        return false;
+    }
+    addRelaxed(stats_.index_records, 1);
     return true;
 }
 
 bool Mp4Recorder::buildAndWriteMoov() {
+    MCSR_TRACE_SCOPE("finalize", "buildAndWriteMoov");
     // Build moov from collected frame info
-    MCSR_LOG(INFO) << "Building moov box with " << video_frames_.size() << " video frames and " << audio_frames_.size() << " audio frames";
-    
-    // Log first and last frame info for debugging
-    if (!video_frames_.empty()) {
-        MCSR_LOG(VERBOSE) << "First video frame: pts=" << video_frames_[0].pts << ", size=" << video_frames_[0].size << ", keyframe=" << video_frames_[0].is_keyframe << ", offset=" << video_frames_[0].offset;
-        MCSR_LOG(VERBOSE) << "Last video frame: pts=" << video_frames_.back().pts << ", size=" << video_frames_.back().size << ", keyframe=" << video_frames_.back().is_keyframe << ", offset=" << video_frames_.back().offset;
-    }
-    
-    MoovBuilder builder;
-    std::vector<uint8_t> moov_data;
+    MCSR_LOG(INFO) << "Building moov box with " << video_table_.sampleCount() << " video frames and " << audio_table_.sampleCount() << " audio frames";
+    MCSR_LOG(VERBOSE) << "Sample size fields: video=" << static_cast<int>(video_table_.sizes().fieldSize()) << " bits, audio=" << static_cast<int>(audio_table_.sizes().fieldSize()) << " bits";
     
-    if (!builder.buildMoov(video_frames_, audio_frames_,
-                          config_.video_timescale, config_.audio_timescale,
-                          config_.audio_sample_rate, config_.audio_channels,
-                          config_.video_width, config_.video_height,
-                          h264_sps_.empty() ? nullptr : h264_sps_.data(),
-                          h264_sps_.size(),
-                          h264_pps_.empty() ? nullptr : h264_pps_.data(),
-                          h264_pps_.size(),
-                          mdat_start_,
-                          moov_data)) {
-        MCSR_LOG(ERROR) << "Failed to build moov box";
+    if (!mp4_file_ || !mp4_file_->isOpen()) {
+        MCSR_LOG(ERROR) << "MP4 file is not open for writing moov";
         return false;
     }
     
-    MCSR_LOG(INFO) << "Moov box built, size: " << moov_data.size() << " bytes";
+    MoovBuilder builder;
+    MoovConfig moov_config = makeMoovConfig(config_, video_vps_, video_sps_, video_pps_, mdat_start_);
     
-    // Write moov to file
-    if (!builder.writeMoovToFile(mp4_filename_, moov_data, file_ops_.get())) {
-        MCSR_LOG(ERROR) << "Failed to write moov to file";
+    // Stream moov straight into the open mp4 file
+    if (!builder.writeMoov(video_table_, audio_table_, moov_config, *mp4_file_)) {
+        MCSR_LOG(ERROR) << "Failed to write moov box";
         return false;
     }
     
@@ -675,6 +1696,10 @@ bool Mp4Recorder::cleanupFiles() {
     // Remove index and lock files
     file_ops_->remove(idx_filename_);
     file_ops_->remove(lock_filename_);
+    if (config_.shm_journal) {
+        journal_.close();
+        ShmJournal::remove(mp4_filename_);
+    }
     return true;
 }
 
@@ -0,0 +1,513 @@
+/*
+ * MP4 Crash-Safe Recorder - MP4 Verifier Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "mp4_verifier.h"
+#include "file_ops.h"
+
+#include <vector>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace mp4_recorder {
+
+namespace {
+
+constexpr uint32_t fourcc(const char (&name)[5]) {
+    return (static_cast<uint32_t>(static_cast<uint8_t>(name[0])) << 24) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(name[1])) << 16) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(name[2])) << 8) |
+           static_cast<uint32_t>(static_cast<uint8_t>(name[3]));
+}
+
+uint32_t readBE32(const uint8_t* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) |
+           (static_cast<uint32_t>(data[2]) << 8) | static_cast<uint32_t>(data[3]);
+}
+
+uint64_t readBE64(const uint8_t* data) {
+    return (static_cast<uint64_t>(readBE32(data)) << 32) | readBE32(data + 4);
+}
+
+std::string typeName(uint32_t type) {
+    std::string name(4, '?');
+    for (int i = 0; i < 4; i++) {
+        char c = static_cast<char>((type >> (24 - 8 * i)) & 0xFF);
+        if (c >= 0x20 && c < 0x7F) {
+            name[i] = c;
+        }
+    }
+    return name;
+}
+
+struct Box {
+    uint32_t type = 0;
+    uint64_t offset = 0;            // Box start in the file
+    uint64_t size = 0;              // Including the header
+    const uint8_t* payload = nullptr;
+    uint64_t payload_offset = 0;
+    uint64_t payload_size = 0;
+};
+
+// Iterates the boxes in [begin, end) of the file image
+class BoxReader {
+public:
+    BoxReader(const uint8_t* data, uint64_t begin, uint64_t end)
+        : data_(data), pos_(begin), end_(end) {
+    }
+
+    bool atEnd() const { return pos_ == end_; }
+
+    // Next box, or false with error set when the remaining bytes do not form one
+    bool next(Box& box, std::string& error) {
+        uint64_t available = end_ - pos_;
+        if (available < 8) {
+            error = std::to_string(available) + " stray bytes at " + std::to_string(pos_);
+            return false;
+        }
+        const uint8_t* header = data_ + pos_;
+        uint64_t size = readBE32(header);
+        uint64_t header_size = 8;
+        box.type = readBE32(header + 4);
+        if (size == 1) {
+            if (available < 16) {
+                error = "truncated '" + typeName(box.type) + "' header at " + std::to_string(pos_);
+                return false;
+            }
+            size = readBE64(header + 8);
+            header_size = 16;
+        } else if (size == 0) {
+            size = available;
+        }
+        if (size < header_size || size > available) {
+            error = "'" + typeName(box.type) + "' at " + std::to_string(pos_) + " (" +
+                    std::to_string(size) + " bytes) does not fit its parent";
+            return false;
+        }
+        box.offset = pos_;
+        box.size = size;
+        box.payload_offset = pos_ + header_size;
+        box.payload = data_ + box.payload_offset;
+        box.payload_size = size - header_size;
+        pos_ += size;
+        return true;
+    }
+
+private:
+    const uint8_t* data_;
+    uint64_t pos_;
+    uint64_t end_;
+};
+
+// Full box with a 32-bit entry count followed by entry_size-byte entries
+bool readTable(const Box& box, uint64_t entry_size, uint32_t& count, std::string& error) {
+    if (box.payload_size < 8) {
+        error = "'" + typeName(box.type) + "' too short";
+        return false;
+    }
+    count = readBE32(box.payload + 4);
+    if (8 + static_cast<uint64_t>(count) * entry_size > box.payload_size) {
+        error = "'" + typeName(box.type) + "' declares " + std::to_string(count) +
+                " entries but holds fewer";
+        return false;
+    }
+    return true;
+}
+
+// Boxes of one track needed for the table checks
+struct TrackBoxes {
+    const Box* find(uint32_t type) const {
+        for (size_t i = 0; i < count; i++) {
+            if (boxes[i].type == type) {
+                return &boxes[i];
+            }
+        }
+        return nullptr;
+    }
+
+    Box boxes[32];
+    size_t count = 0;
+};
+
+// Random access to stsz/stz2 entries
+struct SampleSizes {
+    bool init(const Box& box, std::string& error) {
+        if (box.payload_size < 12) {
+            error = "'" + typeName(box.type) + "' too short";
+            return false;
+        }
+        count = readBE32(box.payload + 8);
+        entries = box.payload + 12;
+        uint64_t needed = 0;
+        if (box.type == fourcc("stsz")) {
+            constant = readBE32(box.payload + 4);
+            field_bits = 32;
+            needed = constant != 0 ? 0 : 4 * static_cast<uint64_t>(count);
+        } else {
+            field_bits = box.payload[7];
+            if (field_bits != 4 && field_bits != 8 && field_bits != 16) {
+                error = "'stz2' field size " + std::to_string(field_bits);
+                return false;
+            }
+            needed = (static_cast<uint64_t>(count) * field_bits + 7) / 8;
+        }
+        if (12 + needed > box.payload_size) {
+            error = "'" + typeName(box.type) + "' declares " + std::to_string(count) +
+                    " samples but holds fewer";
+            return false;
+        }
+        return true;
+    }
+
+    uint32_t at(uint32_t index) const {
+        if (constant != 0) {
+            return constant;
+        }
+        switch (field_bits) {
+            case 4:
+                return (index & 1) ? (entries[index / 2] & 0x0F) : (entries[index / 2] >> 4);
+            case 8:
+                return entries[index];
+            case 16:
+                return (static_cast<uint32_t>(entries[2 * index]) << 8) | entries[2 * index + 1];
+            default:
+                return readBE32(entries + 4 * static_cast<uint64_t>(index));
+        }
+    }
+
+    uint32_t count = 0;
+    uint32_t constant = 0;
+    uint32_t field_bits = 0;
+    const uint8_t* entries = nullptr;
+};
+
+class Checker {
+public:
+    Checker(const uint8_t* data, uint64_t size, Mp4VerifyResult& result)
+        : data_(data), size_(size), result_(result) {
+    }
+
+    bool run() {
+        BoxReader reader(data_, 0, size_);
+        Box box;
+        Box moov;
+        uint32_t moov_count = 0;
+        bool first = true;
+        while (!reader.atEnd()) {
+            if (!reader.next(box, result_.error)) {
+                return false;
+            }
+            if (first && box.type != fourcc("ftyp")) {
+                return fail("file does not start with ftyp");
+            }
+            first = false;
+            if (box.type == fourcc("moov")) {
+                moov = box;
+                moov_count++;
+            } else if (box.type == fourcc("mdat")) {
+                mdats_.push_back(box);
+                result_.mdat_size += box.payload_size;
+            }
+        }
+        if (first) {
+            return fail("empty file");
+        }
+        if (moov_count != 1) {
+            return fail(std::to_string(moov_count) + " moov boxes");
+        }
+        if (mdats_.empty()) {
+            return fail("no mdat box");
+        }
+        return checkMoov(moov);
+    }
+
+private:
+    bool fail(const std::string& error) {
+        result_.error = error;
+        return false;
+    }
+
+    static bool isContainer(uint32_t type) {
+        return type == fourcc("trak") || type == fourcc("mdia") || type == fourcc("minf") ||
+               type == fourcc("stbl") || type == fourcc("dinf") || type == fourcc("edts");
+    }
+
+    // Walk the children of a container, checking nesting and collecting the track boxes
+    bool collect(const Box& parent, TrackBoxes& boxes) {
+        BoxReader reader(data_, parent.payload_offset, parent.payload_offset + parent.payload_size);
+        Box box;
+        while (!reader.atEnd()) {
+            if (!reader.next(box, result_.error)) {
+                result_.error = "in '" + typeName(parent.type) + "': " + result_.error;
+                return false;
+            }
+            if (boxes.count == sizeof(boxes.boxes) / sizeof(boxes.boxes[0])) {
+                return fail("too many boxes in track at " + std::to_string(parent.offset));
+            }
+            boxes.boxes[boxes.count++] = box;
+            if (isContainer(box.type) && !collect(box, boxes)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool checkMoov(const Box& moov) {
+        BoxReader reader(data_, moov.payload_offset, moov.payload_offset + moov.payload_size);
+        Box box;
+        bool has_mvhd = false;
+        while (!reader.atEnd()) {
+            if (!reader.next(box, result_.error)) {
+                result_.error = "in 'moov': " + result_.error;
+                return false;
+            }
+            if (box.type == fourcc("mvhd")) {
+                has_mvhd = true;
+            } else if (box.type == fourcc("trak")) {
+                TrackBoxes boxes;
+                if (!collect(box, boxes) || !checkTrack(boxes)) {
+                    result_.error = "track " + std::to_string(result_.track_count + 1) + ": " + result_.error;
+                    return false;
+                }
+                result_.track_count++;
+            }
+        }
+        if (!has_mvhd) {
+            return fail("moov without mvhd");
+        }
+        if (result_.track_count == 0) {
+            return fail("moov without tracks");
+        }
+        return true;
+    }
+
+    bool checkTrack(const TrackBoxes& boxes) {
+        static const uint32_t kRequired[] = {fourcc("tkhd"), fourcc("mdia"), fourcc("mdhd"),
+                                             fourcc("hdlr"), fourcc("minf"), fourcc("stbl"),
+                                             fourcc("stsd"), fourcc("stts"), fourcc("stsc")};
+        for (uint32_t type : kRequired) {
+            if (!boxes.find(type)) {
+                return fail("missing '" + typeName(type) + "'");
+            }
+        }
+
+        // Media timescale (mdhd version 0 at byte 12, version 1 at byte 20)
+        const Box& mdhd = *boxes.find(fourcc("mdhd"));
+        uint64_t timescale_pos = (mdhd.payload_size > 0 && mdhd.payload[0] == 1) ? 20 : 12;
+        if (mdhd.payload_size < timescale_pos + 4 || readBE32(mdhd.payload + timescale_pos) == 0) {
+            return fail("'mdhd' without timescale");
+        }
+
+        uint32_t description_count = 0;
+        const Box& stsd = *boxes.find(fourcc("stsd"));
+        if (!readTable(stsd, 0, description_count, result_.error)) {
+            return false;
+        }
+        if (description_count == 0) {
+            return fail("'stsd' without sample entries");
+        }
+
+        // Sample sizes
+        const Box* stsz = boxes.find(fourcc("stsz"));
+        const Box* stz2 = boxes.find(fourcc("stz2"));
+        if (!stsz == !stz2) {
+            return fail(stsz ? "both 'stsz' and 'stz2'" : "missing 'stsz'");
+        }
+        SampleSizes sizes;
+        if (!sizes.init(stsz ? *stsz : *stz2, result_.error)) {
+            return false;
+        }
+        uint32_t sample_count = sizes.count;
+
+        // Decoding times and composition offsets must cover every sample
+        if (!checkSampleRuns(*boxes.find(fourcc("stts")), sample_count)) {
+            return false;
+        }
+        if (const Box* ctts = boxes.find(fourcc("ctts"))) {
+            if (!checkSampleRuns(*ctts, sample_count)) {
+                return false;
+            }
+        }
+
+        // Sync samples: increasing sample numbers within the track
+        if (const Box* stss = boxes.find(fourcc("stss"))) {
+            uint32_t count = 0;
+            if (!readTable(*stss, 4, count, result_.error)) {
+                return false;
+            }
+            uint32_t previous = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t sample = readBE32(stss->payload + 8 + 4 * static_cast<uint64_t>(i));
+                if (sample <= previous || sample > sample_count) {
+                    return fail("'stss' entry " + std::to_string(i) + " (" + std::to_string(sample) +
+                                ") out of order or range");
+                }
+                previous = sample;
+            }
+        }
+
+        // Chunk offsets
+        const Box* stco = boxes.find(fourcc("stco"));
+        const Box* co64 = boxes.find(fourcc("co64"));
+        if (!stco == !co64) {
+            return fail(stco ? "both 'stco' and 'co64'" : "missing 'stco'");
+        }
+        const Box& offsets = stco ? *stco : *co64;
+        uint64_t offset_size = stco ? 4 : 8;
+        uint32_t chunk_count = 0;
+        if (!readTable(offsets, offset_size, chunk_count, result_.error)) {
+            return false;
+        }
+
+        // Walk chunks through the stsc runs; each chunk's samples are contiguous and must
+        // lie inside one mdat payload
+        const Box& stsc = *boxes.find(fourcc("stsc"));
+        uint32_t run_count = 0;
+        if (!readTable(stsc, 12, run_count, result_.error)) {
+            return false;
+        }
+        if (chunk_count > 0 && run_count == 0) {
+            return fail("'stsc' without entries");
+        }
+        uint64_t sample = 0;
+        // Empty tracks may keep a default stsc entry without any chunk to apply it to
+        for (uint32_t run = 0; chunk_count > 0 && run < run_count; run++) {
+            const uint8_t* entry = stsc.payload + 8 + 12 * static_cast<uint64_t>(run);
+            uint32_t first_chunk = readBE32(entry);
+            uint32_t samples_per_chunk = readBE32(entry + 4);
+            uint32_t description = readBE32(entry + 8);
+            // The next entry's first chunk ends this run; a non-increasing one wraps or underflows
+            uint64_t last_chunk = run + 1 < run_count ? static_cast<uint64_t>(readBE32(entry + 12)) - 1 : chunk_count;
+            if ((run == 0 && first_chunk != 1) || first_chunk == 0 || last_chunk < first_chunk ||
+                last_chunk > chunk_count) {
+                return fail("'stsc' entry " + std::to_string(run) + " has an invalid chunk range");
+            }
+            if (samples_per_chunk == 0 || description == 0 || description > description_count) {
+                return fail("'stsc' entry " + std::to_string(run) + " is invalid");
+            }
+            for (uint64_t chunk = first_chunk; chunk <= last_chunk; chunk++) {
+                if (sample + samples_per_chunk > sample_count) {
+                    return fail("'stsc' maps more samples than 'stsz' holds (" + std::to_string(sample_count) + ")");
+                }
+                const uint8_t* offset_entry = offsets.payload + 8 + offset_size * (chunk - 1);
+                uint64_t chunk_offset = stco ? readBE32(offset_entry) : readBE64(offset_entry);
+                // Work stays bounded by the table sizes even when counts are corrupt
+                uint64_t chunk_size = static_cast<uint64_t>(sizes.constant) * samples_per_chunk;
+                for (uint32_t i = 0; sizes.constant == 0 && i < samples_per_chunk; i++) {
+                    chunk_size += sizes.at(static_cast<uint32_t>(sample + i));
+                }
+                if (!insideMdat(chunk_offset, chunk_size)) {
+                    return fail("chunk " + std::to_string(chunk) + " [" + std::to_string(chunk_offset) +
+                                ", +" + std::to_string(chunk_size) + ") is outside mdat");
+                }
+                sample += samples_per_chunk;
+            }
+        }
+        if (sample != sample_count) {
+            return fail("'stsc' maps " + std::to_string(sample) + " of " + std::to_string(sample_count) + " samples");
+        }
+
+        result_.sample_count += sample_count;
+        return true;
+    }
+
+    // stts/ctts entries: (count, value) pairs whose counts add up to the sample count
+    bool checkSampleRuns(const Box& box, uint32_t sample_count) {
+        uint32_t count = 0;
+        if (!readTable(box, 8, count, result_.error)) {
+            return false;
+        }
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            total += readBE32(box.payload + 8 + 8 * static_cast<uint64_t>(i));
+        }
+        if (total != sample_count) {
+            return fail("'" + typeName(box.type) + "' covers " + std::to_string(total) + " of " +
+                        std::to_string(sample_count) + " samples");
+        }
+        return true;
+    }
+
+    bool insideMdat(uint64_t offset, uint64_t size) const {
+        for (const Box& mdat : mdats_) {
+            if (offset >= mdat.payload_offset && offset <= mdat.payload_offset + mdat.payload_size &&
+                size <= mdat.payload_offset + mdat.payload_size - offset) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const uint8_t* data_;
+    uint64_t size_;
+    Mp4VerifyResult& result_;
+    std::vector<Box> mdats_;
+};
+
+} // namespace
+
+Mp4VerifyResult Mp4Verifier::verify(const uint8_t* data, size_t size) {
+    Mp4VerifyResult result;
+    Checker checker(data, size, result);
+    result.valid = checker.run();
+    return result;
+}
+
+#ifndef _WIN32
+
+Mp4VerifyResult Mp4Verifier::verifyFile(const std::string& path) {
+    Mp4VerifyResult result;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        result.error = "cannot open " + path;
+        return result;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        result.error = "empty file";
+        return result;
+    }
+
+    // Only the pages holding box headers and sample tables are faulted in, never the media
+    size_t size = static_cast<size_t>(st.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        result.error = "cannot map " + path;
+        return result;
+    }
+    result = verify(static_cast<const uint8_t*>(mapping), size);
+    munmap(mapping, size);
+    return result;
+}
+
+#else // _WIN32
+
+Mp4VerifyResult Mp4Verifier::verifyFile(const std::string& path) {
+    Mp4VerifyResult result;
+    StdioFileOps file_ops;
+    uint64_t size = 0;
+    std::unique_ptr<IFile> file = file_ops.open(path, "rb");
+    if (!file || !file->isOpen() || !file_ops.getFileSize(path, size)) {
+        result.error = "cannot open " + path;
+        return result;
+    }
+    std::vector<uint8_t> data(static_cast<size_t>(size));
+    if (file->read(data.data(), data.size()) != data.size()) {
+        result.error = "cannot read " + path;
+        return result;
+    }
+    return verify(data.data(), data.size());
+}
+
+#endif // _WIN32
+
+} // namespace mp4_recorder
@@ -0,0 +1,87 @@
+/*
+ * MP4 Crash-Safe Recorder - Read Planner Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "read_planner.h"
+#include "common.h"
+
+#include <algorithm>
+
+namespace mp4_recorder {
+
+ReadPlanner::ReadPlanner(size_t max_request_size, size_t max_gap, size_t prefetch_depth)
+    : max_request_size_(max_request_size), max_gap_(max_gap), prefetch_depth_(prefetch_depth) {
+}
+
+void ReadPlanner::add(uint64_t offset, uint32_t size) {
+    ranges_.push_back(Range{offset, size, ranges_.size()});
+}
+
+void ReadPlanner::clear() {
+    ranges_.clear();
+    requests_.clear();
+}
+
+void ReadPlanner::buildRequests() {
+    std::stable_sort(ranges_.begin(), ranges_.end(),
+                     [](const Range& a, const Range& b) { return a.offset < b.offset; });
+
+    requests_.clear();
+    for (size_t i = 0; i < ranges_.size(); i++) {
+        const Range& range = ranges_[i];
+        uint64_t range_end = range.offset + range.size;
+        if (!requests_.empty()) {
+            Request& last = requests_.back();
+            uint64_t last_end = last.offset + last.size;
+            uint64_t merged_end = std::max(last_end, range_end);
+            if (range.offset <= last_end + max_gap_ && merged_end - last.offset <= max_request_size_) {
+                last.size = merged_end - last.offset;
+                last.range_count++;
+                continue;
+            }
+        }
+        requests_.push_back(Request{range.offset, range.size, i, 1});
+    }
+}
+
+bool ReadPlanner::run(IFile& file, const Visitor& visitor) {
+    buildRequests();
+    request_count_ = requests_.size();
+    skipped_ranges_ = 0;
+
+    // Keep prefetch_depth requests announced ahead of the one being read
+    size_t prefetched = 0;
+    std::vector<uint8_t> buffer;
+    for (size_t r = 0; r < requests_.size(); r++) {
+        for (; prefetched < requests_.size() && prefetched <= r + prefetch_depth_; prefetched++) {
+            file.prefetch(requests_[prefetched].offset, requests_[prefetched].size);
+        }
+
+        const Request& request = requests_[r];
+        buffer.resize(static_cast<size_t>(request.size));
+        size_t read_bytes = 0;
+        if (file.seek(static_cast<int64_t>(request.offset), SEEK_SET)) {
+            read_bytes = file.read(buffer.data(), buffer.size());
+        }
+        if (read_bytes < buffer.size()) {
+            MCSR_LOG(WARNING) << "Short read at " << request.offset << ": " << read_bytes << " of " << request.size << " bytes";
+        }
+
+        for (size_t i = request.first_range; i < request.first_range + request.range_count; i++) {
+            const Range& range = ranges_[i];
+            uint64_t begin = range.offset - request.offset;
+            if (begin + range.size > read_bytes) {
+                skipped_ranges_++;
+                continue;
+            }
+            if (visitor(range.id, buffer.data() + begin, range.size)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+} // namespace mp4_recorder
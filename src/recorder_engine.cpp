@@ -0,0 +1,496 @@
+/*
+ * MP4 Crash-Safe Recorder - Recording Engine Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "recorder_engine.h"
+#include "common.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+#ifndef _WIN32
+    #include <sys/stat.h>
+#endif
+
+namespace mp4_recorder {
+
+namespace {
+
+// Device of the directory holding path, so sessions on one disk share its I/O threads
+uint64_t deviceOf(const std::string& path) {
+#ifdef _WIN32
+    (void)path;
+    return 0;
+#else
+    size_t slash = path.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    struct stat buffer;
+    if (stat(directory.c_str(), &buffer) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(buffer.st_dev);
+#endif
+}
+
+// A file written by an I/O thread, with the position the thread last left it at
+struct Target {
+    std::unique_ptr<IFile> file;
+    uint64_t position = 0;
+};
+
+enum class OpType { Write, Flush, Sync, Close };
+
+struct Op {
+    OpType type;
+    Target* target;
+    uint64_t offset;
+    std::vector<uint8_t> data;
+};
+
+} // namespace
+
+class RecorderEngine::Worker {
+public:
+    Worker() : thread_(&Worker::run, this) {
+    }
+
+    ~Worker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+
+    void schedule(std::shared_ptr<Session> session);
+
+    size_t sessions = 0;  // Guarded by the engine's workers_mutex_
+
+private:
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::shared_ptr<Session>> ready_;  // Sessions with queued operations
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+// The queue of one recorder. Operations are enqueued by the recording thread and executed
+// in order by the session's I/O thread.
+class RecorderEngine::Session : public std::enable_shared_from_this<Session> {
+public:
+    explicit Session(RecorderEngine& engine) : engine_(engine) {
+        engine_.sessions_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ~Session() {
+        if (worker_) {
+            engine_.releaseWorker(worker_);
+        }
+        engine_.sessions_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Pick the I/O thread on the first file opened for writing
+    bool attach(const std::string& path) {
+        if (!worker_) {
+            worker_ = engine_.assignWorker(path);
+        }
+        return worker_ != nullptr;
+    }
+
+    size_t chunkSize() const { return engine_.config_.chunk_size; }
+    bool failed() const { return failed_.load(std::memory_order_acquire); }
+
+    // Whether the next chunk would wait for the session or engine limit
+    bool congested() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queued_bytes_ > 0 && !fits(chunkSize());
+    }
+
+    // Queue an operation, waiting while the queue holds max_queued_bytes (or the engine
+    // max_total_queued_bytes); returns its sequence number
+    uint64_t enqueue(Op op);
+    // Wait until the operation with the given sequence number has been executed
+    void wait(uint64_t sequence);
+    void drain() { wait(enqueued_); }
+
+    // Execute the oldest operation on the I/O thread; true if more are queued
+    bool runOne();
+
+    // Files opened for writing, in open order; used by the recording thread only
+    void addFile(SessionFile* file) { files_.push_back(file); }
+    void removeFile(SessionFile* file) { files_.erase(std::remove(files_.begin(), files_.end(), file), files_.end()); }
+    // Queue the buffered data of all files in open order, so a record in a later file (idx)
+    // never reaches the disk before the data written before it in an earlier one (mp4)
+    void handOffAll();
+
+private:
+    bool execute(Op& op);
+    // Called with mutex_ held
+    bool fits(uint64_t size) const {
+        uint64_t total_limit = engine_.config_.max_total_queued_bytes;
+        return queued_bytes_ + size <= engine_.config_.max_queued_bytes &&
+               (total_limit == 0 || engine_.queued_bytes_.load(std::memory_order_relaxed) + size <= total_limit);
+    }
+
+    RecorderEngine& engine_;
+    Worker* worker_ = nullptr;
+    std::vector<SessionFile*> files_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;  // An operation completed
+    std::deque<Op> ops_;
+    uint64_t queued_bytes_ = 0;
+    uint64_t enqueued_ = 0;
+    uint64_t completed_ = 0;
+    bool scheduled_ = false;            // In the worker's ready queue or being executed
+    std::atomic<bool> failed_{false};
+};
+
+class RecorderEngine::SessionFile : public IFile {
+public:
+    SessionFile(std::shared_ptr<Session> session, std::unique_ptr<IFile> file)
+        : session_(std::move(session)) {
+        target_.file = std::move(file);
+        session_->addFile(this);
+    }
+
+    ~SessionFile() override { close(); }
+
+    size_t read(void* data, size_t size) override {
+        // Opened for writing only, like a "wb" stdio file
+        (void)data;
+        (void)size;
+        return 0;
+    }
+
+    size_t write(const void* data, size_t size) override {
+        if (!open_ || session_->failed()) {
+            return 0;
+        }
+        if (pending_.empty()) {
+            pending_offset_ = position_;
+        } else if (pending_offset_ + pending_.size() != position_) {
+            session_->handOffAll();
+            pending_offset_ = position_;
+        }
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        pending_.insert(pending_.end(), bytes, bytes + size);
+        position_ += size;
+        end_ = std::max(end_, position_);
+        if (pending_.size() >= session_->chunkSize()) {
+            session_->handOffAll();
+        }
+        return size;
+    }
+
+    bool seek(int64_t offset, int origin) override {
+        int64_t base = origin == SEEK_SET ? 0 :
+                       origin == SEEK_CUR ? static_cast<int64_t>(position_) : static_cast<int64_t>(end_);
+        if (!open_ || base + offset < 0) {
+            return false;
+        }
+        position_ = static_cast<uint64_t>(base + offset);
+        return true;
+    }
+
+    int64_t tell() override { return open_ ? static_cast<int64_t>(position_) : -1; }
+
+    bool flush() override {
+        if (!open_) {
+            return false;
+        }
+        session_->handOffAll();
+        session_->wait(session_->enqueue(Op{OpType::Flush, &target_, 0, {}}));
+        return !session_->failed();
+    }
+
+    bool sync() override {
+        if (!open_) {
+            return false;
+        }
+        session_->handOffAll();
+        session_->enqueue(Op{OpType::Sync, &target_, 0, {}});
+        return !session_->failed();
+    }
+
+    void close() override {
+        if (!open_) {
+            return;
+        }
+        session_->handOffAll();
+        session_->wait(session_->enqueue(Op{OpType::Close, &target_, 0, {}}));
+        session_->removeFile(this);
+        open_ = false;
+    }
+
+    bool isOpen() const override { return open_; }
+
+    // Queue the buffered data as one write
+    void handOff() {
+        if (pending_.empty()) {
+            return;
+        }
+        Op op{OpType::Write, &target_, pending_offset_, {}};
+        op.data.swap(pending_);
+        pending_.reserve(session_->chunkSize());
+        session_->enqueue(std::move(op));
+    }
+
+private:
+    std::shared_ptr<Session> session_;
+    Target target_;  // Touched by the I/O thread only until close() returns
+    std::vector<uint8_t> pending_;
+    uint64_t pending_offset_ = 0;
+    uint64_t position_ = 0;
+    uint64_t end_ = 0;
+    bool open_ = true;
+};
+
+class RecorderEngine::SessionFileOps : public IFileOps {
+public:
+    SessionFileOps(std::shared_ptr<Session> session, std::shared_ptr<IFileOps> file_ops)
+        : session_(std::move(session)), file_ops_(std::move(file_ops)) {
+    }
+
+    std::unique_ptr<IFile> open(const std::string& path, const char* mode) override {
+        if (mode[0] != 'w') {
+            session_->drain();
+            return file_ops_->open(path, mode);
+        }
+        if (!session_->attach(path)) {
+            return nullptr;
+        }
+        std::unique_ptr<IFile> file = file_ops_->open(path, mode);
+        if (!file || !file->isOpen()) {
+            return file;
+        }
+        return std::unique_ptr<IFile>(new SessionFile(session_, std::move(file)));
+    }
+
+    bool exists(const std::string& path) override {
+        session_->drain();
+        return file_ops_->exists(path);
+    }
+
+    bool remove(const std::string& path) override {
+        session_->drain();
+        return file_ops_->remove(path);
+    }
+
+    bool getFileSize(const std::string& path, uint64_t& size) override {
+        session_->drain();
+        return file_ops_->getFileSize(path, size);
+    }
+
+    bool truncate(const std::string& path, uint64_t size) override {
+        session_->drain();
+        return file_ops_->truncate(path, size);
+    }
+
+    bool congested() override { return session_->congested(); }
+
+private:
+    std::shared_ptr<Session> session_;
+    std::shared_ptr<IFileOps> file_ops_;
+};
+
+void RecorderEngine::Worker::schedule(std::shared_ptr<Session> session) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_.push_back(std::move(session));
+    }
+    wake_.notify_one();
+}
+
+void RecorderEngine::Worker::run() {
+    while (true) {
+        std::shared_ptr<Session> session;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this] { return stop_ || !ready_.empty(); });
+            if (ready_.empty()) {
+                return;
+            }
+            session = std::move(ready_.front());
+            ready_.pop_front();
+        }
+        // One operation per turn keeps a busy session from starving the others
+        if (session->runOne()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ready_.push_back(std::move(session));
+        }
+    }
+}
+
+uint64_t RecorderEngine::Session::enqueue(Op op) {
+    uint64_t size = op.data.size();
+    uint64_t sequence = 0;
+    bool schedule = false;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Other sessions draining does not wake this one; its own queue draining always does
+        if (queued_bytes_ > 0 && !fits(size)) {
+            engine_.backpressure_waits_.fetch_add(1, std::memory_order_relaxed);
+            changed_.wait(lock, [&] { return queued_bytes_ == 0 || fits(size); });
+        }
+        ops_.push_back(std::move(op));
+        queued_bytes_ += size;
+        sequence = ++enqueued_;
+        schedule = !scheduled_;
+        scheduled_ = true;
+    }
+    engine_.queued_bytes_.fetch_add(size, std::memory_order_relaxed);
+    if (schedule) {
+        worker_->schedule(shared_from_this());
+    }
+    return sequence;
+}
+
+void RecorderEngine::Session::wait(uint64_t sequence) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [&] { return completed_ >= sequence; });
+}
+
+bool RecorderEngine::Session::runOne() {
+    Op op;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        op = std::move(ops_.front());
+        ops_.pop_front();
+    }
+
+    // After a failure only closes run, so nothing lands past a gap
+    if ((!failed() || op.type == OpType::Close) && !execute(op)) {
+        if (!failed_.exchange(true, std::memory_order_acq_rel)) {
+            MCSR_LOG(ERROR) << "Engine I/O failed; failing further writes of this session";
+        }
+    }
+
+    uint64_t size = op.data.size();
+    engine_.queued_bytes_.fetch_sub(size, std::memory_order_relaxed);
+    bool more = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_bytes_ -= size;
+        completed_++;
+        more = !ops_.empty();
+        scheduled_ = more;
+    }
+    changed_.notify_all();
+    return more;
+}
+
+bool RecorderEngine::Session::execute(Op& op) {
+    Target& target = *op.target;
+    switch (op.type) {
+    case OpType::Write:
+        engine_.write_ops_.fetch_add(1, std::memory_order_relaxed);
+        if (target.position != op.offset && !target.file->seek(static_cast<int64_t>(op.offset), SEEK_SET)) {
+            target.position = UINT64_MAX;
+            return false;
+        }
+        if (target.file->write(op.data.data(), op.data.size()) != op.data.size()) {
+            target.position = UINT64_MAX;
+            return false;
+        }
+        target.position = op.offset + op.data.size();
+        return true;
+    case OpType::Flush:
+        return target.file->flush();
+    case OpType::Sync:
+        engine_.sync_ops_.fetch_add(1, std::memory_order_relaxed);
+        return target.file->sync();
+    case OpType::Close:
+        target.file->close();
+        return true;
+    }
+    return false;
+}
+
+void RecorderEngine::Session::handOffAll() {
+    for (SessionFile* file : files_) {
+        file->handOff();
+    }
+}
+
+RecorderEngine::RecorderEngine(const EngineConfig& config)
+    : config_(config) {
+    config_.io_threads_per_disk = std::max<size_t>(config_.io_threads_per_disk, 1);
+    config_.chunk_size = std::max<size_t>(config_.chunk_size, 1);
+    if (!config_.file_ops) {
+        config_.file_ops = std::make_shared<StdioFileOps>();
+    }
+}
+
+RecorderEngine::~RecorderEngine() {
+    // Join outside the lock: a worker may be releasing the last reference to a session
+    std::map<uint64_t, std::vector<std::unique_ptr<Worker>>> workers;
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        workers.swap(workers_);
+    }
+}
+
+std::unique_ptr<Mp4Recorder> RecorderEngine::createRecorder() {
+    return std::unique_ptr<Mp4Recorder>(new Mp4Recorder(createSession()));
+}
+
+std::shared_ptr<IFileOps> RecorderEngine::createSession() {
+    return std::make_shared<SessionFileOps>(std::make_shared<Session>(*this), config_.file_ops);
+}
+
+RecorderEngine::Worker* RecorderEngine::assignWorker(const std::string& path) {
+    uint64_t device = deviceOf(path);
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    std::vector<std::unique_ptr<Worker>>& workers = workers_[device];
+    if (workers.empty()) {
+        try {
+            for (size_t i = 0; i < config_.io_threads_per_disk; i++) {
+                workers.emplace_back(new Worker());
+            }
+        } catch (...) {
+            MCSR_LOG(ERROR) << "Failed to start engine I/O threads";
+            if (workers.empty()) {
+                workers_.erase(device);
+                return nullptr;
+            }
+        }
+        MCSR_LOG(INFO) << "Engine: " << workers.size() << " I/O threads for device " << device;
+    }
+    Worker* worker = std::min_element(workers.begin(), workers.end(),
+                                      [](const std::unique_ptr<Worker>& a, const std::unique_ptr<Worker>& b) {
+                                          return a->sessions < b->sessions;
+                                      })->get();
+    worker->sessions++;
+    return worker;
+}
+
+void RecorderEngine::releaseWorker(Worker* worker) {
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    worker->sessions--;
+}
+
+EngineStats RecorderEngine::getStats() const {
+    EngineStats stats;
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        for (const auto& device : workers_) {
+            stats.io_threads += device.second.size();
+        }
+    }
+    stats.sessions = sessions_.load(std::memory_order_relaxed);
+    stats.queued_bytes = queued_bytes_.load(std::memory_order_relaxed);
+    stats.write_ops = write_ops_.load(std::memory_order_relaxed);
+    stats.sync_ops = sync_ops_.load(std::memory_order_relaxed);
+    stats.backpressure_waits = backpressure_waits_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+} // namespace mp4_recorder
@@ -0,0 +1,189 @@
+/*
+ * MP4 Crash-Safe Recorder - Recorder Statistics Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "recorder_stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace mp4_recorder {
+
+namespace {
+
+// Index of the highest set bit; value must not be 0
+uint32_t highestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - static_cast<uint32_t>(__builtin_clzll(value));
+#else
+    uint32_t bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+} // namespace
+
+uint64_t LatencyHistogramSnapshot::percentile(double quantile) const {
+    if (count == 0) {
+        return 0;
+    }
+    quantile = std::min(std::max(quantile, 0.0), 1.0);
+    uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(quantile * static_cast<double>(count))), 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return std::min(LatencyHistogram::bucketUpperBound(i), max_ns);
+        }
+    }
+    return max_ns;
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t value_ns) {
+    if (value_ns < kSubBuckets) {
+        return static_cast<size_t>(value_ns);
+    }
+    uint32_t exponent = highestBit(value_ns);
+    if (exponent > kMaxExponent) {
+        return kBucketCount - 1;
+    }
+    uint64_t sub_bucket = (value_ns >> (exponent - kSubBucketBits)) - kSubBuckets;
+    return (exponent - kSubBucketBits + 1) * kSubBuckets + static_cast<size_t>(sub_bucket);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t index) {
+    if (index + 1 >= kBucketCount) {
+        return UINT64_MAX;
+    }
+    // Lower bound of the next bucket, minus one
+    size_t next = index + 1;
+    if (next < kSubBuckets) {
+        return next - 1;
+    }
+    uint32_t exponent = static_cast<uint32_t>(next / kSubBuckets) + kSubBucketBits - 1;
+    uint64_t sub_bucket = next % kSubBuckets;
+    return ((kSubBuckets + sub_bucket) << (exponent - kSubBucketBits)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value_ns) {
+    addRelaxed(counts_[bucketIndex(value_ns)], 1);
+    addRelaxed(count_, 1);
+    addRelaxed(sum_, value_ns);
+    if (value_ns > max_.load(std::memory_order_relaxed)) {
+        max_.store(value_ns, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (auto& count : counts_) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+LatencyHistogramSnapshot LatencyHistogram::snapshot() const {
+    LatencyHistogramSnapshot snapshot;
+    addTo(snapshot);
+    return snapshot;
+}
+
+void LatencyHistogram::addTo(LatencyHistogramSnapshot& total) const {
+    total.counts.resize(kBucketCount);
+    // Derive the count from the copied buckets, so percentiles stay consistent with them
+    for (size_t i = 0; i < kBucketCount; i++) {
+        uint64_t count = counts_[i].load(std::memory_order_relaxed);
+        total.counts[i] += count;
+        total.count += count;
+    }
+    total.sum_ns += sum_.load(std::memory_order_relaxed);
+    total.max_ns = std::max(total.max_ns, max_.load(std::memory_order_relaxed));
+}
+
+void RecorderCounters::reset() {
+    write_latency.reset();
+    flush_latency.reset();
+    fsync_latency.reset();
+    for (std::atomic<uint64_t>* counter : {&mp4_bytes_written, &idx_bytes_written, &video_frames, &audio_frames,
+                                           &index_records, &unflushed_frames, &durable_frames, &dropped_video_frames,
+                                           &dropped_audio_frames, &overflow_waits, &flush_count, &fsync_count,
+                                           &moov_build_us, &finalize_us}) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+}
+
+RecorderStats RecorderCounters::snapshot() const {
+    RecorderStats stats;
+    addTo(stats);
+    return stats;
+}
+
+void RecorderCounters::addTo(RecorderStats& total) const {
+    write_latency.addTo(total.write_latency);
+    flush_latency.addTo(total.flush_latency);
+    fsync_latency.addTo(total.fsync_latency);
+    total.mp4_bytes_written += mp4_bytes_written.load(std::memory_order_relaxed);
+    total.idx_bytes_written += idx_bytes_written.load(std::memory_order_relaxed);
+    total.video_frames += video_frames.load(std::memory_order_relaxed);
+    total.audio_frames += audio_frames.load(std::memory_order_relaxed);
+    total.index_records += index_records.load(std::memory_order_relaxed);
+    total.unflushed_frames += unflushed_frames.load(std::memory_order_relaxed);
+    total.durable_frames += durable_frames.load(std::memory_order_relaxed);
+    total.dropped_video_frames += dropped_video_frames.load(std::memory_order_relaxed);
+    total.dropped_audio_frames += dropped_audio_frames.load(std::memory_order_relaxed);
+    total.overflow_waits += overflow_waits.load(std::memory_order_relaxed);
+    total.flush_count += flush_count.load(std::memory_order_relaxed);
+    total.fsync_count += fsync_count.load(std::memory_order_relaxed);
+    total.moov_build_us += moov_build_us.load(std::memory_order_relaxed);
+    total.finalize_us += finalize_us.load(std::memory_order_relaxed);
+}
+
+CountingFile::CountingFile(std::unique_ptr<IFile> file, std::atomic<uint64_t>& bytes_written)
+    : file_(std::move(file)), bytes_written_(bytes_written) {
+}
+
+size_t CountingFile::read(void* data, size_t size) {
+    return file_->read(data, size);
+}
+
+size_t CountingFile::write(const void* data, size_t size) {
+    size_t written = file_->write(data, size);
+    addRelaxed(bytes_written_, written);
+    return written;
+}
+
+bool CountingFile::seek(int64_t offset, int origin) {
+    return file_->seek(offset, origin);
+}
+
+int64_t CountingFile::tell() {
+    return file_->tell();
+}
+
+bool CountingFile::flush() {
+    return file_->flush();
+}
+
+bool CountingFile::sync() {
+    return file_->sync();
+}
+
+void CountingFile::close() {
+    file_->close();
+}
+
+bool CountingFile::isOpen() const {
+    return file_->isOpen();
+}
+
+bool CountingFile::prefetch(uint64_t offset, uint64_t size) {
+    return file_->prefetch(offset, size);
+}
+
+} // namespace mp4_recorder
@@ -0,0 +1,195 @@
+/*
+ * MP4 Crash-Safe Recorder - Recovery Manager Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "recovery_manager.h"
+#include "mp4_recorder.h"
+#include "mp4_verifier.h"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+namespace mp4_recorder {
+
+namespace {
+
+namespace fs = std::filesystem;
+
+const char kLockSuffix[] = ".lock";
+
+struct RecoveryJob {
+    std::string filename;
+    uint64_t file_size = 0;
+    fs::file_time_type lock_time;
+};
+
+void sortJobs(std::vector<RecoveryJob>& jobs, RecoveryOrder order) {
+    auto by = [&jobs](auto less) {
+        std::stable_sort(jobs.begin(), jobs.end(), less);
+    };
+    switch (order) {
+        case RecoveryOrder::LargestFirst:
+            by([](const RecoveryJob& a, const RecoveryJob& b) { return a.file_size > b.file_size; });
+            break;
+        case RecoveryOrder::OldestFirst:
+            by([](const RecoveryJob& a, const RecoveryJob& b) { return a.lock_time < b.lock_time; });
+            break;
+        case RecoveryOrder::NewestFirst:
+            by([](const RecoveryJob& a, const RecoveryJob& b) { return a.lock_time > b.lock_time; });
+            break;
+        case RecoveryOrder::SmallestFirst:
+        default:
+            by([](const RecoveryJob& a, const RecoveryJob& b) { return a.file_size < b.file_size; });
+            break;
+    }
+}
+
+} // namespace
+
+RecoveryManager::RecoveryManager()
+    : file_ops_(std::make_shared<StdioFileOps>()) {
+}
+
+RecoveryManager::RecoveryManager(std::shared_ptr<IFileOps> file_ops)
+    : file_ops_(file_ops ? file_ops : std::make_shared<StdioFileOps>()) {
+}
+
+std::vector<std::string> RecoveryManager::findIncompleteRecordings(const std::string& directory,
+                                                                   bool recursive) const {
+    std::vector<std::string> filenames;
+    std::error_code ec;
+    const size_t suffix_len = sizeof(kLockSuffix) - 1;
+
+    auto visit = [&](const fs::directory_entry& entry) {
+        std::error_code entry_ec;
+        if (!entry.is_regular_file(entry_ec)) {
+            return;
+        }
+        std::string lock_path = entry.path().string();
+        if (lock_path.size() <= suffix_len ||
+            lock_path.compare(lock_path.size() - suffix_len, suffix_len, kLockSuffix) != 0) {
+            return;
+        }
+        std::string mp4_path = lock_path.substr(0, lock_path.size() - suffix_len);
+        if (file_ops_->exists(mp4_path + ".idx")) {
+            filenames.push_back(mp4_path);
+        }
+    };
+
+    // Unreadable subdirectories are skipped instead of aborting the whole scan
+    if (recursive) {
+        fs::recursive_directory_iterator it(directory, fs::directory_options::skip_permission_denied, ec);
+        for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            visit(*it);
+        }
+    } else {
+        fs::directory_iterator it(directory, fs::directory_options::skip_permission_denied, ec);
+        for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+            visit(*it);
+        }
+    }
+    if (ec) {
+        MCSR_LOG(WARNING) << "Directory scan stopped early in " << directory << ": " << ec.message();
+    }
+
+    std::sort(filenames.begin(), filenames.end());
+    MCSR_LOG(INFO) << "Found " << filenames.size() << " incomplete recordings in " << directory;
+    return filenames;
+}
+
+std::vector<RecoveryResult> RecoveryManager::recoverDirectory(const std::string& directory,
+                                                              const RecoveryOptions& options,
+                                                              RecoveryProgressCallback progress) {
+    return recoverFiles(findIncompleteRecordings(directory, options.recursive), options, progress);
+}
+
+std::vector<RecoveryResult> RecoveryManager::recoverFiles(const std::vector<std::string>& filenames,
+                                                          const RecoveryOptions& options,
+                                                          RecoveryProgressCallback progress) {
+    std::vector<RecoveryJob> jobs;
+    jobs.reserve(filenames.size());
+    for (const auto& filename : filenames) {
+        RecoveryJob job;
+        job.filename = filename;
+        file_ops_->getFileSize(filename, job.file_size);
+        std::error_code ec;
+        job.lock_time = fs::last_write_time(filename + kLockSuffix, ec);
+        jobs.push_back(job);
+    }
+    sortJobs(jobs, options.order);
+
+    std::vector<RecoveryResult> results(jobs.size());
+    if (jobs.empty()) {
+        return results;
+    }
+
+    uint32_t workers = options.max_workers;
+    if (workers == 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers = static_cast<uint32_t>(std::min<size_t>(workers, jobs.size()));
+
+    std::atomic<size_t> next_job(0);
+    std::mutex progress_mutex;
+    size_t completed = 0;
+
+    auto worker = [&]() {
+        // Recorders are per worker; recover() keeps no state between calls
+        Mp4Recorder recorder(file_ops_);
+        for (size_t i = next_job.fetch_add(1); i < jobs.size(); i = next_job.fetch_add(1)) {
+            RecoveryResult& result = results[i];
+            result.filename = jobs[i].filename;
+            result.file_size = jobs[i].file_size;
+
+            auto begin = std::chrono::steady_clock::now();
+            result.success = recorder.recover(jobs[i].filename);
+            result.duration_us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - begin).count());
+
+            // A moov that does not describe the mdat is no better than a failed recovery
+            if (result.success && options.verify) {
+                Mp4VerifyResult verify_result = Mp4Verifier::verifyFile(result.filename);
+                if (!verify_result.valid) {
+                    result.success = false;
+                    result.verify_error = verify_result.error;
+                    MCSR_LOG(ERROR) << "Recovered file failed verification: " << result.filename << ": " << verify_result.error;
+                }
+            }
+
+            if (!result.success) {
+                MCSR_LOG(ERROR) << "Batch recovery failed: " << result.filename;
+            }
+
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            completed++;
+            if (progress) {
+                progress(result, completed, jobs.size());
+            }
+        }
+    };
+
+    MCSR_LOG(INFO) << "Recovering " << jobs.size() << " recordings with " << workers << " workers";
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (uint32_t i = 1; i < workers; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    size_t succeeded = static_cast<size_t>(std::count_if(results.begin(), results.end(),
+        [](const RecoveryResult& r) { return r.success; }));
+    MCSR_LOG(INFO) << "Batch recovery finished: " << succeeded << "/" << results.size() << " recovered";
+    return results;
+}
+
+} // namespace mp4_recorder
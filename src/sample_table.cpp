@@ -0,0 +1,444 @@
+/*
+ * MP4 Crash-Safe Recorder - Sample Tables Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "sample_table.h"
+#include "mp4_recorder.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mp4_recorder {
+
+namespace {
+
+uint8_t fieldBytesFor(uint32_t max_size) {
+    if (max_size <= 0xFF) {
+        return 1;
+    }
+    if (max_size <= 0xFFFF) {
+        return 2;
+    }
+    return 4;
+}
+
+void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+void putSignedVarint(std::vector<uint8_t>& out, int64_t value) {
+    // Zigzag so small negative values stay short
+    putVarint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+bool getVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (data >= end) {
+            return false;
+        }
+        uint8_t byte = *data++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool getSignedVarint(const uint8_t*& data, const uint8_t* end, int64_t& value) {
+    uint64_t raw = 0;
+    if (!getVarint(data, end, raw)) {
+        return false;
+    }
+    value = static_cast<int64_t>(raw >> 1) ^ -static_cast<int64_t>(raw & 1);
+    return true;
+}
+
+bool getUint32(const uint8_t*& data, const uint8_t* end, uint32_t& value) {
+    uint64_t raw = 0;
+    if (!getVarint(data, end, raw) || raw > 0xFFFFFFFFULL) {
+        return false;
+    }
+    value = static_cast<uint32_t>(raw);
+    return true;
+}
+
+} // namespace
+
+void SampleSizeTable::reset() {
+    count_ = 0;
+    first_size_ = 0;
+    max_size_ = 0;
+    constant_ = true;
+    field_bytes_ = 0;
+    packed_.clear();
+}
+
+void SampleSizeTable::append(uint32_t size) {
+    if (count_ == 0) {
+        first_size_ = size;
+        max_size_ = size;
+        count_ = 1;
+        return;
+    }
+
+    if (constant_ && size == first_size_) {
+        count_++;
+        return;
+    }
+
+    uint8_t needed = fieldBytesFor(std::max(max_size_, size));
+    if (constant_) {
+        // First size change: materialize the entries seen so far
+        constant_ = false;
+        field_bytes_ = needed;
+        packed_.reserve(static_cast<size_t>(count_ + 1) * field_bytes_);
+        for (uint32_t i = 0; i < count_; i++) {
+            pushEntry(first_size_);
+        }
+    } else if (needed > field_bytes_) {
+        widen(needed);
+    }
+
+    pushEntry(size);
+    max_size_ = std::max(max_size_, size);
+    count_++;
+}
+
+const char* SampleSizeTable::boxType() const {
+    return (constant_ || field_bytes_ == 4) ? "stsz" : "stz2";
+}
+
+uint32_t SampleSizeTable::boxSize() const {
+    // stsz: 8 (header) + 4 (version/flags) + 4 (sample_size) + 4 (sample_count) + entries
+    // stz2: 8 (header) + 4 (version/flags) + 3 (reserved) + 1 (field_size) + 4 (count) + entries
+    return 8 + 4 + 4 + 4 + static_cast<uint32_t>(packed_.size());
+}
+
+uint32_t SampleSizeTable::sizeAt(uint32_t index) const {
+    if (index >= count_) {
+        return 0;
+    }
+    if (constant_) {
+        return first_size_;
+    }
+    const uint8_t* p = packed_.data() + static_cast<size_t>(index) * field_bytes_;
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < field_bytes_; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+void SampleSizeTable::serialize(std::vector<uint8_t>& out) const {
+    putVarint(out, count_);
+    putVarint(out, first_size_);
+    putVarint(out, max_size_);
+    out.push_back(constant_ ? 1 : 0);
+    out.push_back(field_bytes_);
+    putVarint(out, packed_.size());
+    out.insert(out.end(), packed_.begin(), packed_.end());
+}
+
+bool SampleSizeTable::deserialize(const uint8_t*& data, const uint8_t* end) {
+    reset();
+    uint64_t packed_size = 0;
+    if (!getUint32(data, end, count_) || !getUint32(data, end, first_size_) ||
+        !getUint32(data, end, max_size_) || end - data < 2) {
+        return false;
+    }
+    constant_ = data[0] != 0;
+    field_bytes_ = data[1];
+    data += 2;
+    if (!getVarint(data, end, packed_size) || packed_size > static_cast<uint64_t>(end - data)) {
+        return false;
+    }
+    // Entry count must match the encoding, otherwise sizeAt() would read out of bounds
+    uint64_t expected = constant_ ? 0 : static_cast<uint64_t>(count_) * field_bytes_;
+    if ((!constant_ && field_bytes_ != 1 && field_bytes_ != 2 && field_bytes_ != 4) ||
+        packed_size != expected) {
+        return false;
+    }
+    packed_.assign(data, data + packed_size);
+    data += packed_size;
+    return true;
+}
+
+void SampleSizeTable::pushEntry(uint32_t size) {
+    for (int shift = (field_bytes_ - 1) * 8; shift >= 0; shift -= 8) {
+        packed_.push_back(static_cast<uint8_t>((size >> shift) & 0xFF));
+    }
+}
+
+void SampleSizeTable::widen(uint8_t field_bytes) {
+    std::vector<uint8_t> old_entries;
+    old_entries.swap(packed_);
+    uint8_t old_bytes = field_bytes_;
+
+    field_bytes_ = field_bytes;
+    packed_.reserve(old_entries.size() / old_bytes * field_bytes_ + field_bytes_);
+    for (size_t pos = 0; pos + old_bytes <= old_entries.size(); pos += old_bytes) {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < old_bytes; i++) {
+            value = (value << 8) | old_entries[pos + i];
+        }
+        pushEntry(value);
+    }
+}
+
+void SampleTable::reset() {
+    sample_count_ = 0;
+    last_dts_ = 0;
+    max_pts_ = 0;
+    time_deltas_.clear();
+    composition_offsets_.clear();
+    has_composition_offsets_ = false;
+    has_negative_offsets_ = false;
+    sync_samples_.clear();
+    sizes_.reset();
+    sample_offsets_.clear();
+}
+
+void SampleTable::append(const FrameInfo& frame) {
+    if (sample_count_ > 0) {
+        // Duration of the previous sample is the decode distance to this one
+        uint32_t delta = static_cast<uint32_t>(frame.dts - last_dts_);
+        if (!time_deltas_.empty() && time_deltas_.back().delta == delta) {
+            time_deltas_.back().count++;
+        } else {
+            time_deltas_.push_back({1, delta});
+        }
+    }
+
+    int32_t offset = static_cast<int32_t>(frame.pts - frame.dts);
+    if (!composition_offsets_.empty() && composition_offsets_.back().offset == offset) {
+        composition_offsets_.back().count++;
+    } else {
+        composition_offsets_.push_back({1, offset});
+    }
+    if (offset != 0) {
+        has_composition_offsets_ = true;
+    }
+    if (offset < 0) {
+        has_negative_offsets_ = true;
+    }
+
+    if (sample_count_ == 0 || frame.pts > max_pts_) {
+        max_pts_ = frame.pts;
+    }
+    sample_count_++;
+    last_dts_ = frame.dts;
+    if (frame.is_keyframe) {
+        sync_samples_.push_back(sample_count_);  // 1-based index
+    }
+    sizes_.append(frame.size);
+    sample_offsets_.push_back(frame.offset);
+}
+
+uint64_t SampleTable::dataEnd() const {
+    if (sample_count_ == 0) {
+        return 0;
+    }
+    return sample_offsets_.back() + sizes_.sizeAt(sample_count_ - 1);
+}
+
+void SampleTable::buildChunks(uint64_t max_chunk_bytes, std::vector<uint64_t>& chunk_offsets,
+                              std::vector<SampleToChunkEntry>& sample_to_chunk) const {
+    chunk_offsets.clear();
+    sample_to_chunk.clear();
+    uint64_t chunk_end = 0;
+    uint64_t chunk_bytes = 0;
+    uint32_t chunk_samples = 0;
+    // stsc only needs an entry where the number of samples per chunk changes
+    auto closeChunk = [&] {
+        if (chunk_samples > 0 &&
+            (sample_to_chunk.empty() || sample_to_chunk.back().samples_per_chunk != chunk_samples)) {
+            sample_to_chunk.push_back({static_cast<uint32_t>(chunk_offsets.size()), chunk_samples});
+        }
+    };
+    for (uint32_t i = 0; i < sample_count_; i++) {
+        uint32_t size = sizes_.sizeAt(i);
+        if (chunk_samples > 0 && sample_offsets_[i] == chunk_end && chunk_bytes + size <= max_chunk_bytes) {
+            chunk_end += size;
+            chunk_bytes += size;
+            chunk_samples++;
+            continue;
+        }
+        closeChunk();
+        chunk_offsets.push_back(sample_offsets_[i]);
+        chunk_end = sample_offsets_[i] + size;
+        chunk_bytes = size;
+        chunk_samples = 1;
+    }
+    closeChunk();
+}
+
+void SampleTable::serialize(std::vector<uint8_t>& out) const {
+    putVarint(out, sample_count_);
+    putSignedVarint(out, last_dts_);
+    putSignedVarint(out, max_pts_);
+    out.push_back(static_cast<uint8_t>((has_composition_offsets_ ? 1 : 0) |
+                                       (has_negative_offsets_ ? 2 : 0)));
+
+    putVarint(out, time_deltas_.size());
+    for (const auto& entry : time_deltas_) {
+        putVarint(out, entry.count);
+        putVarint(out, entry.delta);
+    }
+
+    putVarint(out, composition_offsets_.size());
+    for (const auto& entry : composition_offsets_) {
+        putVarint(out, entry.count);
+        putSignedVarint(out, entry.offset);
+    }
+
+    // Sync samples are increasing, store the distance to the previous one
+    putVarint(out, sync_samples_.size());
+    uint32_t prev_sync = 0;
+    for (uint32_t index : sync_samples_) {
+        putVarint(out, index - prev_sync);
+        prev_sync = index;
+    }
+
+    sizes_.serialize(out);
+
+    // Other tracks' samples sit between consecutive samples, so the gaps stay small
+    uint64_t prev_end = 0;
+    for (uint32_t i = 0; i < sample_count_; i++) {
+        putSignedVarint(out, static_cast<int64_t>(sample_offsets_[i] - prev_end));
+        prev_end = sample_offsets_[i] + sizes_.sizeAt(i);
+    }
+}
+
+bool SampleTable::deserialize(const uint8_t* data, size_t size) {
+    reset();
+    const uint8_t* end = data + size;
+    uint64_t count = 0;
+    if (!getUint32(data, end, sample_count_) || !getSignedVarint(data, end, last_dts_) ||
+        !getSignedVarint(data, end, max_pts_) || data >= end) {
+        reset();
+        return false;
+    }
+    has_composition_offsets_ = (*data & 1) != 0;
+    has_negative_offsets_ = (*data & 2) != 0;
+    data++;
+
+    // Every entry takes at least one byte, which bounds the counts before reserving
+    if (!getVarint(data, end, count) || count > static_cast<uint64_t>(end - data)) {
+        reset();
+        return false;
+    }
+    time_deltas_.resize(static_cast<size_t>(count));
+    for (auto& entry : time_deltas_) {
+        if (!getUint32(data, end, entry.count) || !getUint32(data, end, entry.delta)) {
+            reset();
+            return false;
+        }
+    }
+
+    if (!getVarint(data, end, count) || count > static_cast<uint64_t>(end - data)) {
+        reset();
+        return false;
+    }
+    composition_offsets_.resize(static_cast<size_t>(count));
+    for (auto& entry : composition_offsets_) {
+        int64_t offset = 0;
+        if (!getUint32(data, end, entry.count) || !getSignedVarint(data, end, offset)) {
+            reset();
+            return false;
+        }
+        entry.offset = static_cast<int32_t>(offset);
+    }
+
+    if (!getVarint(data, end, count) || count > static_cast<uint64_t>(end - data)) {
+        reset();
+        return false;
+    }
+    sync_samples_.resize(static_cast<size_t>(count));
+    uint32_t prev_sync = 0;
+    for (auto& index : sync_samples_) {
+        uint32_t distance = 0;
+        if (!getUint32(data, end, distance)) {
+            reset();
+            return false;
+        }
+        index = prev_sync + distance;
+        prev_sync = index;
+    }
+
+    if (!sizes_.deserialize(data, end) || sizes_.sampleCount() != sample_count_ ||
+        sample_count_ > static_cast<uint64_t>(end - data)) {
+        reset();
+        return false;
+    }
+
+    sample_offsets_.resize(sample_count_);
+    uint64_t prev_end = 0;
+    for (uint32_t i = 0; i < sample_count_; i++) {
+        int64_t gap = 0;
+        if (!getSignedVarint(data, end, gap)) {
+            reset();
+            return false;
+        }
+        sample_offsets_[i] = prev_end + static_cast<uint64_t>(gap);
+        prev_end = sample_offsets_[i] + sizes_.sizeAt(i);
+    }
+
+    if (data != end) {
+        reset();
+        return false;
+    }
+    return true;
+}
+
+std::vector<TimeToSampleEntry> SampleTable::timeToSample(uint32_t default_duration) const {
+    std::vector<TimeToSampleEntry> entries = time_deltas_;
+    if (sample_count_ == 0) {
+        return entries;
+    }
+
+    // The last sample repeats the previous sample's duration when there is one
+    if (!entries.empty()) {
+        entries.back().count++;
+    } else {
+        entries.push_back({1, default_duration});
+    }
+    return entries;
+}
+
+void encodeTableSnapshot(const SampleTable& video_table, const SampleTable& audio_table,
+                         std::vector<uint8_t>& payload)
+{
+    payload.assign(sizeof(uint32_t), 0);
+    video_table.serialize(payload);
+    uint32_t video_size = static_cast<uint32_t>(payload.size() - sizeof(uint32_t));
+    std::memcpy(payload.data(), &video_size, sizeof(video_size));
+    audio_table.serialize(payload);
+}
+
+bool decodeTableSnapshot(const std::vector<uint8_t>& payload, SampleTable& video_table,
+                         SampleTable& audio_table)
+{
+    uint32_t video_size = 0;
+    if (payload.size() < sizeof(video_size)) {
+        return false;
+    }
+    std::memcpy(&video_size, payload.data(), sizeof(video_size));
+    if (video_size > payload.size() - sizeof(video_size)) {
+        return false;
+    }
+    const uint8_t* video_data = payload.data() + sizeof(video_size);
+    const uint8_t* audio_data = video_data + video_size;
+    size_t audio_size = payload.size() - sizeof(video_size) - video_size;
+    return video_table.deserialize(video_data, video_size) &&
+           audio_table.deserialize(audio_data, audio_size);
+}
+
+} // namespace mp4_recorder
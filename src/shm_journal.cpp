@@ -0,0 +1,300 @@
+/*
+ * MP4 Crash-Safe Recorder - Shared Memory Journal Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "shm_journal.h"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <new>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace mp4_recorder {
+
+// Start of the segment; journal bytes follow at sizeof(ShmJournalHeader)
+struct ShmJournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint64_t> published;   // Journal bytes visible to recovery
+    uint64_t reserved[6];
+};
+
+namespace {
+
+const uint32_t kJournalMagic = 0x4D50344A;  // "MP4J"
+const uint32_t kJournalVersion = 1;
+
+static_assert(sizeof(ShmJournalHeader) == 64, "journal header must keep its size");
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "published size is shared between processes and must be lock-free");
+
+} // namespace
+
+ShmJournal::ShmJournal() {
+}
+
+ShmJournal::~ShmJournal() {
+    close();
+}
+
+std::string ShmJournal::segmentName(const std::string& mp4_filename) {
+    std::error_code ec;
+    std::filesystem::path path = std::filesystem::absolute(mp4_filename, ec);
+    std::string key = ec ? mp4_filename : path.lexically_normal().string();
+
+    // FNV-1a keeps the name short and free of path separators
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 0x100000001B3ULL;
+    }
+    char name[32];
+    std::snprintf(name, sizeof(name), "/mcsr-%016llx", static_cast<unsigned long long>(hash));
+    return name;
+}
+
+#ifndef _WIN32
+
+bool ShmJournal::create(const std::string& mp4_filename, size_t initial_capacity) {
+    close();
+    name_ = segmentName(mp4_filename);
+
+    // A segment left over from an earlier recording of the same path is stale by now
+    shm_unlink(name_.c_str());
+    fd_ = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd_ < 0) {
+        MCSR_LOG(ERROR) << "Failed to create shared memory journal " << name_ << ": " << std::strerror(errno);
+        return false;
+    }
+    if (!map(std::max<size_t>(initial_capacity, 4096))) {
+        close();
+        shm_unlink(name_.c_str());
+        return false;
+    }
+
+    header_->magic = kJournalMagic;
+    header_->version = kJournalVersion;
+    new (&header_->published) std::atomic<uint64_t>(0);
+    written_end_ = 0;
+    failed_ = false;
+    MCSR_LOG(INFO) << "Shared memory journal created: " << name_ << " for " << mp4_filename;
+    return true;
+}
+
+bool ShmJournal::map(size_t capacity) {
+    size_t total = sizeof(ShmJournalHeader) + capacity;
+    if (ftruncate(fd_, static_cast<off_t>(total)) != 0) {
+        MCSR_LOG(ERROR) << "Failed to size shared memory journal to " << total << " bytes";
+        return false;
+    }
+    void* mapping = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        MCSR_LOG(ERROR) << "Failed to map shared memory journal";
+        return false;
+    }
+    if (header_) {
+        munmap(header_, sizeof(ShmJournalHeader) + capacity_);
+    }
+    header_ = static_cast<ShmJournalHeader*>(mapping);
+    data_ = static_cast<uint8_t*>(mapping) + sizeof(ShmJournalHeader);
+    capacity_ = capacity;
+    return true;
+}
+
+bool ShmJournal::write(uint64_t position, const void* data, size_t size) {
+    if (!ok()) {
+        return false;
+    }
+    uint64_t end = position + size;
+    if (end > capacity_) {
+        // Pages of /dev/shm are only allocated when touched, so doubling is cheap
+        if (!map(static_cast<size_t>(std::max<uint64_t>(end, static_cast<uint64_t>(capacity_) * 2)))) {
+            failed_ = true;
+            return false;
+        }
+    }
+    std::memcpy(data_ + position, data, size);
+    written_end_ = std::max(written_end_, end);
+    return true;
+}
+
+void ShmJournal::publish() {
+    if (ok()) {
+        header_->published.store(written_end_, std::memory_order_release);
+    }
+}
+
+void ShmJournal::close() {
+    if (header_) {
+        munmap(header_, sizeof(ShmJournalHeader) + capacity_);
+        header_ = nullptr;
+        data_ = nullptr;
+        capacity_ = 0;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool ShmJournal::restore(const std::string& mp4_filename, IFileOps& file_ops,
+                         const std::string& idx_filename) {
+    std::string name = segmentName(mp4_filename);
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(ShmJournalHeader)) {
+        mapping = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        MCSR_LOG(WARNING) << "Failed to map shared memory journal " << name;
+        return false;
+    }
+
+    size_t mapped_size = static_cast<size_t>(st.st_size);
+    const ShmJournalHeader* header = static_cast<const ShmJournalHeader*>(mapping);
+    const uint8_t* data = static_cast<const uint8_t*>(mapping) + sizeof(ShmJournalHeader);
+    uint64_t published = header->published.load(std::memory_order_acquire);
+    uint64_t idx_size = 0;
+    bool restored = false;
+
+    if (header->magic != kJournalMagic || header->version != kJournalVersion ||
+        published > mapped_size - sizeof(ShmJournalHeader)) {
+        MCSR_LOG(WARNING) << "Ignoring invalid shared memory journal " << name;
+    } else if (file_ops.getFileSize(idx_filename, idx_size) && idx_size >= published) {
+        MCSR_LOG(INFO) << "Index file already holds the published journal (" << idx_size << " >= " << published << " bytes)";
+    } else {
+        // The on-disk index is a prefix of the journal, so replacing it loses nothing
+        std::unique_ptr<IFile> file = file_ops.open(idx_filename, "wb");
+        restored = file && file->isOpen() &&
+                   file->write(data, static_cast<size_t>(published)) == published &&
+                   file->flush() && file->sync();
+        if (restored) {
+            MCSR_LOG(INFO) << "Index restored from shared memory journal: " << published << " bytes (was " << idx_size << ")";
+        } else {
+            MCSR_LOG(ERROR) << "Failed to restore index from shared memory journal";
+        }
+    }
+
+    munmap(mapping, mapped_size);
+    return restored;
+}
+
+void ShmJournal::remove(const std::string& mp4_filename) {
+    shm_unlink(segmentName(mp4_filename).c_str());
+}
+
+#else // _WIN32
+
+bool ShmJournal::create(const std::string& mp4_filename, size_t initial_capacity) {
+    (void)initial_capacity;
+    MCSR_LOG(WARNING) << "Shared memory journal is not supported on this platform: " << mp4_filename;
+    return false;
+}
+
+bool ShmJournal::map(size_t capacity) {
+    (void)capacity;
+    return false;
+}
+
+bool ShmJournal::write(uint64_t position, const void* data, size_t size) {
+    (void)position;
+    (void)data;
+    (void)size;
+    return false;
+}
+
+void ShmJournal::publish() {
+}
+
+void ShmJournal::close() {
+}
+
+bool ShmJournal::restore(const std::string& mp4_filename, IFileOps& file_ops,
+                         const std::string& idx_filename) {
+    (void)mp4_filename;
+    (void)file_ops;
+    (void)idx_filename;
+    return false;
+}
+
+void ShmJournal::remove(const std::string& mp4_filename) {
+    (void)mp4_filename;
+}
+
+#endif // _WIN32
+
+JournaledFile::JournaledFile(std::unique_ptr<IFile> file, ShmJournal& journal)
+    : file_(std::move(file)), journal_(journal) {
+    int64_t position = file_ ? file_->tell() : -1;
+    position_ = position > 0 ? static_cast<uint64_t>(position) : 0;
+}
+
+size_t JournaledFile::read(void* data, size_t size) {
+    size_t read_bytes = file_->read(data, size);
+    position_ += read_bytes;
+    return read_bytes;
+}
+
+size_t JournaledFile::write(const void* data, size_t size) {
+    size_t written = file_->write(data, size);
+    if (written > 0 && !journal_.write(position_, data, written)) {
+        MCSR_LOG(WARNING) << "Failed to mirror index write into shared memory journal";
+    }
+    position_ += written;
+    return written;
+}
+
+bool JournaledFile::seek(int64_t offset, int origin) {
+    if (!file_->seek(offset, origin)) {
+        return false;
+    }
+    int64_t position = file_->tell();
+    if (position < 0) {
+        return false;
+    }
+    position_ = static_cast<uint64_t>(position);
+    return true;
+}
+
+int64_t JournaledFile::tell() {
+    return file_->tell();
+}
+
+bool JournaledFile::flush() {
+    return file_->flush();
+}
+
+bool JournaledFile::sync() {
+    return file_->sync();
+}
+
+void JournaledFile::close() {
+    file_->close();
+}
+
+bool JournaledFile::isOpen() const {
+    return file_->isOpen();
+}
+
+bool JournaledFile::prefetch(uint64_t offset, uint64_t size) {
+    return file_->prefetch(offset, size);
+}
+
+} // namespace mp4_recorder
@@ -0,0 +1,330 @@
+/*
+ * MP4 Crash-Safe Recorder - Sync Coordinator Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "sync_coordinator.h"
+#include "common.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+#endif
+
+namespace mp4_recorder {
+
+namespace {
+
+bool dataSync(int fd) {
+#if defined(_WIN32)
+    (void)fd;
+    return false;
+#elif defined(__APPLE__)
+    return fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
+}
+
+bool syncFilesystem(int fd) {
+#ifdef __linux__
+    return syncfs(fd) == 0;
+#else
+    (void)fd;
+    return false;
+#endif
+}
+
+void closeFds(const std::vector<int>& fds) {
+#ifndef _WIN32
+    for (int fd : fds) {
+        ::close(fd);
+    }
+#else
+    (void)fds;
+#endif
+}
+
+} // namespace
+
+// Members on one device and the thread that syncs their batches
+class SyncCoordinator::Filesystem {
+public:
+    explicit Filesystem(const SyncCoordinatorConfig& config)
+        : config_(config), thread_(&Filesystem::run, this) {
+    }
+
+    ~Filesystem() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        thread_.join();
+    }
+
+    void add(SyncParticipant* participant) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        members_.push_back(participant);
+    }
+
+    void remove(SyncParticipant* participant) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // The batch being synced may use this participant's descriptors
+        idle_.wait(lock, [this] { return !syncing_; });
+        if (participant->pending_) {
+            pending_count_--;
+        }
+        members_.erase(std::find(members_.begin(), members_.end(), participant));
+    }
+
+    void request(SyncParticipant* participant, uint64_t watermark) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_++;
+            participant->pending_watermark_ = watermark;
+            if (participant->pending_) {
+                return;
+            }
+            participant->pending_ = true;
+            participant->request_time_ = std::chrono::steady_clock::now();
+            if (pending_count_++ > 0) {
+                return;
+            }
+            window_end_ = participant->request_time_ + std::chrono::milliseconds(config_.window_ms);
+        }
+        wake_.notify_all();
+    }
+
+    bool failed(const SyncParticipant* participant) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return participant->failed_;
+    }
+
+    void addStats(SyncCoordinatorStats& stats) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats.participants += members_.size();
+        stats.requests += requests_;
+        stats.batches += batches_;
+        stats.sync_calls += sync_calls_;
+        stats.failed_syncs += failed_syncs_;
+    }
+
+private:
+    struct BatchEntry {
+        SyncParticipant* participant;
+        uint64_t watermark;
+        std::chrono::steady_clock::time_point request_time;
+        bool ok;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [this] { return stop_ || pending_count_ > 0; });
+            if (pending_count_ == 0) {
+                break;
+            }
+            // Give the other recorders on this disk until the end of the window to join
+            wake_.wait_until(lock, window_end_, [this] { return stop_; });
+
+            std::vector<BatchEntry> batch;
+            for (SyncParticipant* participant : members_) {
+                if (participant->pending_) {
+                    participant->pending_ = false;
+                    batch.push_back({participant, participant->pending_watermark_, participant->request_time_, true});
+                }
+            }
+            pending_count_ = 0;
+            if (batch.empty()) {
+                continue;  // Everyone who asked has left
+            }
+            syncing_ = true;
+            lock.unlock();
+
+            uint64_t calls = syncBatch(batch);
+
+            lock.lock();
+            auto now = std::chrono::steady_clock::now();
+            batches_++;
+            sync_calls_ += calls;
+            for (const BatchEntry& entry : batch) {
+                SyncParticipant* participant = entry.participant;
+                if (!entry.ok) {
+                    failed_syncs_++;
+                    participant->failed_ = true;
+                    continue;
+                }
+                // The recording thread only reads these while it is a participant
+                if (participant->counters_) {
+                    participant->counters_->fsync_latency.record(static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(now - entry.request_time).count()));
+                    addRelaxed(participant->counters_->fsync_count, 1);
+                    participant->counters_->durable_frames.store(entry.watermark, std::memory_order_relaxed);
+                }
+            }
+            syncing_ = false;
+            idle_.notify_all();
+        }
+    }
+
+    // Returns the number of sync calls; marks the entries whose files could not be synced
+    uint64_t syncBatch(std::vector<BatchEntry>& batch) {
+        MCSR_TRACE_SCOPE("flush", "syncBatch");
+#ifdef __linux__
+        if (config_.method == SyncMethod::SyncFs) {
+            // Any descriptor on the filesystem will do; all members share it
+            bool ok = syncFilesystem(batch.front().participant->fds_.front());
+            if (!ok) {
+                MCSR_LOG(ERROR) << "syncfs failed for a batch of " << batch.size() << " recorders";
+            }
+            for (BatchEntry& entry : batch) {
+                entry.ok = ok;
+            }
+            return 1;
+        }
+#endif
+        // One job per descriptor; concurrent syncs let the filesystem share journal commits
+        std::vector<std::pair<size_t, int>> jobs;
+        for (size_t i = 0; i < batch.size(); i++) {
+            for (int fd : batch[i].participant->fds_) {
+                jobs.emplace_back(i, fd);
+            }
+        }
+        std::vector<char> results(jobs.size(), 1);
+        std::atomic<size_t> next_job{0};
+        auto work = [&] {
+            for (size_t job = next_job++; job < jobs.size(); job = next_job++) {
+                results[job] = dataSync(jobs[job].second) ? 1 : 0;
+            }
+        };
+        std::vector<std::thread> helpers;
+        size_t threads = std::min(std::max<size_t>(config_.parallel_syncs, 1), jobs.size());
+        for (size_t i = 1; i < threads; i++) {
+            try {
+                helpers.emplace_back(work);
+            } catch (...) {
+                break;
+            }
+        }
+        work();
+        for (auto& helper : helpers) {
+            helper.join();
+        }
+        for (size_t job = 0; job < jobs.size(); job++) {
+            if (!results[job]) {
+                MCSR_LOG(ERROR) << "fdatasync failed for a batched file";
+                batch[jobs[job].first].ok = false;
+            }
+        }
+        return jobs.size();
+    }
+
+    const SyncCoordinatorConfig& config_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::vector<SyncParticipant*> members_;
+    size_t pending_count_ = 0;
+    std::chrono::steady_clock::time_point window_end_;
+    bool syncing_ = false;
+    bool stop_ = false;
+    uint64_t requests_ = 0;
+    uint64_t batches_ = 0;
+    uint64_t sync_calls_ = 0;
+    uint64_t failed_syncs_ = 0;
+    std::thread thread_;
+};
+
+SyncCoordinator::SyncCoordinator(const SyncCoordinatorConfig& config)
+    : config_(config) {
+}
+
+SyncCoordinator::~SyncCoordinator() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    filesystems_.clear();
+}
+
+std::unique_ptr<SyncParticipant> SyncCoordinator::join(const std::vector<std::string>& paths,
+                                                        RecorderCounters* counters) {
+#ifdef _WIN32
+    (void)paths;
+    (void)counters;
+    MCSR_LOG(WARNING) << "Coordinated syncs are not supported on this platform";
+    return nullptr;
+#else
+    std::vector<int> fds;
+    uint64_t device = 0;
+    for (const std::string& path : paths) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat buffer;
+        if (fd < 0 || fstat(fd, &buffer) != 0 || (!fds.empty() && static_cast<uint64_t>(buffer.st_dev) != device)) {
+            MCSR_LOG(WARNING) << "Cannot sync " << path << " through the coordinator";
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            closeFds(fds);
+            return nullptr;
+        }
+        device = static_cast<uint64_t>(buffer.st_dev);
+        fds.push_back(fd);
+    }
+    if (fds.empty()) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Filesystem>& filesystem = filesystems_[device];
+    if (!filesystem) {
+        try {
+            filesystem.reset(new Filesystem(config_));
+        } catch (...) {
+            MCSR_LOG(ERROR) << "Failed to start sync thread";
+            filesystems_.erase(device);
+            closeFds(fds);
+            return nullptr;
+        }
+    }
+    std::unique_ptr<SyncParticipant> participant(new SyncParticipant(*filesystem, std::move(fds), counters));
+    filesystem->add(participant.get());
+    return participant;
+#endif
+}
+
+SyncCoordinatorStats SyncCoordinator::getStats() const {
+    SyncCoordinatorStats stats;
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.filesystems = filesystems_.size();
+    for (const auto& entry : filesystems_) {
+        entry.second->addStats(stats);
+    }
+    return stats;
+}
+
+SyncParticipant::SyncParticipant(SyncCoordinator::Filesystem& filesystem, std::vector<int> fds,
+                                 RecorderCounters* counters)
+    : filesystem_(filesystem), fds_(std::move(fds)), counters_(counters) {
+}
+
+SyncParticipant::~SyncParticipant() {
+    filesystem_.remove(this);
+    closeFds(fds_);
+}
+
+void SyncParticipant::requestSync(uint64_t watermark) {
+    filesystem_.request(this, watermark);
+}
+
+bool SyncParticipant::failed() const {
+    return filesystem_.failed(this);
+}
+
+} // namespace mp4_recorder
@@ -0,0 +1,204 @@
+/*
+ * MP4 Crash-Safe Recorder - Tracing Implementation
+ *
+ * License: GPL v2+
+ */
+
+#include "trace.h"
+#include "common.h"
+
+#include <algorithm>
+#include <fstream>
+
+namespace mp4_recorder {
+
+// Append-only event array of one thread. count_ is the number of published events.
+class Tracer::Buffer {
+public:
+    Buffer(size_t capacity, uint32_t generation, uint32_t thread_id)
+        : events_(capacity), generation_(generation), thread_id_(thread_id) {
+    }
+
+    uint32_t generation() const { return generation_; }
+    uint32_t threadId() const { return thread_id_; }
+
+    bool append(const Event& event) {
+        size_t count = count_.load(std::memory_order_relaxed);
+        if (count == events_.size()) {
+            return false;
+        }
+        events_[count] = event;
+        count_.store(count + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t count() const { return count_.load(std::memory_order_acquire); }
+    const Event& event(size_t index) const { return events_[index]; }
+
+    void setName(const std::string& name) {
+        std::lock_guard<std::mutex> lock(name_mutex_);
+        name_ = name;
+    }
+
+    std::string name() {
+        std::lock_guard<std::mutex> lock(name_mutex_);
+        return name_;
+    }
+
+private:
+    std::vector<Event> events_;
+    std::atomic<size_t> count_{0};
+    uint32_t generation_;
+    uint32_t thread_id_;
+    std::mutex name_mutex_;
+    std::string name_;
+};
+
+namespace {
+
+void writeJsonString(std::ostream& out, const std::string& value) {
+    out << '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << ' ';
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+// Chrome trace timestamps are microseconds; keep nanosecond precision as decimals
+void writeMicroseconds(std::ostream& out, int64_t ns) {
+    out << ns / 1000 << '.' << static_cast<char>('0' + ns / 100 % 10) << static_cast<char>('0' + ns / 10 % 10)
+        << static_cast<char>('0' + ns % 10);
+}
+
+} // namespace
+
+std::atomic<bool> Tracer::enabled_{false};
+thread_local std::shared_ptr<Tracer::Buffer> Tracer::t_buffer_;
+thread_local std::string Tracer::t_thread_name_;
+
+Tracer& Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+void Tracer::start(size_t events_per_thread) {
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    enabled_.store(false, std::memory_order_relaxed);
+    buffers_.clear();
+    next_thread_id_ = 1;
+    events_per_thread_ = std::max<size_t>(events_per_thread, 1);
+    epoch_ns_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count(),
+                    std::memory_order_relaxed);
+    dropped_.store(0, std::memory_order_relaxed);
+    // Threads holding a buffer of an earlier run get a new one with their next event
+    generation_.fetch_add(1, std::memory_order_release);
+    enabled_.store(true, std::memory_order_release);
+}
+
+void Tracer::stop() {
+    enabled_.store(false, std::memory_order_release);
+}
+
+Tracer::Buffer* Tracer::threadBuffer() {
+    Buffer* buffer = t_buffer_.get();
+    uint32_t generation = generation_.load(std::memory_order_acquire);
+    if (buffer && buffer->generation() == generation) {
+        return buffer;
+    }
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    t_buffer_ = std::make_shared<Buffer>(events_per_thread_, generation_.load(std::memory_order_relaxed),
+                                         next_thread_id_++);
+    t_buffer_->setName(t_thread_name_);
+    buffers_.push_back(t_buffer_);
+    return t_buffer_.get();
+}
+
+void Tracer::setThreadName(const std::string& name) {
+    t_thread_name_ = name;
+    threadBuffer()->setName(name);
+}
+
+void Tracer::record(const char* category, const char* name, std::chrono::steady_clock::time_point begin,
+                    std::chrono::steady_clock::time_point end) {
+    Event event;
+    event.category = category;
+    event.name = name;
+    // Scopes opened before start() are clipped to it
+    int64_t begin_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(begin.time_since_epoch()).count() -
+                       epoch_ns_.load(std::memory_order_relaxed);
+    event.begin_ns = std::max<int64_t>(begin_ns, 0);
+    event.duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() -
+                        (event.begin_ns - begin_ns);
+    if (!threadBuffer()->append(event)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+uint64_t Tracer::eventCount() {
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    uint64_t count = 0;
+    for (const auto& buffer : buffers_) {
+        count += buffer->count();
+    }
+    return count;
+}
+
+bool Tracer::writeJson(std::ostream& out) {
+    std::vector<std::shared_ptr<Buffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex_);
+        buffers = buffers_;
+    }
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (const auto& buffer : buffers) {
+        std::string thread_name = buffer->name();
+        if (!thread_name.empty()) {
+            out << (first ? "" : ",") << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"
+                << buffer->threadId() << ",\"args\":{\"name\":";
+            writeJsonString(out, thread_name);
+            out << "}}";
+            first = false;
+        }
+        size_t count = buffer->count();
+        for (size_t i = 0; i < count; i++) {
+            const Event& event = buffer->event(i);
+            out << (first ? "" : ",") << "\n{\"ph\":\"X\",\"cat\":";
+            writeJsonString(out, event.category);
+            out << ",\"name\":";
+            writeJsonString(out, event.name);
+            out << ",\"pid\":1,\"tid\":" << buffer->threadId() << ",\"ts\":";
+            writeMicroseconds(out, event.begin_ns);
+            out << ",\"dur\":";
+            writeMicroseconds(out, event.duration_ns);
+            out << "}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+bool Tracer::writeJson(const std::string& filename) {
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        MCSR_LOG(ERROR) << "Failed to open trace file: " << filename;
+        return false;
+    }
+    if (!writeJson(out)) {
+        MCSR_LOG(ERROR) << "Failed to write trace file: " << filename;
+        return false;
+    }
+    MCSR_LOG(INFO) << "Trace written: " << filename << " (" << eventCount() << " events, " << droppedCount() << " dropped)";
+    return true;
+}
+
+} // namespace mp4_recorder